@@ -15,3 +15,8 @@ class Aligner(object):
     @staticmethod
     def supports_mix():
         return False
+
+    @staticmethod
+    def thread_args(nthreads):
+        """ Return the arguments that have the aligner use nthreads threads """
+        return []
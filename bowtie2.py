@@ -114,3 +114,7 @@ class Bowtie2(Aligner):
     @staticmethod
     def supports_mix():
         return True
+
+    @staticmethod
+    def thread_args(nthreads):
+        return ['-p', str(nthreads)]
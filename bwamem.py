@@ -104,3 +104,7 @@ class BwaMem(Aligner):
     @staticmethod
     def supports_mix():
         return False
+
+    @staticmethod
+    def thread_args(nthreads):
+        return ['-t', str(nthreads)]
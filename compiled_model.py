@@ -0,0 +1,293 @@
+"""
+Copyright 2016, Ben Langmead <langmea@cs.jhu.edu>
+
+CompiledModel: turns a fitted tree ensemble from one of the model_fam.py
+families (RandomForest, ExtraTrees, GradientBoosting) into generated C++,
+with one function per tree and its split thresholds and leaf values as
+constants, builds that into a shared object and scores feature matrices by
+calling it through ctypes.  Scoring then costs a few compares per tree per
+row rather than a walk over scikit-learn's node arrays.
+
+Predictions match the scikit-learn model's: like scikit-learn, features
+are compared as single-precision floats against double-precision
+thresholds.
+"""
+
+import os
+import sys
+import hashlib
+import logging
+import ctypes
+import struct
+import subprocess
+
+__author__ = 'langmead'
+
+
+def _fmt(v):
+    """ Format a double so it reads back exactly """
+    return repr(float(v))
+
+
+def _tree_expr(tree, node=0, indent=1):
+    """ Return a C++ expression evaluating a scikit-learn tree_ for row x """
+    left, right = tree.children_left[node], tree.children_right[node]
+    if left == right:  # leaf; both are -1
+        return _fmt(tree.value[node][0][0])
+    pad = '\t' * (indent + 1)
+    return '((float)x[%d] <= %s\n%s? %s\n%s: %s)' % \
+           (tree.feature[node], _fmt(tree.threshold[node]),
+            pad, _tree_expr(tree, left, indent + 1),
+            pad, _tree_expr(tree, right, indent + 1))
+
+
+def _as_float32(v):
+    return struct.unpack('f', struct.pack('f', v))[0]
+
+
+def _tree_value(tree, x, node=0):
+    """ Evaluate a tree_ for row x in Python; for tests """
+    while tree.children_left[node] != tree.children_right[node]:
+        if _as_float32(x[tree.feature[node]]) <= tree.threshold[node]:
+            node = tree.children_left[node]
+        else:
+            node = tree.children_right[node]
+    return float(tree.value[node][0][0])
+
+
+def _boosting_base(init):
+    """ Return the constant a GradientBoostingRegressor starts from, read
+        from its initial estimator, init_, whose representation varies by
+        scikit-learn version """
+    if isinstance(init, str) and init == 'zero':
+        return 0.0
+    name = type(init).__name__
+    if name == 'DummyRegressor':
+        return float(init.constant_.ravel()[0])
+    elif name == 'MeanEstimator':
+        return float(init.mean)
+    elif name == 'QuantileEstimator':
+        return float(init.quantile)
+    elif name == 'ZeroEstimator':
+        return 0.0
+    raise RuntimeError('Cannot compile GradientBoosting model with initial estimator of type "%s"' % name)
+
+
+def _ensemble_terms(model, nfeatures):
+    """ Return (trees, scale, base) such that the model's prediction is the
+        mean of the trees' values if scale is None, or base plus scale times
+        each tree's value otherwise """
+    name = type(model).__name__
+    if name in ('RandomForestRegressor', 'ExtraTreesRegressor'):
+        return [est.tree_ for est in model.estimators_], None, 0.0
+    elif name == 'GradientBoostingRegressor':
+        trees = [est.tree_ for est in model.estimators_[:, 0]]
+        return trees, float(model.learning_rate), _boosting_base(model.init_)
+    raise RuntimeError('Cannot compile model of type "%s"' % name)
+
+
+def generate_source(trees, scale, base, nfeatures):
+    """ Return C++ source for scoring rows with the given trees; see
+        _ensemble_terms for scale and base.  Sums are accumulated in the
+        same order as scikit-learn's, so results agree to the last bit. """
+    out = ['// Generated by qtip compiled_model.py; do not edit',
+           '#include <stddef.h>', '']
+    for i, tree in enumerate(trees):
+        out.append('static inline double tree%d(const double *x) {' % i)
+        out.append('\treturn %s;' % _tree_expr(tree))
+        out.append('}')
+        out.append('')
+    out.append('extern "C" int qtip_model_nfeatures() {')
+    out.append('\treturn %d;' % nfeatures)
+    out.append('}')
+    out.append('')
+    out.append('extern "C" void qtip_model_predict(const double *xs, size_t nrow, double *out) {')
+    out.append('\tfor(size_t i = 0; i < nrow; i++) {')
+    out.append('\t\tconst double *x = xs + i * %d;' % nfeatures)
+    if scale is None:
+        out.append('\t\tdouble sum = 0.0;')
+        for i in range(len(trees)):
+            out.append('\t\tsum += tree%d(x);' % i)
+        out.append('\t\tout[i] = sum / %d;' % len(trees))
+    else:
+        out.append('\t\tdouble sum = %s;' % _fmt(base))
+        for i in range(len(trees)):
+            out.append('\t\tsum += %s * tree%d(x);' % (_fmt(scale), i))
+        out.append('\t\tout[i] = sum;')
+    out.append('\t}')
+    out.append('}')
+    return '\n'.join(out) + '\n'
+
+
+def build_shared_object(source, build_dir, cxx='g++', log=logging):
+    """ Compile source into a shared object in build_dir, named by the
+        source's hash so identical models are built once.  Return its path,
+        or None if compilation failed. """
+    digest = hashlib.sha1(source.encode('utf-8')).hexdigest()[:16]
+    so_fn = os.path.join(build_dir, 'model_%s.so' % digest)
+    if os.path.exists(so_fn):
+        return so_fn
+    cpp_fn = os.path.join(build_dir, 'model_%s.cpp' % digest)
+    with open(cpp_fn, 'w') as fh:
+        fh.write(source)
+    tmp_fn = so_fn + '.partial'
+    cmd = [cxx, '-O2', '-shared', '-fPIC', '-o', tmp_fn, cpp_fn]
+    try:
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        _, err = proc.communicate()
+    except OSError as e:
+        log.warning('Could not run "%s" to compile model: %s' % (cxx, str(e)))
+        return None
+    if proc.returncode != 0:
+        log.warning('Compiling model failed: %s' % err.decode('utf-8', 'replace')[:1000])
+        return None
+    os.rename(tmp_fn, so_fn)
+    return so_fn
+
+
+class CompiledModel(object):
+    """ Drop-in replacement for a fitted model's predict() """
+
+    def __init__(self, so_fn, nfeatures):
+        self.so_fn = so_fn
+        self.lib = ctypes.CDLL(so_fn)
+        self.lib.qtip_model_nfeatures.restype = ctypes.c_int
+        self.lib.qtip_model_predict.restype = None
+        self.lib.qtip_model_predict.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_void_p]
+        self.nfeatures = nfeatures
+        if self.lib.qtip_model_nfeatures() != nfeatures:
+            raise RuntimeError('Compiled model "%s" expects %d features, not %d' %
+                               (so_fn, self.lib.qtip_model_nfeatures(), nfeatures))
+
+    def predict(self, x):
+        import numpy as np
+        x = np.ascontiguousarray(x, dtype=np.float64)
+        assert x.ndim == 2 and x.shape[1] == self.nfeatures, (x.shape, self.nfeatures)
+        out = np.empty(x.shape[0], dtype=np.float64)
+        self.lib.qtip_model_predict(x.ctypes.data, x.shape[0], out.ctypes.data)
+        return out
+
+    def predict_rows(self, rows):
+        """ Score a list of rows without numpy """
+        flat = (ctypes.c_double * (len(rows) * self.nfeatures))(*[v for row in rows for v in row])
+        out = (ctypes.c_double * len(rows))()
+        self.lib.qtip_model_predict(ctypes.addressof(flat), len(rows), ctypes.addressof(out))
+        return list(out)
+
+
+def compile_model(model, nfeatures, build_dir, log=logging):
+    """ Return a CompiledModel for the given fitted model, or None if it
+        can't be compiled, in which case the caller should keep using the
+        model itself. """
+    try:
+        trees, scale, base = _ensemble_terms(model, nfeatures)
+    except RuntimeError as e:
+        log.warning(str(e))
+        return None
+    so_fn = build_shared_object(generate_source(trees, scale, base, nfeatures), build_dir, log=log)
+    if so_fn is None:
+        return None
+    return CompiledModel(so_fn, nfeatures)
+
+
+if __name__ == "__main__":
+
+    import unittest
+    import shutil
+    import tempfile
+
+    class FakeTree(object):
+        """ Same attributes as a scikit-learn tree_ """
+        def __init__(self, left, right, feature, threshold, value):
+            self.children_left, self.children_right = left, right
+            self.feature, self.threshold = feature, threshold
+            self.value = [[[v]] for v in value]
+
+    # x[0] <= 0.5 ? (x[1] <= 2.5 ? 1 : 2) : 3
+    tree1 = FakeTree([1, 3, -1, -1, -1], [2, 4, -1, -1, -1],
+                     [0, 1, -2, -2, -2], [0.5, 2.5, -2.0, -2.0, -2.0],
+                     [0.0, 0.0, 3.0, 1.0, 2.0])
+    # leaf only
+    tree2 = FakeTree([-1], [-1], [-2], [-2.0], [0.25])
+    # threshold between float and double representations of 0.1
+    tree3 = FakeTree([1, -1, -1], [2, -1, -1], [1, -2, -2], [0.1, -2.0, -2.0], [0.0, 10.0, 20.0])
+
+    def _sklearn():
+        """ Return scikit-learn's ensemble module, or None if it's missing """
+        try:
+            import sklearn.ensemble
+            return sklearn.ensemble
+        except ImportError:
+            return None
+
+    class TestCases(unittest.TestCase):
+
+        def setUp(self):
+            self.dir = tempfile.mkdtemp()
+
+        def tearDown(self):
+            shutil.rmtree(self.dir)
+
+        def _compile(self, trees, scale, base):
+            so_fn = build_shared_object(generate_source(trees, scale, base, 2), self.dir)
+            if so_fn is None:
+                self.skipTest('no C++ compiler')
+            return CompiledModel(so_fn, 2)
+
+        def test_forest(self):
+            m = self._compile([tree1, tree2], None, 0.0)
+            rows = [[0.0, 0.0], [0.0, 3.0], [1.0, 0.0], [0.5, 2.5]]
+            want = [0.5 * (_tree_value(tree1, r) + 0.25) for r in rows]
+            self.assertEqual(want, m.predict_rows(rows))
+            self.assertEqual([0.625, 1.125, 1.625, 0.625], m.predict_rows(rows))
+
+        def test_boosting(self):
+            m = self._compile([tree1, tree2], 0.1, 2.0)
+            self.assertAlmostEqual(2.0 + 0.1 * (3.0 + 0.25), m.predict_rows([[1.0, 0.0]])[0])
+
+        def test_float_compare(self):
+            # Like scikit-learn, compare as float: 0.1f > 0.1
+            m = self._compile([tree3], 1.0, 0.0)
+            self.assertEqual([20.0, 10.0], m.predict_rows([[0.0, 0.1], [0.0, 0.09]]))
+            self.assertEqual(20.0, _tree_value(tree3, [0.0, 0.1]))
+
+        def test_cached(self):
+            src = generate_source([tree1], 1.0, 0.0, 2)
+            fn1 = build_shared_object(src, self.dir)
+            if fn1 is None:
+                self.skipTest('no C++ compiler')
+            self.assertEqual(fn1, build_shared_object(src, self.dir))
+
+        def test_sklearn_models(self):
+            # Fitted models like the ones model_fam.py makes; the compiled
+            # versions must predict exactly what the models themselves do
+            ens = _sklearn()
+            if ens is None:
+                self.skipTest('scikit-learn not available')
+            import numpy as np
+            rng = np.random.RandomState(0)
+            x = rng.uniform(size=(400, 4))
+            x[:, 3] = np.round(x[:, 3] * 10) / 10  # values tied with thresholds
+            y = x[:, 0] + 2 * x[:, 1] * x[:, 2] + x[:, 3] + rng.normal(scale=0.1, size=400)
+            x_test = np.vstack([rng.uniform(size=(400, 4)), x[:50]])
+            models = [ens.RandomForestRegressor(n_estimators=10, max_features=0.5, max_leaf_nodes=35,
+                                                bootstrap=True, random_state=0),
+                      ens.ExtraTreesRegressor(n_estimators=10, max_features=0.5, max_leaf_nodes=35,
+                                              bootstrap=True, random_state=0),
+                      ens.GradientBoostingRegressor(n_estimators=30, learning_rate=0.85,
+                                                    max_leaf_nodes=35, random_state=0),
+                      ens.GradientBoostingRegressor(n_estimators=30, learning_rate=0.9, max_leaf_nodes=35,
+                                                    loss='huber', random_state=0),
+                      ens.GradientBoostingRegressor(n_estimators=30, learning_rate=0.9, max_leaf_nodes=35,
+                                                    init='zero', random_state=0)]
+            for model in models:
+                model.fit(x, y)
+                compiled = compile_model(model, 4, self.dir)
+                if compiled is None:
+                    self.skipTest('no C++ compiler')
+                for xs in [x, x_test]:
+                    want = model.predict(xs)
+                    self.assertTrue(np.array_equal(want, compiled.predict(xs)),
+                                    (type(model).__name__, np.abs(want - compiled.predict(xs)).max()))
+
+    unittest.main(argv=[sys.argv[0]])
@@ -48,9 +48,11 @@ class FeatureTableReader(object):
             raise RuntimeError('No non-empty input files with names like: ' + str(fns))
 
     @staticmethod
-    def _postprocess_data_frame(df):
+    def _postprocess_data_frame(df, stats=None):
         """ Changes 'correct' column to use 0/1 and replaces NAs in the score
-            difference columns with small values. """
+            difference columns with small values.  Given per-column
+            statistics, columns without NAs are left alone and the rest are
+            filled using the whole column's max rather than the chunk's. """
 
         def _fill_nas(_df, nm):
             with warnings.catch_warnings(record=True) as w:
@@ -65,6 +67,11 @@ class FeatureTableReader(object):
 
         for col in df:
             if df[col].dtype != 'object':
+                if stats is not None:
+                    if stats[col]['nan'] > 0:
+                        mx = stats[col]['max']
+                        df[col] = df[col].fillna(0 if math.isnan(mx) else mx + 1)
+                    continue
                 _fill_nas(df, col)
                 assert not math.isnan(df[col].sum())
 
@@ -74,7 +81,14 @@ class FeatureTableReader(object):
         """ Return an iterator over chunks of rows from the data frame. """
         assert sn in self.readers
         self.readers[sn].reset()
-        return imap(lambda x: self._postprocess_data_frame(x), self.readers[sn])
+        stats = self.readers[sn].stats
+        return imap(lambda x: self._postprocess_data_frame(x, stats), self.readers[sn])
+
+    def stats(self, sn):
+        """ Return per-column statistics for the whole table, or None if
+            qtip-parse didn't write any. """
+        assert sn in self.readers
+        return self.readers[sn].stats
 
     def __contains__(self, o):
         return o in self.readers
@@ -10,6 +10,7 @@ import logging
 import pandas
 import numpy as np
 import itertools
+import math
 import resource
 import gc
 import os
@@ -57,11 +58,35 @@ def postprocess_predictions(pcor_test, dataset_name, max_pcor=0.999999, log=logg
     return _clamp_predictions(pcor_test, 0.0, max_pcor)
 
 
-def _df_to_mat(data, shortname, training, training_labs, log=logging, include_mapq=False):
+def _informative_columns(cols, stats, exclude_cols):
+    """ Use per-column statistics gathered by qtip-parse to drop constant
+        columns and all but the first of each set of identical columns.
+        NAs are filled with the column max + 1 (or 0 if all are NA) before
+        training, so a column is constant if it's all NA or has no NAs and
+        min == max, and two columns are identical if their hashes, NA counts
+        and maxes agree. """
+    labs, seen = [], set()
+    for col in cols:
+        if col in exclude_cols:
+            continue
+        st = stats[col]
+        if math.isnan(st['max']) or (st['nan'] == 0 and st['min'] == st['max']):
+            continue
+        key = (st['hash'], st['nan'], st['max'])
+        if key not in seen:
+            seen.add(key)
+            labs.append(col)
+    return labs
+
+
+def _df_to_mat(data, shortname, training, training_labs, log=logging, include_mapq=False, stats=None):
     """ Convert a data frame read with read_dataset into a matrix suitable
         for use with scikit-learn, and parallel vectors giving the
         original MAPQ predictions, the ids for the alignments (i.e. their
-        line of origin) and whether or not the alignments are correct. """
+        line of origin) and whether or not the alignments are correct.
+        When training, stats (if given) are per-column statistics for the
+        whole table and spare a pass over the data to find constant and
+        duplicate columns. """
     labs = []
     exclude_cols = ['id', 'correct', 'rname']
     if not include_mapq:
@@ -69,15 +94,18 @@ def _df_to_mat(data, shortname, training, training_labs, log=logging, include_ma
     if training:
         assert shortname not in training_labs
         log.info('  Removing duplicate columns')
-        for col in data:
-            if col not in exclude_cols and data[col].nunique() > 1:
-                labs.append(col)
-        to_remove = set()
-        for x, y in itertools.combinations(labs, 2):
-            if (data[x] == data[y]).all():
-                to_remove.add(y)
-        for lab in to_remove:
-            labs.remove(lab)
+        if stats is not None:
+            labs = _informative_columns(data.columns, stats, exclude_cols)
+        else:
+            for col in data:
+                if col not in exclude_cols and data[col].nunique() > 1:
+                    labs.append(col)
+            to_remove = set()
+            for x, y in itertools.combinations(labs, 2):
+                if (data[x] == data[y]).all():
+                    to_remove.add(y)
+            for lab in to_remove:
+                labs.remove(lab)
         training_labs[shortname] = labs
         if len(labs) == 0:
             raise RuntimeError('Error: all training records were identical')
@@ -100,6 +128,44 @@ _prediction_worker_pred_overall = None
 _prediction_worker_log = None
 
 
+def _chunk_predictions(trained_model, x_test, idxs, invs, ids, mapq_orig_test, y_test, ds, ds_long):
+    """ Predict for one chunk's feature matrix and return a data frame of
+        MAPQs, ids, original MAPQs and correctness.  If idxs and invs are
+        given, predict only for the distinct rows idxs and expand using
+        invs. """
+    if idxs is not None:
+        pcor = trained_model.predict(x_test[idxs])[invs]  # make predictions
+    else:
+        pcor = trained_model.predict(x_test)  # make predictions
+    pcor = np.array(postprocess_predictions(pcor, ds_long))
+    # convert category data to doubles
+    ds = {'u': 1.0, 'b': 2.0, 'c': 3.0, 'd': 4.0}.get(ds)
+    return pandas.DataFrame({'mapq': pandas.Series(pcor_to_mapq_np(pcor), dtype=np.float32),
+                             'ids': pandas.Series(ids, dtype=np.float64),
+                             'category': ds,
+                             'mapq_orig': pandas.Series(mapq_orig_test, dtype=np.int16),
+                             'correct': pandas.Series(y_test, dtype=np.int8)})
+
+
+def _chunk_has_correct(pred_df):
+    """ Return true iff chunk's alignments have correctness information """
+    cor_mn, cor_mx = pred_df.correct.min(), pred_df.correct.max()
+    has_correct = cor_mx >= 0
+    if has_correct:
+        assert cor_mn in [0, 1], (cor_mn, cor_mx)
+        assert cor_mx in [0, 1], (cor_mn, cor_mx)
+        assert cor_mx >= cor_mn, (cor_mn, cor_mx)
+    return has_correct
+
+
+def _add_chunk_predictions(pred_overall, pred_df):
+    if _chunk_has_correct(pred_df):
+        pred_overall.add(pred_df, pred_df.ids[0], pred_df.ids.iloc[-1],
+                         pred_df.mapq, pred_df.mapq_orig, pred_df.correct)
+    else:
+        pred_overall.add(pred_df, pred_df.ids[0], pred_df.ids.iloc[-1])
+
+
 def _prediction_worker(my_test_chunk_tup, training, training_labs, ds,
                        ds_long, dedup, multiprocess=True, include_mapq=False):
     i, my_test_chunk = my_test_chunk_tup
@@ -113,45 +179,25 @@ def _prediction_worker(my_test_chunk_tup, training, training_labs, ds,
         _df_to_mat(my_test_chunk, ds, False, training_labs, log=log, include_mapq=include_mapq)
     del my_test_chunk
     gc.collect()
+    idxs, invs = None, None
     if dedup:
         log.info('    Done loading data; collapsing and making predictions')
         idxs, invs = _np_deduping_indexes(x_test)
         log.info('    Collapsed %d rows to %d distinct rows (%0.2f%%)' %
                  (len(invs), len(idxs), 100.0 * len(idxs) / len(invs)))
-        pcor = trained_model.predict(x_test[idxs])[invs]  # make predictions
     else:
         log.info('    Done loading data; making predictions')
-        pcor = trained_model.predict(x_test)  # make predictions
+    pred_df = _chunk_predictions(trained_model, x_test, idxs, invs, ids, mapq_orig_test, y_test, ds, ds_long)
     del x_test
     gc.collect()
-    pcor = np.array(postprocess_predictions(pcor, ds_long))
-    # convert category data to doubles
-    ds = {'u': 1.0, 'b': 2.0, 'c': 3.0, 'd': 4.0}.get(ds)
-    pred_df = pandas.DataFrame({'mapq': pandas.Series(pcor_to_mapq_np(pcor), dtype=np.float32),
-                                'ids': pandas.Series(ids, dtype=np.float64),
-                                'category': ds,
-                                'mapq_orig': pandas.Series(mapq_orig_test, dtype=np.int16),
-                                'correct': pandas.Series(y_test, dtype=np.int8)})
-    cor_mn, cor_mx = pred_df.correct.min(), pred_df.correct.max()
-    has_correct = cor_mx >= 0
     if multiprocess:
-        if has_correct:
-            assert cor_mn in [0, 1], (cor_mn, cor_mx)
-            assert cor_mx in [0, 1], (cor_mn, cor_mx)
-            assert cor_mx >= cor_mn, (cor_mn, cor_mx)
+        if _chunk_has_correct(pred_df):
             return (i, pred_df, pred_df.ids[0], pred_df.ids.iloc[-1],
                     pred_df.mapq, pred_df.mapq_orig, pred_df.correct)
         else:
             return i, pred_df, pred_df.ids[0], pred_df.ids.iloc[-1]
     else:
-        if has_correct:
-            assert cor_mn in [0, 1], (cor_mn, cor_mx)
-            assert cor_mx in [0, 1], (cor_mn, cor_mx)
-            assert cor_mx >= cor_mn, (cor_mn, cor_mx)
-            pred_overall.add(pred_df, pred_df.ids[0], pred_df.ids.iloc[-1],
-                             pred_df.mapq, pred_df.mapq_orig, pred_df.correct)
-        else:
-            pred_overall.add(pred_df, pred_df.ids[0], pred_df.ids.iloc[-1])
+        _add_chunk_predictions(pred_overall, pred_df)
     log.info('    Done; peak mem usage so far = %0.2fGB' %
              (resource.getrusage(resource.RUSAGE_SELF).ru_maxrss / (1024.0 * 1024.0)))
 
@@ -260,7 +306,8 @@ class MapqFit:
                                 'results circumspectly.' % train['correct'][0])
             # extract features, convert to matrix
             x_train, _, mapq_orig_train, y_train, self.col_names[ds] = \
-                _df_to_mat(train, ds, True, self.training_labs, log=logging, include_mapq=False)
+                _df_to_mat(train, ds, True, self.training_labs, log=logging, include_mapq=False,
+                           stats=dfs.stats(ds))
             assert x_train.shape[0] == y_train.shape[0]
             assert x_train.shape[1] > 0
             # optionally subsample
@@ -303,7 +350,7 @@ class MapqFit:
                                        prediction_mem_limit=prediction_mem_limit)
         log.info('  Created overall MapqPredictions (peak mem=%0.2fGB)' % _get_peak_gb())
 
-        _prediction_worker_trained_models = self.trained_models
+        _prediction_worker_trained_models = self.scoring_models
         _prediction_worker_pred_overall = pred_overall
         _prediction_worker_log = log
 
@@ -367,6 +414,19 @@ class MapqFit:
 
         return pred_overall
 
+    def compile(self, build_dir, log=logging):
+        """ Compile each trained model to native code (see
+            compiled_model.py) and use that for predictions.  Models that
+            can't be compiled keep being used as they are. """
+        from compiled_model import compile_model
+        for ds, model in sorted(self.trained_models.items()):
+            compiled = compile_model(model, self.trained_shape[ds][1], build_dir, log=log)
+            if compiled is None:
+                log.warning('  Could not compile %s model; predicting with it as is' % ds)
+            else:
+                log.info('  Compiled %s model to "%s"' % (ds, compiled.so_fn))
+                self.scoring_models[ds] = compiled
+
     def write_feature_importances(self, prefix):
         """
         Write feature importances for each model to an appropriately-named
@@ -426,6 +486,7 @@ class MapqFit:
                  no_oob=False):
         self.model_gen = model_gen
         self.trained_models = {}
+        self.scoring_models = {}  # trained models, or compiled versions of them
         self.crossval_std = {}
         self.col_names = {}
         self.trained_params = {}
@@ -438,3 +499,59 @@ class MapqFit:
         self._fit(dfs, log=log, frac=sample_fraction, heap_profiler=heap_profiler, include_mapq=include_mapq,
                   reweight_ratio=reweight_ratio, reweight_mapq=reweight_mapq,
                   reweight_mapq_offset=reweight_mapq_offset, no_oob=no_oob)
+        self.scoring_models.update(self.trained_models)
+
+
+def predict_multi(fits, dfs, pred_prefixes, assess_prefixes,
+                  log=logging, dedup=False, training=False, calc_summaries=False,
+                  prediction_mem_limit=10000000, heap_profiler=None):
+    """ Make predictions with several fitted models (e.g. one per
+        subsampling fraction or include-MAPQ setting) in one pass over the
+        feature tables.  Each chunk is read and converted to a matrix once
+        per distinct set of training columns, then scored by every model
+        that uses those columns.  Returns a list of finalized
+        MapqPredictions, parallel to fits, written to the corresponding
+        prefixes. """
+    assert len(fits) == len(pred_prefixes) == len(assess_prefixes)
+    name = '_'.join(['overall', 'training' if training else 'test'])
+    preds = [MapqPredictions(name, pred_prefix, assess_prefix,
+                             calc_summaries=calc_summaries,
+                             prediction_mem_limit=prediction_mem_limit)
+             for pred_prefix, assess_prefix in zip(pred_prefixes, assess_prefixes)]
+    log.info('  Created %d overall MapqPredictions (peak mem=%0.2fGB)' % (len(preds), _get_peak_gb()))
+
+    for ds, ds_long, paired in MapqFit.datasets:  # outer loop over alignment types
+        if ds not in dfs:
+            continue
+        users = [i for i, fit in enumerate(fits) if ds in fit.trained_models]
+        if len(users) == 0:
+            continue
+        for chunk in dfs.dataset_iter(ds):
+            log.info('  Predicting for %s %s chunk, %d rows, with %d models (peak mem=%0.2fGB)' %
+                     ('training' if training else 'test', ds_long, chunk.shape[0], len(users), _get_peak_gb()))
+            mats = {}  # training columns -> (matrix, dedup indexes, dedup inverse)
+            for i in users:
+                labs = tuple(fits[i].training_labs[ds])
+                if labs not in mats:
+                    x_test, ids, mapq_orig_test, y_test, _ = \
+                        _df_to_mat(chunk, ds, False, fits[i].training_labs, log=log)
+                    idxs, invs = None, None
+                    if dedup:
+                        idxs, invs = _np_deduping_indexes(x_test)
+                    mats[labs] = (x_test, idxs, invs)
+                x_test, idxs, invs = mats[labs]
+                pred_df = _chunk_predictions(fits[i].scoring_models[ds], x_test, idxs, invs,
+                                             ids, mapq_orig_test, y_test, ds, ds_long)
+                _add_chunk_predictions(preds[i], pred_df)
+            del chunk, mats
+            gc.collect()
+            if heap_profiler is not None:
+                print(heap_profiler.heap(), file=sys.stderr)
+
+    for pred in preds:
+        log.info('Finalizing results for overall %s data (%d alignments)' %
+                 ('training' if training else 'test', pred.npredictions))
+        pred.finalize()
+    log.info('Done')
+    return preds
+
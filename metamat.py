@@ -10,8 +10,22 @@ class MetaMat(object):
     Iterator that returns a large matrix of floats in chunks of rows, where the
     number of rows in a chunk is a parameter passed to the constructor.
     Assumes all elements are double-precision 8-byte floating-point numbers.
+
+    If the second line of the metadata file is "layout,pair", the data file
+    holds one compact record per pair (a block of per-mate columns for mate 1,
+    the same for mate 2, then fraglen) and each is expanded into the two
+    mirrored per-mate rows described by the first line.
+
+    If a .stats file sits alongside, self.stats maps each column name to the
+    min, max, NaN count, estimated number of distinct values and hash that
+    qtip-parse gathered while writing it; otherwise self.stats is None.
     """
 
+    # columns in each mate's block of a compact pair record, besides the
+    # ztz_* and rl_* columns
+    mate_block_head = ['id', 'len', 'clip', 'alqual', 'clipqual']
+    mate_block_tail = ['mapq', 'correct']
+
     def __init__(self, prefix, chunk_size=1000000):
         """ Parse metadata, check that files exist and initialize members """
         self.prefix = prefix
@@ -32,6 +46,18 @@ class MetaMat(object):
             fields = fh.readline().rstrip().split(',')
             self.nrow = int(fields[-1])
             self.cols = fields[:-1]
+            layout = fh.readline().rstrip().split(',')
+
+        self.pair_layout = layout[:2] == ['layout', 'pair']
+        if self.pair_layout:
+            assert self.nrow % 2 == 0
+            self.stored_nrow = self.nrow // 2
+            self.stored_ncol, self.expand_idx = self._pair_expansion(self.cols)
+        else:
+            self.stored_nrow = self.nrow
+            self.stored_ncol = len(self.cols)
+
+        self.stats = self._read_stats(prefix + '.stats')
 
         # Start at first chunk
         self.fh = open(self.data_fn, 'rb')
@@ -44,25 +70,80 @@ class MetaMat(object):
     def next(self):
         return self.__next__()
 
+    def _read_stats(self, stats_fn):
+        """ Parse per-column statistics file, if there is one and it
+            describes the same columns as the metadata. """
+        if not os.path.exists(stats_fn):
+            return None
+        stats = {}
+        with open(stats_fn) as fh:
+            header = fh.readline().rstrip().split(',')
+            assert header[0] == 'col'
+            for ln in fh:
+                toks = ln.rstrip().split(',')
+                rec = dict(zip(header[1:], toks[1:]))
+                stats[toks[0]] = {'min': float(rec['min']),
+                                  'max': float(rec['max']),
+                                  'nan': int(rec['nan']),
+                                  'distinct': float(rec['distinct']),
+                                  'hash': rec['hash']}
+        if sorted(stats.keys()) != sorted(self.cols):
+            return None
+        return stats
+
+    @classmethod
+    def _pair_expansion(cls, cols):
+        """ Given the expanded column names for a compact pair file, return
+            the number of stored columns and, for each of the two expanded
+            rows, the stored column each expanded column comes from. """
+        block = cls.mate_block_head + \
+            [c for c in cols if c.startswith('ztz_')] + \
+            [c for c in cols if c.startswith('rl_')] + \
+            cls.mate_block_tail
+        m = len(block)
+        idxs = []
+        for mine, other in [(0, m), (m, 0)]:
+            idx = []
+            for c in cols:
+                if c in block:
+                    idx.append(mine + block.index(c))
+                elif c[0] == 'o' and c[1:] in block:
+                    idx.append(other + block.index(c[1:]))
+                else:
+                    assert c == 'fraglen', c
+                    idx.append(2 * m)
+            idxs.append(numpy.array(idx))
+        return 2 * m + 1, idxs
+
     def __next__(self):
         """ Return next chunk """
         if self.done:
             self.fh.close()
             raise StopIteration
-        if self.chunk_size > 0:
-            row_i, row_f = self.cur, min(self.cur + self.chunk_size, self.nrow)
+        chunk_size = self.chunk_size
+        if self.pair_layout and chunk_size > 0:
+            chunk_size = max(1, chunk_size // 2)
+        if chunk_size > 0:
+            row_i, row_f = self.cur, min(self.cur + chunk_size, self.stored_nrow)
         else:
             assert self.cur == 0
-            row_i, row_f = 0, self.nrow
-        self.done = row_f == self.nrow
+            row_i, row_f = 0, self.stored_nrow
+        self.done = row_f == self.stored_nrow
         self.cur = row_f
-        nelt = (row_f - row_i) * len(self.cols)
-        assert self.fh.tell() == row_i * 8 * len(self.cols)
+        ncol = self.stored_ncol
+        nelt = (row_f - row_i) * ncol
+        assert self.fh.tell() == row_i * 8 * ncol
         m = numpy.fromfile(self.fh, dtype=numpy.float64, count=nelt, sep='')
-        expected_pos = row_f * 8 * len(self.cols)
+        expected_pos = row_f * 8 * ncol
         assert self.fh.tell() == expected_pos
-        assert m.size == nelt, (row_i, row_f, len(self.cols), m.size, nelt)
-        m = m.reshape((row_f - row_i, len(self.cols)))
+        assert m.size == nelt, (row_i, row_f, ncol, m.size, nelt)
+        m = m.reshape((row_f - row_i, ncol))
+        if self.pair_layout:
+            # mate 1's row, then mate 2's, for each pair
+            expanded = numpy.empty((2 * m.shape[0], len(self.cols)))
+            expanded[0::2] = m[:, self.expand_idx[0]]
+            expanded[1::2] = m[:, self.expand_idx[1]]
+            m = expanded
         return pandas.DataFrame(data=m, columns=self.cols)
 
     def reset(self):
@@ -172,6 +253,59 @@ if __name__ == "__main__":
             except StopIteration:
                 pass
 
+        def test_pair_layout(self):
+            """ Compact pair records expand to the mirrored per-mate rows """
+            prefix = '.testmat_pair'
+            self.prefixes.append(prefix)
+            cols = ['id', 'len', 'clip', 'alqual', 'clipqual', 'ztz_0', 'ztz_1',
+                    'olen', 'oclip', 'oalqual', 'oclipqual', 'fraglen',
+                    'oztz_0', 'oztz_1', 'mapq', 'correct']
+            npair = 5
+            with open(prefix + '.meta', 'w') as fh:
+                fh.write(','.join(cols + [str(npair * 2)]) + '\n')
+                fh.write('layout,pair\n')
+            with open(prefix + '.npy', 'wb') as fh:
+                for i in range(npair):
+                    for mate in [1, 2]:
+                        # id, len, clip, alqual, clipqual, ztz_0, ztz_1, mapq, correct
+                        base = i * 100 + mate * 10
+                        for j in range(9):
+                            fh.write(struct.pack('d', base + j))
+                    fh.write(struct.pack('d', 1000 + i))
+            m = MetaMat(prefix, 4)
+            dfs = [df for df in m]
+            self.assertEqual([4, 4, 2], [df.shape[0] for df in dfs])
+            df = pandas.concat(dfs, ignore_index=True)
+            self.assertEqual(cols, list(df.columns))
+            for i in range(npair):
+                for mate, omate in [(1, 2), (2, 1)]:
+                    row = df.iloc[2 * i + mate - 1]
+                    base, obase = i * 100 + mate * 10, i * 100 + omate * 10
+                    self.assertEqual(base, row['id'])
+                    self.assertEqual(base + 1, row['len'])
+                    self.assertEqual(base + 6, row['ztz_1'])
+                    self.assertEqual(obase + 1, row['olen'])
+                    self.assertEqual(obase + 4, row['oclipqual'])
+                    self.assertEqual(obase + 5, row['oztz_0'])
+                    self.assertEqual(1000 + i, row['fraglen'])
+                    self.assertEqual(base + 7, row['mapq'])
+                    self.assertEqual(base + 8, row['correct'])
+
+        def test_stats(self):
+            """ Statistics sidecar is read when present and matches """
+            prefix = self.prefixes[0]
+            m = MetaMat(prefix)
+            self.assertIsNone(m.stats)
+            with open(prefix + '.stats', 'w') as fh:
+                fh.write('col,min,max,nan,distinct,hash\n')
+                fh.write('alpha,0,1,0,500,00000000000000aa\n')
+                fh.write('bravo,nan,nan,500,0,00000000000000bb\n')
+            m = MetaMat(prefix)
+            self.assertEqual(1.0, m.stats['alpha']['max'])
+            self.assertEqual(500, m.stats['bravo']['nan'])
+            self.assertEqual('00000000000000bb', m.stats['bravo']['hash'])
+            os.remove(prefix + '.stats')
+
         def tearDown(self):
             for prefix in self.prefixes:
                 os.remove(prefix + '.meta')
@@ -0,0 +1,95 @@
+"""
+compare_summaries.py
+
+Compare the summary.csv accuracy measures written by two qtip runs with
+--assess-accuracy, e.g. a baseline run and one with extra features.  Every
+summary.csv under the baseline output directory is paired with the one at
+the same relative path under the other, and each measure is printed side by
+side.  Measures are percent changes relative to the aligner's own MAPQs, so
+lower is better.
+
+Exits non-zero if no summaries pair up, if any baseline summary is missing
+from the new run, or if the AUC measure of any pair is worse in the new run
+than in the baseline by more than --tolerance percentage points.
+
+Usage:
+python compare_summaries.py [--tolerance 1.0] baseline_dir new_dir
+"""
+
+from __future__ import print_function
+import os
+import sys
+import argparse
+
+parser = argparse.ArgumentParser(description='Compare qtip accuracy summaries between two output directories')
+parser.add_argument(
+    'baseline', metavar='dir', type=str, help='Output directory of the baseline run.')
+parser.add_argument(
+    'new', metavar='dir', type=str, help='Output directory of the run to compare against it.')
+parser.add_argument(
+    '--tolerance', metavar='float', type=float, default=1.0,
+    help='Largest increase in AUC percent change allowed before failing.')
+args = parser.parse_args()
+
+
+# Columns of summary.csv, in order, less the leading model name; see
+# MapqPredictions.write_summary_measures
+MEASURES = ['auc_diff_pct', 'auc_diff_pct_round', 'mse_diff_pct', 'mse_diff_pct_round']
+
+
+def read_summary(fn):
+    """ Return dict from measure name to value, or None where the value is
+        missing """
+    with open(fn) as fh:
+        fh.readline()
+        values = fh.readline().rstrip().split(',')
+    summ = {}
+    for measure, value in zip(MEASURES, values):
+        try:
+            summ[measure] = float(value)
+        except ValueError:
+            summ[measure] = None
+    return summ
+
+
+def find_summaries(od):
+    """ Return sorted list of paths, relative to od, of all summary.csv files
+        under od """
+    found = []
+    for root, _, files in os.walk(od):
+        if 'summary.csv' in files:
+            found.append(os.path.relpath(os.path.join(root, 'summary.csv'), od))
+    return sorted(found)
+
+
+def go():
+    npaired, nworse, nmissing = 0, 0, 0
+    for rel in find_summaries(args.baseline):
+        new_fn = os.path.join(args.new, rel)
+        if not os.path.exists(new_fn):
+            print('%s: missing from %s' % (rel, args.new))
+            nmissing += 1
+            continue
+        npaired += 1
+        base, new = read_summary(os.path.join(args.baseline, rel)), read_summary(new_fn)
+        print(rel)
+        for measure in MEASURES:
+            b, n = base.get(measure), new.get(measure)
+            worse = measure == 'auc_diff_pct' and b is not None and \
+                (n is None or n > b + args.tolerance)
+            print('  %-22s %12s %12s%s' % (measure, b, n, '  WORSE' if worse else ''))
+            if worse:
+                nworse += 1
+    if npaired == 0:
+        print('No summary.csv files in common between %s and %s' % (args.baseline, args.new))
+        return 1
+    if nmissing > 0:
+        return 1
+    if nworse > 0:
+        print('%d of %d summaries worse by more than %0.2f points' % (nworse, npaired, args.tolerance))
+        return 1
+    print('%d summaries compared; none worse by more than %0.2f points' % (npaired, args.tolerance))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(go())
@@ -186,3 +186,7 @@ class SnapAligner(Aligner):
         interleaved in the input.
         """
         return False
+
+    @staticmethod
+    def thread_args(nthreads):
+        return ['-t', str(nthreads)]
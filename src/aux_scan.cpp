@@ -0,0 +1,187 @@
+//
+//  aux_scan.cpp
+//  qtip
+//
+
+#include "aux_scan.h"
+#include "simd.h"
+#include <string.h>
+#include <cassert>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static inline bool is_field_end(char c) {
+	return c == '\t' || c == '\n' || c == '\r' || c == '\0';
+}
+
+#if defined(__SSE2__)
+
+/**
+ * Return bit mask of the field-ending characters among the 16 at p.
+ */
+static inline unsigned field_end_mask(const char *p) {
+	const __m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	return (unsigned)_mm_movemask_epi8(m);
+}
+
+#endif
+
+const char *sam_field_end(const char *p) {
+#if defined(__SSE2__)
+	if(simd_level() >= SIMD_SSE2) {
+		// Step a character at a time up to a 16-byte boundary, so the
+		// vector loads never cross into a page past the string's end
+		while(((uintptr_t)p & 15) != 0) {
+			if(is_field_end(*p)) {
+				return p;
+			}
+			p++;
+		}
+		while(true) {
+			unsigned mask = field_end_mask(p);
+			if(mask != 0) {
+				return p + __builtin_ctz(mask);
+			}
+			p += 16;
+		}
+	}
+#endif
+	while(!is_field_end(*p)) {
+		p++;
+	}
+	return p;
+}
+
+AuxScanner::AuxScanner() {
+	for(size_t i = 0; i < TABSZ; i++) {
+		table_[i].key = 0;
+		table_[i].slot = -1;
+	}
+}
+
+int AuxScanner::add(const char *tag) {
+	assert(strlen(tag) == 2);
+	const uint16_t key = tag_key(tag);
+	size_t h = tag_hash(key);
+	for(; table_[h].slot >= 0; h = (h + 1) & (TABSZ - 1)) {
+		if(table_[h].key == key) {
+			return table_[h].slot;
+		}
+	}
+	assert(found_.size() < TABSZ / 2);
+	table_[h].key = key;
+	table_[h].slot = (int)found_.size();
+	found_.push_back(AuxField());
+	return table_[h].slot;
+}
+
+char *AuxScanner::scan(char *p) {
+	for(size_t i = 0; i < found_.size(); i++) {
+		found_[i].field = NULL;
+	}
+	while(true) {
+		char *end = const_cast<char *>(sam_field_end(p));
+		const int slot = lookup(p, (size_t)(end - p));
+		if(slot >= 0 && found_[slot].field == NULL) {
+			found_[slot].field = p;
+			found_[slot].len = (size_t)(end - p);
+		}
+		if(*end != '\t') {
+			return end;
+		}
+		p = end + 1;
+	}
+}
+
+#ifdef AUX_SCAN_MAIN
+
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+
+static void test1() {
+	AuxScanner sc;
+	int md = sc.add("MD");
+	int zt = sc.add("ZT");
+	int nm = sc.add("NM");
+	int as = sc.add("AS");
+	assert(sc.add("MD") == md);
+	assert(sc.size() == 4);
+	char line[] = "AS:i:-12\tXS:i:-20\tNM:i:2\tMD:Z:10A5\tMD:Z:99\tZT:Z:-12,0.5\n";
+	char *end = sc.scan(line);
+	assert(*end == '\n');
+	assert(sc[as].found() && sc[as].type() == 'i');
+	assert(strncmp(sc[as].value(), "-12", sc[as].value_len()) == 0);
+	assert(sc[nm].value_len() == 1 && sc[nm].value()[0] == '2');
+	// first MD wins
+	assert(strcmp(sc[md].terminate(), "10A5") == 0);
+	assert(strcmp(sc[zt].terminate(), "-12,0.5") == 0);
+	assert(sc.lookup("XS:i:-20", 8) == -1);
+	assert(sc.lookup("ZT", 2) == -1);
+	// a later scan forgets earlier results
+	char line2[] = "NM:i:0";
+	assert(*sc.scan(line2) == '\0');
+	assert(sc[nm].found() && !sc[md].found() && !sc[zt].found());
+	std::cerr << "PASSED test1" << std::endl;
+}
+
+static void test2() {
+	// sam_field_end against a byte-at-a-time search, from every alignment
+	srand(5);
+	const char alphabet[] = "ACGT:iZ0123456789\t\r\n";
+	for(int t = 0; t < 20000; t++) {
+		std::string s;
+		int n = rand() % 80;
+		for(int i = 0; i < n; i++) {
+			s.push_back(alphabet[rand() % (sizeof(alphabet) - 1)]);
+		}
+		for(size_t i = 0; i <= s.size(); i++) {
+			const char *p = s.c_str() + i;
+			const char *q = p;
+			while(!is_field_end(*q)) {
+				q++;
+			}
+			assert(sam_field_end(p) == q);
+		}
+	}
+	std::cerr << "PASSED test2" << std::endl;
+}
+
+static void test3() {
+	// Many tags, with collisions in the hash table
+	AuxScanner sc;
+	const char *tags[] = {"AS", "XS", "NM", "MD", "ZT", "XA", "SA", "YS", "YT", "XM",
+	                      "XO", "XG", "XN", "YF", "RG", NULL};
+	for(int i = 0; tags[i] != NULL; i++) {
+		assert(sc.add(tags[i]) == i);
+	}
+	std::string line;
+	for(int i = 0; tags[i] != NULL; i++) {
+		line += std::string(i == 0 ? "" : "\t") + tags[i] + ":i:" + std::to_string(i);
+	}
+	line += "\r\n";
+	std::vector<char> buf(line.begin(), line.end());
+	buf.push_back('\0');
+	assert(*sc.scan(&buf[0]) == '\r');
+	for(int i = 0; tags[i] != NULL; i++) {
+		assert(sc[i].found());
+		assert(atoi(sc[i].terminate()) == i);
+	}
+	std::cerr << "PASSED test3" << std::endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+	test3();
+}
+
+#endif
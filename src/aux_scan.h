@@ -0,0 +1,153 @@
+//
+//  aux_scan.h
+//  qtip
+//
+
+#ifndef __qtip__aux_scan__
+#define __qtip__aux_scan__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * An optional field of a SAM record, e.g. "NM:i:2", found by AuxScanner.
+ * field is NULL if the record didn't have it.
+ */
+struct AuxField {
+
+	AuxField() : field(NULL), len(0) { }
+
+	bool found() const {
+		return field != NULL;
+	}
+
+	/**
+	 * Return the type character, e.g. 'i' for "NM:i:2".
+	 */
+	char type() const {
+		return field[3];
+	}
+
+	/**
+	 * Return the value, e.g. "2" for "NM:i:2".  Not terminated; see
+	 * value_len() and terminate().
+	 */
+	char *value() const {
+		return field + 5;
+	}
+
+	size_t value_len() const {
+		return len - 5;
+	}
+
+	/**
+	 * Overwrite the character after the field with a NUL so the value can
+	 * be used as a C string.  Only once the line's done being scanned.
+	 */
+	char *terminate() const {
+		field[len] = '\0';
+		return value();
+	}
+
+	char *field;  // first character of the tag
+	size_t len;   // length of the whole field, tag through value
+};
+
+/**
+ * Return a pointer to the first tab, newline, carriage return or NUL at or
+ * after p; i.e. the end of a SAM field.  Looks at 16 characters at a time
+ * with SSE2 where available.
+ */
+const char *sam_field_end(const char *p);
+
+/**
+ * Return true iff the SAM field at p has the form of an optional field,
+ * TG:T:value.
+ */
+static inline bool is_aux_field(const char *p, size_t len) {
+	return len >= 5 && p[2] == ':' && p[4] == ':';
+}
+
+/**
+ * Finds, in one pass over a SAM record's optional fields, the first field
+ * with each of a set of two-character tags.  Tags are registered once with
+ * add() and looked up through a small hash table keyed on the two tag
+ * characters, so each field costs one probe however many tags are wanted.
+ *
+ * Not thread-safe: scan() overwrites the results of the previous scan.
+ */
+class AuxScanner {
+
+public:
+
+	AuxScanner();
+
+	/**
+	 * Add a two-character tag, e.g. "MD", to look for.  Return its slot,
+	 * which indexes the results of scan(); adding a tag again returns the
+	 * same slot.
+	 */
+	int add(const char *tag);
+
+	/**
+	 * Return the slot of the optional field at p (of length len) if its tag
+	 * has been added, -1 otherwise.
+	 */
+	int lookup(const char *p, size_t len) const {
+		if(!is_aux_field(p, len)) {
+			return -1;
+		}
+		const uint16_t key = tag_key(p);
+		for(size_t h = tag_hash(key); table_[h].slot >= 0; h = (h + 1) & (TABSZ - 1)) {
+			if(table_[h].key == key) {
+				return table_[h].slot;
+			}
+		}
+		return -1;
+	}
+
+	/**
+	 * Scan tab-separated optional fields from p, the start of the first one,
+	 * to the end of the line.  Afterwards, (*this)[slot] is the first field
+	 * with that slot's tag, if any.  Return a pointer to the end of the line
+	 * (the newline, carriage return or NUL).
+	 */
+	char *scan(char *p);
+
+	/**
+	 * Return what the last scan() found for the given slot.
+	 */
+	const AuxField& operator[](int slot) const {
+		return found_[slot];
+	}
+
+	/**
+	 * Return the number of tags added.
+	 */
+	size_t size() const {
+		return found_.size();
+	}
+
+protected:
+
+	static const size_t TABSZ = 64; // power of 2, well above # tags
+
+	struct Entry {
+		uint16_t key;
+		int slot;  // -1 if empty
+	};
+
+	static uint16_t tag_key(const char *tag) {
+		return (uint16_t)(((unsigned char)tag[0] << 8) | (unsigned char)tag[1]);
+	}
+
+	static size_t tag_hash(uint16_t key) {
+		return ((key >> 8) * 7 + (key & 0xff)) & (TABSZ - 1);
+	}
+
+	Entry table_[TABSZ];
+	std::vector<AuxField> found_;
+};
+
+#endif /* defined(__qtip__aux_scan__) */
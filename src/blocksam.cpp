@@ -0,0 +1,586 @@
+//
+//  blocksam.cpp
+//  qtip
+//
+
+#include "blocksam.h"
+#include "probes.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+
+static const char BSAM_MAGIC[8] = {'Q', 'T', 'B', 'S', 'A', 'M', '\1', '\0'};
+static const char BSAM_INDEX_MAGIC[8] = {'Q', 'T', 'B', 'S', 'I', 'D', 'X', '\0'};
+
+/** Size of one index entry, and of the trailer that ends the file */
+static const size_t BSAM_ENTRYSZ = 24;
+static const size_t BSAM_TRAILERSZ = 24;
+
+static inline void put_le(unsigned char *p, uint64_t v, int nbytes) {
+	for(int i = 0; i < nbytes; i++) {
+		p[i] = (unsigned char)(v >> (8 * i));
+	}
+}
+
+static inline uint64_t get_le(const unsigned char *p, int nbytes) {
+	uint64_t v = 0;
+	for(int i = nbytes - 1; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+/**
+ * Read exactly n bytes at offset off.  Return true on success.
+ */
+static bool pread_all(int fd, void *buf, size_t n, uint64_t off) {
+	char *cur = (char *)buf;
+	while(n > 0) {
+		ssize_t r = pread(fd, cur, n, (off_t)off);
+		if(r <= 0) {
+			return false;
+		}
+		cur += r;
+		n -= (size_t)r;
+		off += (uint64_t)r;
+	}
+	return true;
+}
+
+int BlockSamWriter::open(const string& fn, int level) {
+	fn_ = fn;
+	tmp_fn_ = fn + ".partial";
+	level_ = level;
+	fh_ = fopen(tmp_fn_.c_str(), "wb");
+	if(fh_ == NULL) {
+		cerr << "Could not open block-compressed SAM file \"" << tmp_fn_
+		     << "\" for writing" << endl;
+		return -1;
+	}
+	if(fwrite(BSAM_MAGIC, 1, 8, fh_) != 8) {
+		cerr << "Could not write to \"" << tmp_fn_ << "\"" << endl;
+		return -1;
+	}
+	off_ = 8;
+	raw_bytes_ = 0;
+	buf_.clear();
+	buf_.reserve(BSAM_BLOCKSZ + 65536);
+	index_.clear();
+	return 0;
+}
+
+int BlockSamWriter::write(const char *buf, size_t len) {
+	assert(fh_ != NULL);
+	buf_.insert(buf_.end(), buf, buf + len);
+	raw_bytes_ += len;
+	while(buf_.size() >= BSAM_BLOCKSZ) {
+		// Cut after the last newline in the first BSAM_BLOCKSZ bytes so
+		// blocks hold whole lines, unless a line is longer than that
+		size_t n = BSAM_BLOCKSZ;
+		while(n > 0 && buf_[n-1] != '\n') {
+			n--;
+		}
+		if(n == 0) {
+			n = BSAM_BLOCKSZ;
+		}
+		if(flush_block(n) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int BlockSamWriter::flush_block(size_t n) {
+	if(n == 0) {
+		return 0;
+	}
+	uLongf comp_len = compressBound((uLong)n);
+	comp_.resize(comp_len);
+	int ret = compress2(&comp_.front(), &comp_len,
+	                    (const Bytef *)&buf_.front(), (uLong)n, level_);
+	if(ret != Z_OK) {
+		cerr << "zlib compression failed with status " << ret << endl;
+		return -1;
+	}
+	if(fwrite(&comp_.front(), 1, comp_len, fh_) != comp_len) {
+		cerr << "Could not write to \"" << tmp_fn_ << "\"" << endl;
+		return -1;
+	}
+	IndexEntry e;
+	e.off = off_;
+	e.comp_len = (uint32_t)comp_len;
+	e.raw_len = (uint32_t)n;
+	e.nlines = 0;
+	for(const char *p = &buf_.front(), *end = p + n;
+	    (p = (const char *)memchr(p, '\n', end - p)) != NULL; p++)
+	{
+		e.nlines++;
+	}
+	index_.push_back(e);
+	off_ += comp_len;
+	buf_.erase(buf_.begin(), buf_.begin() + n);
+	return 0;
+}
+
+int BlockSamWriter::close() {
+	if(fh_ == NULL) {
+		return 0;
+	}
+	if(flush_block(buf_.size()) != 0) {
+		return -1;
+	}
+	const uint64_t index_off = off_;
+	for(size_t i = 0; i < index_.size(); i++) {
+		unsigned char ent[BSAM_ENTRYSZ];
+		put_le(ent, index_[i].off, 8);
+		put_le(ent + 8, index_[i].comp_len, 4);
+		put_le(ent + 12, index_[i].raw_len, 4);
+		put_le(ent + 16, index_[i].nlines, 8);
+		if(fwrite(ent, 1, BSAM_ENTRYSZ, fh_) != BSAM_ENTRYSZ) {
+			cerr << "Could not write to \"" << tmp_fn_ << "\"" << endl;
+			return -1;
+		}
+	}
+	unsigned char trailer[BSAM_TRAILERSZ];
+	put_le(trailer, index_.size(), 8);
+	put_le(trailer + 8, index_off, 8);
+	memcpy(trailer + 16, BSAM_INDEX_MAGIC, 8);
+	if(fwrite(trailer, 1, BSAM_TRAILERSZ, fh_) != BSAM_TRAILERSZ) {
+		cerr << "Could not write to \"" << tmp_fn_ << "\"" << endl;
+		return -1;
+	}
+	if(fclose(fh_) != 0) {
+		fh_ = NULL;
+		cerr << "Could not close \"" << tmp_fn_ << "\"" << endl;
+		return -1;
+	}
+	fh_ = NULL;
+	if(rename(tmp_fn_.c_str(), fn_.c_str()) != 0) {
+		cerr << "Could not rename \"" << tmp_fn_ << "\" to \"" << fn_
+		     << "\"" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+bool BlockSamReader::sniff(const string& fn) {
+	FILE *fh = fopen(fn.c_str(), "rb");
+	if(fh == NULL) {
+		return false;
+	}
+	char magic[8];
+	bool ret = fread(magic, 1, 8, fh) == 8 && memcmp(magic, BSAM_MAGIC, 8) == 0;
+	fclose(fh);
+	return ret;
+}
+
+int BlockSamReader::open(const string& fn, int nthreads, uint64_t start) {
+	assert(!is_open());
+	fd_ = ::open(fn.c_str(), O_RDONLY);
+	if(fd_ < 0) {
+		cerr << "Could not open block-compressed SAM file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	off_t fsz = lseek(fd_, 0, SEEK_END);
+	unsigned char trailer[BSAM_TRAILERSZ];
+	if(fsz < (off_t)(8 + BSAM_TRAILERSZ) ||
+	   !pread_all(fd_, trailer, BSAM_TRAILERSZ, (uint64_t)fsz - BSAM_TRAILERSZ) ||
+	   memcmp(trailer + 16, BSAM_INDEX_MAGIC, 8) != 0)
+	{
+		cerr << "Block-compressed SAM file \"" << fn << "\" has no index; "
+		     << "it may be truncated" << endl;
+		close();
+		return -1;
+	}
+	const uint64_t nblocks = get_le(trailer, 8);
+	const uint64_t index_off = get_le(trailer + 8, 8);
+	if(index_off + nblocks * BSAM_ENTRYSZ + BSAM_TRAILERSZ != (uint64_t)fsz) {
+		cerr << "Block-compressed SAM file \"" << fn << "\" has a bad index" << endl;
+		close();
+		return -1;
+	}
+	vector<unsigned char> idx(nblocks * BSAM_ENTRYSZ + 1);
+	if(!pread_all(fd_, &idx.front(), nblocks * BSAM_ENTRYSZ, index_off)) {
+		cerr << "Could not read index of \"" << fn << "\"" << endl;
+		close();
+		return -1;
+	}
+	blocks_.resize(nblocks);
+	for(size_t i = 0; i < nblocks; i++) {
+		const unsigned char *ent = &idx[i * BSAM_ENTRYSZ];
+		blocks_[i].off = get_le(ent, 8);
+		blocks_[i].comp_len = (uint32_t)get_le(ent + 8, 4);
+		blocks_[i].raw_len = (uint32_t)get_le(ent + 12, 4);
+		blocks_[i].nlines = get_le(ent + 16, 8);
+	}
+	cur_ = NULL;
+	len_ = pos_ = 0;
+	consumed_ = next_claim_ = 0;
+	holding_ = stop_ = false;
+	skip_ = 0;
+	// Start in the block holding offset start
+	while(consumed_ < blocks_.size() && start >= blocks_[consumed_].raw_len) {
+		start -= blocks_[consumed_++].raw_len;
+	}
+	if(start > 0 && consumed_ == blocks_.size()) {
+		cerr << "Offset is past the end of block-compressed SAM file \""
+		     << fn << "\"" << endl;
+		close();
+		return -1;
+	}
+	next_claim_ = consumed_;
+	skip_ = (size_t)start;
+	// Workers stay at most two blocks apiece ahead of the reader
+	slots_.clear();
+	slots_.resize(nthreads > 0 ? 2 * nthreads : 1);
+	for(int i = 0; i < nthreads; i++) {
+		threads_.push_back(thread(&BlockSamReader::worker, this));
+	}
+	return 0;
+}
+
+uint64_t BlockSamReader::num_lines() const {
+	uint64_t n = 0;
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		n += blocks_[i].nlines;
+	}
+	return n;
+}
+
+bool BlockSamReader::decompress(size_t b, Slot& s) {
+	const Block& blk = blocks_[b];
+	QTIP_PROBE1(bsam_block, b);
+	s.comp.resize(blk.comp_len + 1);
+	s.raw.resize(blk.raw_len + 1);
+	if(!pread_all(fd_, &s.comp.front(), blk.comp_len, blk.off)) {
+		return false;
+	}
+	uLongf raw_len = blk.raw_len;
+	int ret = uncompress((Bytef *)&s.raw.front(), &raw_len,
+	                     &s.comp.front(), blk.comp_len);
+	return ret == Z_OK && raw_len == blk.raw_len;
+}
+
+void BlockSamReader::worker() {
+	while(true) {
+		size_t b;
+		{
+			unique_lock<mutex> lk(mu_);
+			cv_.wait(lk, [this] {
+				return stop_ || next_claim_ >= blocks_.size() ||
+				       next_claim_ < consumed_ + slots_.size();
+			});
+			if(stop_ || next_claim_ >= blocks_.size()) {
+				return;
+			}
+			b = next_claim_++;
+		}
+		Slot& s = slots_[b % slots_.size()];
+		bool ok = decompress(b, s);
+		{
+			lock_guard<mutex> lk(mu_);
+			s.block = b;
+			s.ok = ok;
+			s.ready = true;
+		}
+		cv_.notify_all();
+	}
+}
+
+bool BlockSamReader::advance() {
+	Slot *s = NULL;
+	if(threads_.empty()) {
+		if(holding_) {
+			consumed_++;
+			holding_ = false;
+		}
+		if(consumed_ >= blocks_.size()) {
+			return false;
+		}
+		s = &slots_[0];
+		s->ok = decompress(consumed_, *s);
+	} else {
+		unique_lock<mutex> lk(mu_);
+		if(holding_) {
+			slots_[consumed_ % slots_.size()].ready = false;
+			consumed_++;
+			holding_ = false;
+			cv_.notify_all();
+		}
+		if(consumed_ >= blocks_.size()) {
+			return false;
+		}
+		s = &slots_[consumed_ % slots_.size()];
+		cv_.wait(lk, [this, s] {
+			return s->ready && s->block == consumed_;
+		});
+	}
+	if(!s->ok) {
+		cerr << "Could not decompress block " << consumed_
+		     << " of block-compressed SAM file" << endl;
+		throw 1;
+	}
+	holding_ = true;
+	cur_ = &s->raw.front();
+	len_ = blocks_[consumed_].raw_len;
+	pos_ = skip_;
+	skip_ = 0;
+	return true;
+}
+
+uint64_t BlockSamReader::tell() const {
+	uint64_t off = 0;
+	for(size_t i = 0; i < consumed_ && i < blocks_.size(); i++) {
+		off += blocks_[i].raw_len;
+	}
+	return off + (holding_ ? pos_ : skip_);
+}
+
+char *BlockSamReader::gets(char *buf, int sz) {
+	assert(sz > 1);
+	size_t n = 0;
+	const size_t max = (size_t)sz - 1;
+	while(n < max) {
+		if(pos_ == len_ && !advance()) {
+			break;
+		}
+		const char *beg = cur_ + pos_;
+		const size_t avail = min(len_ - pos_, max - n);
+		const char *nl = (const char *)memchr(beg, '\n', avail);
+		const size_t take = (nl == NULL) ? avail : (size_t)(nl - beg) + 1;
+		memcpy(buf + n, beg, take);
+		n += take;
+		pos_ += take;
+		if(nl != NULL) {
+			break;
+		}
+	}
+	if(n == 0) {
+		return NULL;
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+void BlockSamReader::close() {
+	{
+		lock_guard<mutex> lk(mu_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	for(size_t i = 0; i < threads_.size(); i++) {
+		threads_[i].join();
+	}
+	threads_.clear();
+	slots_.clear();
+	blocks_.clear();
+	if(fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+	cur_ = NULL;
+	len_ = pos_ = 0;
+}
+
+int SamInput::open(
+	const string& fn,
+	char *buf,
+	size_t bufsz,
+	int nthreads,
+	uint64_t start)
+{
+	if(BlockSamReader::sniff(fn)) {
+		return blk_.open(fn, nthreads, start);
+	}
+	fh_ = fopen(fn.c_str(), "rb");
+	if(fh_ == NULL) {
+		cerr << "Could not open input SAM file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	setvbuf(fh_, buf, _IOFBF, bufsz);
+	if(start > 0 && fseeko(fh_, (off_t)start, SEEK_SET) != 0) {
+		cerr << "Could not seek in input SAM file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+void SamInput::close() {
+	if(fh_ != NULL) {
+		fclose(fh_);
+		fh_ = NULL;
+	}
+	blk_.close();
+}
+
+#ifdef BLOCKSAM_MAIN
+
+#include <stdlib.h>
+
+/**
+ * Write text through a BlockSamWriter, then read it back line by line with
+ * the given number of threads and buffer size; it should match what
+ * fgets gives on the plain text.
+ */
+static void roundtrip(const string& text, int nthreads, int bufsz) {
+	const char *fn = ".test.bsam";
+	const char *plain_fn = ".test.sam";
+	{
+		BlockSamWriter w;
+		assert(w.open(fn, 1) == 0);
+		// write in odd-sized pieces
+		for(size_t i = 0; i < text.size(); i += 1000003) {
+			assert(w.write(text.data() + i, min((size_t)1000003, text.size() - i)) == 0);
+		}
+		assert(w.close() == 0);
+		FILE *fh = fopen(plain_fn, "wb");
+		fwrite(text.data(), 1, text.size(), fh);
+		fclose(fh);
+	}
+	assert(BlockSamReader::sniff(fn));
+	assert(!BlockSamReader::sniff(plain_fn));
+	BlockSamReader r;
+	assert(r.open(fn, nthreads) == 0);
+	size_t nl = 0;
+	for(size_t i = 0; i < text.size(); i++) {
+		nl += text[i] == '\n';
+	}
+	assert(r.num_lines() == nl);
+	FILE *fh = fopen(plain_fn, "rb");
+	vector<char> b1(bufsz), b2(bufsz);
+	while(true) {
+		char *l1 = r.gets(&b1.front(), bufsz);
+		char *l2 = fgets(&b2.front(), bufsz, fh);
+		assert((l1 == NULL) == (l2 == NULL));
+		if(l1 == NULL) {
+			break;
+		}
+		assert(strcmp(l1, l2) == 0);
+	}
+	fclose(fh);
+	r.close();
+	remove(fn);
+	remove(plain_fn);
+}
+
+/**
+ * Many short lines across many blocks, with and without worker threads.
+ */
+static void test1() {
+	string text;
+	char line[256];
+	srand(7);
+	for(int i = 0; i < 200000; i++) {
+		int n = snprintf(line, sizeof(line), "read%d\t%d\tchr%d\t%d\t60\t100M\t*\t0\t0\n",
+		                 i, rand() % 4096, rand() % 3, rand());
+		text.append(line, n);
+	}
+	roundtrip(text, 0, 1024);
+	roundtrip(text, 1, 1024);
+	roundtrip(text, 3, 1024);
+	// lines split by a small buffer
+	roundtrip(text, 2, 7);
+	cerr << "PASSED test1" << endl;
+}
+
+/**
+ * A line longer than a block, no final newline, and an empty file.
+ */
+static void test2() {
+	string text = "@HD\tVN:1.0\n";
+	text.append(BSAM_BLOCKSZ * 2 + 17, 'A');
+	text.append("\nlast line, no newline");
+	roundtrip(text, 2, 4096);
+	roundtrip("", 2, 4096);
+	cerr << "PASSED test2" << endl;
+}
+
+/**
+ * Truncated files are rejected.
+ */
+static void test3() {
+	const char *fn = ".test3.bsam";
+	BlockSamWriter w;
+	assert(w.open(fn, 1) == 0);
+	string text(100000, 'C');
+	assert(w.write(text.data(), text.size()) == 0);
+	assert(w.close() == 0);
+	assert(truncate(fn, 50) == 0);
+	BlockSamReader r;
+	assert(r.open(fn, 2) != 0);
+	remove(fn);
+	cerr << "PASSED test3" << endl;
+}
+
+/**
+ * Reopening at an offset from tell() picks up at the same line, for both
+ * plain and block-compressed files.
+ */
+static void test4() {
+	const char *fn = ".test4.bsam";
+	const char *plain_fn = ".test4.sam";
+	string text;
+	char line[256];
+	for(int i = 0; i < 100000; i++) {
+		int n = snprintf(line, sizeof(line), "read%d\t0\tchr1\t%d\t60\t50M\n", i, i * 7);
+		text.append(line, n);
+	}
+	{
+		BlockSamWriter w;
+		assert(w.open(fn, 1) == 0);
+		assert(w.write(text.data(), text.size()) == 0);
+		assert(w.close() == 0);
+		FILE *fh = fopen(plain_fn, "wb");
+		fwrite(text.data(), 1, text.size(), fh);
+		fclose(fh);
+	}
+	const char *fns[] = {fn, plain_fn};
+	char buf[65536], lbuf1[1024], lbuf2[1024];
+	for(int f = 0; f < 2; f++) {
+		for(int nthreads = 0; nthreads <= 2; nthreads += 2) {
+			// stop at the start, in the first block, at a block
+			// boundary's neighborhood and at the end
+			const int stops[] = {0, 10, 30000, 99999, 100000};
+			for(size_t si = 0; si < sizeof(stops)/sizeof(int); si++) {
+				SamInput in1;
+				assert(in1.open(fns[f], buf, sizeof(buf), nthreads) == 0);
+				for(int i = 0; i < stops[si]; i++) {
+					assert(in1.gets(lbuf1, sizeof(lbuf1)) != NULL);
+				}
+				uint64_t off = in1.tell();
+				SamInput in2;
+				char buf2[4096];
+				assert(in2.open(fns[f], buf2, sizeof(buf2), nthreads, off) == 0);
+				assert(in2.compressed() == (f == 0));
+				while(true) {
+					char *l1 = in1.gets(lbuf1, sizeof(lbuf1));
+					char *l2 = in2.gets(lbuf2, sizeof(lbuf2));
+					assert((l1 == NULL) == (l2 == NULL));
+					if(l1 == NULL) {
+						break;
+					}
+					assert(strcmp(l1, l2) == 0);
+				}
+				assert(in1.tell() == text.size());
+				assert(in2.tell() == text.size());
+			}
+		}
+	}
+	remove(fn);
+	remove(plain_fn);
+	cerr << "PASSED test4" << endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+	test3();
+	test4();
+}
+
+#endif
@@ -0,0 +1,278 @@
+//
+//  blocksam.h
+//  qtip
+//
+
+#ifndef __qtip__blocksam__
+#define __qtip__blocksam__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Block-compressed SAM.  Used so the aligner's output can be kept in the
+ * temporary directory at a fraction of its size while still being read
+ * quickly by qtip-parse and qtip-rewrite.
+ *
+ * The file is an 8-byte magic string, then zlib-compressed blocks of whole
+ * lines (a line is split only if it's longer than a block), then an index
+ * with, for each block, its file offset, compressed and uncompressed sizes
+ * and number of lines.  The file ends with the number of blocks, the
+ * index's offset and a second magic string.  Integers are little-endian.
+ * Because the index is at the end, a truncated file (e.g. from an aligner
+ * that died) is detected when it's opened.
+ */
+
+/** Uncompressed size at which blocks are cut */
+static const size_t BSAM_BLOCKSZ = 1024 * 1024;
+
+/**
+ * Writes block-compressed SAM.  Text goes in through write(); blocks are
+ * compressed as they fill and the index is written by close().  Output
+ * goes to a temporary name that's renamed when the file is complete.
+ */
+class BlockSamWriter {
+
+public:
+
+	BlockSamWriter() : fh_(NULL), level_(1), off_(0), raw_bytes_(0) { }
+
+	~BlockSamWriter() {
+		if(fh_ != NULL) {
+			fclose(fh_);
+			remove(tmp_fn_.c_str());
+		}
+	}
+
+	/**
+	 * Start writing fn at the given zlib compression level.  Return 0 on
+	 * success.
+	 */
+	int open(const std::string& fn, int level);
+
+	/**
+	 * Append len bytes of SAM text.  Return 0 on success.
+	 */
+	int write(const char *buf, size_t len);
+
+	/**
+	 * Compress what's left, write the index and move the file into place.
+	 * Return 0 on success.
+	 */
+	int close();
+
+	/** Number of blocks written so far */
+	size_t num_blocks() const { return index_.size(); }
+
+	/** Total uncompressed and compressed bytes written so far */
+	uint64_t raw_bytes() const { return raw_bytes_; }
+	uint64_t comp_bytes() const { return off_; }
+
+protected:
+
+	/**
+	 * Compress and write the first n bytes of buf_.
+	 */
+	int flush_block(size_t n);
+
+	struct IndexEntry {
+		uint64_t off;
+		uint32_t comp_len;
+		uint32_t raw_len;
+		uint64_t nlines;
+	};
+
+	std::string fn_;
+	std::string tmp_fn_;
+	FILE *fh_;
+	int level_;
+	uint64_t off_;       // file offset of next block
+	uint64_t raw_bytes_;
+	std::vector<char> buf_;
+	std::vector<unsigned char> comp_;
+	std::vector<IndexEntry> index_;
+};
+
+/**
+ * Reads block-compressed SAM a line at a time, like fgets.  Blocks are
+ * decompressed ahead of the reader by a few worker threads; with zero
+ * threads they're decompressed as they're needed.
+ */
+class BlockSamReader {
+
+public:
+
+	BlockSamReader() :
+		fd_(-1),
+		cur_(NULL),
+		len_(0),
+		pos_(0),
+		consumed_(0),
+		next_claim_(0),
+		holding_(false),
+		stop_(false),
+		skip_(0) { }
+
+	~BlockSamReader() {
+		close();
+	}
+
+	/**
+	 * Return true iff fn starts with the block-compressed SAM magic.
+	 */
+	static bool sniff(const std::string& fn);
+
+	/**
+	 * Open fn and read its index.  Reading starts start bytes into the
+	 * uncompressed text, which must be a value returned by tell().
+	 * Return 0 on success.
+	 */
+	int open(const std::string& fn, int nthreads, uint64_t start = 0);
+
+	/**
+	 * Like fgets: copy the next line, up to sz-1 characters, into buf and
+	 * NUL-terminate it.  Return NULL at end of file.
+	 */
+	char *gets(char *buf, int sz);
+
+	void close();
+
+	/**
+	 * Return the offset into the uncompressed text of the next line.
+	 */
+	uint64_t tell() const;
+
+	bool is_open() const {
+		return fd_ >= 0;
+	}
+
+	size_t num_blocks() const {
+		return blocks_.size();
+	}
+
+	/**
+	 * Total number of lines, according to the index.
+	 */
+	uint64_t num_lines() const;
+
+protected:
+
+	struct Block {
+		uint64_t off;
+		uint32_t comp_len;
+		uint32_t raw_len;
+		uint64_t nlines;
+	};
+
+	/**
+	 * A decompressed block, or space for one.  Block b goes in slot
+	 * b % slots_.size().
+	 */
+	struct Slot {
+		Slot() : block(0), ready(false), ok(false) { }
+		std::vector<char> raw;
+		std::vector<unsigned char> comp;
+		size_t block;
+		bool ready;
+		bool ok;
+	};
+
+	/**
+	 * Read and decompress block b into slot s.  Return true on success.
+	 */
+	bool decompress(size_t b, Slot& s);
+
+	/**
+	 * Release the current block, if any, and make the next one current.
+	 * Return false if there are no more.
+	 */
+	bool advance();
+
+	/**
+	 * Worker thread body: decompress blocks up to slots_.size() ahead of
+	 * the reader.
+	 */
+	void worker();
+
+	int fd_;
+	std::vector<Block> blocks_;
+	std::vector<Slot> slots_;
+	std::vector<std::thread> threads_;
+
+	// Current block
+	const char *cur_;
+	size_t len_;
+	size_t pos_;
+
+	std::mutex mu_;
+	std::condition_variable cv_;
+	size_t consumed_;    // blocks the reader is done with
+	size_t next_claim_;  // next block for a worker to claim
+	bool holding_;       // reader holds block consumed_
+	bool stop_;
+	size_t skip_;        // bytes to skip in the first block read
+};
+
+/**
+ * A SAM file to read line by line, either plain or block-compressed.
+ */
+class SamInput {
+
+public:
+
+	SamInput() : fh_(NULL) { }
+
+	~SamInput() {
+		close();
+	}
+
+	/**
+	 * Open fn, deciding from its first bytes whether it's block-compressed.
+	 * Plain files are read through buf, of bufsz bytes; compressed ones are
+	 * decompressed with nthreads worker threads.  Reading starts at start,
+	 * an offset returned by tell().  Return 0 on success.
+	 */
+	int open(
+		const std::string& fn,
+		char *buf,
+		size_t bufsz,
+		int nthreads,
+		uint64_t start = 0);
+
+	inline char *gets(char *buf, int sz) {
+		if(blk_.is_open()) {
+			return blk_.gets(buf, sz);
+		}
+		return fgets(buf, sz, fh_);
+	}
+
+	void close();
+
+	/**
+	 * Return the offset of the next line, for reopening there later.  For
+	 * block-compressed files it's an offset into the uncompressed text.
+	 */
+	uint64_t tell() const {
+		if(blk_.is_open()) {
+			return blk_.tell();
+		}
+		return (uint64_t)ftello(fh_);
+	}
+
+	bool compressed() const {
+		return blk_.is_open();
+	}
+
+protected:
+
+	FILE *fh_;
+	BlockSamReader blk_;
+};
+
+#endif /* defined(__qtip__blocksam__) */
@@ -0,0 +1,339 @@
+//
+//  checkpoint.cpp
+//  qtip
+//
+
+#include "checkpoint.h"
+#include "rnglib.hpp"
+#include <stdio.h>
+#include <errno.h>
+#include <cassert>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char CKPT_MAGIC[] = "QTIPCKP1";
+
+/** Number of generators rnglib keeps (its G_MAX) */
+static const int RNG_NGEN = 32;
+
+/**
+ * 64-bit FNV-1a hash, for detecting damaged checkpoints.
+ */
+static uint64_t fnv1a(const char *p, size_t n) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < n; i++) {
+		h ^= (unsigned char)p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static double now_secs() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int CheckpointWriter::commit(const string& fn) const {
+	string tmp_fn = fn + ".partial";
+	FILE *fh = fopen(tmp_fn.c_str(), "wb");
+	if(fh == NULL) {
+		cerr << "Could not open checkpoint file \"" << tmp_fn << "\"" << endl;
+		return -1;
+	}
+	uint64_t sum = fnv1a(buf_.empty() ? NULL : &buf_.front(), buf_.size());
+	unsigned char sumbuf[8];
+	for(int i = 0; i < 8; i++) {
+		sumbuf[i] = (unsigned char)((sum >> (8 * i)) & 0xff);
+	}
+	bool ok = fwrite(CKPT_MAGIC, 1, 8, fh) == 8 &&
+	          (buf_.empty() || fwrite(&buf_.front(), 1, buf_.size(), fh) == buf_.size()) &&
+	          fwrite(sumbuf, 1, 8, fh) == 8;
+	ok = checkpoint_sync_file(fh) == 0 && ok;
+	ok = fclose(fh) == 0 && ok;
+	if(!ok || rename(tmp_fn.c_str(), fn.c_str()) != 0) {
+		cerr << "Error writing checkpoint file \"" << fn << "\"" << endl;
+		remove(tmp_fn.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+int CheckpointReader::load(const string& fn) {
+	buf_.clear();
+	off_ = 0;
+	FILE *fh = fopen(fn.c_str(), "rb");
+	if(fh == NULL) {
+		return errno == ENOENT ? 1 : -1;
+	}
+	vector<char> all;
+	char tmp[65536];
+	size_t n;
+	while((n = fread(tmp, 1, sizeof(tmp), fh)) > 0) {
+		all.insert(all.end(), tmp, tmp + n);
+	}
+	bool err = ferror(fh) != 0;
+	fclose(fh);
+	if(err || all.size() < 16 || memcmp(&all.front(), CKPT_MAGIC, 8) != 0) {
+		return -1;
+	}
+	uint64_t sum = 0;
+	for(int i = 0; i < 8; i++) {
+		sum |= ((uint64_t)(unsigned char)all[all.size() - 8 + i]) << (8 * i);
+	}
+	if(fnv1a(&all.front() + 8, all.size() - 16) != sum) {
+		return -1;
+	}
+	buf_.assign(all.begin() + 8, all.end() - 8);
+	return 0;
+}
+
+bool Checkpointer::init(const string& fn, double interval, const string& tag) {
+	fn_ = fn;
+	tag_ = tag;
+	interval_ = interval;
+	last_ = now_secs();
+	resuming_ = false;
+	if(!enabled()) {
+		return false;
+	}
+	int ret = in_.load(fn_);
+	if(ret < 0) {
+		cerr << "Warning: checkpoint \"" << fn_ << "\" is damaged; "
+		     << "starting over" << endl;
+	} else if(ret == 0) {
+		if(in_.get_str() != tag_) {
+			cerr << "Warning: checkpoint \"" << fn_ << "\" is from a run with "
+			     << "different arguments; starting over" << endl;
+		} else {
+			resuming_ = true;
+		}
+	}
+	return resuming_;
+}
+
+bool Checkpointer::due() const {
+	return enabled() && !resuming_ && now_secs() - last_ >= interval_;
+}
+
+int Checkpointer::save(const function<void(CheckpointWriter&)>& save) {
+	assert(!resuming_);
+	out_.clear();
+	out_.put_str(tag_);
+	if(common_) {
+		common_(out_);
+	}
+	save(out_);
+	if(out_.commit(fn_) != 0) {
+		return -1;
+	}
+	last_ = now_secs();
+	return 0;
+}
+
+void Checkpointer::finish() {
+	if(enabled()) {
+		remove(fn_.c_str());
+	}
+}
+
+uint64_t checkpoint_file_length(FILE *fh) {
+	fflush(fh);
+	struct stat st;
+	if(fstat(fileno(fh), &st) != 0) {
+		cerr << "Error: could not get length of an output file" << endl;
+		throw 1;
+	}
+	return (uint64_t)st.st_size;
+}
+
+int checkpoint_sync_file(FILE *fh) {
+	if(fflush(fh) != 0) {
+		return -1;
+	}
+	return fsync(fileno(fh));
+}
+
+int checkpoint_truncate_file(FILE *fh, const string& fn, uint64_t len) {
+	fflush(fh);
+	if(fseeko(fh, 0, SEEK_END) != 0 || (uint64_t)ftello(fh) < len) {
+		cerr << "Error: output file \"" << fn << "\" is shorter than it was "
+		     << "at the checkpoint; remove the checkpoint and start over" << endl;
+		return -1;
+	}
+	if(ftruncate(fileno(fh), (off_t)len) != 0 || fseeko(fh, 0, SEEK_END) != 0) {
+		cerr << "Error: could not truncate output file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+void checkpoint_save_rng(CheckpointWriter& w) {
+	w.put_i64(cgn_get());
+	w.put_bool(antithetic_get());
+	for(int g = 0; g < RNG_NGEN; g++) {
+		int a1, a2;
+		ig_get(g, a1, a2);
+		w.put_i64(a1); w.put_i64(a2);
+		lg_get(g, a1, a2);
+		w.put_i64(a1); w.put_i64(a2);
+		cg_get(g, a1, a2);
+		w.put_i64(a1); w.put_i64(a2);
+	}
+}
+
+void checkpoint_restore_rng(CheckpointReader& r) {
+	int cur = (int)r.get_i64();
+	antithetic_set(r.get_bool());
+	for(int g = 0; g < RNG_NGEN; g++) {
+		int a1 = (int)r.get_i64(), a2 = (int)r.get_i64();
+		ig_set(g, a1, a2);
+		a1 = (int)r.get_i64(); a2 = (int)r.get_i64();
+		lg_set(g, a1, a2);
+		a1 = (int)r.get_i64(); a2 = (int)r.get_i64();
+		cg_set(g, a1, a2);
+	}
+	cgn_set(cur);
+}
+
+#ifdef CHECKPOINT_MAIN
+
+static void test1() {
+	// Round trip
+	const char *fn = ".checkpoint.test1";
+	CheckpointWriter w;
+	w.put_u64(12345678901234ULL);
+	w.put_i64(-7);
+	w.put_bool(true);
+	w.put_double(0.1);
+	w.put_str("hello");
+	w.put_cstr(NULL);
+	w.put_cstr("IIII");
+	int ar[3] = {1, 2, 3};
+	w.put_bytes(ar, sizeof(ar));
+	assert(w.commit(fn) == 0);
+	CheckpointReader r;
+	assert(r.load(fn) == 0);
+	assert(r.get_u64() == 12345678901234ULL);
+	assert(r.get_i64() == -7);
+	assert(r.get_bool());
+	assert(r.get_double() == 0.1);
+	assert(r.get_str() == "hello");
+	string s;
+	assert(!r.get_cstr(s));
+	assert(r.get_cstr(s) && s == "IIII");
+	int ar2[3];
+	r.get_bytes(ar2, sizeof(ar2));
+	assert(ar2[2] == 3);
+	assert(r.done());
+	// Damage is detected
+	FILE *fh = fopen(fn, "r+b");
+	fseek(fh, 12, SEEK_SET);
+	fputc('x', fh);
+	fclose(fh);
+	assert(r.load(fn) == -1);
+	remove(fn);
+	assert(r.load(fn) == 1);
+	cerr << "PASSED test1" << endl;
+}
+
+static void test2() {
+	// Truncating an output file back to its checkpointed length
+	const char *fn = ".checkpoint.test2";
+	FILE *fh = fopen(fn, "wb");
+	fputs("0123456789", fh);
+	uint64_t len = checkpoint_file_length(fh);
+	assert(len == 10);
+	fputs("abcdef", fh);
+	fclose(fh);
+	fh = fopen(fn, "ab");
+	assert(checkpoint_truncate_file(fh, fn, len) == 0);
+	fputs("XY", fh);
+	fclose(fh);
+	fh = fopen(fn, "rb");
+	char buf[32];
+	assert(fgets(buf, sizeof(buf), fh) != NULL);
+	fclose(fh);
+	assert(strcmp(buf, "0123456789XY") == 0);
+	fh = fopen(fn, "ab");
+	assert(checkpoint_truncate_file(fh, fn, 100) != 0);
+	fclose(fh);
+	remove(fn);
+	cerr << "PASSED test2" << endl;
+}
+
+static void test3() {
+	// Restored generators pick up where the saved ones were
+	initialize();
+	set_seed(77, 1234);
+	for(int i = 0; i < 10; i++) {
+		r4_uni_01();
+	}
+	CheckpointWriter w;
+	checkpoint_save_rng(w);
+	const char *fn = ".checkpoint.test3";
+	assert(w.commit(fn) == 0);
+	float want[5];
+	for(int i = 0; i < 5; i++) {
+		want[i] = r4_uni_01();
+	}
+	set_seed(1, 1);
+	r4_uni_01();
+	CheckpointReader r;
+	assert(r.load(fn) == 0);
+	checkpoint_restore_rng(r);
+	assert(r.done());
+	for(int i = 0; i < 5; i++) {
+		assert(r4_uni_01() == want[i]);
+	}
+	remove(fn);
+	cerr << "PASSED test3" << endl;
+}
+
+static void test4() {
+	// Checkpointer: tag must match, and finish removes the file
+	const char *fn = ".checkpoint.test4";
+	remove(fn);
+	{
+		Checkpointer ck;
+		assert(!ck.init(fn, 0.0, "args"));
+		assert(!ck.enabled());
+	}
+	{
+		Checkpointer ck;
+		assert(!ck.init(fn, 1e-9, "args"));
+		ck.set_common([](CheckpointWriter& w) { w.put_u64(1); });
+		assert(ck.due());
+		assert(ck.save([](CheckpointWriter& w) { w.put_str("state"); }) == 0);
+	}
+	{
+		Checkpointer ck;
+		assert(ck.init(fn, 1e-9, "args"));
+		assert(!ck.due());
+		assert(ck.reader().get_u64() == 1);
+		assert(ck.reader().get_str() == "state");
+		ck.resumed();
+		assert(!ck.resuming());
+	}
+	{
+		Checkpointer ck;
+		assert(!ck.init(fn, 1e-9, "other args"));
+		ck.finish();
+	}
+	FILE *fh = fopen(fn, "rb");
+	assert(fh == NULL);
+	cerr << "PASSED test4" << endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+	test3();
+	test4();
+}
+
+#endif
@@ -0,0 +1,301 @@
+//
+//  checkpoint.h
+//  qtip
+//
+
+#ifndef __qtip__checkpoint__
+#define __qtip__checkpoint__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <iostream>
+
+/**
+ * Checkpoints let a long qtip-parse run that's killed partway through (e.g.
+ * on a preempted spot instance) pick up where it left off instead of
+ * starting over.
+ *
+ * Every so often, at a point where nothing is half-done (between SAM
+ * records with no mate waiting for its opposite, or between FASTA chunks
+ * when simulating), qtip-parse flushes its output files and saves
+ * everything needed to carry on from there: where it is in the input, its
+ * counters, the lengths of the output files, the reservoirs of input-model
+ * templates and the state of the random number generators.  A restarted
+ * run with the same arguments loads the checkpoint, truncates the output
+ * files back to the saved lengths and continues, producing exactly the
+ * output an uninterrupted run would have.
+ *
+ * A checkpoint is written to a temporary name and renamed into place, and
+ * the output files are synced first, so the checkpoint on disk never gets
+ * ahead of them.  It ends with a checksum, so a damaged one is ignored
+ * rather than trusted.  Integers are little-endian.
+ */
+
+/**
+ * Accumulates a checkpoint's contents in memory.
+ */
+class CheckpointWriter {
+
+public:
+
+	void put_u64(uint64_t v) {
+		for(int i = 0; i < 8; i++) {
+			buf_.push_back((char)((v >> (8 * i)) & 0xff));
+		}
+	}
+
+	void put_i64(int64_t v) {
+		put_u64((uint64_t)v);
+	}
+
+	void put_bool(bool b) {
+		put_u64(b ? 1 : 0);
+	}
+
+	void put_double(double d) {
+		uint64_t v;
+		memcpy(&v, &d, 8);
+		put_u64(v);
+	}
+
+	void put_bytes(const void *p, size_t n) {
+		put_u64(n);
+		buf_.insert(buf_.end(), (const char *)p, (const char *)p + n);
+	}
+
+	void put_str(const std::string& s) {
+		put_bytes(s.data(), s.size());
+	}
+
+	/**
+	 * Put a string that may be NULL.
+	 */
+	void put_cstr(const char *s) {
+		put_bool(s != NULL);
+		if(s != NULL) {
+			put_bytes(s, strlen(s));
+		}
+	}
+
+	/**
+	 * Write the contents to fn, atomically.  Return 0 on success.
+	 */
+	int commit(const std::string& fn) const;
+
+	void clear() {
+		buf_.clear();
+	}
+
+protected:
+
+	std::vector<char> buf_;
+};
+
+/**
+ * Reads back what a CheckpointWriter wrote, in the same order.  Running off
+ * the end is an error.
+ */
+class CheckpointReader {
+
+public:
+
+	CheckpointReader() : off_(0) { }
+
+	/**
+	 * Load a checkpoint.  Return 0 on success, 1 if there's no file and -1
+	 * if it's unreadable or damaged.
+	 */
+	int load(const std::string& fn);
+
+	uint64_t get_u64() {
+		need(8);
+		uint64_t v = 0;
+		for(int i = 0; i < 8; i++) {
+			v |= ((uint64_t)(unsigned char)buf_[off_ + i]) << (8 * i);
+		}
+		off_ += 8;
+		return v;
+	}
+
+	int64_t get_i64() {
+		return (int64_t)get_u64();
+	}
+
+	bool get_bool() {
+		return get_u64() != 0;
+	}
+
+	double get_double() {
+		uint64_t v = get_u64();
+		double d;
+		memcpy(&d, &v, 8);
+		return d;
+	}
+
+	/**
+	 * Get n bytes written by put_bytes; n must match.
+	 */
+	void get_bytes(void *p, size_t n) {
+		if(get_u64() != n) {
+			std::cerr << "Error: unexpected field length in checkpoint" << std::endl;
+			throw 1;
+		}
+		need(n);
+		if(n > 0) {
+			memcpy(p, &buf_[off_], n);
+		}
+		off_ += n;
+	}
+
+	std::string get_str() {
+		size_t n = (size_t)get_u64();
+		need(n);
+		std::string s(buf_.begin() + off_, buf_.begin() + off_ + n);
+		off_ += n;
+		return s;
+	}
+
+	/**
+	 * Get a string put with put_cstr.  Return false if it was NULL.
+	 */
+	bool get_cstr(std::string& s) {
+		if(!get_bool()) {
+			return false;
+		}
+		s = get_str();
+		return true;
+	}
+
+	/**
+	 * Return true iff everything has been read.
+	 */
+	bool done() const {
+		return off_ == buf_.size();
+	}
+
+protected:
+
+	void need(size_t n) const {
+		if(off_ + n > buf_.size()) {
+			std::cerr << "Error: checkpoint ended early" << std::endl;
+			throw 1;
+		}
+	}
+
+	std::vector<char> buf_;
+	size_t off_;
+};
+
+/**
+ * Decides when to take checkpoints and writes them to a file.  The caller
+ * registers a function that saves the state common to the whole run (see
+ * set_common); the code taking a checkpoint adds its own state after that.
+ */
+class Checkpointer {
+
+public:
+
+	Checkpointer() : interval_(0.0), last_(0.0), resuming_(false) { }
+
+	/**
+	 * Take checkpoints in fn about every interval seconds.  If fn holds a
+	 * checkpoint made with the same tag (e.g. the command line), load it
+	 * for the caller to resume from; a checkpoint with a different tag or
+	 * a damaged one is ignored.  Return true iff resuming.
+	 */
+	bool init(const std::string& fn, double interval, const std::string& tag);
+
+	bool enabled() const {
+		return interval_ > 0.0;
+	}
+
+	/**
+	 * Return true iff we loaded a checkpoint that hasn't been fully
+	 * consumed yet.
+	 */
+	bool resuming() const {
+		return resuming_;
+	}
+
+	/**
+	 * Return the loaded checkpoint.  Only valid while resuming().
+	 */
+	CheckpointReader& reader() {
+		return in_;
+	}
+
+	/**
+	 * Note that the resumed code has caught up with the checkpoint.
+	 */
+	void resumed() {
+		if(!in_.done()) {
+			std::cerr << "Error: checkpoint has unexpected trailing data" << std::endl;
+			throw 1;
+		}
+		resuming_ = false;
+	}
+
+	/**
+	 * Return true iff it's time for another checkpoint.
+	 */
+	bool due() const;
+
+	/**
+	 * Set the function that saves state common to all checkpoints.  It's
+	 * called first when a checkpoint is taken.
+	 */
+	void set_common(const std::function<void(CheckpointWriter&)>& common) {
+		common_ = common;
+	}
+
+	/**
+	 * Take a checkpoint: the common state, then what save adds.  Return 0
+	 * on success.
+	 */
+	int save(const std::function<void(CheckpointWriter&)>& save);
+
+	/**
+	 * Remove the checkpoint once the run has finished.
+	 */
+	void finish();
+
+protected:
+
+	std::string fn_;
+	std::string tag_;
+	double interval_;
+	double last_;  // time of last checkpoint, or of init
+	bool resuming_;
+	CheckpointReader in_;
+	CheckpointWriter out_;
+	std::function<void(CheckpointWriter&)> common_;
+};
+
+/**
+ * Flush fh and return the length of its file.
+ */
+uint64_t checkpoint_file_length(FILE *fh);
+
+/**
+ * Flush fh and make sure what's been written is on disk.  Return 0 on
+ * success.
+ */
+int checkpoint_sync_file(FILE *fh);
+
+/**
+ * Cut an output file opened for appending back to len bytes, the length it
+ * had at the checkpoint.  Return 0 on success.
+ */
+int checkpoint_truncate_file(FILE *fh, const std::string& fn, uint64_t len);
+
+/**
+ * Save and restore the state of all of rnglib's generators.
+ */
+void checkpoint_save_rng(CheckpointWriter& w);
+void checkpoint_restore_rng(CheckpointReader& r);
+
+#endif /* defined(__qtip__checkpoint__) */
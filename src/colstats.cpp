@@ -0,0 +1,321 @@
+//
+//  colstats.cpp
+//  qtip
+//
+
+#include "colstats.h"
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <cassert>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+/**
+ * Bits of a double with all NaNs mapped to one value and -0.0 to 0.0, so
+ * values that compare equal (or are both NaN) hash the same.
+ */
+static inline uint64_t canonical_bits(double d) {
+	if(d != d) {
+		return 0x7ff8000000000000ULL;
+	}
+	if(d == 0.0) {
+		d = 0.0;
+	}
+	uint64_t x;
+	memcpy(&x, &d, 8);
+	return x;
+}
+
+/**
+ * splitmix64 finalizer.
+ */
+static inline uint64_t mix64(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+void ColumnStats::init(const vector<string>& names) {
+	vector<vector<size_t> > expand(1);
+	for(size_t i = 0; i < names.size(); i++) {
+		expand[0].push_back(i);
+	}
+	init(names, names.size(), expand);
+}
+
+void ColumnStats::init(
+	const vector<string>& names,
+	size_t stored_ncol,
+	const vector<vector<size_t> >& expand)
+{
+	assert(stored_ncol > 0);
+	names_ = names;
+	stored_ncol_ = stored_ncol;
+	expand_ = expand;
+	cols_.resize(names.size());
+	for(size_t c = 0; c < cols_.size(); c++) {
+		cols_[c].mn = numeric_limits<double>::infinity();
+		cols_[c].mx = -numeric_limits<double>::infinity();
+		cols_[c].nnan = 0;
+		cols_[c].hash = 0;
+		cols_[c].hll.assign(HLL_REGS, 0);
+	}
+	nrow_ = 0;
+}
+
+void ColumnStats::add(const double *recs, size_t nvals) {
+	assert(initialized());
+	assert(nvals % stored_ncol_ == 0);
+	const size_t nrec = nvals / stored_ncol_;
+	for(size_t i = 0; i < nrec; i++) {
+		const double *rec = recs + i * stored_ncol_;
+		for(size_t r = 0; r < expand_.size(); r++) {
+			const vector<size_t>& idx = expand_[r];
+			for(size_t c = 0; c < cols_.size(); c++) {
+				const double d = rec[idx[c]];
+				Col& col = cols_[c];
+				const uint64_t bits = canonical_bits(d);
+				col.hash = col.hash * 0x100000001b3ULL + mix64(bits);
+				if(d != d) {
+					col.nnan++;
+					continue;
+				}
+				if(d < col.mn) col.mn = d;
+				if(d > col.mx) col.mx = d;
+				const uint64_t h = mix64(bits ^ 0x9e3779b97f4a7c15ULL);
+				const size_t reg = (size_t)(h >> (64 - HLL_BITS));
+				const uint64_t w = h << HLL_BITS;
+				const uint8_t rank = (uint8_t)(w == 0 ? (64 - HLL_BITS + 1) : (__builtin_clzll(w) + 1));
+				if(rank > col.hll[reg]) {
+					col.hll[reg] = rank;
+				}
+			}
+		}
+		nrow_ += expand_.size();
+	}
+}
+
+double ColumnStats::distinct(size_t c) const {
+	const vector<uint8_t>& hll = cols_[c].hll;
+	const double m = (double)HLL_REGS;
+	double sum = 0.0;
+	size_t zeros = 0;
+	for(size_t i = 0; i < HLL_REGS; i++) {
+		sum += ldexp(1.0, -(int)hll[i]);
+		if(hll[i] == 0) {
+			zeros++;
+		}
+	}
+	double est = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+	if(est <= 2.5 * m && zeros > 0) {
+		// linear counting does better for small cardinalities
+		est = m * log(m / (double)zeros);
+	}
+	return est;
+}
+
+void ColumnStats::save(CheckpointWriter& w) const {
+	w.put_u64(names_.size());
+	for(size_t c = 0; c < names_.size(); c++) {
+		w.put_str(names_[c]);
+	}
+	w.put_u64(stored_ncol_);
+	w.put_u64(expand_.size());
+	for(size_t r = 0; r < expand_.size(); r++) {
+		w.put_u64(expand_[r].size());
+		for(size_t c = 0; c < expand_[r].size(); c++) {
+			w.put_u64(expand_[r][c]);
+		}
+	}
+	for(size_t c = 0; c < cols_.size(); c++) {
+		w.put_double(cols_[c].mn);
+		w.put_double(cols_[c].mx);
+		w.put_u64(cols_[c].nnan);
+		w.put_u64(cols_[c].hash);
+		w.put_bytes(&cols_[c].hll.front(), HLL_REGS);
+	}
+	w.put_u64(nrow_);
+}
+
+void ColumnStats::restore(CheckpointReader& r) {
+	vector<string> names((size_t)r.get_u64());
+	for(size_t c = 0; c < names.size(); c++) {
+		names[c] = r.get_str();
+	}
+	size_t stored_ncol = (size_t)r.get_u64();
+	vector<vector<size_t> > expand((size_t)r.get_u64());
+	for(size_t i = 0; i < expand.size(); i++) {
+		expand[i].resize((size_t)r.get_u64());
+		for(size_t c = 0; c < expand[i].size(); c++) {
+			expand[i][c] = (size_t)r.get_u64();
+		}
+	}
+	init(names, stored_ncol, expand);
+	for(size_t c = 0; c < cols_.size(); c++) {
+		cols_[c].mn = r.get_double();
+		cols_[c].mx = r.get_double();
+		cols_[c].nnan = r.get_u64();
+		cols_[c].hash = r.get_u64();
+		r.get_bytes(&cols_[c].hll.front(), HLL_REGS);
+	}
+	nrow_ = r.get_u64();
+}
+
+/**
+ * Print a min or max; all-NaN columns have neither.
+ */
+static void print_bound(FILE *fh, double d, uint64_t nnan, uint64_t nrow) {
+	if(nnan == nrow) {
+		fprintf(fh, "nan");
+	} else {
+		fprintf(fh, "%.17g", d);
+	}
+}
+
+int ColumnStats::write(const string& fn) const {
+	FILE *fh = fopen(fn.c_str(), "wb");
+	if(fh == NULL) {
+		cerr << "Could not open output statistics file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	fprintf(fh, "col,min,max,nan,distinct,hash\n");
+	for(size_t c = 0; c < cols_.size(); c++) {
+		const Col& col = cols_[c];
+		fprintf(fh, "%s,", names_[c].c_str());
+		print_bound(fh, col.mn, col.nnan, nrow_);
+		fprintf(fh, ",");
+		print_bound(fh, col.mx, col.nnan, nrow_);
+		fprintf(fh, ",%llu,%.0f,%016llx\n",
+		        (unsigned long long)col.nnan,
+		        distinct(c),
+		        (unsigned long long)col.hash);
+	}
+	fclose(fh);
+	return 0;
+}
+
+#ifdef COLSTATS_MAIN
+
+#include <stdlib.h>
+
+/**
+ * Min, max, NaNs and duplicate detection on an unpaired layout.
+ */
+static void test1() {
+	vector<string> names;
+	names.push_back("a");
+	names.push_back("b");
+	names.push_back("c");
+	names.push_back("d");
+	ColumnStats st;
+	st.init(names);
+	const double nan = numeric_limits<double>::quiet_NaN();
+	// a, b copy of a, c constant, d has a NaN
+	double recs[] = {1.0, 1.0, 5.0, nan,
+	                 -2.0, -2.0, 5.0, 3.0,
+	                 7.0, 7.0, 5.0, -0.0};
+	st.add(recs, 8);
+	st.add(recs + 8, 4);
+	assert(st.nrow() == 3);
+	assert(st.min(0) == -2.0 && st.max(0) == 7.0);
+	assert(st.min(2) == 5.0 && st.max(2) == 5.0);
+	assert(st.nnan(3) == 1 && st.nnan(0) == 0);
+	assert(st.min(3) == 0.0 && st.max(3) == 3.0);
+	assert(st.hash(0) == st.hash(1));
+	assert(st.hash(0) != st.hash(2));
+	assert(st.hash(0) != st.hash(3));
+	assert(fabs(st.distinct(0) - 3.0) < 0.5);
+	assert(fabs(st.distinct(2) - 1.0) < 0.5);
+	cerr << "PASSED test1" << endl;
+}
+
+/**
+ * Expanded pair layout: mirrored columns see the same values, in a
+ * different order.
+ */
+static void test2() {
+	vector<string> names;
+	names.push_back("len");
+	names.push_back("olen");
+	names.push_back("fraglen");
+	vector<vector<size_t> > expand(2);
+	expand[0].push_back(0); expand[0].push_back(1); expand[0].push_back(2);
+	expand[1].push_back(1); expand[1].push_back(0); expand[1].push_back(2);
+	ColumnStats st;
+	st.init(names, 3, expand);
+	double recs[] = {100.0, 150.0, 400.0,
+	                 120.0, 120.0, 300.0};
+	st.add(recs, 6);
+	assert(st.nrow() == 4);
+	assert(st.min(0) == 100.0 && st.max(0) == 150.0);
+	assert(st.min(1) == 100.0 && st.max(1) == 150.0);
+	assert(st.hash(0) != st.hash(1));
+	assert(fabs(st.distinct(2) - 2.0) < 0.5);
+	cerr << "PASSED test2" << endl;
+}
+
+/**
+ * Distinct-count estimate stays within a few percent for larger columns.
+ */
+static void test3() {
+	vector<string> names;
+	names.push_back("x");
+	ColumnStats st;
+	st.init(names);
+	for(int i = 0; i < 100000; i++) {
+		double d = (double)(i % 20000);
+		st.add(&d, 1);
+	}
+	double est = st.distinct(0);
+	assert(est > 20000 * 0.9 && est < 20000 * 1.1);
+	cerr << "PASSED test3" << endl;
+}
+
+/**
+ * Restored statistics continue as if never interrupted.
+ */
+static void test4() {
+	vector<string> names;
+	names.push_back("x");
+	names.push_back("y");
+	ColumnStats all, part;
+	all.init(names);
+	part.init(names);
+	double recs[] = {1.0, 2.0, 3.0, numeric_limits<double>::quiet_NaN(), 5.0, 6.0};
+	all.add(recs, 6);
+	part.add(recs, 2);
+	const char *fn = ".colstats.test4.ckpt";
+	CheckpointWriter w;
+	part.save(w);
+	assert(w.commit(fn) == 0);
+	CheckpointReader r;
+	assert(r.load(fn) == 0);
+	ColumnStats resumed;
+	resumed.restore(r);
+	assert(r.done());
+	remove(fn);
+	resumed.add(recs + 2, 4);
+	assert(resumed.nrow() == all.nrow());
+	for(size_t c = 0; c < 2; c++) {
+		assert(resumed.hash(c) == all.hash(c));
+		assert(resumed.nnan(c) == all.nnan(c));
+		assert(resumed.min(c) == all.min(c) && resumed.max(c) == all.max(c));
+		assert(resumed.distinct(c) == all.distinct(c));
+	}
+	cerr << "PASSED test4" << endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+	test3();
+	test4();
+}
+
+#endif
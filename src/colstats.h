@@ -0,0 +1,103 @@
+//
+//  colstats.h
+//  qtip
+//
+
+#ifndef __qtip__colstats__
+#define __qtip__colstats__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+#include "checkpoint.h"
+
+/**
+ * Summary statistics for each column of a feature record file, gathered as
+ * the records are written so that readers can pick out constant and
+ * duplicate columns and fill in NaNs without another pass over the data.
+ *
+ * Statistics are kept for the columns readers see.  For files where a
+ * stored record expands to several rows (compact pair records), the
+ * caller supplies, for each expanded row, the stored column each visible
+ * column comes from.
+ */
+class ColumnStats {
+
+public:
+
+	/** log2 of the number of HyperLogLog registers per column */
+	static const int HLL_BITS = 10;
+	static const size_t HLL_REGS = 1 << HLL_BITS;
+
+	ColumnStats() : stored_ncol_(0), nrow_(0) { }
+
+	/**
+	 * Set up for records with one visible row per stored record, with
+	 * columns stored in the order given.
+	 */
+	void init(const std::vector<std::string>& names);
+
+	/**
+	 * Set up for stored records of stored_ncol doubles, each expanding to
+	 * expand.size() visible rows, where expand[r][c] is the stored column
+	 * holding column c of row r.
+	 */
+	void init(
+		const std::vector<std::string>& names,
+		size_t stored_ncol,
+		const std::vector<std::vector<size_t> >& expand);
+
+	/**
+	 * Return true iff init has been called.
+	 */
+	bool initialized() const {
+		return stored_ncol_ > 0;
+	}
+
+	/**
+	 * Account for nvals doubles' worth of whole stored records.
+	 */
+	void add(const double *recs, size_t nvals);
+
+	/**
+	 * Estimated number of distinct non-NaN values in column c.
+	 */
+	double distinct(size_t c) const;
+
+	/**
+	 * Write statistics as CSV, one line per column.  Return 0 on success.
+	 */
+	int write(const std::string& fn) const;
+
+	/**
+	 * Save or restore all state, for checkpointing (see checkpoint.h).
+	 */
+	void save(CheckpointWriter& w) const;
+	void restore(CheckpointReader& r);
+
+	size_t ncol() const { return names_.size(); }
+	uint64_t nrow() const { return nrow_; }
+	double min(size_t c) const { return cols_[c].mn; }
+	double max(size_t c) const { return cols_[c].mx; }
+	uint64_t nnan(size_t c) const { return cols_[c].nnan; }
+	uint64_t hash(size_t c) const { return cols_[c].hash; }
+
+protected:
+
+	struct Col {
+		double mn;
+		double mx;
+		uint64_t nnan;
+		uint64_t hash; // polynomial hash of values in row order
+		std::vector<uint8_t> hll;
+	};
+
+	std::vector<std::string> names_;
+	size_t stored_ncol_;
+	std::vector<std::vector<size_t> > expand_;
+	std::vector<Col> cols_;
+	uint64_t nrow_;
+};
+
+#endif /* defined(__qtip__colstats__) */
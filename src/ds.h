@@ -364,7 +364,9 @@ private:
 				// Note: operator= is used
 				tmp[i] = list_[i];
 			}
-			memset(list_, 0, sizeof(T) * cur_); // make all ptrs NULL
+			// operator= may copy pointers rather than what they point to, so
+			// make all ptrs NULL before the old elements are destroyed
+			memset(static_cast<void*>(list_), 0, sizeof(T) * cur_);
 			free();
 		}
 		list_ = tmp;
@@ -445,6 +447,14 @@ public:
 		}
 	}
 
+	/**
+	 * Set the number of items added so far, when restoring a sampler and
+	 * its list from a checkpoint.
+	 */
+	void set_size(size_t n) {
+		n_ = n;
+	}
+
 	/**
 	 * Return the number of items added (not all of which were retained by the
 	 * sampler).
@@ -488,6 +498,5 @@ protected:
 	EList<T> list_;
 };
 
-
 #endif
 
@@ -76,6 +76,7 @@ const char *FastaChunkwiseParser::next(
 		if(c == EOF) {
 			if(!first) {
 				pushback(EOF);
+				last_ = true;
 				retsz = bufcur_ = buf - buf_;
 				refoff = refoff_ - retsz;
 				return buf_; // End of file
@@ -91,6 +92,7 @@ const char *FastaChunkwiseParser::next(
 		} else if(c == '>') {
 			if(!first) {
 				pushback('>');
+				last_ = true;
 				retsz = bufcur_ = buf - buf_;
 				refoff = refoff_ - retsz;
 				return buf_; // Beginning of new FASTA record
@@ -118,6 +120,12 @@ const char *FastaChunkwiseParser::next(
 			if(buf - buf_ == chunksz_) {
 				retsz = bufcur_ = chunksz_;
 				refoff = refoff_ - retsz;
+				// Peek past line breaks to see if the record ends here too
+				do {
+					c = get(fh_);
+				} while(c != EOF && isspace(c));
+				pushback(c);
+				last_ = (c == '>' || c == EOF);
 				return buf_; // Chunk buffer full
 			}
 			assert(buf - buf_ < chunksz_);
@@ -127,6 +135,53 @@ const char *FastaChunkwiseParser::next(
 	return NULL;
 }
 
+void FastaChunkwiseParser::save(CheckpointWriter& w) const {
+	w.put_u64(fni_);
+	w.put_u64(foff_);
+	w.put_u64(refoff_);
+	w.put_u64(bufcur_);
+	w.put_bytes(buf_, bufcur_);
+	w.put_i64(pushback_);
+	w.put_bool(last_);
+	w.put_bool(fh_ != NULL);
+	if(fh_ != NULL) {
+		w.put_u64((uint64_t)ftello(fh_));
+	}
+}
+
+void FastaChunkwiseParser::restore(CheckpointReader& r) {
+	reset();
+	fni_ = (size_t)r.get_u64();
+	foff_ = (size_t)r.get_u64();
+	refoff_ = (size_t)r.get_u64();
+	bufcur_ = (size_t)r.get_u64();
+	if(bufcur_ > chunksz_) {
+		cerr << "Error: checkpointed FASTA chunk is larger than the chunk size" << endl;
+		throw 1;
+	}
+	r.get_bytes(buf_, bufcur_);
+	pushback_ = (int)r.get_i64();
+	last_ = r.get_bool();
+	if(r.get_bool()) {
+		off_t off = (off_t)r.get_u64();
+		fh_ = fopen(fns_[fni_].c_str(), "rb");
+		if(fh_ == NULL) {
+			cerr << "Could not open FASTA file \"" << fns_[fni_] << "\"" << endl;
+			throw 1;
+		}
+		setvbuf(fh_, fabuf_, _IOFBF, FASTA_BUFSZ);
+		if(fseeko(fh_, off, SEEK_SET) != 0) {
+			cerr << "Could not seek in FASTA file \"" << fns_[fni_] << "\"" << endl;
+			throw 1;
+		}
+		if(pushback_ == EOF) {
+			// A fresh handle at the end of the file hasn't seen EOF yet; let
+			// it find EOF itself so feof() is set as next() expects
+			pushback_ = std::numeric_limits<int>::min();
+		}
+	}
+}
+
 #ifdef FASTA_MAIN
 
 #include <fstream>
@@ -178,6 +233,7 @@ static void test1() {
 		assert(refoff == i);
 		assert(buf[0] == 'A');
 		assert(buf[1] == 'A');
+		assert(!fa.last_chunk());
 	}
 
 	buf = fa.next(refid, refid_full, refoff, retsz);
@@ -220,6 +276,7 @@ static void test1() {
 		assert(refoff == 12 + i);
 		assert(buf[0] == 'T');
 		assert(buf[1] == 'T');
+		assert(fa.last_chunk() == (i == 2));
 	}
 	
 	assert(refid == string("record1"));
@@ -232,6 +289,7 @@ static void test1() {
 	assert(refoff == 0);
 	assert(buf[0] == 'A');
 	assert(buf[1] == 'T');
+	assert(fa.last_chunk());
 
 	buf = fa.next(refid, refid_full, refoff, retsz);
 	assert(refid == string("record3"));
@@ -239,6 +297,7 @@ static void test1() {
 	assert(retsz == 1);
 	assert(refoff == 0);
 	assert(buf[0] == 'A');
+	assert(fa.last_chunk());
 
 	do {
 		assert(!fa.done());
@@ -265,8 +324,113 @@ static void test1() {
 	assert(buf[1] == 'A');
 }
 
+/**
+ * A record that ends exactly at a chunk boundary, followed by line breaks,
+ * has its last chunk flagged.
+ */
+static void test2() {
+	string fn1 = ".test2.1.fa";
+	ofstream ofs1(fn1.c_str(), ofstream::out);
+	ofs1 << ">r1" << endl << "ACGT" << endl << endl;
+	ofs1 << ">r2" << endl << "GGGGCC" << endl;
+	ofs1.close();
+
+	vector<string> fns;
+	fns.push_back(fn1);
+	FastaChunkwiseParser fa(fns, 4, 1);
+	string refid, refid_full;
+	size_t refoff = 0, retsz = 0;
+
+	const char *buf = fa.next(refid, refid_full, refoff, retsz);
+	assert(refid == string("r1"));
+	assert(retsz == 4 && refoff == 0);
+	assert(fa.last_chunk());
+	assert(buf[3] == 'T');
+
+	buf = fa.next(refid, refid_full, refoff, retsz);
+	assert(refid == string("r2"));
+	assert(retsz == 4 && refoff == 0);
+	assert(!fa.last_chunk());
+
+	buf = fa.next(refid, refid_full, refoff, retsz);
+	assert(retsz == 3 && refoff == 3);
+	assert(fa.last_chunk());
+	assert(buf[0] == 'G' && buf[2] == 'C');
+
+	buf = fa.next(refid, refid_full, refoff, retsz);
+	assert(buf == NULL && fa.done());
+	remove(fn1.c_str());
+}
+
+/**
+ * A parser restored from a checkpoint returns the same chunks as the
+ * original, whether the checkpoint falls mid-record or mid-file.
+ */
+static void test3() {
+	string fn1 = ".test3.1.fa", fn2 = ".test3.2.fa";
+	ofstream ofs1(fn1.c_str(), ofstream::out);
+	ofs1 << ">r1" << endl << "ACGTACGTAC" << endl << "GTTTGA" << endl;
+	ofs1 << ">r2 two" << endl << "CCA" << endl;
+	ofs1.close();
+	ofstream ofs2(fn2.c_str(), ofstream::out);
+	ofs2 << ">r3" << endl << "TTTTGGGGCCCCAAAA" << endl;
+	ofs2.close();
+	vector<string> fns;
+	fns.push_back(fn1);
+	fns.push_back(fn2);
+
+	// All chunks from an uninterrupted pass
+	vector<string> want;
+	{
+		FastaChunkwiseParser fa(fns, 5, 2);
+		string refid, refid_full;
+		size_t refoff = 0, retsz = 0;
+		while(!fa.done()) {
+			const char *buf = fa.next(refid, refid_full, refoff, retsz);
+			if(buf != NULL) {
+				want.push_back(refid + ":" + string(buf, retsz));
+			}
+		}
+	}
+	const char *ckfn = ".test3.ckpt";
+	for(size_t stop = 0; stop <= want.size(); stop++) {
+		vector<string> got;
+		string refid, refid_full;
+		size_t refoff = 0, retsz = 0;
+		{
+			FastaChunkwiseParser fa(fns, 5, 2);
+			while(got.size() < stop) {
+				const char *buf = fa.next(refid, refid_full, refoff, retsz);
+				if(buf != NULL) {
+					got.push_back(refid + ":" + string(buf, retsz));
+				}
+			}
+			CheckpointWriter w;
+			fa.save(w);
+			assert(w.commit(ckfn) == 0);
+		}
+		FastaChunkwiseParser fa(fns, 5, 2);
+		CheckpointReader r;
+		assert(r.load(ckfn) == 0);
+		fa.restore(r);
+		assert(r.done());
+		while(!fa.done()) {
+			const char *buf = fa.next(refid, refid_full, refoff, retsz);
+			if(buf != NULL) {
+				got.push_back(refid + ":" + string(buf, retsz));
+			}
+		}
+		assert(got == want);
+	}
+	remove(ckfn);
+	remove(fn1.c_str());
+	remove(fn2.c_str());
+}
+
 int main(void) {
 	test1();
+	test2();
+	test3();
 	cout << "ALL TESTS PASSED" << endl;
 }
 #endif
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <cassert>
 #include <limits>
+#include "checkpoint.h"
 
 /**
  * Class that facilitates iterating through overlapping stretches of all the
@@ -36,7 +37,8 @@ public:
 		bufcur_(0),
 		chunksz_(chunksz),
 		olap_(olap),
-		pushback_(std::numeric_limits<int>::min())
+		pushback_(std::numeric_limits<int>::min()),
+		last_(false)
 	{
 		assert(chunksz > olap);
 		buf_ = new char[chunksz];
@@ -52,6 +54,7 @@ public:
 	void reset() {
 		fni_ = foff_ = bufcur_ = refoff_ = 0;
 		pushback_ = std::numeric_limits<int>::min();
+		last_ = false;
 		if(fh_ != NULL) {
 			fclose(fh_); fh_ = NULL;
 		}
@@ -64,6 +67,27 @@ public:
 		return fni_ >= fns_.size();
 	}
 
+	/**
+	 * Return true iff the chunk most recently returned by next() ends its
+	 * FASTA record.  If it also starts at offset 0, it holds the whole
+	 * record.
+	 */
+	inline bool last_chunk() const {
+		return last_;
+	}
+
+	/**
+	 * Save where we are, including the overlap carried into the next
+	 * chunk, so a restored parser returns the same chunks this one would
+	 * have.  Only valid between calls to next().
+	 */
+	void save(CheckpointWriter& w) const;
+
+	/**
+	 * Pick up where a saved parser over the same files left off.
+	 */
+	void restore(CheckpointReader& r);
+
 		/**
 	 * Returns pointer to sequence.
 	 */
@@ -102,6 +126,7 @@ protected:
 	const size_t olap_;
 	char fabuf_[FASTA_BUFSZ];
 	int pushback_;
+	bool last_; // last chunk returned ends its record
 };
 
 #endif /* defined(__qtip__fasta__) */
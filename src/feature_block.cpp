@@ -0,0 +1,276 @@
+//
+//  feature_block.cpp
+//  qtip
+//
+
+#include "feature_block.h"
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+void FeatureBlock::add_mate(
+	size_t line,
+	size_t len,
+	int left_clip,
+	int right_clip,
+	const char *qual,
+	const char *ztz,
+	int mapq,
+	int correct,
+	size_t realign_job)
+{
+	assert(realign_ == (realign_job != NO_JOB));
+	line_.push_back((double)line);
+	len_.push_back(len);
+	left_clip_.push_back(left_clip);
+	right_clip_.push_back(right_clip);
+	mapq_.push_back(mapq);
+	correct_.push_back(correct);
+	job_.push_back(realign_job);
+	qual_off_.push_back(text_.size());
+	text_.insert(text_.end(), qual, qual + len);
+	ztz_off_.push_back(text_.size());
+	// ZT:Z may be the last field on the line
+	const char *ztz_end = ztz;
+	while(*ztz_end != '\0' && *ztz_end != '\n' && *ztz_end != '\r') {
+		ztz_end++;
+	}
+	text_.insert(text_.end(), ztz, ztz_end);
+	text_.push_back('\0');
+}
+
+/**
+ * Sum of Phred qualities for n quality characters.
+ */
+static inline size_t qual_sum(const uint8_t *q, size_t n) {
+	uint32_t tot = 0;
+	for(size_t i = 0; i < n; i++) {
+		tot += q[i];
+	}
+	return tot - 33 * n;
+}
+
+/**
+ * Bases within the CIGAR's soft clipping count as clipped, as does the
+ * last base of the read.  Reads with a single clipped base are treated as
+ * unclipped, with no clipped quality.
+ */
+void FeatureBlock::calc_quals() {
+	const size_t nmate = line_.size();
+	clip_.resize(nmate);
+	alqual_.resize(nmate);
+	clipqual_.resize(nmate);
+	for(size_t i = 0; i < nmate; i++) {
+		const size_t nclipped = (size_t)(left_clip_[i] + right_clip_[i]);
+		clip_[i] = (double)(nclipped > 1 ? nclipped : 0);
+	}
+	for(size_t i = 0; i < nmate; i++) {
+		const uint8_t *q = (const uint8_t *)&text_[qual_off_[i]];
+		const size_t len = len_[i];
+		const size_t lc = (size_t)left_clip_[i];
+		const size_t rc = (size_t)right_clip_[i];
+		assert(lc + rc < len);
+		const size_t al = qual_sum(q + lc, len - 1 - rc - lc);
+		alqual_[i] = (double)al;
+		clipqual_[i] = (lc + rc > 1) ? (double)(qual_sum(q, len) - al) : 0.0;
+	}
+}
+
+void FeatureBlock::parse_ztzs() {
+	const size_t nmate = line_.size();
+	ztz_vals_.clear();
+	ztz_beg_.resize(nmate + 1);
+	for(size_t i = 0; i < nmate; i++) {
+		ztz_beg_[i] = ztz_vals_.size();
+		const char *cur = &text_[ztz_off_[i]];
+		while(*cur != '\0') {
+			if(*cur == ',') {
+				cur++; // empty field
+				continue;
+			}
+			const char *tok = cur;
+			while(*cur != ',' && *cur != '\0') {
+				cur++;
+			}
+			if(*tok == 'N') {
+				// Handle NA
+				assert(tok[1] == 'A');
+				ztz_vals_.push_back(std::numeric_limits<double>::quiet_NaN());
+				continue;
+			}
+			bool neg = false;
+			const char *buf = tok;
+			if(*buf == '-') {
+				neg = true;
+				buf++;
+			}
+			int ztz_i = 0;
+			bool added = false;
+			for(; buf < cur; buf++) {
+				assert((*buf >= '0' && *buf <= '9') || *buf == '.');
+				if(*buf == '.') {
+					ztz_vals_.push_back(strtod(tok, NULL));
+					added = true;
+					break;
+				}
+				// Avoid strtod if it's just an int
+				ztz_i = ztz_i * 10 + (*buf - '0');
+			}
+			if(!added) {
+				ztz_vals_.push_back((double)(neg ? (-ztz_i) : ztz_i));
+			}
+		}
+	}
+	ztz_beg_[nmate] = ztz_vals_.size();
+}
+
+void FeatureBlock::push_mate(size_t i) {
+	out_.push_back(line_[i]);
+	out_.push_back((double)len_[i]);
+	out_.push_back(clip_[i]);
+	out_.push_back(alqual_[i]);
+	out_.push_back(clipqual_[i]);
+}
+
+int FeatureBlock::flush(const RealignBatch *batch, ColumnStats *stats) {
+	if(extra_.empty()) {
+		return 0;
+	}
+	assert(!realign_ || batch != NULL);
+	calc_quals();
+	parse_ztzs();
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	out_.clear();
+	const size_t nmate_rec = paired_ ? 2 : 1;
+	for(size_t r = 0; r < extra_.size(); r++) {
+		for(size_t m = 0; m < nmate_rec; m++) {
+			const size_t i = r * nmate_rec + m;
+			push_mate(i);
+			if(!paired_) {
+				out_.push_back(extra_[r]);
+			}
+			out_.insert(out_.end(),
+			            ztz_vals_.begin() + ztz_beg_[i],
+			            ztz_vals_.begin() + ztz_beg_[i+1]);
+			if(realign_) {
+				const RealignResult& res = batch->result(job_[i]);
+				out_.push_back(res.valid ? (double)res.best : nan);
+				out_.push_back(res.valid ? (double)res.second : nan);
+				out_.push_back(res.valid ? (double)res.near : nan);
+			}
+			out_.push_back((double)mapq_[i]);
+			out_.push_back((double)correct_[i]);
+		}
+		if(paired_) {
+			out_.push_back(extra_[r]);
+		}
+	}
+	if(stats != NULL) {
+		stats->add(&out_.front(), out_.size());
+	}
+	size_t nwritten = fwrite(&out_.front(), 8, out_.size(), fh_);
+	if(nwritten != out_.size()) {
+		cerr << "Could not write all " << out_.size()
+		     << " doubles to record file" << endl;
+		return -1;
+	}
+	line_.clear();
+	len_.clear();
+	left_clip_.clear();
+	right_clip_.clear();
+	qual_off_.clear();
+	ztz_off_.clear();
+	mapq_.clear();
+	correct_.clear();
+	job_.clear();
+	extra_.clear();
+	text_.clear();
+	return 0;
+}
+
+#ifdef FEATURE_BLOCK_MAIN
+
+#include <math.h>
+
+/**
+ * Read back all the doubles in a file.
+ */
+static vector<double> read_doubles(FILE *fh) {
+	vector<double> v;
+	rewind(fh);
+	double d;
+	while(fread(&d, 8, 1, fh) == 1) {
+		v.push_back(d);
+	}
+	return v;
+}
+
+static bool same(double a, double b) {
+	return a == b || (isnan(a) && isnan(b));
+}
+
+/**
+ * Unpaired rows, quality sums with and without clipping, ZT:Z parsing.
+ */
+static void test1() {
+	FILE *fh = tmpfile();
+	FeatureBlock blk(fh, false, false);
+	// qualities 'I' = 40; one soft-clipped base on the left counts as
+	// unclipped, two on the right don't
+	blk.add_mate(7, 5, 1, 0, "IIIII", "-12,NA,3.5,0\n", 42, 1, FeatureBlock::NO_JOB);
+	blk.end_record(100.0);
+	blk.add_mate(9, 6, 0, 2, "I#IIII", "-3,,7", 0, -1, FeatureBlock::NO_JOB);
+	blk.end_record(0.0);
+	assert(blk.size() == 2);
+	assert(blk.flush(NULL, NULL) == 0);
+	assert(blk.size() == 0);
+	vector<double> v = read_doubles(fh);
+	const double nan = std::numeric_limits<double>::quiet_NaN();
+	double ex[] = {7, 5, 0, 40*3, 0, 100, -12, nan, 3.5, 0, 42, 1,
+	               9, 6, 2, 2+40*2, 40*3, 0, -3, 7, 0, -1};
+	assert(v.size() == sizeof(ex) / sizeof(double));
+	for(size_t i = 0; i < v.size(); i++) {
+		assert(same(v[i], ex[i]));
+	}
+	fclose(fh);
+	cerr << "PASSED test1" << endl;
+}
+
+/**
+ * Paired rows: per-mate blocks then the fragment length, and statistics.
+ */
+static void test2() {
+	FILE *fh = tmpfile();
+	FeatureBlock blk(fh, true, false);
+	blk.add_mate(1, 3, 0, 0, "+++", "5,1", 10, 1, FeatureBlock::NO_JOB);
+	blk.add_mate(2, 3, 0, 0, "555", "6,2", 20, 0, FeatureBlock::NO_JOB);
+	blk.end_record(250.0);
+	vector<string> names;
+	names.push_back("a");
+	ColumnStats st;
+	vector<vector<size_t> > expand(1);
+	expand[0].push_back(17);
+	st.init(names, 19, expand);
+	assert(blk.flush(NULL, &st) == 0);
+	vector<double> v = read_doubles(fh);
+	double ex[] = {1, 3, 0, 10*2, 0, 5, 1, 10, 1,
+	               2, 3, 0, 20*2, 0, 6, 2, 20, 0,
+	               250};
+	assert(v.size() == sizeof(ex) / sizeof(double));
+	for(size_t i = 0; i < v.size(); i++) {
+		assert(same(v[i], ex[i]));
+	}
+	assert(st.nrow() == 1 && st.max(0) == 0.0);
+	fclose(fh);
+	cerr << "PASSED test2" << endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+}
+
+#endif
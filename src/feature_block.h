@@ -0,0 +1,140 @@
+//
+//  feature_block.h
+//  qtip
+//
+
+#ifndef __qtip__feature_block__
+#define __qtip__feature_block__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <cassert>
+#include <vector>
+#include "realign.h"
+#include "colstats.h"
+
+/**
+ * Feature records bound for one record file, staged a block at a time.
+ * As alignments are parsed, only their scalar fields are copied out, into
+ * struct-of-arrays buffers, along with their quality and ZT:Z strings.
+ * When the block is flushed each feature is computed for the whole block
+ * in its own loop, then the rows are assembled and written with one fwrite.
+ *
+ * An unpaired row is
+ *
+ *   id,len,clip,alqual,clipqual,olen,ztz*,[rl_best,rl_second,rl_near],mapq,correct
+ *
+ * and a paired row (one per pair; see print_paired_header) is two per-mate
+ * blocks
+ *
+ *   id,len,clip,alqual,clipqual,ztz*,[rl_best,rl_second,rl_near],mapq,correct
+ *
+ * followed by the fragment length.  olen and the fragment length are the
+ * record's "extra" value.
+ */
+class FeatureBlock {
+
+public:
+
+	/** Job id for mates that weren't queued for realignment */
+	static const size_t NO_JOB = (size_t)-1;
+
+	FeatureBlock(FILE *fh, bool paired, bool realign) :
+		fh_(fh),
+		paired_(paired),
+		realign_(realign) { }
+
+	/**
+	 * Stage one mate.  Clipping is as parsed from the CIGAR.  qual points to
+	 * len quality characters and ztz to the ZT:Z field's value; both are
+	 * copied.
+	 */
+	void add_mate(
+		size_t line,
+		size_t len,
+		int left_clip,
+		int right_clip,
+		const char *qual,
+		const char *ztz,
+		int mapq,
+		int correct,
+		size_t realign_job);
+
+	/**
+	 * Finish the record whose mate(s) were just added.
+	 */
+	void end_record(double extra) {
+		assert(line_.size() == (extra_.size() + 1) * (paired_ ? 2 : 1));
+		extra_.push_back(extra);
+	}
+
+	/**
+	 * Number of records staged.
+	 */
+	size_t size() const {
+		return extra_.size();
+	}
+
+	FILE *fh() const {
+		return fh_;
+	}
+
+	/**
+	 * Compute features for all staged records, update stats (if non-NULL)
+	 * and write the rows.  If realignment is enabled, batch must already
+	 * have been run on all the jobs the staged mates refer to.  Return 0
+	 * on success.
+	 */
+	int flush(const RealignBatch *batch, ColumnStats *stats);
+
+protected:
+
+	/**
+	 * Compute quality and clipping columns for all staged mates.
+	 */
+	void calc_quals();
+
+	/**
+	 * Parse all staged ZT:Z strings into ztz_vals_.
+	 */
+	void parse_ztzs();
+
+	/**
+	 * Append the columns every row starts with for mate i to out_.
+	 */
+	void push_mate(size_t i);
+
+	FILE *fh_;
+	bool paired_;
+	bool realign_;
+
+	// Per mate, as staged
+	std::vector<double> line_;
+	std::vector<size_t> len_;
+	std::vector<int> left_clip_;
+	std::vector<int> right_clip_;
+	std::vector<size_t> qual_off_; // offsets into text_
+	std::vector<size_t> ztz_off_;
+	std::vector<int> mapq_;
+	std::vector<int> correct_;
+	std::vector<size_t> job_;
+
+	// Per record, as staged
+	std::vector<double> extra_;
+
+	// Quality and ZT:Z strings for all staged mates
+	std::vector<char> text_;
+
+	// Per mate, computed on flush
+	std::vector<double> clip_;
+	std::vector<double> alqual_;
+	std::vector<double> clipqual_;
+	std::vector<size_t> ztz_beg_; // offsets into ztz_vals_, plus one at end
+	std::vector<double> ztz_vals_;
+
+	// Rows being written
+	std::vector<double> out_;
+};
+
+#endif /* defined(__qtip__feature_block__) */
@@ -109,9 +109,13 @@ public:
 	{
 		fraglen_avg_ = 0.0f;
 		fraglen_max_ = 0;
+		mate_len_avg_ = 0.0f;
 		for(size_t i = 0; i < ts.size(); i++) {
 			fraglen_avg_ += ((float)ts[i].fraglen_ / ts.size());
 			fraglen_max_ = std::max(fraglen_max_, ts[i].fraglen_);
+			mate_len_avg_ += ((float)(edit_xscript_to_rflen(ts[i].edit_xscript_1_) +
+			                          edit_xscript_to_rflen(ts[i].edit_xscript_2_)) /
+			                  (2 * ts.size()));
 		}
 	}
 	
@@ -149,6 +153,13 @@ public:
 		return fraglen_avg_;
 	}
 
+	/**
+	 * Return average number of reference characters spanned by a mate.
+	 */
+	float avg_mate_len() const {
+		return mate_len_avg_;
+	}
+
 	/**
 	 * Return maximum length of any unpaired template.
 	 */
@@ -160,6 +171,7 @@ protected:
 	
 	const EList<TemplatePaired>& ts_;
 	float fraglen_avg_;
+	float mate_len_avg_;
 	size_t n_;
 	size_t fraglen_max_;
 	float fraction_even_; // unused
@@ -0,0 +1,246 @@
+//
+//  perfcount.cpp
+//  qtip
+//
+
+#include "perfcount.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <iostream>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+bool PerfCounters::enabled_ = false;
+
+/** Group leader first; -1 when not open */
+static int perf_fds[PerfCounters::NCOUNTERS] = {-1, -1, -1, -1};
+
+static const char *counter_names[PerfCounters::NCOUNTERS] = {
+	"cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+struct PerfPhase {
+	const char *name;
+	uint64_t calls;
+	double secs;
+	uint64_t vals[PerfCounters::NCOUNTERS];
+};
+
+static vector<PerfPhase> perf_phases;
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group_fd) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = (group_fd == -1) ? 1 : 0;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP |
+	                   PERF_FORMAT_TOTAL_TIME_ENABLED |
+	                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+bool PerfCounters::enable() {
+	if(enabled_) {
+		return true;
+	}
+#ifdef __linux__
+	static const uint64_t configs[NCOUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+	for(int i = 0; i < NCOUNTERS; i++) {
+		perf_fds[i] = perf_open(configs[i], i == 0 ? -1 : perf_fds[0]);
+		if(perf_fds[i] < 0) {
+			cerr << "Warning: could not open " << counter_names[i]
+			     << " performance counter (" << strerror(errno)
+			     << "); not collecting counters" << endl;
+			disable();
+			return false;
+		}
+	}
+	ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	enabled_ = true;
+	return true;
+#else
+	cerr << "Warning: performance counters are only supported on Linux" << endl;
+	return false;
+#endif
+}
+
+void PerfCounters::read(uint64_t *vals) {
+	// nr, time_enabled, time_running, then one value per counter
+	uint64_t buf[3 + NCOUNTERS];
+	ssize_t n = ::read(perf_fds[0], buf, sizeof(buf));
+	if(n != (ssize_t)sizeof(buf)) {
+		memset(vals, 0, NCOUNTERS * sizeof(uint64_t));
+		return;
+	}
+	const uint64_t enabled = buf[1], running = buf[2];
+	for(int i = 0; i < NCOUNTERS; i++) {
+		uint64_t v = buf[3 + i];
+		if(running > 0 && running < enabled) {
+			v = (uint64_t)((double)v * enabled / running);
+		}
+		vals[i] = v;
+	}
+}
+
+void PerfCounters::add(const char *phase, const uint64_t *delta, double secs) {
+	PerfPhase *ph = NULL;
+	for(size_t i = 0; i < perf_phases.size(); i++) {
+		if(strcmp(perf_phases[i].name, phase) == 0) {
+			ph = &perf_phases[i];
+			break;
+		}
+	}
+	if(ph == NULL) {
+		PerfPhase p;
+		memset(&p, 0, sizeof(p));
+		p.name = phase;
+		perf_phases.push_back(p);
+		ph = &perf_phases.back();
+	}
+	ph->calls++;
+	ph->secs += secs;
+	for(int i = 0; i < NCOUNTERS; i++) {
+		ph->vals[i] += delta[i];
+	}
+}
+
+void PerfCounters::trace(
+	const char *phase,
+	uint64_t ts,
+	uint64_t dur,
+	const uint64_t *delta)
+{
+	char args[256];
+	args[0] = '\0';
+	if(delta != NULL) {
+		snprintf(args, sizeof(args),
+		         "\"cycles\":%llu,\"instructions\":%llu,"
+		         "\"cache-misses\":%llu,\"branch-misses\":%llu",
+		         (unsigned long long)delta[CYCLES],
+		         (unsigned long long)delta[INSTRUCTIONS],
+		         (unsigned long long)delta[CACHE_MISSES],
+		         (unsigned long long)delta[BRANCH_MISSES]);
+	}
+	Timeline::span(phase, "phase", ts, dur, args);
+}
+
+void PerfCounters::report(FILE *fh) {
+	if(perf_phases.empty()) {
+		return;
+	}
+	fprintf(fh, "Performance counters by phase (inclusive of nested phases):\n");
+	fprintf(fh, "%-16s %8s %9s %15s %15s %6s %13s %13s\n",
+	        "phase", "calls", "seconds", "cycles", "instructions", "IPC",
+	        "cache-misses", "branch-misses");
+	for(size_t i = 0; i < perf_phases.size(); i++) {
+		const PerfPhase& p = perf_phases[i];
+		const double ipc = p.vals[CYCLES] == 0 ? 0.0 :
+			(double)p.vals[INSTRUCTIONS] / (double)p.vals[CYCLES];
+		fprintf(fh, "%-16s %8llu %9.3f %15llu %15llu %6.2f %13llu %13llu\n",
+		        p.name,
+		        (unsigned long long)p.calls,
+		        p.secs,
+		        (unsigned long long)p.vals[CYCLES],
+		        (unsigned long long)p.vals[INSTRUCTIONS],
+		        ipc,
+		        (unsigned long long)p.vals[CACHE_MISSES],
+		        (unsigned long long)p.vals[BRANCH_MISSES]);
+	}
+}
+
+void PerfCounters::disable() {
+	for(int i = NCOUNTERS - 1; i >= 0; i--) {
+		if(perf_fds[i] >= 0) {
+			close(perf_fds[i]);
+			perf_fds[i] = -1;
+		}
+	}
+	enabled_ = false;
+}
+
+#ifdef PERFCOUNT_MAIN
+
+#include <cassert>
+#include "probes.h"
+
+static void test1() {
+	// Phases accumulate by name, in first-seen order
+	uint64_t d[PerfCounters::NCOUNTERS] = {100, 250, 3, 4};
+	PerfCounters::add("a", d, 0.5);
+	PerfCounters::add("b", d, 0.25);
+	PerfCounters::add("a", d, 0.5);
+	assert(perf_phases.size() == 2);
+	assert(strcmp(perf_phases[0].name, "a") == 0);
+	assert(perf_phases[0].calls == 2);
+	assert(perf_phases[0].vals[PerfCounters::INSTRUCTIONS] == 500);
+	assert(perf_phases[0].secs == 1.0);
+	assert(perf_phases[1].calls == 1);
+	perf_phases.clear();
+	cerr << "PASSED test1" << endl;
+}
+
+static void test2() {
+	// Scopes do nothing when counters aren't enabled
+	assert(!PerfCounters::enabled());
+	{
+		PerfScope p("off");
+	}
+	assert(perf_phases.empty());
+	cerr << "PASSED test2" << endl;
+}
+
+static void test3() {
+	// When the kernel allows it, nested scopes are counted inclusively
+	if(!PerfCounters::enable()) {
+		cerr << "SKIPPED test3" << endl;
+		return;
+	}
+	volatile uint64_t x = 0;
+	{
+		PerfScope outer("outer");
+		for(int i = 0; i < 100000; i++) {
+			x += i;
+			QTIP_PROBE1(test, i);
+		}
+		PerfScope inner("inner");
+		for(int i = 0; i < 1000; i++) {
+			x += i;
+		}
+	}
+	assert(perf_phases.size() == 2);
+	assert(strcmp(perf_phases[0].name, "inner") == 0);
+	assert(perf_phases[1].vals[PerfCounters::INSTRUCTIONS] >=
+	       perf_phases[0].vals[PerfCounters::INSTRUCTIONS]);
+	PerfCounters::report(stderr);
+	PerfCounters::disable();
+	perf_phases.clear();
+	cerr << "PASSED test3" << endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+	test3();
+}
+
+#endif
@@ -0,0 +1,137 @@
+//
+//  perfcount.h
+//  qtip
+//
+
+#ifndef __qtip__perfcount__
+#define __qtip__perfcount__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "timeline.h"
+
+/**
+ * Optional hardware performance counters, read around the main phases of
+ * qtip-parse, qtip-rewrite and the simulator so we can tell, e.g., whether a
+ * phase is branch-miss-bound or cache-miss-bound.  Uses perf_event_open on
+ * Linux; elsewhere, or when the kernel won't let us (see
+ * /proc/sys/kernel/perf_event_paranoid), enable() warns and counting stays
+ * off.
+ *
+ * One group of counters runs for the whole process once enabled.  A
+ * PerfScope reads the group when it's constructed and destroyed and adds
+ * the difference to its phase, so phases nest and are inclusive.  Only the
+ * thread that called enable() is counted, so background work like
+ * block-compressed SAM decompression doesn't show up.
+ */
+class PerfCounters {
+
+public:
+
+	enum {
+		CYCLES = 0,
+		INSTRUCTIONS,
+		CACHE_MISSES,
+		BRANCH_MISSES,
+		NCOUNTERS
+	};
+
+	/**
+	 * Open and start the counters.  Return true on success; on failure,
+	 * print a warning and leave counting disabled.
+	 */
+	static bool enable();
+
+	static bool enabled() {
+		return enabled_;
+	}
+
+	/**
+	 * Read current counter values, scaled up if the kernel had to
+	 * multiplex them.
+	 */
+	static void read(uint64_t *vals);
+
+	/**
+	 * Add a scope's counter deltas and elapsed time to the named phase.
+	 * phase must be a string literal or otherwise outlive the process.
+	 */
+	static void add(const char *phase, const uint64_t *delta, double secs);
+
+	/**
+	 * Record a phase's span on the timeline, with counter deltas as
+	 * arguments if delta is non-NULL.
+	 */
+	static void trace(
+		const char *phase,
+		uint64_t ts,
+		uint64_t dur,
+		const uint64_t *delta);
+
+	/**
+	 * Print a table of all phases.
+	 */
+	static void report(FILE *fh);
+
+	/**
+	 * Stop counting and close the counters.
+	 */
+	static void disable();
+
+protected:
+
+	static bool enabled_;
+};
+
+/**
+ * Counts whatever runs during its lifetime toward a phase and, when there's
+ * a timeline (see timeline.h), records it there as a span.  Does nothing
+ * (beyond a couple of branches) when neither is enabled.
+ */
+class PerfScope {
+
+public:
+
+	explicit PerfScope(const char *phase) :
+		phase_(phase),
+		counting_(PerfCounters::enabled()),
+		traced_(Timeline::enabled())
+	{
+		if(counting_ || traced_) {
+			t0_ = Timeline::now_us();
+		}
+		if(counting_) {
+			PerfCounters::read(start_);
+		}
+	}
+
+	~PerfScope() {
+		if(!counting_ && !traced_) {
+			return;
+		}
+		uint64_t delta[PerfCounters::NCOUNTERS];
+		if(counting_) {
+			PerfCounters::read(delta);
+			for(int i = 0; i < PerfCounters::NCOUNTERS; i++) {
+				delta[i] -= start_[i];
+			}
+		}
+		const uint64_t dur = Timeline::now_us() - t0_;
+		if(counting_) {
+			PerfCounters::add(phase_, delta, dur * 1e-6);
+		}
+		if(traced_) {
+			PerfCounters::trace(phase_, t0_, dur, counting_ ? delta : NULL);
+		}
+	}
+
+protected:
+
+	const char *phase_;
+	bool counting_;
+	bool traced_;
+	uint64_t start_[PerfCounters::NCOUNTERS];
+	uint64_t t0_;
+};
+
+#endif /* defined(__qtip__perfcount__) */
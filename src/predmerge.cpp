@@ -2,6 +2,8 @@
 #include <iostream>
 #include <cassert>
 #include <stdio.h>
+#include <math.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -119,6 +121,64 @@ bool PredictionMerger::advanceFile(size_t i) {
     return true;
 }
 
+/**
+ * Open one PredictionMerger per set of prediction files.
+ */
+EnsembleMerger::EnsembleMerger(const vector<vector<string> >& sets, int agg) :
+    sets_(sets), agg_(agg)
+{
+    for(size_t i = 0; i < sets_.size(); i++) {
+        mergers_.push_back(new PredictionMerger(sets_[i]));
+    }
+    pcors_.resize(sets_.size());
+}
+
+EnsembleMerger::~EnsembleMerger() {
+    for(size_t i = 0; i < mergers_.size(); i++) {
+        delete mergers_[i];
+    }
+}
+
+/**
+ * Get next prediction from every set and return their combination.
+ */
+Prediction EnsembleMerger::next() {
+    Prediction first = mergers_[0]->next();
+    if(mergers_.size() == 1) {
+        return first;
+    }
+    double sum = 0.0, sum_sq = 0.0;
+    const size_t n = mergers_.size();
+    for(size_t i = 0; i < n; i++) {
+        Prediction p = (i == 0) ? first : mergers_[i]->next();
+        if(p.valid() != first.valid() || p.line != first.line) {
+            cerr << "Prediction sets 1 and " << (i+1) << " disagree on which "
+                 << "lines have predictions (at line " << first.line << ")" << endl;
+            throw 1;
+        }
+        sum += p.mapq;
+        sum_sq += p.mapq * p.mapq;
+        pcors_[i] = 1.0 - pow(10.0, -0.1 * p.mapq);
+    }
+    if(!first.valid()) {
+        return first;
+    }
+    double pcor = 0.0;
+    if(agg_ == ENSEMBLE_MEDIAN) {
+        sort(pcors_.begin(), pcors_.end());
+        pcor = (n & 1) ? pcors_[n/2] : 0.5 * (pcors_[n/2-1] + pcors_[n/2]);
+    } else {
+        for(size_t i = 0; i < n; i++) {
+            pcor += pcors_[i];
+        }
+        pcor /= n;
+    }
+    Prediction ret(first.line, fabs(-10.0 * log10(1.0 - pcor)));
+    const double mean = sum / n;
+    ret.spread = sqrt(max(0.0, sum_sq / n - mean * mean));
+    return ret;
+}
+
 #ifdef PREDMERGE_MAIN
 
 #include <fstream>
@@ -311,10 +371,81 @@ static void test3() {
     assert(!pred.valid());
 }
 
+static void write_file_d(string fn) {
+	FILE *fh = fopen(fn.c_str(), "wb");
+	if(fh == NULL) {
+		cerr << "could not write test file d" << endl;
+		throw 1;
+	}
+	write2_or_throw(0.0, 20.0, fh);
+	write2_or_throw(2.0, 20.0, fh);
+	write2_or_throw(3.0, 10.0, fh);
+	write2_or_throw(10.0, 11.0, fh);
+	write2_or_throw(12.0, 3.0, fh);
+	fclose(fh);
+}
+
+static void test4() {
+    string fn_a(".predmerge.test4.1.npy");
+    string fn_d(".predmerge.test4.2.npy");
+    string fn_e(".predmerge.test4.3.npy");
+	write_file_a(fn_a);
+	write_file_d(fn_d);
+	write_file_a(fn_e);
+
+    // One set passes through unchanged
+    vector<vector<string> > sets(1);
+    sets[0].push_back(fn_a);
+    {
+        EnsembleMerger m(sets, EnsembleMerger::ENSEMBLE_MEAN);
+        Prediction pred = m.next();
+        assert(pred.line == 0);
+        assert(pred.mapq == 10.0);
+        assert(pred.spread == 0.0);
+    }
+
+    // Mean of pcors: 0.9 and 0.99 -> 0.945
+    sets.resize(2);
+    sets[1].push_back(fn_d);
+    {
+        EnsembleMerger m(sets, EnsembleMerger::ENSEMBLE_MEAN);
+        Prediction pred = m.next();
+        assert(pred.line == 0);
+        assert(fabs(pred.mapq - (-10.0 * log10(0.055))) < 1e-9);
+        assert(fabs(pred.spread - 5.0) < 1e-9);
+        pred = m.next();
+        assert(pred.line == 2);
+        assert(fabs(pred.mapq - 20.0) < 1e-9);
+        assert(pred.spread == 0.0);
+        for(int i = 0; i < 3; i++) {
+            pred = m.next();
+            assert(pred.valid());
+        }
+        assert(pred.line == 12);
+        assert(!m.next().valid());
+    }
+
+    // Median of three: 10, 20, 10 -> 10
+    sets.resize(3);
+    sets[2].push_back(fn_e);
+    {
+        EnsembleMerger m(sets, EnsembleMerger::ENSEMBLE_MEDIAN);
+        Prediction pred = m.next();
+        assert(pred.line == 0);
+        assert(fabs(pred.mapq - 10.0) < 1e-9);
+        pred = m.next();
+        assert(fabs(pred.mapq - 20.0) < 1e-9);
+        pred = m.next();
+        assert(pred.line == 3);
+        assert(fabs(pred.mapq - 30.0) < 1e-9);
+    }
+}
+
 int main(void) {
 	test1();
 	test2();
 	test3();
+	test4();
 	cout << "ALL TESTS PASSED" << endl;
 }
 #endif
@@ -11,11 +11,12 @@ struct Prediction {
         reset();
     }
 
-    Prediction(unsigned long long _line, double _mapq) : line(_line), mapq(_mapq) { }
+    Prediction(unsigned long long _line, double _mapq) : line(_line), mapq(_mapq), spread(0.0) { }
 	
 	void reset() {
         line = std::numeric_limits<unsigned long long>::max();
         mapq = 0.0;
+        spread = 0.0;
 	}
 
     bool valid() const {
@@ -24,6 +25,7 @@ struct Prediction {
 
     unsigned long long line;
     double mapq;
+    double spread; // std. dev. of per-trial MAPQs, if an ensemble
 };
 
 /**
@@ -50,3 +52,37 @@ private:
     std::vector<bool> done_;
     int next_; // -1 if next is unknown, index of next file to read from otherwise
 };
+
+/**
+ * Combines predictions from several trials into one MAPQ per line.  Each
+ * trial's predictions are a set of files read by their own
+ * PredictionMerger, and every set must have predictions for the same lines.
+ * MAPQs are converted to probabilities of being correct (pcor), combined by
+ * mean or median, and converted back.  With a single set, predictions pass
+ * through untouched.
+ */
+class EnsembleMerger {
+public:
+
+    enum {
+        ENSEMBLE_MEAN = 1,
+        ENSEMBLE_MEDIAN
+    };
+
+    EnsembleMerger(const std::vector<std::vector<std::string> >& sets, int agg);
+
+    ~EnsembleMerger();
+
+    Prediction next();
+
+    size_t num_sets() const {
+        return mergers_.size();
+    }
+
+private:
+
+    std::vector<std::vector<std::string> > sets_; // mergers refer to these
+    std::vector<PredictionMerger *> mergers_;
+    std::vector<double> pcors_;
+    int agg_;
+};
@@ -0,0 +1,94 @@
+//
+//  probes.h
+//  qtip
+//
+
+#ifndef __qtip__probes__
+#define __qtip__probes__
+
+#include <stdint.h>
+
+/**
+ * Static (USDT) probe points, provider "qtip", for attaching bpftrace or
+ * perf to a running binary, e.g.
+ *
+ *   bpftrace -e 'usdt:./qtip-parse:qtip:record { @n = count(); }'
+ *
+ * A probe is a single nop plus an ELF note describing it; it costs nothing
+ * measurable when nothing is attached.  When <sys/sdt.h> (systemtap-sdt-dev)
+ * is available its macros are used.  Otherwise, on x86-64 and AArch64 with
+ * GCC or Clang, the same .note.stapsdt notes are emitted here; elsewhere,
+ * or if QTIP_NO_PROBES is defined, probes compile to nothing.  Arguments
+ * are passed as signed 64-bit integers.
+ *
+ * Probes:
+ *   record(line)             qtip-parse, each SAM record parsed
+ *   feature_flush(nrecs)     qtip-parse, each block of feature records
+ *   sim_chunk(len, nsegs)    simulator, each chunk (or pack of records)
+ *   rewrite_record(line)     qtip-rewrite, each record rewritten
+ *   bsam_block(block)        block-compressed SAM, each block decompressed
+ */
+
+#if !defined(QTIP_NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define QTIP_HAVE_SYS_SDT 1
+# endif
+#endif
+
+#if defined(QTIP_NO_PROBES)
+
+# define QTIP_PROBE1(name, a) do { } while(0)
+# define QTIP_PROBE2(name, a, b) do { } while(0)
+
+#elif defined(QTIP_HAVE_SYS_SDT)
+
+# define QTIP_PROBE1(name, a) DTRACE_PROBE1(qtip, name, a)
+# define QTIP_PROBE2(name, a, b) DTRACE_PROBE2(qtip, name, a, b)
+
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+/*
+ * Same layout as <sys/sdt.h>: a stapsdt note holding the probe's address,
+ * the address of .stapsdt.base (so tools can adjust for prelinking), no
+ * semaphore, then provider, name and argument descriptions.
+ */
+# define QTIP_SDT_(name, args, ...) \
+	__asm__ __volatile__ ( \
+		"990: nop\n" \
+		".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f-991f, 994f-993f, 3\n" \
+		"991: .asciz \"stapsdt\"\n" \
+		"992: .balign 4\n" \
+		"993: .8byte 990b\n" \
+		".8byte _.stapsdt.base\n" \
+		".8byte 0\n" \
+		".asciz \"qtip\"\n" \
+		".asciz \"" #name "\"\n" \
+		".asciz \"" args "\"\n" \
+		"994: .balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n" \
+		: : __VA_ARGS__)
+
+# define QTIP_PROBE1(name, a) \
+	QTIP_SDT_(name, "-8@%0", "r"((int64_t)(a)))
+# define QTIP_PROBE2(name, a, b) \
+	QTIP_SDT_(name, "-8@%0 -8@%1", "r"((int64_t)(a)), "r"((int64_t)(b)))
+
+#else
+
+# define QTIP_PROBE1(name, a) do { } while(0)
+# define QTIP_PROBE2(name, a, b) do { } while(0)
+
+#endif
+
+#endif /* defined(__qtip__probes__) */
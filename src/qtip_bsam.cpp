@@ -0,0 +1,146 @@
+//
+//  qtip_bsam.cpp
+//  qtip
+//
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "blocksam.h"
+#include "timeline.h"
+
+using namespace std;
+
+/**
+ * Convert SAM to block-compressed SAM (mode c) or back (mode d).  The
+ * driver has the aligner write to a named pipe that's read by
+ * "qtip-bsam c", so the uncompressed SAM never touches the disk.
+ *
+ * Usage: qtip-bsam <c|d> -- [name value]... -- <input> -- <output>
+ *
+ * An input of "-" means standard input and, when decompressing, an output
+ * of "-" means standard output.
+ */
+
+int compress_level = 1;
+int io_threads = 2;
+
+const static size_t BUFSZ = 262144;
+
+static int do_compress(const string& in_fn, const string& out_fn) {
+	FILE *fh = stdin;
+	if(in_fn != "-") {
+		fh = fopen(in_fn.c_str(), "rb");
+		if(fh == NULL) {
+			cerr << "Could not open input SAM file \"" << in_fn << "\"" << endl;
+			return -1;
+		}
+	}
+	BlockSamWriter w;
+	if(w.open(out_fn, compress_level) != 0) {
+		return -1;
+	}
+	char *buf = new char[BUFSZ];
+	size_t n;
+	int ret = 0;
+	while((n = fread(buf, 1, BUFSZ, fh)) > 0) {
+		if(w.write(buf, n) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if(ferror(fh)) {
+		cerr << "Error reading \"" << in_fn << "\"" << endl;
+		ret = -1;
+	}
+	delete[] buf;
+	if(fh != stdin) {
+		fclose(fh);
+	}
+	if(ret == 0) {
+		ret = w.close();
+	}
+	if(ret == 0) {
+		cerr << "Compressed " << w.raw_bytes() << " bytes to " << w.comp_bytes()
+		     << " in " << w.num_blocks() << " blocks" << endl;
+	}
+	return ret;
+}
+
+static int do_decompress(const string& in_fn, const string& out_fn) {
+	BlockSamReader r;
+	if(r.open(in_fn, io_threads) != 0) {
+		return -1;
+	}
+	FILE *fh = stdout;
+	if(out_fn != "-") {
+		fh = fopen(out_fn.c_str(), "wb");
+		if(fh == NULL) {
+			cerr << "Could not open output SAM file \"" << out_fn << "\"" << endl;
+			return -1;
+		}
+	}
+	char *buf = new char[BUFSZ];
+	while(r.gets(buf, BUFSZ) != NULL) {
+		fputs(buf, fh);
+	}
+	delete[] buf;
+	if(fh != stdout) {
+		fclose(fh);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	if(argc == 1) {
+		// print which arguments from ts.py should pass through to here
+		cout << "io-threads" << endl;
+		return 0;
+	}
+
+	string mode, in_fn, out_fn;
+	{
+		int section = 0;
+		for(int i = 1; i < argc; i++) {
+			if(strcmp(argv[i], "--") == 0) {
+				section++;
+				continue;
+			}
+			if(section == 0) {
+				mode = argv[i];
+			} else if(section == 1) {
+				if(i == argc-1) {
+					cerr << "Error: odd number of arguments in options section" << endl;
+					throw 1;
+				}
+				if(strcmp(argv[i], "io-threads") == 0) {
+					io_threads = atoi(argv[++i]);
+				} else if(strcmp(argv[i], "compress-level") == 0) {
+					compress_level = atoi(argv[++i]);
+				} else {
+					cerr << "Warning: unrecognized option '" << argv[i] << "'" << endl;
+					i++;
+				}
+			} else if(section == 2) {
+				in_fn = argv[i];
+			} else {
+				out_fn = argv[i];
+			}
+		}
+	}
+	if(in_fn.empty() || out_fn.empty() || (mode != "c" && mode != "d") ||
+	   (mode == "c" && out_fn == "-"))
+	{
+		cerr << "Usage: qtip-bsam <c|d> -- [name value]... -- <input> -- <output>" << endl;
+		return 1;
+	}
+	Timeline::init("qtip-bsam");
+	TimelineScope lifetime(mode == "c" ? "compress" : "decompress", "process");
+	if(mode == "c") {
+		return do_compress(in_fn, out_fn) == 0 ? 0 : 1;
+	}
+	return do_decompress(in_fn, out_fn) == 0 ? 0 : 1;
+}
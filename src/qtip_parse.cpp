@@ -8,11 +8,23 @@
 #include <string>
 #include <vector>
 #include <limits>
+#include <map>
+#include <sstream>
 #include "ds.h"
 #include "template.h"
 #include "input_model.h"
 #include "rnglib.hpp"
 #include "simplesim.h"
+#include "realign.h"
+#include "colstats.h"
+#include "feature_block.h"
+#include "refdict.h"
+#include "blocksam.h"
+#include "perfcount.h"
+#include "probes.h"
+#include "checkpoint.h"
+#include "run_decode.h"
+#include "aux_scan.h"
 
 using namespace std;
 
@@ -65,6 +77,15 @@ using namespace std;
  * 6. Fragment length
  * 7+. All the ZT:Z fields for mate 1
  * X+. All the ZT:Z fields for mate 2
+ *
+ * When realign-window > 0, the ZT:Z fields are followed by the best score,
+ * second-best score and number of near-equal placements from realigning the
+ * read (and, for pairs, its opposite mate) near where it aligned.
+ *
+ * Paired-end records are stored once per pair, as a block of per-mate
+ * features for each mate followed by the fragment length; the .meta file's
+ * second line ("layout,pair") tells readers to expand each into the two
+ * per-mate rows described by the first line.
  */
 
 /**
@@ -76,46 +97,74 @@ using namespace std;
 /* 64K buffer for all input and output */
 const static size_t BUFSZ = 65536;
 
-struct OpRunOffset {
-	char op;
-	int run;
-	int offset;
-	
-	void init(char _op, int _run, int _offset) {
-		op = _op;
-		run = _run;
-		offset = _offset;
-	}
+/**
+ * Finds the optional fields qtip-parse uses in one pass over each record.
+ */
+static AuxScanner aux_scanner;
+static const int AUX_ZT = aux_scanner.add("ZT");
+static const int AUX_MD = aux_scanner.add("MD");
+static const int AUX_AS = aux_scanner.add("AS");
+static const int AUX_XS = aux_scanner.add("XS");
+static const int AUX_NM = aux_scanner.add("NM");
+static const int AUX_XA = aux_scanner.add("XA");
+static const int AUX_SA = aux_scanner.add("SA");
+
+/*
+ * With aux-features, alignments don't need the ZT:Z field that qtip's
+ * patched aligners add.  Instead, its place is taken by features that
+ * stock aligners report in standard fields: the alignment score (AS:i),
+ * the second-best score (XS:i), the edit distance (NM:i), the number of
+ * alternative (XA:Z) and supplementary (SA:Z) alignments listed, and the
+ * total quality of mismatched read characters, from the MD:Z field or an
+ * extended CIGAR.  Fields a record lacks are NA, except that the first is
+ * taken as the best score, as the first ZT:Z value otherwise is, so input
+ * alignments that are modeled must have AS:i.
+ */
+bool aux_features = false;
+static const int AUX_NFEATURES = 6;
+
+/**
+ * An alignment's fields parsed from its SAM record.  Kept apart from the
+ * lists in Alignment so they can all be cleared at once by zeroing.
+ */
+struct AlignmentFields {
+	char *rest_of_line;
+	bool valid;
+	char *qname;
+	char *typ;
+	int flag;
+	char *rname;
+	size_t pos;
+	int mapq;
+	char *cigar;
+	char *rnext;
+	int pnext;
+	char *seq;
+	size_t len;
+	char *qual;
+	char *mdz;
+	bool cigar_equal_x;
+	int best_score;
+	int left_clip;
+	int right_clip;
+	int parsed_left_clip;
+	int parsed_right_clip;
+	int correct;
+	size_t line;
 };
 
-struct Alignment {
+struct Alignment : public AlignmentFields {
 	
 	Alignment() { clear(); }
 	
 	~Alignment() { }
 	
+	/**
+	 * Clear for reuse.  The fields are zeroed in one go rather than one at a
+	 * time, and the lists keep their memory.
+	 */
 	void clear() {
-		rest_of_line = NULL;
-		valid = false;
-		qname = NULL;
-		typ = NULL;
-		flag = 0;
-		rname = NULL;
-		pos = 0;
-		mapq = 0;
-		cigar = NULL;
-		rnext = NULL;
-		pnext = 0;
-		seq = NULL;
-		len = 0;
-		qual = NULL;
-		avg_clipped_qual = 0.0;
-		avg_aligned_qual = 0.0;
-		mdz = NULL;
-		cigar_equal_x = false;
-		best_score = 0;
-		left_clip = 0;
-		right_clip = 0;
+		memset(static_cast<AlignmentFields*>(this), 0, sizeof(AlignmentFields));
 		rf_aln_buf.clear();
 		rd_aln_buf.clear();
 		edit_xscript.clear();
@@ -124,7 +173,6 @@ struct Alignment {
 		mdz_char.clear();
 		mdz_oro.clear();
 		correct = -1;
-		line = 0;
 	}
 	
 	inline bool is_aligned() const {
@@ -168,86 +216,210 @@ struct Alignment {
 	
 	/**
 	 * Return rightmost reference pos involved in the alignment, considering
-	 * soft clipped bases as being included in the alignment.
+	 * soft clipped bases as being included in the alignment.  Worked out
+	 * from the CIGAR so it's available without the edit transcript; like
+	 * the transcript-based version it replaces, the first position after
+	 * any leading soft clipping isn't counted.
 	 */
 	size_t rpos() const {
-		assert(!edit_xscript.empty());
+		assert(!cigar_ops.empty());
 		size_t mv = 0;
-		const char *xs = edit_xscript.ptr();
-		while(*xs++ == 'S');
-		assert(*xs != '\0');
-		while(*xs != '\0') {
-			if(*xs == 'S' || *xs == 'D' || *xs == 'X' || *xs == '=') {
-				mv++;
+		size_t i = 0;
+		while(i < cigar_ops.size() && (cigar_ops[i] == 'S' || cigar_ops[i] == 'H')) {
+			i++;
+		}
+		assert(i < cigar_ops.size());
+		bool first = true;
+		for(; i < cigar_ops.size(); i++) {
+			const char cop = cigar_ops[i];
+			if(cop == 'H' || cigar_run[i] == 0) {
+				continue;
+			}
+			size_t run = (size_t)cigar_run[i];
+			if(first) {
+				first = false;
+				run--;
+			}
+			if(cop == 'S' || cop == 'D' || cop == 'X' || cop == '=' || cop == 'M') {
+				mv += run;
 			}
-			xs++;
 		}
 		return pos + mv - 1;
 	}
+
+	/**
+	 * Return number of reference characters involved in the alignment,
+	 * including soft-clipped ones; same as edit_xscript_to_rflen on the edit
+	 * transcript.
+	 */
+	size_t rflen() const {
+		size_t n = 0;
+		for(size_t i = 0; i < cigar_ops.size(); i++) {
+			const char cop = cigar_ops[i];
+			if(cop == 'S' || cop == 'D' || cop == 'X' || cop == '=' || cop == 'M') {
+				n += cigar_run[i];
+			}
+		}
+		return n;
+	}
+
+	/**
+	 * Return true iff there's enough information to build an edit
+	 * transcript: either an extended CIGAR or an MD:Z field.
+	 */
+	bool has_xscript_source() const {
+		return cigar_equal_x || mdz != NULL;
+	}
 	
 	/**
-	 * Return value is first pre-comma token of ZT:Z strings.s
+	 * Return value is first pre-comma token of ZT:Z strings, or with
+	 * aux-features, of the features standing in for them.  The MD:Z field
+	 * is only decoded, and combined with the CIGAR into an edit transcript,
+	 * if need_xscript is true (or, for the mismatch qualities, if
+	 * aux_features is).  The ZT:Z and MD:Z values are NUL-terminated in
+	 * place.
 	 */
-	char * parse_extra(char *extra) {
+	char * parse_extra(char *extra, bool need_xscript) {
 		char *ztz = NULL;
-		extra = strtok(extra, "\t");
-		bool found_ztz = false, found_mdz = false;
-		while(extra != NULL && (!found_mdz || !found_ztz)) {
-			if(strncmp(extra, "ZT:Z:", 5) == 0) {
-				ztz = extra + 5;
-				found_ztz = true;
-			}
-			if(strncmp(extra, "MD:Z:", 5) == 0) {
-				assert(mdz == NULL);
-				mdz = extra + 5;
-				mdz_to_list();
-				found_mdz = true;
-			}
-			extra = strtok(NULL, "\t");
+		aux_scanner.scan(extra);
+		const AuxField& ztz_field = aux_scanner[AUX_ZT];
+		const AuxField& mdz_field = aux_scanner[AUX_MD];
+		if(ztz_field.found() && ztz_field.type() == 'Z') {
+			ztz = ztz_field.terminate();
 		}
-		if(cigar != NULL && mdz != NULL && !cigar_equal_x) {
+		if(mdz_field.found() && mdz_field.type() == 'Z') {
+			mdz = mdz_field.terminate();
+		}
+		if(cigar != NULL && mdz != NULL && !cigar_equal_x && (need_xscript || aux_features)) {
+			mdz_to_list();
+		}
+		if(aux_features) {
+			// Before the edit transcript is built, as that uses up mdz_oro
+			ztz = aux_ztz();
+		}
+		if(need_xscript && cigar != NULL && mdz != NULL && !cigar_equal_x) {
 			cigar_and_mdz_to_edit_xscript();
 		}
 		if(ztz == NULL) {
 			cerr << "Input SAM file did not have ZT:Z field.  Be sure to run"
 			     << " a version of the aligner that produces the output needed"
-			     << " for qtip." << endl;
+			     << " for qtip, or use aux-features (--aux-features) to use"
+			     << " standard fields instead." << endl;
 			throw 1;
 		}
 		return ztz;
 	}
+
+	/**
+	 * Return the total Phred quality of read characters aligned to
+	 * mismatched reference characters, going by the CIGAR and either the
+	 * decoded MD:Z field or an extended CIGAR.  Return -1 if there's
+	 * neither, or no qualities.
+	 */
+	int mismatch_qual_sum() const {
+		if((!cigar_equal_x && mdz == NULL) || qual == NULL || qual[0] == '*') {
+			return -1;
+		}
+		// MD:Z's match and mismatch stretches line up with the read
+		// characters of the M operations; its deletions, like the D
+		// operations, don't involve read characters and are skipped
+		int tot = 0;
+		size_t rdoff = 0, mdo = 0;
+		int mdleft = 0;
+		bool mm = false;
+		for(size_t i = 0; i < cigar_ops.size(); i++) {
+			const char cop = cigar_ops[i];
+			int crun = cigar_run[i];
+			if(cop == 'M') {
+				while(crun > 0) {
+					if(mdleft == 0) {
+						while(mdo < mdz_oro.size() && mdz_oro[mdo].op == 2) {
+							mdo++;
+						}
+						if(mdo == mdz_oro.size()) {
+							break;
+						}
+						mdleft = mdz_oro[mdo].run;
+						mm = mdz_oro[mdo].op == 1;
+						mdo++;
+					}
+					int run = min(crun, mdleft);
+					for(int j = 0; mm && j < run && rdoff + j < len; j++) {
+						tot += qual[rdoff + j] - 33;
+					}
+					rdoff += run;
+					crun -= run;
+					mdleft -= run;
+				}
+				rdoff += crun;
+			} else if(cop == 'X') {
+				for(int j = 0; j < crun && rdoff + j < len; j++) {
+					tot += qual[rdoff + j] - 33;
+				}
+				rdoff += crun;
+			} else if(cop == '=' || cop == 'I' || cop == 'S') {
+				rdoff += crun;
+			}
+		}
+		return tot;
+	}
+
+	/**
+	 * Write the aux-features stand-ins for the ZT:Z values to aux_ztz_buf,
+	 * comma-separated like ZT:Z, and return it.
+	 */
+	char * aux_ztz() {
+		char *cur = aux_ztz_buf;
+		char *const end = aux_ztz_buf + sizeof(aux_ztz_buf);
+		const int int_tags[] = {AUX_AS, AUX_XS, AUX_NM};
+		for(size_t i = 0; i < sizeof(int_tags) / sizeof(int); i++) {
+			const AuxField& f = aux_scanner[int_tags[i]];
+			if(f.found() && f.type() == 'i') {
+				cur += snprintf(cur, end - cur, "%ld,", strtol(f.value(), NULL, 10));
+			} else {
+				cur += snprintf(cur, end - cur, "NA,");
+			}
+		}
+		// XA:Z and SA:Z list one alignment per ;-terminated entry
+		const int list_tags[] = {AUX_XA, AUX_SA};
+		for(size_t i = 0; i < sizeof(list_tags) / sizeof(int); i++) {
+			const AuxField& f = aux_scanner[list_tags[i]];
+			int n = 0;
+			if(f.found()) {
+				n = (int)std::count(f.value(), f.value() + f.value_len(), ';');
+			}
+			cur += snprintf(cur, end - cur, "%d,", n);
+		}
+		int mmq = mismatch_qual_sum();
+		if(mmq >= 0) {
+			snprintf(cur, end - cur, "%d", mmq);
+		} else {
+			snprintf(cur, end - cur, "NA");
+		}
+		return aux_ztz_buf;
+	}
 	
 	/**
-	 * CIGAR string to list.
+	 * CIGAR string to list.  If it uses = and X and need_xscript is true,
+	 * also build the edit transcript.
 	 */
-	void parse_cigar() {
+	void parse_cigar(bool need_xscript) {
 		assert(cigar_ops.empty());
 		assert(cigar_run.empty());
 		assert(cigar != NULL);
-		const size_t clen = strlen(cigar);
-		int i = 0;
-		while(i < clen) {
-			assert(isdigit(cigar[i]));
-			int run = 0;
-			do {
-				run *= 10;
-				run += ((int)cigar[i] - (int)'0');
-				i++;
-			} while(isdigit(cigar[i]));
-			assert(isalpha(cigar[i]) || cigar[i] == '=');
-			if(cigar_ops.empty() && cigar[i] == 'S') {
-				left_clip = run;
-			} else if(i+1 >= clen && cigar[i] == 'S') {
-				right_clip = run;
-			}
-			if(cigar[i] == 'X' || cigar[i] == '=') {
+		decode_cigar(cigar, strlen(cigar), cigar_ops, cigar_run);
+		if(!cigar_ops.empty() && cigar_ops[0] == 'S') {
+			left_clip = cigar_run[0];
+		}
+		for(size_t i = 0; i < cigar_ops.size(); i++) {
+			if(cigar_ops[i] == 'X' || cigar_ops[i] == '=') {
 				cigar_equal_x = true;
 			}
-			cigar_ops.push_back(cigar[i]);
-			cigar_run.push_back(run);
-			i++;
 		}
-		if(cigar_equal_x) {
+		if(cigar_ops.size() > 1 && cigar_ops.back() == 'S') {
+			right_clip = cigar_run.back();
+		}
+		if(cigar_equal_x && need_xscript) {
 			cigar_to_edit_xscript();
 		}
 	}
@@ -259,44 +431,7 @@ struct Alignment {
 		assert(mdz_char.empty());
 		assert(mdz_oro.empty());
 		assert(mdz != NULL);
-		const size_t mlen = strlen(mdz);
-		int i = 0;
-		while(i < mlen) {
-			if(isdigit(mdz[i])) {
-				// Matching stretch
-				int run = 0;
-				do {
-					run *= 10;
-					run += ((int)mdz[i] - (int)'0');
-					i++;
-				} while(i < mlen && isdigit(mdz[i]));
-				if(run > 0) {
-					mdz_oro.expand();
-					mdz_oro.back().init(0, run, -1);
-				}
-			} else if(isalpha(mdz[i])) {
-				// Mismatching stretch
-				int run = 0;
-				do {
-					mdz_char.push_back(mdz[i++]);
-					run++;
-				} while(i < mlen && isalpha(mdz[i]));
-				mdz_oro.expand();
-				mdz_oro.back().init(1, run, (int)(mdz_char.size() - run));
-			} else if(mdz[i] == '^') {
-				i++; // skip the ^
-				int run = 0;
-				while(i < mlen && isalpha(mdz[i])) {
-					mdz_char.push_back(mdz[i++]);
-					run++;
-				}
-				mdz_oro.expand();
-				mdz_oro.back().init(2, run, (int)(mdz_char.size() - run));
-			} else {
-				fprintf(stderr, "Unexpected character at position %d of MD:Z string '%s'\n", i, mdz);
-			}
-		}
-		assert(i == mlen);
+		decode_mdz(mdz, strlen(mdz), mdz_oro, mdz_char);
 	}
 
 	/**
@@ -484,29 +619,16 @@ struct Alignment {
 	}
 
 	/**
-	 * Having already parsed the quality and CIGAR strings, we can now
-	 * calculate the average quality of the aligned and clipped bases.
+	 * Having parsed the CIGAR, treat a read with just one soft-clipped base
+	 * as unclipped.  The clipping as parsed is kept for the quality features
+	 * (see FeatureBlock::calc_quals).
 	 */
-	void calc_qual_averages() {
+	void ignore_short_clips() {
 		assert(len > 0);
-		const size_t nclipped = left_clip + right_clip;
-		assert(nclipped < len);
-		tot_clipped_qual = 0;
-		tot_aligned_qual = 0;
-		for(size_t i = 0; i < len; i++) {
-			assert((int)qual[i] >= 33);
-			if(i < left_clip || i >= len - 1 - right_clip) {
-				tot_clipped_qual += ((int)qual[i] - 33);
-			} else {
-				tot_aligned_qual += ((int)qual[i] - 33);
-			}
-		}
-		avg_aligned_qual = (double)tot_aligned_qual / (len - nclipped);
-		if(nclipped > 1) {
-			avg_clipped_qual = (double)tot_clipped_qual / nclipped;
-		} else {
-			avg_clipped_qual = 100.0;
-			tot_clipped_qual = 0;
+		assert((size_t)(left_clip + right_clip) < len);
+		parsed_left_clip = left_clip;
+		parsed_right_clip = right_clip;
+		if(left_clip + right_clip <= 1) {
 			left_clip = right_clip = 0;
 		}
 	}
@@ -514,24 +636,28 @@ struct Alignment {
 	/**
 	 * If the read has a recognizable simulated read name, set the 'correct'
 	 * field to 0/1 according to whether the alignment is correct.  Otherwise
-	 * leave it as -1.
+	 * leave it as -1.  refid is rname's id in the @SQ dictionary (-1 if it
+	 * isn't there); names of reads simulated by qtip carry reference ids
+	 * rather than names (see RefDict).
 	 */
-	void set_correctness(int wiggle) {
+	void set_correctness(int wiggle, int refid) {
 		assert(correct == -1);
 		assert(is_aligned());
-		const size_t rname_len = strlen(rname);
 		if(strncmp(qname, sim_startswith, strlen(sim_startswith)) == 0) {
 			correct = 0;
 			// This is read simulated by qtip
 			char *qname_cur = qname +strlen(sim_startswith);
 			assert(*qname_cur == sim_sep);
 			qname_cur++;
-			if(mate_flag() != '2' &&
-			   strncmp(qname_cur, rname, rname_len) != 0)
-			{
+			// now pointing to reference id
+			int refid1 = 0;
+			while(isdigit(*qname_cur)) {
+				refid1 *= 10;
+				refid1 += (int)(*qname_cur++ - '0');
+			}
+			if(mate_flag() != '2' && refid1 != refid) {
 				return;
 			}
-			qname_cur += rname_len;
 			if(*(qname_cur++) != sim_sep) {
 				return;
 			}
@@ -582,11 +708,14 @@ struct Alignment {
 				return;
 			}
 			// Final case: read is paired-end and mate 2
-			if(strncmp(qname_cur, rname, rname_len) != 0)
-			{
+			int refid2 = 0;
+			while(isdigit(*qname_cur)) {
+				refid2 *= 10;
+				refid2 += (int)(*qname_cur++ - '0');
+			}
+			if(refid2 != refid) {
 				return;
 			}
-			qname_cur += rname_len;
 			if(*(qname_cur++) != sim_sep) {
 				return;
 			}
@@ -651,6 +780,7 @@ struct Alignment {
 			if(nund >= 8 && ncolon == 4) {
 				char *qname_cur = qname;
 				correct = 0;
+				const size_t rname_len = strlen(rname);
 				if(strncmp(qname_cur, rname, rname_len) != 0) {
 					return;
 				}
@@ -712,32 +842,6 @@ struct Alignment {
 		}
 	}
 	
-	char *rest_of_line;
-	bool valid;
-	char *qname;
-	char *typ;
-	int flag;
-	char *rname;
-	size_t pos;
-	int mapq;
-	char *cigar;
-	char *rnext;
-	int pnext;
-	char *seq;
-	size_t len;
-	char *qual;
-	size_t tot_clipped_qual;
-	size_t tot_aligned_qual;
-	double avg_clipped_qual;
-	double avg_aligned_qual;
-	char *mdz;
-	bool cigar_equal_x;
-	int best_score;
-	int left_clip;
-	int right_clip;
-	int correct;
-	size_t line;
-	
 	// For holding stacked alignment result
 	EList<char> rf_aln_buf;
 	EList<char> rd_aln_buf;
@@ -752,8 +856,21 @@ struct Alignment {
 	// For holding MD:Z parsing info
 	EList<OpRunOffset> mdz_oro;
 	EList<char> mdz_char;
+
+	// Stands in for the ZT:Z value with aux-features; see aux_ztz
+	char aux_ztz_buf[128];
 };
 
+/*
+ * Which parts of each alignment the enabled modes use.  Anything else is
+ * left undecoded.
+ */
+enum {
+	NEED_XSCRIPT = 1,  // edit transcripts: input model and simulation
+	NEED_FEATURES = 2  // quality totals, correctness, all ZT:Z fields
+};
+int parse_needs = NEED_XSCRIPT | NEED_FEATURES;
+
 /**
  * strtok already used to parse up to rname.  Parse the rest and return char *
  * to the extra flags.
@@ -776,7 +893,7 @@ static char * parse_from_rname_on(Alignment& al) {
 	// if CIGAR string uses = and X, then also sets edit transcript
 	al.cigar = strtok(NULL, "\t");
 	assert(al.cigar != NULL);
-	al.parse_cigar();
+	al.parse_cigar((parse_needs & NEED_XSCRIPT) != 0);
 
 	al.rnext = strtok(NULL, "\t"); assert(al.rnext != NULL);
 	char *pnext_str = strtok(NULL, "\t"); assert(pnext_str != NULL);
@@ -785,10 +902,10 @@ static char * parse_from_rname_on(Alignment& al) {
 	al.seq = strtok(NULL, "\t"); assert(al.seq != NULL);
 	al.len = strlen(al.seq);
 
-	// sets qual, avg_aligned_qual and avg_clipped_qual
+	// sets qual; quality features are computed a block at a time later
 	al.qual = strtok(NULL, "\t");
 	assert(al.qual != NULL);
-	al.calc_qual_averages();
+	al.ignore_short_clips();
 
 	al.rest_of_line = al.qual + strlen(al.qual) + 1;
 	return al.rest_of_line;
@@ -805,8 +922,173 @@ int sim_unp_min = 30000;
 int sim_conc_min = 30000;
 int sim_disc_min = 10000;
 int sim_bad_end_min = 10000;
+string sim_categories = "ubcd"; // which categories of tandem reads to simulate
+bool sim_append = false;        // append to existing tandem read files
+int sim_continuation = 0;       // if > 0, top-up run drawing from a fresh stream
+int sim_shards = 1;             // sets of tandem read files to deal reads into
+string ref_ids_fn;              // reference ids to use, from the simulating run
+size_t ref_ids_n = 0;           // # references ref_ids_fn numbered
+string input_model_fn;          // input model to simulate from, saved by mode i
+int realign_window = 0;
+int io_threads = 2;             // threads decompressing block-compressed SAM
+bool perf_counters = false;     // report hardware counters per phase
+double checkpoint_interval = 0; // seconds between checkpoints; 0 = none
+
+/*
+ * Reference ids, from the @SQ header lines of the SAM files parsed so far.
+ * The simulator adds any FASTA contigs missing from the header.
+ */
+RefDict refs;
+
+/*
+ * Realignment features.  When enabled, reads are queued for realignment as
+ * their records are staged, and the batch is realigned just before the
+ * staged records are written.
+ */
+const static size_t REALIGN_BATCHSZ = 2048;
+ReferenceSet realign_refs;
+RealignParams realign_params;
+RealignBatch *realign_batch = NULL;
+
+/*
+ * Per-column statistics for each record file, written alongside the .meta
+ * file as .stats (see colstats.h).
+ */
+vector<pair<FILE*, ColumnStats> > rec_stats;
+
+/**
+ * Start gathering statistics for rows written to the given record file.
+ */
+static void rec_stats_init(
+	FILE *fh,
+	const vector<string>& names,
+	size_t stored_ncol,
+	const vector<vector<size_t> >& expand)
+{
+	rec_stats.push_back(make_pair(fh, ColumnStats()));
+	rec_stats.back().second.init(names, stored_ncol, expand);
+}
+
+/**
+ * Return statistics for the given record file, or NULL if there are none.
+ */
+static ColumnStats *rec_stats_for(FILE *fh) {
+	for(size_t i = 0; i < rec_stats.size(); i++) {
+		if(rec_stats[i].first == fh) {
+			return &rec_stats[i].second;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Queue the read from an aligned record for realignment in a window around
+ * where it aligned.  Return job id.
+ */
+static size_t realign_queue(const Alignment& al) {
+	assert(realign_batch != NULL);
+	long long lpos = (long long)al.pos - 1 - al.left_clip;
+	return realign_batch->add(
+		al.seq,
+		al.len,
+		al.rname,
+		lpos,
+		al.rflen());
+}
+
+/*
+ * Feature records are staged in a FeatureBlock per record file and written a
+ * block at a time (see feature_block.h).
+ */
+const static size_t FEATURE_BLOCKSZ = 4096;
+vector<FeatureBlock*> feature_blocks;
+size_t feature_block_recs = 0; // records staged across all blocks
+
+/**
+ * Return the block for the given record file, making it if needed.
+ */
+static FeatureBlock *feature_block_for(FILE *fh, bool paired) {
+	for(size_t i = 0; i < feature_blocks.size(); i++) {
+		if(feature_blocks[i]->fh() == fh) {
+			return feature_blocks[i];
+		}
+	}
+	feature_blocks.push_back(new FeatureBlock(fh, paired, realign_batch != NULL));
+	return feature_blocks.back();
+}
+
+/**
+ * Realign all queued reads, if any, then compute features for and write out
+ * all staged records.
+ */
+static int flush_features() {
+	PerfScope perf("features");
+	QTIP_PROBE1(feature_flush, feature_block_recs);
+	if(realign_batch != NULL) {
+		PerfScope perf_realign("realign");
+		realign_batch->run();
+	}
+	for(size_t i = 0; i < feature_blocks.size(); i++) {
+		FeatureBlock *blk = feature_blocks[i];
+		if(blk->flush(realign_batch, rec_stats_for(blk->fh())) != 0) {
+			return -1;
+		}
+	}
+	if(realign_batch != NULL) {
+		realign_batch->clear();
+	}
+	feature_block_recs = 0;
+	return 0;
+}
+
+/**
+ * Note that a record was staged, flushing if a block's worth have been.
+ */
+static int feature_record_done() {
+	if(++feature_block_recs >= FEATURE_BLOCKSZ ||
+	   (realign_batch != NULL && realign_batch->size() >= REALIGN_BATCHSZ))
+	{
+		return flush_features();
+	}
+	return 0;
+}
 
-vector<double> write_buf;
+/**
+ * Stage an alignment's per-mate features.
+ */
+static void stage_mate(FeatureBlock *blk, const Alignment& al, const char *ztz) {
+	blk->add_mate(
+		al.line,
+		al.len,
+		al.parsed_left_clip,
+		al.parsed_right_clip,
+		al.qual,
+		ztz,
+		al.mapq,
+		al.correct,
+		realign_batch != NULL ? realign_queue(al) : FeatureBlock::NO_JOB);
+}
+
+/**
+ * Return the alignment score, the first ZT:Z value (AS:i with
+ * aux-features).  The input model is built from it, so a record without
+ * one is an error rather than a score of 0.
+ */
+static int best_score(const Alignment& al, const char *ztz) {
+	char *end = NULL;
+	const long score = strtol(ztz, &end, 10);
+	if(end == ztz) {
+		cerr << "Error: no alignment score for read \"" << al.qname << "\"; ";
+		if(aux_features) {
+			cerr << "aux-features needs an AS:i field in every aligned record";
+		} else {
+			cerr << "the first ZT:Z value is \"" << ztz << "\"";
+		}
+		cerr << endl;
+		throw 1;
+	}
+	return (int)score;
+}
 
 /**
  * No guarantee about state of strtok upon return.
@@ -819,18 +1101,21 @@ static int print_unpaired(
 	ReservoirSampledEList<TemplateUnpaired> *unp_model)
 {
 	assert(al.is_aligned());
+	const bool need_xscript = (parse_needs & NEED_XSCRIPT) != 0;
 	char *extra = parse_from_rname_on(al);
-	al.set_correctness(wiggle);
-	char *ztz = al.parse_extra(extra);
-	if(al.edit_xscript.empty()) {
+	if(fh_recs != NULL) {
+		al.set_correctness(wiggle, refs.id(al.rname));
+	}
+	char *ztz = al.parse_extra(extra, need_xscript);
+	if(need_xscript && al.edit_xscript.empty()) {
 		cerr << "Error: Input SAM file has neither extended CIGAR (using ="
 		     << " and X instead of M) nor MD:Z field.  One or the other is"
 		     << " required for use with qtip." << endl;
 		throw 1;
 	}
-	char *ztz_tok = strtok(ztz, ",");
-	assert(ztz_tok != NULL);
-	al.best_score = atoi(ztz_tok);
+	if(fh_model != NULL || unp_model != NULL) {
+		al.best_score = best_score(al, ztz);
+	}
 	char fw_flag = al.is_fw() ? 'T' : 'F';
 	
 	if(fh_model != NULL) {
@@ -861,72 +1146,23 @@ static int print_unpaired(
 	}
 	
 	if(fh_recs != NULL) {
-		// Output information relevant to MAPQ model
-		write_buf.push_back((double)al.line);
-		write_buf.push_back((double)al.len);
-		write_buf.push_back((double)(al.left_clip + al.right_clip));
-		write_buf.push_back((double)al.tot_aligned_qual);
-		write_buf.push_back((double)al.tot_clipped_qual);
-		write_buf.push_back((double)ordlen);
-
-		// ... including all the ZT:Z fields
-		while(ztz_tok != NULL) {
-			const char *buf = ztz_tok;
-			if(*buf == 'N') {
-				// Handle NA
-				assert(*(++buf) == 'A');
-				write_buf.push_back(std::numeric_limits<double>::quiet_NaN());
-			} else {
-				bool neg = false;
-				bool added = false;
-				int ztz_i = 0;
-				if(*buf == '-') {
-					neg = true;
-					buf++;
-				}
-				while(*buf != '\0' && *buf != '\r' && *buf != '\n') {
-					assert((*buf >= '0' && *buf <= '9') || *buf == '.');
-					if(*buf != '.') {
-						// Avoid sscanf if it's just an int
-						ztz_i *= 10.0;
-						ztz_i += ((*buf) - '0');
-					} else {
-						double ztz_d;
-						sscanf(ztz_tok, "%lf", &ztz_d);
-						write_buf.push_back(ztz_d);
-						added = true;
-						break;
-					}
-					buf++;
-				}
-				if(!added) {
-					write_buf.push_back((double)(neg ? (-ztz_i) : ztz_i));
-				}
-			}
-			ztz_tok = strtok(NULL, ",");
-		}
-
-		// ... and finish with MAPQ and correct
-		write_buf.push_back((double)al.mapq);
-		write_buf.push_back((double)al.correct);
-
-		// Flush output buffer
-		size_t nwritten = fwrite(&(write_buf.front()), 8,
-			write_buf.size(), fh_recs);
-		if(nwritten != write_buf.size()) {
-			cerr << "Could not write all " << write_buf.size()
-				 << " doubles to record file" << endl;
+		// Stage information relevant to MAPQ model
+		FeatureBlock *blk = feature_block_for(fh_recs, false);
+		stage_mate(blk, al, ztz);
+		blk->end_record((double)ordlen);
+		if(feature_record_done() != 0) {
 			return -1;
 		}
-		write_buf.clear();
 	}
 	return 0;
 }
 
-vector<double> ztz1_buf;
-vector<double> ztz2_buf;
-
 /**
+ * Write one compact record for a concordant or discordant pair: a block of
+ * per-mate features for mate 1, the same block for mate 2, then the
+ * fragment length.  Readers expand it into one row per mate, each with the
+ * opposite mate's features alongside (see print_paired_header).
+ *
  * No guarantee about state of strtok upon return.
  */
 static int print_paired_helper(
@@ -939,191 +1175,45 @@ static int print_paired_helper(
 	assert(al1.is_aligned());
 	assert(al2.is_aligned());
 	
+	const bool need_xscript = (parse_needs & NEED_XSCRIPT) != 0;
 	char *extra1 = parse_from_rname_on(al1);
 	char *extra2 = parse_from_rname_on(al2);
-	al1.set_correctness(wiggle);
-	al2.set_correctness(wiggle);
+	if(fh_recs != NULL) {
+		al1.set_correctness(wiggle, refs.id(al1.rname));
+		al2.set_correctness(wiggle, refs.id(al2.rname));
+	}
 	
-	char *ztz1 = al1.parse_extra(extra1);
-	if(al1.edit_xscript.empty()) {
+	char *ztz1 = al1.parse_extra(extra1, need_xscript);
+	if(need_xscript && al1.edit_xscript.empty()) {
 		cerr << "Error: Input SAM file has neither extended CIGAR (using ="
 		     << " and X instead of M) nor MD:Z field.  One or the other is"
 		     << " required for use with qtip." << endl;
 		throw 1;
 	}
-	char *ztz2 = al2.parse_extra(extra2);
+	char *ztz2 = al2.parse_extra(extra2, need_xscript);
 	size_t fraglen = std::min((size_t)max_allowed_fraglen,
 							  Alignment::fragment_length(al1, al2));
 	bool upstream1 = al1.pos < al2.pos;
 	assert(al1.cigar != NULL);
 	assert(al2.cigar != NULL);
 
-	char *ztz_tok1 = strtok(ztz1, ",");
-	assert(ztz_tok1 != NULL);
-	al1.best_score = atoi(ztz_tok1);
-	char fw_flag1 = al1.is_fw() ? 'T' : 'F';	
-
-    double len1_d;
-    double clip1_d;
-    double alqual1_d;
-    double clipqual1_d;
-
-	if(fh_recs != NULL) {
-		ztz1_buf.clear();
-		
-		//
-		// Mate 1
-		//
-
-		// Output information relevant to MAPQ model
-		len1_d = (double)al1.len;
-		clip1_d = (double)al1.left_clip + al1.right_clip;
-		alqual1_d = (double)al1.tot_aligned_qual;
-		clipqual1_d = (double)(double)al1.tot_clipped_qual;
-		write_buf.push_back((double)al1.line);
-		write_buf.push_back(len1_d);
-		write_buf.push_back(clip1_d);
-		write_buf.push_back(alqual1_d);
-		write_buf.push_back(clipqual1_d);
-
-		// ... including all the ZT:Z fields
-		while(ztz_tok1 != NULL) {
-			const char *buf = ztz_tok1;
-			if(*buf == 'N') {
-				// Handle NA
-				assert(*(++buf) == 'A');
-				write_buf.push_back(std::numeric_limits<double>::quiet_NaN());
-				ztz1_buf.push_back(std::numeric_limits<double>::quiet_NaN());
-			} else {
-				bool neg = false;
-				bool added = false;
-				int ztz_i = 0;
-				if(*buf == '-') {
-					neg = true;
-					buf++;
-				}
-				while(*buf != '\0' && *buf != '\r' && *buf != '\n') {
-					assert((*buf >= '0' && *buf <= '9') || *buf == '.');
-					if(*buf != '.') {
-						// Avoid sscanf if it's just an int
-						ztz_i *= 10.0;
-						ztz_i += ((*buf) - '0');
-					} else {
-						double ztz_d;
-						sscanf(ztz_tok1, "%lf", &ztz_d);
-						write_buf.push_back(ztz_d);
-						ztz1_buf.push_back(ztz_d);
-						added = true;
-						break;
-					}
-					buf++;
-				}
-				if(!added) {
-					double ztz_add = (double)(neg ? (-ztz_i) : ztz_i);
-					write_buf.push_back(ztz_add);
-					ztz1_buf.push_back(ztz_add);
-				}
-			}
-			ztz_tok1 = strtok(NULL, ",");
-		}
+	if(fh_model != NULL || paired_model != NULL) {
+		al1.best_score = best_score(al1, ztz1);
+		al2.best_score = best_score(al2, ztz2);
 	}
-	
-	char *ztz_tok2 = strtok(ztz2, ",");
-	assert(ztz_tok2 != NULL);
-	al2.best_score = atoi(ztz_tok2);
+	char fw_flag1 = al1.is_fw() ? 'T' : 'F';
 	char fw_flag2 = al2.is_fw() ? 'T' : 'F';
-	
+
 	if(fh_recs != NULL) {
-		ztz2_buf.clear();
-		
-		//
-		// Mate 2
-		//
-
-		// Output information relevant to MAPQ model
-        const double len2_d = (double)al2.len;
-        const double clip2_d = (double)(al2.left_clip + al2.right_clip);
-        const double alqual2_d = (double)al2.tot_aligned_qual;
-        const double clipqual2_d = (double)al2.tot_clipped_qual;
-		const double fraglen_d = (double)fraglen;
-		write_buf.push_back(len2_d);
-		write_buf.push_back(clip2_d);
-		write_buf.push_back(alqual2_d);
-		write_buf.push_back(clipqual2_d);
-		write_buf.push_back(fraglen_d);
-
-		// ... including all the ZT:Z fields
-		while(ztz_tok2 != NULL) {
-			const char *buf = ztz_tok2;
-			if(*buf == 'N') {
-				// Handle NA
-				assert(*(++buf) == 'A');
-				write_buf.push_back(std::numeric_limits<double>::quiet_NaN());
-				ztz2_buf.push_back(std::numeric_limits<double>::quiet_NaN());
-			} else {
-				bool neg = false;
-				bool added = false;
-				int ztz_i = 0;
-				if(*buf == '-') {
-					neg = true;
-					buf++;
-				}
-				while(*buf != '\0' && *buf != '\r' && *buf != '\n') {
-					assert((*buf >= '0' && *buf <= '9') || *buf == '.');
-					if(*buf != '.') {
-						// Avoid sscanf if it's just an int
-						ztz_i *= 10.0;
-						ztz_i += ((*buf) - '0');
-					} else {
-						double ztz_d;
-						sscanf(ztz_tok2, "%lf", &ztz_d);
-						write_buf.push_back(ztz_d);
-						ztz2_buf.push_back(ztz_d);
-						added = true;
-						break;
-					}
-					buf++;
-				}
-				if(!added) {
-					double ztz_add = (double)(neg ? (-ztz_i) : ztz_i);
-					write_buf.push_back(ztz_add);
-					ztz2_buf.push_back(ztz_add);
-				}
-			}
-			ztz_tok2 = strtok(NULL, ",");
-		}
-
-		// ... and finish with MAPQ and correct
-		write_buf.push_back((double)al1.mapq);
-		write_buf.push_back((double)al1.correct);
-
-		//
-		// Now mate 2 again
-		//
-		write_buf.push_back((double)al2.line);
-		write_buf.push_back(len2_d);
-		write_buf.push_back(clip2_d);
-		write_buf.push_back(alqual2_d);
-		write_buf.push_back(clipqual2_d);
-		write_buf.insert(write_buf.end(), ztz2_buf.begin(), ztz2_buf.end());
-		write_buf.push_back(len1_d);
-		write_buf.push_back(clip1_d);
-		write_buf.push_back(alqual1_d);
-		write_buf.push_back(clipqual1_d);
-		write_buf.push_back(fraglen_d);
-		write_buf.insert(write_buf.end(), ztz1_buf.begin(), ztz1_buf.end());
-		write_buf.push_back((double)al2.mapq);
-		write_buf.push_back((double)al2.correct);
-		
-		// Flush output buffer
-		size_t nwritten = fwrite(&(write_buf.front()), 8,
-			write_buf.size(), fh_recs);
-		if(nwritten != write_buf.size()) {
-			cerr << "Could not write all " << write_buf.size()
-				 << " doubles to record file" << endl;
+		// Stage information relevant to MAPQ model: each mate's block, then
+		// the one feature the mates share
+		FeatureBlock *blk = feature_block_for(fh_recs, true);
+		stage_mate(blk, al1, ztz1);
+		stage_mate(blk, al2, ztz2);
+		blk->end_record((double)fraglen);
+		if(feature_record_done() != 0) {
 			return -1;
 		}
-		write_buf.clear();
 	}
 
 	if(fh_model != NULL) {
@@ -1190,6 +1280,9 @@ static int print_paired(
  * records in the ZT:Z extra field.
  */
 static int infer_num_ztzs(const char *rest_of_line) {
+	if(aux_features) {
+		return AUX_NFEATURES;
+	}
 	const char * cur = rest_of_line;
 	int n_ztz_fields = 1;
 	while(*cur != '\0') {
@@ -1233,60 +1326,569 @@ static size_t infer_read_length(const char *rest_of_line) {
 }
 
 /**
- * Print column headers for an unpaired file of feature records.
+ * Names of the columns in an unpaired file of feature records.
  */
-static void print_unpaired_header(FILE *fh, int n_ztz_fields, unsigned long long nrow) {
-	fprintf(fh, "id,len,clip,alqual,clipqual,olen");
+static vector<string> unpaired_cols(int n_ztz_fields) {
+	vector<string> cols;
+	const char *head[] = {"id", "len", "clip", "alqual", "clipqual", "olen"};
+	cols.insert(cols.end(), head, head + 6);
+	char buf[32];
 	for(int i = 0; i < n_ztz_fields; i++) {
-		fprintf(fh, ",ztz%d", i);
+		snprintf(buf, sizeof(buf), "ztz%d", i);
+		cols.push_back(buf);
 	}
-	fprintf(fh, ",mapq,correct,%llu\n", nrow);
+	if(realign_window > 0) {
+		cols.push_back("rl_best");
+		cols.push_back("rl_second");
+		cols.push_back("rl_near");
+	}
+	cols.push_back("mapq");
+	cols.push_back("correct");
+	return cols;
 }
 
 /**
- * Print column headers for a paired-end file of feature records.
+ * Names of the per-mate columns in a paired-end file of feature records, in
+ * the order print_paired_helper writes each mate's block.
  */
-static void print_paired_header(FILE *fh, int n_ztz_fields, unsigned long long nrow) {
-	fprintf(fh, "id,len,clip,alqual,clipqual");
+static vector<string> paired_block_cols(int n_ztz_fields) {
+	vector<string> cols;
+	const char *head[] = {"id", "len", "clip", "alqual", "clipqual"};
+	cols.insert(cols.end(), head, head + 5);
+	char buf[32];
 	for(int i = 0; i < n_ztz_fields; i++) {
-		fprintf(fh, ",ztz_%d", i);
+		snprintf(buf, sizeof(buf), "ztz_%d", i);
+		cols.push_back(buf);
 	}
-	fprintf(fh, ",olen,oclip,oalqual,oclipqual,fraglen");
-	for(int i = 0; i < n_ztz_fields; i++) {
-		fprintf(fh, ",oztz_%d", i);
+	if(realign_window > 0) {
+		cols.push_back("rl_best");
+		cols.push_back("rl_second");
+		cols.push_back("rl_near");
 	}
-	fprintf(fh, ",mapq,correct,%llu\n", nrow);
+	cols.push_back("mapq");
+	cols.push_back("correct");
+	return cols;
 }
 
 /**
- * Read the input SAM file while simultaneously writing out records used to
- * train a MAPQ model as well as records used to build an input model.
+ * Names of the columns readers see for a paired-end file of feature
+ * records, one row per mate.  Columns starting with "o" hold the opposite
+ * mate's value.
  */
-static int sam_pass1(
-	FILE *fh,
-	const string& orec_u_fn, FILE *orec_u_fh,
-	const string& orec_u_meta_fn, FILE *orec_u_meta_fh,
-	const string& omod_u_fn, FILE *omod_u_fh,
-	const string& orec_b_fn, FILE *orec_b_fh,
-	const string& orec_b_meta_fn, FILE *orec_b_meta_fh,
-	const string& omod_b_fn, FILE *omod_b_fh,
-	const string& orec_c_fn, FILE *orec_c_fh,
-	const string& orec_c_meta_fn, FILE *orec_c_meta_fh,
-	const string& omod_c_fn, FILE *omod_c_fh,
-	const string& orec_d_fn, FILE *orec_d_fh,
-	const string& orec_d_meta_fn, FILE *orec_d_meta_fh,
-	const string& omod_d_fn, FILE *omod_d_fh,
-	ReservoirSampledEList<TemplateUnpaired> *u_templates,
-	ReservoirSampledEList<TemplateUnpaired> *b_templates,
-	ReservoirSampledEList<TemplatePaired> *c_templates,
-	ReservoirSampledEList<TemplatePaired> *d_templates,
-	bool quiet)
-{
-	/* Advise the kernel of our access pattern.  */
-	/* posix_fadvise(fd, 0, 0, 1); */ /* FDADVICE_SEQUENTIAL */
+static vector<string> paired_cols(int n_ztz_fields) {
+	vector<string> cols;
+	const char *head[] = {"id", "len", "clip", "alqual", "clipqual"};
+	cols.insert(cols.end(), head, head + 5);
+	char buf[32];
+	for(int i = 0; i < n_ztz_fields; i++) {
+		snprintf(buf, sizeof(buf), "ztz_%d", i);
+		cols.push_back(buf);
+	}
+	const char *ohead[] = {"olen", "oclip", "oalqual", "oclipqual", "fraglen"};
+	cols.insert(cols.end(), ohead, ohead + 5);
+	for(int i = 0; i < n_ztz_fields; i++) {
+		snprintf(buf, sizeof(buf), "oztz_%d", i);
+		cols.push_back(buf);
+	}
+	if(realign_window > 0) {
+		const char *rl[] = {"rl_best", "rl_second", "rl_near",
+		                    "orl_best", "orl_second", "orl_near"};
+		cols.insert(cols.end(), rl, rl + 6);
+	}
+	cols.push_back("mapq");
+	cols.push_back("correct");
+	return cols;
+}
 
-    bool c_head = false, d_head = false, u_head = false, b_head = false;
-    int c_nztz = 0, d_nztz = 0, u_nztz = 0, b_nztz = 0;
+/**
+ * For each of the two rows a compact pair record expands to, the stored
+ * column holding each of the columns named by paired_cols.
+ */
+static vector<vector<size_t> > paired_expansion(int n_ztz_fields) {
+	const vector<string> block = paired_block_cols(n_ztz_fields);
+	const vector<string> cols = paired_cols(n_ztz_fields);
+	const size_t m = block.size();
+	vector<vector<size_t> > expand(2);
+	for(size_t r = 0; r < 2; r++) {
+		const size_t mine = r * m, other = (1 - r) * m;
+		for(size_t c = 0; c < cols.size(); c++) {
+			vector<string>::const_iterator it = find(block.begin(), block.end(), cols[c]);
+			if(it != block.end()) {
+				expand[r].push_back(mine + (it - block.begin()));
+				continue;
+			}
+			it = find(block.begin(), block.end(), cols[c].substr(1));
+			if(cols[c][0] == 'o' && it != block.end()) {
+				expand[r].push_back(other + (it - block.begin()));
+				continue;
+			}
+			assert(cols[c] == "fraglen");
+			expand[r].push_back(2 * m);
+		}
+	}
+	return expand;
+}
+
+/**
+ * Start gathering statistics for an unpaired or paired-end record file.
+ */
+static void rec_stats_init_unpaired(FILE *fh, int n_ztz_fields) {
+	const vector<string> cols = unpaired_cols(n_ztz_fields);
+	vector<vector<size_t> > expand(1);
+	for(size_t i = 0; i < cols.size(); i++) {
+		expand[0].push_back(i);
+	}
+	rec_stats_init(fh, cols, cols.size(), expand);
+}
+
+static void rec_stats_init_paired(FILE *fh, int n_ztz_fields) {
+	rec_stats_init(
+		fh,
+		paired_cols(n_ztz_fields),
+		2 * paired_block_cols(n_ztz_fields).size() + 1,
+		paired_expansion(n_ztz_fields));
+}
+
+/**
+ * Print a comma-separated line of column names followed by the row count.
+ */
+static void print_cols(FILE *fh, const vector<string>& cols, unsigned long long nrow) {
+	for(size_t i = 0; i < cols.size(); i++) {
+		fprintf(fh, "%s,", cols[i].c_str());
+	}
+	fprintf(fh, "%llu\n", nrow);
+}
+
+/**
+ * Print column headers for an unpaired file of feature records.
+ */
+static void print_unpaired_header(FILE *fh, int n_ztz_fields, unsigned long long nrow) {
+	print_cols(fh, unpaired_cols(n_ztz_fields), nrow);
+}
+
+/**
+ * Print column headers for a paired-end file of feature records.  The first
+ * line describes the rows readers see, one per mate (so nrow is twice the
+ * number of pairs).  The second line says the file actually holds one
+ * compact record per pair, as written by print_paired_helper:
+ *
+ *   id,len,clip,alqual,clipqual,ztz_*,[rl_*],mapq,correct   (mate 1)
+ *   id,len,clip,alqual,clipqual,ztz_*,[rl_*],mapq,correct   (mate 2)
+ *   fraglen
+ */
+static void print_paired_header(FILE *fh, int n_ztz_fields, unsigned long long nrow) {
+	print_cols(fh, paired_cols(n_ztz_fields), nrow);
+	fprintf(fh, "layout,pair\n");
+}
+
+/**
+ * Write the statistics gathered for a record file next to its .meta file.
+ */
+static int write_rec_stats(FILE *fh, const string& meta_fn) {
+	ColumnStats *st = rec_stats_for(fh);
+	if(st == NULL) {
+		return 0;
+	}
+	string fn = meta_fn.substr(0, meta_fn.size() - 5) + ".stats";
+	return st->write(fn);
+}
+
+/*
+ * Checkpoints (see checkpoint.h).  When checkpoint-interval is > 0, the
+ * run's state is saved to [record prefix].ckpt about that often, and a run
+ * restarted with the same arguments resumes from it.  Each checkpoint holds
+ * the state common to the whole run, saved by ckpt_save_common, followed by
+ * the state of the SAM parse (sam_pass1) or simulation (simulate_batch),
+ * whichever was underway.
+ */
+enum {
+	CKPT_PARSE = 0,
+	CKPT_SIMULATE
+};
+Checkpointer ckpt;
+int ckpt_phase = CKPT_PARSE;
+size_t ckpt_sam = 0;                      // index of SAM file being parsed
+vector<pair<string, FILE*> > ckpt_files;  // output files
+vector<pair<string, uint64_t> > ckpt_closed; // finished ones, final lengths
+map<string, uint64_t> ckpt_lengths;       // their lengths at the checkpoint
+
+/** SAM lines between checks of whether a checkpoint is due */
+const static size_t CKPT_CHECK_LINES = 1024;
+
+/**
+ * Note an output file whose length is checkpointed.  If it's added after a
+ * checkpoint has been restored, cut it back to its length at the
+ * checkpoint; it must have been opened for appending.
+ */
+static int ckpt_add_file(const string& fn, FILE *fh) {
+	if(fh == NULL) {
+		return 0;
+	}
+	ckpt_files.push_back(make_pair(fn, fh));
+	map<string, uint64_t>::const_iterator it = ckpt_lengths.find(fn);
+	if(it != ckpt_lengths.end()) {
+		return checkpoint_truncate_file(fh, fn, it->second);
+	}
+	return 0;
+}
+
+/**
+ * Note that the output files added so far are finished and about to be
+ * closed.  Later checkpoints keep their final lengths.
+ */
+static void ckpt_close_files() {
+	for(size_t i = 0; i < ckpt_files.size(); i++) {
+		ckpt_closed.push_back(make_pair(ckpt_files[i].first,
+		                                checkpoint_file_length(ckpt_files[i].second)));
+	}
+	ckpt_files.clear();
+}
+
+static const string& ckpt_file_name(FILE *fh) {
+	for(size_t i = 0; i < ckpt_files.size(); i++) {
+		if(ckpt_files[i].second == fh) {
+			return ckpt_files[i].first;
+		}
+	}
+	cerr << "Error: statistics for an output file that isn't checkpointed" << endl;
+	throw 1;
+}
+
+static FILE *ckpt_file_handle(const string& fn) {
+	for(size_t i = 0; i < ckpt_files.size(); i++) {
+		if(ckpt_files[i].first == fn) {
+			return ckpt_files[i].second;
+		}
+	}
+	cerr << "Error: checkpoint has statistics for unknown output file \""
+	     << fn << "\"" << endl;
+	throw 1;
+}
+
+static void save_templates(
+	CheckpointWriter& w,
+	const ReservoirSampledEList<TemplateUnpaired>& ts)
+{
+	w.put_u64(ts.size());
+	w.put_u64(ts.list().size());
+	for(size_t i = 0; i < ts.list().size(); i++) {
+		const TemplateUnpaired& t = ts.list()[i];
+		w.put_i64(t.best_score_);
+		w.put_i64(t.len_);
+		w.put_i64(t.fw_flag_);
+		w.put_i64(t.mate_flag_);
+		w.put_i64(t.opp_len_);
+		w.put_cstr(t.qual_);
+		w.put_cstr(t.edit_xscript_);
+	}
+}
+
+static void save_templates(
+	CheckpointWriter& w,
+	const ReservoirSampledEList<TemplatePaired>& ts)
+{
+	w.put_u64(ts.size());
+	w.put_u64(ts.list().size());
+	for(size_t i = 0; i < ts.list().size(); i++) {
+		const TemplatePaired& t = ts.list()[i];
+		w.put_i64(t.score_12_);
+		w.put_i64(t.score_1_);
+		w.put_i64(t.len_1_);
+		w.put_i64(t.fw_flag_1_);
+		w.put_cstr(t.qual_1_);
+		w.put_cstr(t.edit_xscript_1_);
+		w.put_i64(t.score_2_);
+		w.put_i64(t.len_2_);
+		w.put_i64(t.fw_flag_2_);
+		w.put_cstr(t.qual_2_);
+		w.put_cstr(t.edit_xscript_2_);
+		w.put_bool(t.upstream1_);
+		w.put_u64(t.fraglen_);
+	}
+}
+
+static void restore_template(CheckpointReader& r, TemplateUnpaired& t) {
+	string qual, xscript;
+	int best_score = (int)r.get_i64();
+	int len = (int)r.get_i64();
+	char fw_flag = (char)r.get_i64();
+	char mate_flag = (char)r.get_i64();
+	int opp_len = (int)r.get_i64();
+	bool has_qual = r.get_cstr(qual);
+	bool has_xscript = r.get_cstr(xscript);
+	t.init(
+		best_score, len, fw_flag, mate_flag, opp_len,
+		has_qual ? qual.c_str() : NULL,
+		has_xscript ? xscript.c_str() : NULL);
+}
+
+static void restore_template(CheckpointReader& r, TemplatePaired& t) {
+	string qual_1, xscript_1, qual_2, xscript_2;
+	int score_12 = (int)r.get_i64();
+	int score_1 = (int)r.get_i64();
+	int len_1 = (int)r.get_i64();
+	char fw_flag_1 = (char)r.get_i64();
+	bool has_qual_1 = r.get_cstr(qual_1);
+	bool has_xscript_1 = r.get_cstr(xscript_1);
+	int score_2 = (int)r.get_i64();
+	int len_2 = (int)r.get_i64();
+	char fw_flag_2 = (char)r.get_i64();
+	bool has_qual_2 = r.get_cstr(qual_2);
+	bool has_xscript_2 = r.get_cstr(xscript_2);
+	bool upstream1 = r.get_bool();
+	size_t fraglen = (size_t)r.get_u64();
+	t.init(
+		score_12,
+		score_1, len_1, fw_flag_1,
+		has_qual_1 ? qual_1.c_str() : NULL,
+		has_xscript_1 ? xscript_1.c_str() : NULL,
+		score_2, len_2, fw_flag_2,
+		has_qual_2 ? qual_2.c_str() : NULL,
+		has_xscript_2 ? xscript_2.c_str() : NULL,
+		upstream1, fraglen);
+}
+
+/**
+ * Refill an empty reservoir with what save_templates saved.
+ */
+template<typename T>
+static void restore_templates(CheckpointReader& r, ReservoirSampledEList<T>& ts) {
+	const size_t n = (size_t)r.get_u64();
+	const size_t nlist = (size_t)r.get_u64();
+	// The bound on nlist also keeps its byte size from overflowing below
+	if(nlist > ts.k() || nlist > n || !ts.empty() ||
+	   nlist > (size_t)std::numeric_limits<int>::max())
+	{
+		cerr << "Error: checkpoint holds more templates than the reservoir" << endl;
+		throw 1;
+	}
+	// Size the list once, now that nlist is known to be sane, and fill its
+	// slots in the order they were saved, so that sampling picks up where
+	// it left off whether or not the reservoir had filled.  The list is
+	// empty, so reserving allocates exactly nlist items and nothing is
+	// copied.
+	EList<T>& list = ts.list();
+	if(nlist > 0) {
+		list.reserveExact(nlist);
+		list.resize(nlist);
+	}
+	for(size_t i = 0; i < nlist; i++) {
+		restore_template(r, list[i]);
+	}
+	ts.set_size(n);
+}
+
+/**
+ * Save the state common to all checkpoints: which phase we're in, the
+ * output files' lengths (after making sure what's been written is on
+ * disk), the reference ids, the per-column statistics and the templates.
+ */
+static void ckpt_save_common(
+	CheckpointWriter& w,
+	const ReservoirSampledEList<TemplateUnpaired>& u_templates,
+	const ReservoirSampledEList<TemplateUnpaired>& b_templates,
+	const ReservoirSampledEList<TemplatePaired>& c_templates,
+	const ReservoirSampledEList<TemplatePaired>& d_templates)
+{
+	w.put_u64(ckpt_phase);
+	w.put_u64(ckpt_closed.size() + ckpt_files.size());
+	for(size_t i = 0; i < ckpt_closed.size(); i++) {
+		w.put_str(ckpt_closed[i].first);
+		w.put_u64(ckpt_closed[i].second);
+	}
+	for(size_t i = 0; i < ckpt_files.size(); i++) {
+		if(checkpoint_sync_file(ckpt_files[i].second) != 0) {
+			cerr << "Error writing output file \"" << ckpt_files[i].first
+			     << "\"" << endl;
+			throw 1;
+		}
+		w.put_str(ckpt_files[i].first);
+		w.put_u64(checkpoint_file_length(ckpt_files[i].second));
+	}
+	w.put_u64(refs.size());
+	for(size_t i = 0; i < refs.size(); i++) {
+		w.put_str(refs.name((int)i));
+	}
+	// Statistics are only needed until the feature files are finished
+	const size_t nstats = ckpt_phase == CKPT_PARSE ? rec_stats.size() : 0;
+	w.put_u64(nstats);
+	for(size_t i = 0; i < nstats; i++) {
+		w.put_str(ckpt_file_name(rec_stats[i].first));
+		rec_stats[i].second.save(w);
+	}
+	save_templates(w, u_templates);
+	save_templates(w, b_templates);
+	save_templates(w, c_templates);
+	save_templates(w, d_templates);
+}
+
+/**
+ * Restore what ckpt_save_common saved and cut the output files added so far
+ * back to their lengths at the checkpoint.  Return 0 on success.
+ */
+static int ckpt_restore_common(
+	CheckpointReader& r,
+	ReservoirSampledEList<TemplateUnpaired>& u_templates,
+	ReservoirSampledEList<TemplateUnpaired>& b_templates,
+	ReservoirSampledEList<TemplatePaired>& c_templates,
+	ReservoirSampledEList<TemplatePaired>& d_templates)
+{
+	ckpt_phase = (int)r.get_u64();
+	const size_t nfiles = (size_t)r.get_u64();
+	for(size_t i = 0; i < nfiles; i++) {
+		string fn = r.get_str();
+		ckpt_lengths[fn] = r.get_u64();
+	}
+	const size_t nrefs = (size_t)r.get_u64();
+	for(size_t i = 0; i < nrefs; i++) {
+		refs.add(r.get_str());
+	}
+	const size_t nstats = (size_t)r.get_u64();
+	for(size_t i = 0; i < nstats; i++) {
+		FILE *fh = ckpt_file_handle(r.get_str());
+		rec_stats.push_back(make_pair(fh, ColumnStats()));
+		rec_stats.back().second.restore(r);
+	}
+	restore_templates(r, u_templates);
+	restore_templates(r, b_templates);
+	restore_templates(r, c_templates);
+	restore_templates(r, d_templates);
+	for(size_t i = 0; i < ckpt_files.size(); i++) {
+		const string& fn = ckpt_files[i].first;
+		if(ckpt_lengths.count(fn) == 0) {
+			cerr << "Error: output file \"" << fn << "\" is missing from "
+			     << "the checkpoint" << endl;
+			return -1;
+		}
+		if(checkpoint_truncate_file(ckpt_files[i].second, fn, ckpt_lengths[fn]) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** First field of an input model file, and its format version */
+static const char *INPUT_MODEL_TAG = "qtip input model 1";
+
+/**
+ * Save the input model -- the reference ids and the template reservoirs --
+ * in the checkpoint file format, so that a later top-up run can simulate
+ * more tandem reads from it (see input-model) without parsing the input
+ * SAM again.  Return 0 on success.
+ */
+static int write_input_model(
+	const string& fn,
+	const ReservoirSampledEList<TemplateUnpaired>& u_templates,
+	const ReservoirSampledEList<TemplateUnpaired>& b_templates,
+	const ReservoirSampledEList<TemplatePaired>& c_templates,
+	const ReservoirSampledEList<TemplatePaired>& d_templates)
+{
+	CheckpointWriter w;
+	w.put_str(INPUT_MODEL_TAG);
+	w.put_u64(refs.size());
+	for(size_t i = 0; i < refs.size(); i++) {
+		w.put_str(refs.name((int)i));
+	}
+	save_templates(w, u_templates);
+	save_templates(w, b_templates);
+	save_templates(w, c_templates);
+	save_templates(w, d_templates);
+	if(w.commit(fn) != 0) {
+		cerr << "Could not write input model file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Load what write_input_model saved into the empty reservoirs.  Its
+ * reference ids must agree with any already assigned (e.g. by ref-ids).
+ * Return 0 on success.
+ */
+static int read_input_model(
+	const string& fn,
+	ReservoirSampledEList<TemplateUnpaired>& u_templates,
+	ReservoirSampledEList<TemplateUnpaired>& b_templates,
+	ReservoirSampledEList<TemplatePaired>& c_templates,
+	ReservoirSampledEList<TemplatePaired>& d_templates)
+{
+	CheckpointReader r;
+	if(r.load(fn) != 0 || r.get_str() != INPUT_MODEL_TAG) {
+		cerr << "Could not read input model file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	const size_t nrefs = (size_t)r.get_u64();
+	for(size_t i = 0; i < nrefs; i++) {
+		string name = r.get_str();
+		if(refs.add(name) != (int)i) {
+			cerr << "Reference \"" << name << "\" has a different id in input "
+			     << "model file \"" << fn << "\"" << endl;
+			return -1;
+		}
+	}
+	restore_templates(r, u_templates);
+	restore_templates(r, b_templates);
+	restore_templates(r, c_templates);
+	restore_templates(r, d_templates);
+	if(!r.done()) {
+		cerr << "Input model file \"" << fn << "\" has trailing data" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * What sam_pass1 has counted so far.  The counts carry over from one SAM
+ * file to the next, so that records from all the SAM files given (e.g. the
+ * tandem SAMs of several shards) go into one set of record files, with ids
+ * (line numbers counted across all the files) that don't collide and a
+ * single metadata header each, written by sam_pass1_finish.
+ */
+struct SamPass1Counts {
+
+	SamPass1Counts() {
+		memset(this, 0, sizeof(*this));
+	}
+
+	bool c_head, d_head, u_head, b_head;
+	int c_nztz, d_nztz, u_nztz, b_nztz;
+	int nline, nhead, nsq, nsec, nsupp, npair, nunp;
+	int nunp_al, nunp_unal, npair_badend, npair_conc, npair_disc,
+	    npair_unal, ntyp_mismatch;
+};
+
+/**
+ * Read the input SAM file while simultaneously writing out records used to
+ * train a MAPQ model as well as records used to build an input model.
+ * Counts accumulate in cnt; call sam_pass1_finish after the last file.
+ *
+ * When checkpointing, the parse can be checkpointed between records, and
+ * if resuming, in must already be positioned where the checkpoint was
+ * taken.
+ */
+static int sam_pass1(
+	SamInput& in,
+	SamPass1Counts& cnt,
+	const string& orec_u_fn, FILE *orec_u_fh,
+	const string& omod_u_fn, FILE *omod_u_fh,
+	const string& orec_b_fn, FILE *orec_b_fh,
+	const string& omod_b_fn, FILE *omod_b_fh,
+	const string& orec_c_fn, FILE *orec_c_fh,
+	const string& omod_c_fn, FILE *omod_c_fh,
+	const string& orec_d_fn, FILE *orec_d_fh,
+	const string& omod_d_fn, FILE *omod_d_fh,
+	ReservoirSampledEList<TemplateUnpaired> *u_templates,
+	ReservoirSampledEList<TemplateUnpaired> *b_templates,
+	ReservoirSampledEList<TemplatePaired> *c_templates,
+	ReservoirSampledEList<TemplatePaired> *d_templates)
+{
+	/* Advise the kernel of our access pattern.  */
+	/* posix_fadvise(fd, 0, 0, 1); */ /* FDADVICE_SEQUENTIAL */
+
+	bool &c_head = cnt.c_head, &d_head = cnt.d_head,
+	     &u_head = cnt.u_head, &b_head = cnt.b_head;
+	int &c_nztz = cnt.c_nztz, &d_nztz = cnt.d_nztz,
+	    &u_nztz = cnt.u_nztz, &b_nztz = cnt.b_nztz;
 
 	char linebuf1[BUFSZ], linebuf2[BUFSZ];
 	int line1 = 1;
@@ -1295,19 +1897,80 @@ static int sam_pass1(
 	
 	int al_cur1 = 1;
 	
-	int nline = 0, nhead = 0, nsec = 0, nsupp = 0, npair = 0, nunp = 0;
-	int nunp_al = 0, nunp_unal = 0, npair_badend = 0, npair_conc = 0,
-	    npair_disc = 0, npair_unal = 0, ntyp_mismatch = 0;
-	
+	int &nline = cnt.nline, &nhead = cnt.nhead, &nsq = cnt.nsq,
+	    &nsec = cnt.nsec, &nsupp = cnt.nsupp, &npair = cnt.npair,
+	    &nunp = cnt.nunp;
+	int &nunp_al = cnt.nunp_al, &nunp_unal = cnt.nunp_unal,
+	    &npair_badend = cnt.npair_badend, &npair_conc = cnt.npair_conc,
+	    &npair_disc = cnt.npair_disc, &npair_unal = cnt.npair_unal,
+	    &ntyp_mismatch = cnt.ntyp_mismatch;
+
+	// Everything a checkpoint needs from here
+	int *ckpt_counts[] = {
+		&nline, &nhead, &nsq, &nsec, &nsupp, &npair, &nunp,
+		&nunp_al, &nunp_unal, &npair_badend, &npair_conc,
+		&npair_disc, &npair_unal, &ntyp_mismatch,
+		&c_nztz, &d_nztz, &u_nztz, &b_nztz};
+	bool *ckpt_heads[] = {&c_head, &d_head, &u_head, &b_head};
+	const size_t ckpt_ncounts = sizeof(ckpt_counts) / sizeof(int*);
+	const size_t ckpt_nheads = sizeof(ckpt_heads) / sizeof(bool*);
+	if(ckpt.resuming()) {
+		CheckpointReader& r = ckpt.reader();
+		for(size_t i = 0; i < ckpt_ncounts; i++) {
+			*ckpt_counts[i] = (int)r.get_i64();
+		}
+		for(size_t i = 0; i < ckpt_nheads; i++) {
+			*ckpt_heads[i] = r.get_bool();
+		}
+		checkpoint_restore_rng(r);
+		ckpt.resumed();
+		cerr << "  Resumed from checkpoint at line " << nline << endl;
+	}
+	const int nline_start = nline, nhead_start = nhead, nsq_start = nsq;
+	int nsq_unknown = 0;
+	size_t ckpt_lines = 0;
+
 	while(1) {
+		// Checkpoint only when no mate is waiting for its opposite
+		if(ckpt.enabled() && ++ckpt_lines >= CKPT_CHECK_LINES &&
+		   !al1.valid && !al2.valid)
+		{
+			ckpt_lines = 0;
+			if(ckpt.due()) {
+				if(flush_features() != 0) {
+					return -1;
+				}
+				if(ckpt.save([&](CheckpointWriter& w) {
+					w.put_u64(ckpt_sam);
+					w.put_u64(in.tell());
+					for(size_t i = 0; i < ckpt_ncounts; i++) {
+						w.put_i64(*ckpt_counts[i]);
+					}
+					for(size_t i = 0; i < ckpt_nheads; i++) {
+						w.put_bool(*ckpt_heads[i]);
+					}
+					checkpoint_save_rng(w);
+				}) != 0)
+				{
+					return -1;
+				}
+			}
+		}
 		char *line = line1 ? linebuf1 : linebuf2;
-		if(fgets(line, BUFSZ, fh) == NULL) {
+		if(in.gets(line, BUFSZ) == NULL) {
 			break; /* done */
 		}
 		nline++;
+		QTIP_PROBE1(record, nline);
 		if(line[0] == '@') {
 			nhead++;
-			continue; // skip header
+			if(strncmp(line, "@SQ\t", 4) == 0) {
+				if(refs.add_sq(line) >= (int)ref_ids_n && ref_ids_n > 0) {
+					nsq_unknown++;
+				}
+				nsq++;
+			}
+			continue; // skip rest of header
 		}
 		char *qname = strtok(line, "\t"); assert(qname != NULL);
 		assert(qname == line);
@@ -1389,6 +2052,7 @@ static int sam_pass1(
 				if(nunp_al == 0 && orec_u_fh != NULL) {
                     u_head = true;
                     u_nztz = infer_num_ztzs(al_cur.rest_of_line);
+                    rec_stats_init_unpaired(orec_u_fh, u_nztz);
 				}
 
 				nunp_al++;
@@ -1423,6 +2087,7 @@ static int sam_pass1(
 					if(npair_badend == 0 && orec_b_fh != NULL) {
                         b_head = true;
                         b_nztz = infer_num_ztzs(alm.rest_of_line);
+                        rec_stats_init_unpaired(orec_b_fh, b_nztz);
 					}
 
 					npair_badend++;
@@ -1450,6 +2115,7 @@ static int sam_pass1(
 						if(npair_conc == 0 && orec_c_fh != NULL) {
                             c_head = true;
                             c_nztz = infer_num_ztzs(mate1->rest_of_line);
+                            rec_stats_init_paired(orec_c_fh, c_nztz);
 						}
 
 						// Case 6: Current read is paired and both mates
@@ -1472,6 +2138,7 @@ static int sam_pass1(
 						if(npair_disc == 0 && orec_d_fh != NULL) {
                             d_head = true;
                             d_nztz = infer_num_ztzs(mate1->rest_of_line);
+                            rec_stats_init_paired(orec_d_fh, d_nztz);
 						}
 
 						// Case 7: Current read is paired and both mates aligned, not condordantly
@@ -1495,48 +2162,192 @@ static int sam_pass1(
 		}
 	}
 
-    // Write metadata
-    if(u_head) {
-		print_unpaired_header(orec_u_meta_fh, u_nztz, nunp_al);
-    }
-    if(b_head) {
-		print_unpaired_header(orec_b_meta_fh, b_nztz, npair_badend);
-    }
-    if(c_head) {
-		print_paired_header(orec_c_meta_fh, c_nztz, npair_conc * 2);
-    }
-    if(d_head) {
-		print_paired_header(orec_d_meta_fh, d_nztz, npair_disc * 2);
-    }
+	// Write any records still staged
+	if(flush_features() != 0) {
+		return -1;
+	}
+	for(size_t i = 0; i < feature_blocks.size(); i++) {
+		delete feature_blocks[i];
+	}
+	feature_blocks.clear();
+
+	if(nsq == nsq_start && nline - nline_start > nhead - nhead_start) {
+		cerr << "Warning: no @SQ header lines; alignments of reads simulated "
+		     << "by qtip won't be recognized as correct" << endl;
+	}
+	if(nsq_unknown > 0) {
+		// e.g. an aligner index built from differently named sequences
+		cerr << "Warning: " << nsq_unknown << " @SQ lines name references "
+		     << "that weren't simulated from; alignments to them won't be "
+		     << "recognized as correct" << endl;
+	}
+	return 0;
+}
+
+/**
+ * After sam_pass1 has read the last SAM file, write the record files'
+ * metadata and statistics and summarize what was parsed.
+ */
+static int sam_pass1_finish(
+	const SamPass1Counts& cnt,
+	FILE *orec_u_fh, const string& orec_u_meta_fn, FILE *orec_u_meta_fh,
+	FILE *orec_b_fh, const string& orec_b_meta_fn, FILE *orec_b_meta_fh,
+	FILE *orec_c_fh, const string& orec_c_meta_fn, FILE *orec_c_meta_fh,
+	FILE *orec_d_fh, const string& orec_d_meta_fn, FILE *orec_d_meta_fh,
+	bool quiet)
+{
+	// Write metadata
+	if(cnt.u_head) {
+		print_unpaired_header(orec_u_meta_fh, cnt.u_nztz, cnt.nunp_al);
+	}
+	if(cnt.b_head) {
+		print_unpaired_header(orec_b_meta_fh, cnt.b_nztz, cnt.npair_badend);
+	}
+	if(cnt.c_head) {
+		print_paired_header(orec_c_meta_fh, cnt.c_nztz, cnt.npair_conc * 2);
+	}
+	if(cnt.d_head) {
+		print_paired_header(orec_d_meta_fh, cnt.d_nztz, cnt.npair_disc * 2);
+	}
+	if(write_rec_stats(orec_u_fh, orec_u_meta_fn) != 0 ||
+	   write_rec_stats(orec_b_fh, orec_b_meta_fn) != 0 ||
+	   write_rec_stats(orec_c_fh, orec_c_meta_fn) != 0 ||
+	   write_rec_stats(orec_d_fh, orec_d_meta_fn) != 0)
+	{
+		return -1;
+	}
 
 	if(!quiet) {
-		cerr << "  " << nline << " lines" << endl;
-		cerr << "  " << nhead << " header lines" << endl;
-		cerr << "  " << nsec << " secondary alignments ignored" << endl;
-		cerr << "  " << nsupp << " supplementary alignments ignored" << endl;
-		cerr << "  " << ntyp_mismatch << " alignment type didn't match simulated type" << endl;
-		cerr << "  " << nunp << " unpaired" << endl;
-		if(nunp > 0) {
-			cerr << "    " << nunp_al << " aligned" << endl;
-			cerr << "    " << nunp_unal << " unaligned" << endl;
-		}
-		cerr << "  " << npair << " paired-end" << endl;
-		if(npair > 0) {
-			cerr << "    " << npair_conc << " concordant" << endl;
-			cerr << "    " << npair_disc << " discordant" << endl;
-			cerr << "    " << npair_badend << " bad-end" << endl;
-			cerr << "    " << npair_unal << " unaligned" << endl;
+		cerr << "  " << cnt.nline << " lines" << endl;
+		cerr << "  " << cnt.nhead << " header lines" << endl;
+		cerr << "    " << cnt.nsq << " @SQ lines (" << refs.size() << " references)" << endl;
+		cerr << "  " << cnt.nsec << " secondary alignments ignored" << endl;
+		cerr << "  " << cnt.nsupp << " supplementary alignments ignored" << endl;
+		cerr << "  " << cnt.ntyp_mismatch << " alignment type didn't match simulated type" << endl;
+		cerr << "  " << cnt.nunp << " unpaired" << endl;
+		if(cnt.nunp > 0) {
+			cerr << "    " << cnt.nunp_al << " aligned" << endl;
+			cerr << "    " << cnt.nunp_unal << " unaligned" << endl;
+		}
+		cerr << "  " << cnt.npair << " paired-end" << endl;
+		if(cnt.npair > 0) {
+			cerr << "    " << cnt.npair_conc << " concordant" << endl;
+			cerr << "    " << cnt.npair_disc << " discordant" << endl;
+			cerr << "    " << cnt.npair_badend << " bad-end" << endl;
+			cerr << "    " << cnt.npair_unal << " unaligned" << endl;
 		}
 	}
 	
 	return 0;
 }
 
-#define FILEDEC(fn, fh, buf, typ, do_open) \
+/**
+ * Tandem read files for each shard: unpaired, then mates 1 and 2 of
+ * bad-end, concordant and discordant pairs.
+ */
+static const int SIM_NREAD_FILES = 7;
+static const char *SIM_READ_SUFFIXES[SIM_NREAD_FILES] = {
+	"_reads_u.fastq",
+	"_reads_b_1.fastq", "_reads_b_2.fastq",
+	"_reads_c_1.fastq", "_reads_c_2.fastq",
+	"_reads_d_1.fastq", "_reads_d_2.fastq"
+};
+
+/**
+ * Return the prefix of shard k's tandem read files.  Without sharding it's
+ * just the model prefix.
+ */
+static string sim_read_prefix(const string& mod_prefix, int k) {
+	if(sim_shards == 1) {
+		return mod_prefix;
+	}
+	ostringstream os;
+	os << mod_prefix << "_shard" << k;
+	return os.str();
+}
+
+/**
+ * Record the shard layout in [model prefix]_shards.tsv: one line per shard
+ * with its index and file prefix, so whatever aligns the shards (in
+ * separate processes, or on other machines) can find them.
+ */
+static int write_sim_shards(const string& mod_prefix) {
+	string fn = mod_prefix + "_shards.tsv";
+	FILE *fh = fopen(fn.c_str(), "wb");
+	if(fh == NULL) {
+		cerr << "Could not open output shard layout file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	fprintf(fh, "# reads dealt round-robin within each category\n");
+	for(int k = 0; k < sim_shards; k++) {
+		fprintf(fh, "%d\t%s\n", k, sim_read_prefix(mod_prefix, k).c_str());
+	}
+	fclose(fh);
+	return 0;
+}
+
+/**
+ * Record the reference ids used in the simulated reads' names in
+ * [model prefix]_refs.tsv: one line per reference with its id and name.
+ * Parsing the tandem alignments with ref-ids pointed at this file resolves
+ * their RNAMEs to the same ids, whatever order the aligner's @SQ lines are
+ * in.
+ */
+static int write_ref_ids(const string& mod_prefix) {
+	string fn = mod_prefix + "_refs.tsv";
+	FILE *fh = fopen(fn.c_str(), "wb");
+	if(fh == NULL) {
+		cerr << "Could not open output reference id file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	fprintf(fh, "# ids of references in simulated read names\n");
+	for(size_t i = 0; i < refs.size(); i++) {
+		fprintf(fh, "%d\t%s\n", (int)i, refs.name((int)i).c_str());
+	}
+	fclose(fh);
+	return 0;
+}
+
+/**
+ * Number references as write_ref_ids recorded, before any @SQ lines are
+ * read.  References the file doesn't mention get the next free ids.
+ */
+static int read_ref_ids(const string& fn) {
+	FILE *fh = fopen(fn.c_str(), "rb");
+	if(fh == NULL) {
+		cerr << "Could not open reference id file \"" << fn << "\"" << endl;
+		return -1;
+	}
+	char line[BUFSZ];
+	while(fgets(line, BUFSZ, fh) != NULL) {
+		if(line[0] == '#') {
+			continue;
+		}
+		char *name = strchr(line, '\t');
+		if(name == NULL) {
+			cerr << "Malformed line in reference id file \"" << fn << "\": "
+			     << line << endl;
+			fclose(fh);
+			return -1;
+		}
+		*name++ = '\0';
+		name[strcspn(name, "\r\n")] = '\0';
+		if(refs.add(string(name)) != atoi(line)) {
+			cerr << "Reference \"" << name << "\" is out of order or repeated "
+			     << "in reference id file \"" << fn << "\"" << endl;
+			fclose(fh);
+			return -1;
+		}
+	}
+	fclose(fh);
+	return 0;
+}
+
+#define FILEDEC_MODE(fn, fh, buf, typ, do_open, mode) \
 	char buf [BUFSZ]; \
 	FILE * fh = NULL; \
 	if(do_open) { \
-		fh = fopen( fn .c_str(), "wb"); \
+		fh = fopen( fn .c_str(), mode); \
 		if(fh == NULL) { \
 			cerr << "Could not open output " << typ << " file \"" << fn << "\"" << endl; \
 			return -1; \
@@ -1544,6 +2355,9 @@ static int sam_pass1(
 		setvbuf(fh, buf, _IOFBF, BUFSZ); \
 	}
 
+#define FILEDEC(fn, fh, buf, typ, do_open) \
+	FILEDEC_MODE(fn, fh, buf, typ, do_open, "wb")
+
 /**
  * Caller gives path to one or more SAM files, then the final argument is a prefix where all the
  */
@@ -1563,14 +2377,25 @@ int main(int argc, char **argv) {
 		     << "sim-disc-min "
 		     << "sim-bad-end-min "
 		     << "seed "
+		     << "sim-categories "
+		     << "sim-append "
+		     << "sim-continuation "
+		     << "sim-shards "
+		     << "realign-window "
+		     << "io-threads "
+		     << "perf-counters "
+		     << "checkpoint-interval "
+		     << "aux-features "
 		     << endl;
 		return 0;
 	}
+	Timeline::init("qtip-parse");
+	TimelineScope lifetime("qtip-parse", "process");
 	
-	string orec_u_fn, omod_u_fn, oread_u_fn;
-	string orec_b_fn, omod_b_fn, oread1_b_fn, oread2_b_fn;
-	string orec_c_fn, omod_c_fn, oread1_c_fn, oread2_c_fn;
-	string orec_d_fn, omod_d_fn, oread1_d_fn, oread2_d_fn;
+	string orec_u_fn, omod_u_fn;
+	string orec_b_fn, omod_b_fn;
+	string orec_c_fn, omod_c_fn;
+	string orec_d_fn, omod_d_fn;
     string orec_u_meta_fn;
     string orec_b_meta_fn;
     string orec_c_meta_fn;
@@ -1666,6 +2491,51 @@ int main(int argc, char **argv) {
 				else if(strcmp(argv[i], "sim-bad-end-min") == 0) {
 					sim_bad_end_min = atoi(argv[++i]);
 				}
+				else if(strcmp(argv[i], "sim-categories") == 0) {
+					sim_categories = argv[++i];
+					if(sim_categories.empty() ||
+					   sim_categories.find_first_not_of("ubcd") != string::npos)
+					{
+						cerr << "Error: sim-categories must be made of u, b, c "
+						     << "and d; got \"" << sim_categories << "\"" << endl;
+						return -1;
+					}
+				}
+				else if(strcmp(argv[i], "sim-append") == 0) {
+					sim_append = strcmp(argv[++i], "True") == 0;
+				}
+				else if(strcmp(argv[i], "sim-continuation") == 0) {
+					sim_continuation = atoi(argv[++i]);
+				}
+				else if(strcmp(argv[i], "sim-shards") == 0) {
+					sim_shards = atoi(argv[++i]);
+					if(sim_shards < 1) {
+						cerr << "Error: sim-shards must be at least 1; got "
+						     << sim_shards << endl;
+						return -1;
+					}
+				}
+				else if(strcmp(argv[i], "io-threads") == 0) {
+					io_threads = atoi(argv[++i]);
+				}
+				else if(strcmp(argv[i], "perf-counters") == 0) {
+					perf_counters = strcmp(argv[++i], "True") == 0;
+				}
+				else if(strcmp(argv[i], "ref-ids") == 0) {
+					ref_ids_fn = argv[++i];
+				}
+				else if(strcmp(argv[i], "input-model") == 0) {
+					input_model_fn = argv[++i];
+				}
+				else if(strcmp(argv[i], "aux-features") == 0) {
+					aux_features = strcmp(argv[++i], "True") == 0;
+				}
+				else if(strcmp(argv[i], "realign-window") == 0) {
+					realign_window = atoi(argv[++i]);
+				}
+				else if(strcmp(argv[i], "checkpoint-interval") == 0) {
+					checkpoint_interval = atof(argv[++i]);
+				}
 				else if(strcmp(argv[i], "seed") == 0) {
 					// Unsure whether this is a good way to do this
 					i++;
@@ -1701,14 +2571,8 @@ int main(int argc, char **argv) {
 				omod_c_fn = mod_prefix + string("_mod_c.csv");
 				omod_d_fn = mod_prefix + string("_mod_d.csv");
 
-				// simulated (tandem) reads
-				oread_u_fn = mod_prefix + string("_reads_u.fastq");
-				oread1_b_fn = mod_prefix + string("_reads_b_1.fastq");
-				oread1_c_fn = mod_prefix + string("_reads_c_1.fastq");
-				oread1_d_fn = mod_prefix + string("_reads_d_1.fastq");
-				oread2_b_fn = mod_prefix + string("_reads_b_2.fastq");
-				oread2_c_fn = mod_prefix + string("_reads_c_2.fastq");
-				oread2_d_fn = mod_prefix + string("_reads_d_2.fastq");
+				// simulated (tandem) reads go to files named with
+				// sim_read_prefix() and SIM_READ_SUFFIXES
 			}
 			if(prefix_set > 1) {
 				cerr << "Warning: More than one output prefix specified; using last one: \"" << prefix << "\"" << endl;
@@ -1717,77 +2581,208 @@ int main(int argc, char **argv) {
 				cerr << "Warning: More than one model output prefix specified; using last one: \"" << mod_prefix << "\"" << endl;
 			}
 		}
-		if(sams.empty() || !prefix_set) {
+		if((sams.empty() && input_model_fn.empty()) || !prefix_set) {
 			cerr << "Usage: qtip_parse_input [modes]* -- [argument value]* -- [sam]* -- [fasta]* -- [record prefix] -- [read/model prefix]" << endl;
 			cerr << "[record prefix] is prefix for record files" << endl;
 			cerr << "[read/model prefix] is prefix for simulated read and model files" << endl;
 			cerr << "Modes:" << endl;
 			cerr << "  f: write feature records for learning/prediction" << endl;
-			cerr << "  i: write input-model templates (requires [read/model prefix])" << endl;
+			cerr << "  i: save input-model templates to [read/model prefix]_input_model.bin" << endl;
 			cerr << "  s: simulate reads based on input model templates (requires [read/model prefix])" << endl;
 			cerr << "Arguments:" << endl;
 			// TODO: better documentation here
 			cerr << "  wiggle <int>: if the reported alignment is within "
 			     << "this many of the true alignment, it's considered correct"
 			     << endl;
+			cerr << "  realign-window <int>: if > 0, realign each read within "
+			     << "this many reference positions of where it aligned and "
+			     << "add the results as features (requires [fasta], held "
+			     << "in memory at 2 bits per base)" << endl;
+			cerr << "  sim-categories <str>: simulate only these categories of "
+			     << "tandem reads: any of u (unpaired), b (bad-end), "
+			     << "c (concordant), d (discordant); default ubcd" << endl;
+			cerr << "  sim-append <True/False>: append to existing tandem read "
+			     << "files; files for other categories are left alone" << endl;
+			cerr << "  sim-continuation <int>: if > 0, reseed before simulating "
+			     << "so this top-up run's reads differ from the original run's "
+			     << "and from other continuations; use 1, 2, ... for "
+			     << "successive top-ups" << endl;
+			cerr << "  sim-shards <int>: if > 1, deal tandem reads round-robin "
+			     << "into this many sets of files, "
+			     << "[model prefix]_shard<k>_reads_*.fastq, listed in "
+			     << "[model prefix]_shards.tsv" << endl;
+			cerr << "  perf-counters <True/False>: report cycles, instructions, "
+			     << "cache misses and branch misses for each phase" << endl;
+			cerr << "  checkpoint-interval <float>: if > 0, save a checkpoint "
+			     << "to [record prefix].ckpt about every this many seconds; "
+			     << "rerunning with the same arguments resumes from it" << endl;
+			cerr << "  ref-ids <path>: number references as in this "
+			     << "[model prefix]_refs.tsv, written when the reads were "
+			     << "simulated, rather than by the SAM's @SQ order" << endl;
+			cerr << "  input-model <path>: simulate from this "
+			     << "[model prefix]_input_model.bin, saved by an earlier run "
+			     << "with mode i, instead of from the SAM files, which may "
+			     << "then be omitted; for top-up runs" << endl;
+			cerr << "  aux-features <True/False>: take features from standard "
+			     << "fields (AS:i, XS:i, NM:i, XA:Z, SA:Z, MD:Z) rather than "
+			     << "the ZT:Z field; for output of stock aligners" << endl;
 		}
 	}
-	keep_templates = do_simulation;
+	if(perf_counters) {
+		PerfCounters::enable();
+	}
+	keep_templates = do_simulation || do_input_model;
+	// With input-model, the templates come from there and not the SAMs
+	const bool parse_templates = keep_templates && input_model_fn.empty();
+	parse_needs = (parse_templates ? NEED_XSCRIPT : 0) |
+	              (do_features ? NEED_FEATURES : 0);
 
 	if(do_simulation && mod_prefix_set == 0) {
 		cerr << "s (simulation) argument specified, but [read/model prefix] not specified" << endl;
 		return -1;
 	}
+	if(do_input_model && mod_prefix_set == 0) {
+		cerr << "i (input model) argument specified, but [read/model prefix] not specified" << endl;
+		return -1;
+	}
+	if(do_input_model && !input_model_fn.empty()) {
+		cerr << "i (input model) argument specified along with input-model; "
+		     << "the input model is either built from the SAM files or loaded" << endl;
+		return -1;
+	}
+
+	if(!ref_ids_fn.empty()) {
+		if(read_ref_ids(ref_ids_fn) != 0) {
+			return -1;
+		}
+		ref_ids_n = refs.size();
+	}
 
-	FILEDEC(orec_u_fn, orec_u_fh, orec_u_buf, "feature", do_features);
-	FILEDEC(orec_u_meta_fn, orec_u_meta_fh, orec_u_meta_buf, "feature", do_features);
+	// The checkpoint is only used by a run with exactly the same arguments
+	string ckpt_tag;
+	for(int i = 1; i < argc; i++) {
+		ckpt_tag += argv[i];
+		ckpt_tag += '\n';
+	}
+	if(ckpt.init(prefix + ".ckpt", checkpoint_interval, ckpt_tag)) {
+		cerr << "Resuming from checkpoint \"" << prefix << ".ckpt\"" << endl;
+	}
+	// When resuming, keep what was written before the checkpoint
+	const char *out_mode = ckpt.resuming() ? "ab" : "wb";
+
+	FILEDEC_MODE(orec_u_fn, orec_u_fh, orec_u_buf, "feature", do_features, out_mode);
+	FILEDEC_MODE(orec_u_meta_fn, orec_u_meta_fh, orec_u_meta_buf, "feature", do_features, out_mode);
 	FILEDEC(omod_u_fn, omod_u_fh, omod_u_buf, "template record", false);
-	FILEDEC(orec_b_fn, orec_b_fh, orec_b_buf, "feature", do_features);
-	FILEDEC(orec_b_meta_fn, orec_b_meta_fh, orec_b_meta_buf, "feature", do_features);
+	FILEDEC_MODE(orec_b_fn, orec_b_fh, orec_b_buf, "feature", do_features, out_mode);
+	FILEDEC_MODE(orec_b_meta_fn, orec_b_meta_fh, orec_b_meta_buf, "feature", do_features, out_mode);
 	FILEDEC(omod_b_fn, omod_b_fh, omod_b_buf, "template record", false);
-	FILEDEC(orec_c_fn, orec_c_fh, orec_c_buf, "feature", do_features);
-	FILEDEC(orec_c_meta_fn, orec_c_meta_fh, orec_c_meta_buf, "feature", do_features);
+	FILEDEC_MODE(orec_c_fn, orec_c_fh, orec_c_buf, "feature", do_features, out_mode);
+	FILEDEC_MODE(orec_c_meta_fn, orec_c_meta_fh, orec_c_meta_buf, "feature", do_features, out_mode);
 	FILEDEC(omod_c_fn, omod_c_fh, omod_c_buf, "template record", false);
-	FILEDEC(orec_d_fn, orec_d_fh, orec_d_buf, "feature", do_features);
-	FILEDEC(orec_d_meta_fn, orec_d_meta_fh, orec_d_meta_buf, "feature", do_features);
+	FILEDEC_MODE(orec_d_fn, orec_d_fh, orec_d_buf, "feature", do_features, out_mode);
+	FILEDEC_MODE(orec_d_meta_fn, orec_d_meta_fh, orec_d_meta_buf, "feature", do_features, out_mode);
 	FILEDEC(omod_d_fn, omod_d_fh, omod_d_buf, "template record", false);
+	ckpt_add_file(orec_u_fn, orec_u_fh);
+	ckpt_add_file(orec_u_meta_fn, orec_u_meta_fh);
+	ckpt_add_file(orec_b_fn, orec_b_fh);
+	ckpt_add_file(orec_b_meta_fn, orec_b_meta_fh);
+	ckpt_add_file(orec_c_fn, orec_c_fh);
+	ckpt_add_file(orec_c_meta_fn, orec_c_meta_fh);
+	ckpt_add_file(orec_d_fn, orec_d_fh);
+	ckpt_add_file(orec_d_meta_fn, orec_d_meta_fh);
+
+	if(do_features && realign_window > 0) {
+		if(fastas.empty()) {
+			cerr << "realign-window specified, but no FASTA files specified" << endl;
+			return -1;
+		}
+		cerr << "Loading reference for realignment" << endl;
+		realign_refs.load(fastas);
+		cerr << "  Loaded " << realign_refs.num_refs() << " sequences, "
+		     << realign_refs.num_bases() << " bases in "
+		     << realign_refs.num_bytes() << " bytes" << endl;
+		realign_params.window = realign_window;
+		realign_batch = new RealignBatch(realign_refs, realign_params);
+	}
 
 	ReservoirSampledEList<TemplateUnpaired> u_templates(input_model_size);
 	ReservoirSampledEList<TemplateUnpaired> b_templates(input_model_size);
 	ReservoirSampledEList<TemplatePaired> c_templates(input_model_size);
 	ReservoirSampledEList<TemplatePaired> d_templates(input_model_size);
 
-	if(do_features || do_input_model || do_simulation) {
-		for(size_t i = 0; i < sams.size(); i++) {
+	size_t first_sam = 0;
+	uint64_t first_off = 0;
+	if(ckpt.resuming()) {
+		CheckpointReader& r = ckpt.reader();
+		if(ckpt_restore_common(r, u_templates, b_templates, c_templates, d_templates) != 0) {
+			return -1;
+		}
+		if(ckpt_phase == CKPT_PARSE) {
+			// sam_pass1 restores the rest
+			first_sam = (size_t)r.get_u64();
+			first_off = r.get_u64();
+		} else {
+			first_sam = sams.size(); // finished parsing
+		}
+	}
+	if(!input_model_fn.empty() && !ckpt.resuming()) {
+		// A checkpoint would already hold the loaded templates
+		cerr << "Loading input model \"" << input_model_fn << "\"" << endl;
+		if(read_input_model(input_model_fn, u_templates, b_templates, c_templates, d_templates) != 0) {
+			return -1;
+		}
+	}
+	ckpt.set_common([&](CheckpointWriter& w) {
+		ckpt_save_common(w, u_templates, b_templates, c_templates, d_templates);
+	});
+
+	if((do_features || do_input_model || do_simulation) && first_sam < sams.size()) {
+		SamPass1Counts cnt;
+		for(size_t i = first_sam; i < sams.size(); i++) {
 			cerr << "Parsing SAM file \"" << sams[i] << "\" (seed=" << seed << ")" << endl;
-			FILE *fh = fopen(sams[i].c_str(), "rb");
-			if(fh == NULL) {
-				cerr << "Could not open input SAM file \"" << sams[i] << "\"" << endl;
+			ckpt_sam = i;
+			SamInput in;
+			if(in.open(sams[i], buf_input_sam, BUFSZ, io_threads,
+			           i == first_sam ? first_off : 0) != 0)
+			{
 				return -1;
 			}
-			setvbuf(fh, buf_input_sam, _IOFBF, BUFSZ);
-			sam_pass1(fh,
+			PerfScope perf("sam_pass1");
+			if(sam_pass1(in, cnt,
 					  orec_u_fn, orec_u_fh,
-					  orec_u_meta_fn, orec_u_meta_fh,
 					  omod_u_fn, omod_u_fh,
 					  orec_b_fn, orec_b_fh,
-					  orec_b_meta_fn, orec_b_meta_fh,
 					  omod_b_fn, omod_b_fh,
 					  orec_c_fn, orec_c_fh,
-					  orec_c_meta_fn, orec_c_meta_fh,
 					  omod_c_fn, omod_c_fh,
 					  orec_d_fn, orec_d_fh,
-					  orec_d_meta_fn, orec_d_meta_fh,
 					  omod_d_fn, omod_d_fh,
-					  keep_templates ? &u_templates : NULL,
-					  keep_templates ? &b_templates : NULL,
-					  keep_templates ? &c_templates : NULL,
-					  keep_templates ? &d_templates : NULL,
-					  false); // not quiet
-			fclose(fh);
+					  parse_templates ? &u_templates : NULL,
+					  parse_templates ? &b_templates : NULL,
+					  parse_templates ? &c_templates : NULL,
+					  parse_templates ? &d_templates : NULL) != 0)
+			{
+				return -1;
+			}
+			in.close();
+		}
+		if(sam_pass1_finish(cnt,
+		                    orec_u_fh, orec_u_meta_fn, orec_u_meta_fh,
+		                    orec_b_fh, orec_b_meta_fn, orec_b_meta_fh,
+		                    orec_c_fh, orec_c_meta_fn, orec_c_meta_fh,
+		                    orec_d_fh, orec_d_meta_fn, orec_d_meta_fh,
+		                    false) != 0) // not quiet
+		{
+			return -1;
 		}
 	}
 
+	if(realign_batch != NULL) {
+		delete realign_batch;
+		realign_batch = NULL;
+	}
+
+	ckpt_close_files();
 	if(omod_u_fh != NULL) fclose(omod_u_fh);
 	if(orec_u_fh != NULL) fclose(orec_u_fh);
 	if(orec_u_meta_fh != NULL) fclose(orec_u_meta_fh);
@@ -1821,48 +2816,104 @@ int main(int argc, char **argv) {
 			     << "(out of " << d_templates.size() << ")" << endl;
 		}
 	}
+	if(do_input_model) {
+		string fn = mod_prefix + "_input_model.bin";
+		if(write_input_model(fn, u_templates, b_templates, c_templates, d_templates) != 0) {
+			return -1;
+		}
+	}
 
 	if(do_simulation) {
+		PerfScope perf("simulate");
 		InputModelUnpaired u_model(u_templates.list(), u_templates.size(), fraction_even, low_score_bias);
 		InputModelUnpaired b_model(b_templates.list(), b_templates.size(), fraction_even, low_score_bias);
 		InputModelPaired c_model(c_templates.list(), c_templates.size(), fraction_even, low_score_bias);
 		InputModelPaired d_model(d_templates.list(), d_templates.size(), fraction_even, low_score_bias);
 		
-		FILEDEC(oread_u_fn, oread_u_fh, oread_u_buf, "FASTQ", true);
-		FILEDEC(oread1_b_fn, oread1_b_fh, oread1_b_buf, "FASTQ", true);
-		FILEDEC(oread2_b_fn, oread2_b_fh, oread2_b_buf, "FASTQ", true);
-		FILEDEC(oread1_c_fn, oread1_c_fh, oread1_c_buf, "FASTQ", true);
-		FILEDEC(oread2_c_fn, oread2_c_fh, oread2_c_buf, "FASTQ", true);
-		FILEDEC(oread1_d_fn, oread1_d_fh, oread1_d_buf, "FASTQ", true);
-		FILEDEC(oread2_d_fn, oread2_d_fh, oread2_d_buf, "FASTQ", true);
+		// When appending, leave files for unselected categories untouched.
+		// When resuming a simulation, keep what was written before the
+		// checkpoint.
+		ckpt_phase = CKPT_SIMULATE;
+		const char *sim_mode = (sim_append || ckpt.resuming()) ? "ab" : "wb";
+		const bool open_u = !sim_append || sim_categories.find('u') != string::npos;
+		const bool open_b = !sim_append || sim_categories.find('b') != string::npos;
+		const bool open_c = !sim_append || sim_categories.find('c') != string::npos;
+		const bool open_d = !sim_append || sim_categories.find('d') != string::npos;
+		const bool open_read[SIM_NREAD_FILES] = {
+			open_u, open_b, open_b, open_c, open_c, open_d, open_d };
+		vector<FILE*> oread_fhs(sim_shards * SIM_NREAD_FILES, (FILE*)NULL);
+		vector<char*> oread_bufs;
+		for(int k = 0; k < sim_shards; k++) {
+			for(int j = 0; j < SIM_NREAD_FILES; j++) {
+				if(!open_read[j]) {
+					continue;
+				}
+				string fn = sim_read_prefix(mod_prefix, k) + SIM_READ_SUFFIXES[j];
+				FILE *fh = fopen(fn.c_str(), sim_mode);
+				if(fh == NULL) {
+					cerr << "Could not open output FASTQ file \"" << fn << "\"" << endl;
+					return -1;
+				}
+				oread_bufs.push_back(new char[BUFSZ]);
+				setvbuf(fh, oread_bufs.back(), _IOFBF, BUFSZ);
+				oread_fhs[k * SIM_NREAD_FILES + j] = fh;
+				if(ckpt_add_file(fn, fh) != 0) {
+					return -1;
+				}
+			}
+		}
+		if(sim_shards > 1 && write_sim_shards(mod_prefix) != 0) {
+			return -1;
+		}
+
+		if(sim_continuation > 0) {
+			// Same templates as the original run (loaded with input-model,
+			// or the input SAM parsed again with the same seed), but a
+			// fresh stream for the simulation
+			cerr << "  Continuation " << sim_continuation << "; reseeding" << endl;
+			set_seed((int)((seed * 77L + sim_continuation * 7919L) % 2147483562 + 1),
+			         (int)((seed + sim_continuation * 104729L) % 2147483398 + 1));
+			random_bases.reset();
+		}
 
 		cerr << "Creating tandem read simulator" << endl;
 		const size_t chunksz = 128 * 1024;
-		StreamingSimulator ss(fastas, chunksz,
+		FILE **fhs = &oread_fhs.front();
+		StreamingSimulator ss(fastas, chunksz, refs,
 							  u_model, b_model, c_model, d_model,
-							  oread_u_fh,
-							  oread1_b_fh, oread2_b_fh,
-							  oread1_c_fh, oread2_c_fh,
-							  oread1_d_fh, oread2_d_fh);
+							  fhs[0], fhs[1], fhs[2], fhs[3], fhs[4], fhs[5], fhs[6]);
+		for(int k = 1; k < sim_shards; k++) {
+			fhs += SIM_NREAD_FILES;
+			ss.add_shard(fhs[0], fhs[1], fhs[2], fhs[3], fhs[4], fhs[5], fhs[6]);
+		}
 
 		cerr << "  Estimate total number of FASTA bases is a bit less than "
 		     << ss.num_estimated_bases() / 1000 << "k" << endl;
 		
-		cerr << "  Simulating reads..." << endl;
+		cerr << "  Simulating reads (categories=" << sim_categories
+		     << (sim_append ? ", appending" : "") << ")..." << endl;
 		ss.simulate_batch(
 			sim_factor,
 			sim_function,
 			sim_unp_min,
 			sim_conc_min,
 			sim_disc_min,
-			sim_bad_end_min);
+			sim_bad_end_min,
+			sim_categories.c_str(),
+			&ckpt);
+		if(write_ref_ids(mod_prefix) != 0) {
+			return -1;
+		}
 		
-		fclose(oread_u_fh);
-		fclose(oread1_b_fh);
-		fclose(oread2_b_fh);
-		fclose(oread1_c_fh);
-		fclose(oread2_c_fh);
-		fclose(oread1_d_fh);
-		fclose(oread2_d_fh);
+		for(size_t i = 0; i < oread_fhs.size(); i++) {
+			if(oread_fhs[i] != NULL) fclose(oread_fhs[i]);
+		}
+		for(size_t i = 0; i < oread_bufs.size(); i++) {
+			delete[] oread_bufs[i];
+		}
+	}
+	ckpt.finish();
+	if(perf_counters) {
+		PerfCounters::report(stderr);
 	}
 }
@@ -14,6 +14,10 @@
 #include <cassert>
 #include "qtip_rewrite.h"
 #include "predmerge.h"
+#include "blocksam.h"
+#include "aux_scan.h"
+#include "perfcount.h"
+#include "probes.h"
 
 using namespace std;
 
@@ -29,13 +33,28 @@ const char *precise_mapq_flag = "Zp:Z";
 
 bool keep_ztz = false;
 
+// When prediction sets from several trials are given (separated by "+"),
+// how to combine them, and whether to record their spread
+int ensemble_agg = EnsembleMerger::ENSEMBLE_MEAN;
+bool write_ensemble_spread = false;
+const char *ensemble_spread_flag = "Zs:Z";
+
+int io_threads = 2; // threads decompressing block-compressed SAM
+
+bool perf_counters = false; // report hardware counters per phase
+
 const static size_t BUFSZ = 262144;
 
+// For spotting the ZT:Z fields to remove
+static AuxScanner aux_scanner;
+static const int AUX_ZT = aux_scanner.add("ZT");
+
 /**
  * Write a new line of SAM (buf) to output filehandle (osam_fh) replacing the
  * existing MAPQ with the predicted one (mapq).
  */
-static void rewrite(FILE *fh, char *buf, double mapq) {
+static void rewrite(FILE *fh, char *buf, const Prediction& p, bool ensemble) {
+	const double mapq = p.mapq;
 	char orig[10];
 	char *orig_cur = orig;
 	for(int i = 0; i < 4; i++) {
@@ -52,23 +71,15 @@ static void rewrite(FILE *fh, char *buf, double mapq) {
 		*orig_cur++ = *buf++;
 	}
 	*orig_cur = '\0';
-	while(*buf != '\n' && *buf != '\r') {
-		if(!keep_ztz && *buf == '\t') {
-			if(strncmp(buf+1, "ZT:Z:", 5) == 0) { // Remove the ZT:Z
-				buf += 6;
-				while(true) {
-					if(*buf == '\t' || *buf == '\n' || *buf == '\r') {
-						break;
-					}
-					buf++;
-				}
-			}
-			if(*buf == '\n' || *buf == '\r') {
-				break;
-			}
+	// Copy the remaining fields a field at a time, minus any ZT:Z
+	while(*buf == '\t') {
+		const char *field = buf + 1;
+		const char *end = sam_field_end(field);
+		const size_t len = (size_t)(end - field);
+		if(keep_ztz || aux_scanner.lookup(field, len) != AUX_ZT || field[3] != 'Z') {
+			fwrite_unlocked(buf, 1, len + 1, fh);
 		}
-		putc_unlocked(*buf, fh);
-		buf++;
+		buf = const_cast<char *>(end);
 	}
 	if(write_orig_mapq) {
 		fprintf(fh, "\t%s:%s", orig_mapq_flag, orig);
@@ -76,6 +87,9 @@ static void rewrite(FILE *fh, char *buf, double mapq) {
 	if(write_precise_mapq) {
 		fprintf(fh, "\t%s:%0.3lf", precise_mapq_flag, mapq);
 	}
+	if(ensemble && write_ensemble_spread) {
+		fprintf(fh, "\t%s:%0.3lf", ensemble_spread_flag, p.spread);
+	}
 	putc_unlocked('\n', fh);
 }
 
@@ -87,14 +101,23 @@ int main(int argc, char **argv) {
 		     << "precise-mapq-flag "
 		     << "write-orig-mapq "
 		     << "write-precise-mapq "
-		     << "keep-ztz" << endl;
+		     << "keep-ztz "
+		     << "io-threads "
+		     << "perf-counters "
+		     << "ensemble-agg "
+		     << "write-ensemble-spread "
+		     << "ensemble-spread-flag" << endl;
 		return 0;
 	}
+	Timeline::init("qtip-rewrite");
+	TimelineScope lifetime("qtip-rewrite", "process");
 
 	string fn;
 	string outfn;
 	string sam;           // handle 1 SAM file per invocation
-	vector<string> preds; // might handle many prediction files; need merging
+	// might handle many prediction files; need merging.  "+" starts the
+	// prediction files for another trial, to be combined with the others
+	vector<vector<string> > preds(1);
 
 	// All arguments except last are SAM files to parse.  Final argument is
 	// output file.
@@ -125,10 +148,38 @@ int main(int argc, char **argv) {
 				if(strcmp(argv[i], "keep-ztz") == 0) {
 					keep_ztz = strcmp(argv[++i], "True") == 0;
 				}
+				if(strcmp(argv[i], "io-threads") == 0) {
+					io_threads = atoi(argv[++i]);
+				}
+				if(strcmp(argv[i], "perf-counters") == 0) {
+					perf_counters = strcmp(argv[++i], "True") == 0;
+				}
+				if(strcmp(argv[i], "ensemble-agg") == 0) {
+					i++;
+					if(strcmp(argv[i], "mean") == 0) {
+						ensemble_agg = EnsembleMerger::ENSEMBLE_MEAN;
+					} else if(strcmp(argv[i], "median") == 0) {
+						ensemble_agg = EnsembleMerger::ENSEMBLE_MEDIAN;
+					} else {
+						cerr << "Error: ensemble-agg must be mean or median, got \""
+						     << argv[i] << "\"" << endl;
+						throw 1;
+					}
+				}
+				if(strcmp(argv[i], "write-ensemble-spread") == 0) {
+					write_ensemble_spread = strcmp(argv[++i], "True") == 0;
+				}
+				if(strcmp(argv[i], "ensemble-spread-flag") == 0) {
+					ensemble_spread_flag = argv[++i];
+				}
 			} else if(section == 1) {
 				sam = argv[i];
 			} else if(section == 2) {
-				preds.push_back(string(argv[i]));
+				if(strcmp(argv[i], "+") == 0) {
+					preds.push_back(vector<string>());
+				} else {
+					preds.back().push_back(string(argv[i]));
+				}
 			} else {
 				outfn = argv[i];
 				outfn_set++;
@@ -153,56 +204,76 @@ int main(int argc, char **argv) {
 
 	// Input SAM file
 	char buf_input_sam[BUFSZ];
-	FILE *fh_sam = fopen(sam.c_str(), "rb");
-	if(fh_sam == NULL) {
-		cerr << "Could not open input SAM file \"" << sam << "\"" << endl;
+	SamInput in_sam;
+	if(in_sam.open(sam, buf_input_sam, BUFSZ, io_threads) != 0) {
 		return -1;
 	}
-	setvbuf(fh_sam, buf_input_sam, _IOFBF, BUFSZ);
 
 	cerr << "Parsing SAM file \"" << sam << "\"" << endl;
 
 	// Input prediction file
-	PredictionMerger m(preds);
+	for(size_t i = 0; preds.size() > 1 && i < preds.size(); i++) {
+		if(preds[i].empty()) {
+			cerr << "Error: prediction set " << (i+1) << " has no files" << endl;
+			return -1;
+		}
+	}
+	EnsembleMerger m(preds, ensemble_agg);
+	const bool ensemble = m.num_sets() > 1;
+	if(ensemble) {
+		cerr << "Combining predictions from " << m.num_sets() << " trials ("
+		     << (ensemble_agg == EnsembleMerger::ENSEMBLE_MEDIAN ? "median" : "mean")
+		     << " pcor)" << endl;
+	}
 	bool done_with_predictions = false;
 	bool done_with_sam = false;
+	if(perf_counters) {
+		PerfCounters::enable();
+	}
 	char linebuf[BUFSZ];
 	size_t nline = 0, nhead = 0;
 	size_t nskip = 0, nrewrite = 0;
-	while(!done_with_predictions || !done_with_sam) {
-		Prediction p = m.next();
-		done_with_predictions = !p.valid();
-		while(true) {
-			// Handle line of sam
-			if(fgets(linebuf, BUFSZ, fh_sam) == NULL) {
-				assert(done_with_predictions);
-				done_with_sam = true;
-				break;
-			}
-			nline++;
-			assert(done_with_predictions || nline <= p.line);
-			if(linebuf[0] == '@') {
-				nhead++;
-				fputs(linebuf, osam_fh);
-				continue; // skip header
-			}
-			if(done_with_predictions || p.line > nline) {
-				fputs(linebuf, osam_fh); // no prediction for this line
-				nskip++;
-				continue;
+	{
+		PerfScope perf("rewrite");
+		while(!done_with_predictions || !done_with_sam) {
+			Prediction p = m.next();
+			done_with_predictions = !p.valid();
+			while(true) {
+				// Handle line of sam
+				if(in_sam.gets(linebuf, BUFSZ) == NULL) {
+					assert(done_with_predictions);
+					done_with_sam = true;
+					break;
+				}
+				nline++;
+				QTIP_PROBE1(rewrite_record, nline);
+				assert(done_with_predictions || nline <= p.line);
+				if(linebuf[0] == '@') {
+					nhead++;
+					fputs(linebuf, osam_fh);
+					continue; // skip header
+				}
+				if(done_with_predictions || p.line > nline) {
+					fputs(linebuf, osam_fh); // no prediction for this line
+					nskip++;
+					continue;
+				}
+				assert(nline == p.line); // there is a prediction
+				rewrite(osam_fh, linebuf, p, ensemble);
+				nrewrite++;
+				break; // get next prediction
 			}
-			assert(nline == p.line); // there is a prediction
-			rewrite(osam_fh, linebuf, p.mapq);
-			nrewrite++;
-			break; // get next prediction
 		}
 	}
 	assert(done_with_predictions && done_with_sam);
-	fclose(fh_sam);
+	in_sam.close();
 
 	cerr << "Header lines:  " << nhead << endl;
 	cerr << "Skipped lines (did not rewrite MAPQ): " << nskip << endl;
 	cerr << "Lines with rewritten MAPQ: " << nrewrite << endl;
+	if(perf_counters) {
+		PerfCounters::report(stderr);
+	}
 
 	return 0;
 }
@@ -0,0 +1,825 @@
+//
+//  realign.cpp
+//  qtip
+//
+
+#include <string.h>
+#include <cctype>
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+#include "realign.h"
+#include "realign_kernel.h"
+#include "fasta.h"
+#include "simd.h"
+
+using namespace std;
+
+/**
+ * Map a nucleotide character to a 0-4 code.
+ */
+static inline uint8_t base_code(int c) {
+	switch(c) {
+		case 'A': case 'a': return 0;
+		case 'C': case 'c': return 1;
+		case 'G': case 'g': return 2;
+		case 'T': case 't': return 3;
+		default: return 4;
+	}
+}
+
+/**
+ * Read all records from all the given FASTA files.  Uses the chunkwise
+ * parser with no overlap, so chunks from a record abut one another.
+ */
+void ReferenceSet::load(const vector<string>& fns) {
+	const size_t chunksz = 1024 * 1024;
+	FastaChunkwiseParser fa(fns, chunksz, 0);
+	string refid, refid_full;
+	size_t refoff = 0, retsz = 0;
+	while(true) {
+		const char *buf = fa.next(refid, refid_full, refoff, retsz);
+		if(buf == NULL) {
+			if(fa.done()) {
+				break;
+			}
+			continue;
+		}
+		if(refoff == 0) {
+			// first chunk of a new record
+			if(name2idx_.find(refid) == name2idx_.end()) {
+				name2idx_[refid] = (int)lens_.size();
+			} else {
+				cerr << "Warning: reference name \"" << refid << "\" appears "
+				     << "more than once; realigning only against first" << endl;
+			}
+			offs_.push_back(nbases_);
+			lens_.push_back(0);
+		}
+		assert(!lens_.empty());
+		assert(lens_.back() == refoff);
+		packed_.resize((nbases_ + retsz + 3) / 4, 0);
+		for(size_t i = 0; i < retsz; i++, nbases_++) {
+			const uint8_t c = base_code(buf[i]);
+			if(c > 3) {
+				if(nend_.empty() || nend_.back() != nbases_) {
+					nbeg_.push_back(nbases_);
+					nend_.push_back(nbases_);
+				}
+				nend_.back()++;
+				continue; // packed as A
+			}
+			packed_[nbases_ >> 2] |= (uint8_t)(c << ((nbases_ & 3) << 1));
+		}
+		lens_.back() += retsz;
+	}
+}
+
+/**
+ * Decode bases [beg, end) of reference with given index into out, then paint
+ * in any runs of non-ACGT overlapping the window.
+ */
+void ReferenceSet::fetch(
+	int refi,
+	size_t beg,
+	size_t end,
+	vector<uint8_t>& out) const
+{
+	assert(beg <= end);
+	assert(end <= lens_[refi]);
+	const size_t off = offs_[refi];
+	out.resize(end - beg);
+	for(size_t i = beg + off, j = 0; i < end + off; i++, j++) {
+		out[j] = (packed_[i >> 2] >> ((i & 3) << 1)) & 3;
+	}
+	// First run that ends after the window starts
+	size_t r = upper_bound(nend_.begin(), nend_.end(), beg + off) - nend_.begin();
+	for(; r < nbeg_.size() && nbeg_[r] < end + off; r++) {
+		const size_t rbeg = max(nbeg_[r], beg + off);
+		const size_t rend = min(nend_[r], end + off);
+		memset(&out[rbeg - off - beg], 4, rend - rbeg);
+	}
+}
+
+/**
+ * Return index of the reference with the given name, or -1 if there's no
+ * such reference.  Name is terminated by NUL or whitespace.
+ */
+int ReferenceSet::lookup(const char *name) const {
+	size_t len = 0;
+	while(name[len] != '\0' && !isspace(name[len])) {
+		len++;
+	}
+	if(last_idx_ >= 0 && last_name_.length() == len &&
+	   strncmp(last_name_.c_str(), name, len) == 0)
+	{
+		return last_idx_;
+	}
+	last_name_.assign(name, len);
+	map<string, int>::const_iterator it = name2idx_.find(last_name_);
+	last_idx_ = (it == name2idx_.end()) ? -1 : it->second;
+	return last_idx_;
+}
+
+/**
+ * Score given to query positions that pad out the last vector.  Small enough
+ * that a padding cell can never be a match, large enough not to saturate.
+ */
+static const int16_t PAD_SCORE = -16384;
+
+/**
+ * Pick the widest striped kernel that is both compiled in and supported by
+ * the CPU, never exceeding the requested level.
+ */
+LocalAligner::LocalAligner(const RealignParams& p, int simd) :
+	p_(p),
+	simd_(SIMD_NONE),
+	kernel_(NULL),
+	batch_(NULL),
+	lanes_(8),
+	qlen_(0),
+	seglen_(0)
+{
+	const int cpu = simd_level();
+	if(simd < 0 || simd > cpu) {
+		simd = cpu;
+	}
+	if(simd >= SIMD_AVX2 && (kernel_ = striped_kernel_avx2()) != NULL) {
+		batch_ = batch_kernel_avx2();
+		simd_ = SIMD_AVX2;
+		lanes_ = 16;
+	} else if(simd >= SIMD_SSE42 && (kernel_ = striped_kernel_sse42()) != NULL) {
+		batch_ = batch_kernel_sse42();
+		simd_ = SIMD_SSE42;
+	}
+#if defined(__SSE2__)
+	else if(simd >= SIMD_SSE2) {
+		kernel_ = &striped_local_align<VecSSE2>;
+		batch_ = &batch_local_align<VecSSE2>;
+		simd_ = SIMD_SSE2;
+	}
+#endif
+}
+
+/**
+ * Return name of the instruction set the striped kernel uses.
+ */
+const char *LocalAligner::kernel_name() const {
+	return simd_level_name(simd_);
+}
+
+/**
+ * Set the query.  Builds the striped query profile: for each reference
+ * character r and segment s, lane k holds the score of aligning query
+ * position k * seglen + s to r.
+ */
+void LocalAligner::init_query(const uint8_t *q, size_t qlen) {
+	query_.assign(q, q + qlen);
+	qlen_ = qlen;
+	if(kernel_ == NULL) {
+		return;
+	}
+	const size_t L = lanes_;
+	seglen_ = (qlen + L - 1) / L;
+	const size_t nelt = seglen_ * L;
+	profile_.resize(5 * nelt);
+	for(int r = 0; r < 5; r++) {
+		int16_t *prof = &profile_[r * nelt];
+		for(size_t s = 0; s < seglen_; s++) {
+			for(size_t k = 0; k < L; k++) {
+				size_t i = k * seglen_ + s;
+				prof[s * L + k] = (i < qlen) ? (int16_t)score(q[i], r) : PAD_SCORE;
+			}
+		}
+	}
+	hstore_.resize(nelt);
+	hload_.resize(nelt);
+	e_.resize(nelt);
+}
+
+/**
+ * Align the current query against rf[0..rflen) and store per-column maxima
+ * in colmax.  Returns the overall maximum.
+ */
+int LocalAligner::align(
+	const uint8_t *rf,
+	size_t rflen,
+	vector<int>& colmax)
+{
+	// Fall back to scalar if scores could overflow 16 bits
+	if(kernel_ == NULL || qlen_ == 0 || qlen_ * (size_t)p_.match >= 32000) {
+		return align_scalar(rf, rflen, colmax);
+	}
+	colmax.resize(rflen);
+	if(rflen == 0) {
+		return 0;
+	}
+	return kernel_(
+		&profile_[0],
+		seglen_,
+		rf,
+		rflen,
+		p_.gap_open + p_.gap_extend,
+		p_.gap_extend,
+		&hstore_[0],
+		&hload_[0],
+		&e_[0],
+		&colmax[0]);
+}
+
+/**
+ * Gotoh local alignment, one reference column at a time, keeping only the
+ * previous column.
+ */
+int LocalAligner::align_scalar(
+	const uint8_t *rf,
+	size_t rflen,
+	vector<int>& colmax)
+{
+	colmax.resize(rflen);
+	const int go = p_.gap_open + p_.gap_extend;
+	const int ge = p_.gap_extend;
+	h_scalar_.assign(qlen_, 0);
+	e_scalar_.assign(qlen_, 0);
+	int best = 0;
+	for(size_t j = 0; j < rflen; j++) {
+		int diag = 0, f = 0, m = 0;
+		for(size_t i = 0; i < qlen_; i++) {
+			const int e = e_scalar_[i];
+			int h = diag + score(query_[i], rf[j]);
+			h = max(h, e);
+			h = max(h, f);
+			h = max(h, 0);
+			diag = h_scalar_[i];
+			h_scalar_[i] = h;
+			e_scalar_[i] = max(e - ge, h - go);
+			f = max(f - ge, h - go);
+			m = max(m, h);
+		}
+		colmax[j] = m;
+		best = max(best, m);
+	}
+	return best;
+}
+
+/**
+ * Interleave the queries and windows so lane k holds pair k, run the
+ * inter-read kernel, then de-interleave the column maxima.  Falls back to
+ * aligning pairs one at a time if there's no inter-read kernel or if scores
+ * could overflow 16 bits.
+ */
+void LocalAligner::align_batch(
+	size_t n,
+	const uint8_t * const *qs,
+	const size_t *qlens,
+	const uint8_t * const *rfs,
+	const size_t *rflens,
+	vector<int> *colmax)
+{
+	assert(n <= lanes_);
+	size_t qmax = 0, rmax = 0;
+	for(size_t k = 0; k < n; k++) {
+		qmax = max(qmax, qlens[k]);
+		rmax = max(rmax, rflens[k]);
+	}
+	if(batch_ == NULL || qmax == 0 || rmax == 0 || qmax * (size_t)p_.match >= 32000) {
+		for(size_t k = 0; k < n; k++) {
+			init_query(qs[k], qlens[k]);
+			align(rfs[k], rflens[k], colmax[k]);
+		}
+		return;
+	}
+	const size_t L = lanes_;
+	bq_.assign(qmax * L, BATCH_PAD);
+	brf_.assign(rmax * L, 4);
+	for(size_t k = 0; k < n; k++) {
+		for(size_t i = 0; i < qlens[k]; i++) {
+			bq_[i * L + k] = qs[k][i];
+		}
+		for(size_t j = 0; j < rflens[k]; j++) {
+			brf_[j * L + k] = rfs[k][j];
+		}
+	}
+	hstore_.resize(qmax * L);
+	e_.resize(qmax * L);
+	bcol_.resize(rmax * L);
+	batch_(
+		&bq_[0],
+		qmax,
+		&brf_[0],
+		rmax,
+		p_.match,
+		p_.mismatch,
+		p_.n_penalty,
+		p_.gap_open + p_.gap_extend,
+		p_.gap_extend,
+		&hstore_[0],
+		&e_[0],
+		&bcol_[0]);
+	for(size_t k = 0; k < n; k++) {
+		colmax[k].resize(rflens[k]);
+		for(size_t j = 0; j < rflens[k]; j++) {
+			colmax[k][j] = bcol_[j * L + k];
+		}
+	}
+}
+
+/**
+ * Reduce per-column maxima to best score, second-best distinct placement and
+ * the number of near-equal placements.
+ */
+void summarize_columns(
+	const vector<int>& colmax,
+	size_t excl,
+	int near_delta,
+	RealignResult& res)
+{
+	const size_t max_placements = 32;
+	res.best = res.second = res.near = 0;
+	const size_t n = colmax.size();
+	// Local maxima, sorted by descending score then ascending position
+	vector<pair<int, size_t> > peaks;
+	for(size_t j = 0; j < n; j++) {
+		const int sc = colmax[j];
+		if(sc > 0 &&
+		   (j == 0 || sc >= colmax[j-1]) &&
+		   (j+1 == n || sc > colmax[j+1]))
+		{
+			peaks.push_back(make_pair(-sc, j));
+		}
+	}
+	if(peaks.empty()) {
+		return;
+	}
+	sort(peaks.begin(), peaks.end());
+	size_t accepted[max_placements];
+	size_t naccepted = 0;
+	res.best = -peaks[0].first;
+	for(size_t i = 0; i < peaks.size() && naccepted < max_placements; i++) {
+		const size_t j = peaks[i].second;
+		bool distinct = true;
+		for(size_t k = 0; k < naccepted; k++) {
+			size_t dist = (j > accepted[k]) ? (j - accepted[k]) : (accepted[k] - j);
+			if(dist <= excl) {
+				distinct = false;
+				break;
+			}
+		}
+		if(!distinct) {
+			continue;
+		}
+		accepted[naccepted++] = j;
+		const int sc = -peaks[i].first;
+		if(naccepted == 2) {
+			res.second = sc;
+		}
+		if(naccepted > 1 && sc >= res.best - near_delta) {
+			res.near++;
+		}
+	}
+}
+
+/**
+ * Queue a read for realignment.  Sequence is copied.
+ */
+size_t RealignBatch::add(
+	const char *seq,
+	size_t len,
+	const char *rname,
+	long long lpos,
+	size_t rflen)
+{
+	Job job;
+	job.seqoff = seqs_.size();
+	job.len = len;
+	job.refi = refs_.lookup(rname);
+	job.wbeg = job.wend = 0;
+	for(size_t i = 0; i < len; i++) {
+		seqs_.push_back(base_code(seq[i]));
+	}
+	if(job.refi >= 0) {
+		const long long reflen = (long long)refs_.length(job.refi);
+		long long wbeg = lpos - p_.window;
+		long long wend = lpos + (long long)rflen + p_.window;
+		wbeg = max(wbeg, 0LL);
+		wend = min(wend, reflen);
+		if(wend > wbeg) {
+			job.wbeg = (size_t)wbeg;
+			job.wend = (size_t)wend;
+		}
+	}
+	jobs_.push_back(job);
+	return jobs_.size() - 1;
+}
+
+/**
+ * Realign all queued reads.  Jobs are sorted by read length, then window
+ * length, so each group of lanes is about the same shape and little of the
+ * inter-read kernel's work is padding.
+ */
+void RealignBatch::run() {
+	results_.resize(jobs_.size());
+	order_.clear();
+	for(size_t i = 0; i < jobs_.size(); i++) {
+		const Job& job = jobs_[i];
+		results_[i].reset();
+		if(job.refi >= 0 && job.len > 0 && job.wend > job.wbeg) {
+			order_.push_back(i);
+		}
+	}
+	sort(order_.begin(), order_.end(), JobSizeLess(jobs_));
+	const size_t L = al_.batch_lanes();
+	assert(L <= MAX_BATCH_LANES);
+	windows_.resize(L);
+	colmax_.resize(L);
+	const uint8_t *qs[MAX_BATCH_LANES], *rfs[MAX_BATCH_LANES];
+	size_t qlens[MAX_BATCH_LANES], rflens[MAX_BATCH_LANES];
+	for(size_t g = 0; g < order_.size(); g += L) {
+		const size_t n = min(L, order_.size() - g);
+		for(size_t k = 0; k < n; k++) {
+			const Job& job = jobs_[order_[g + k]];
+			refs_.fetch(job.refi, job.wbeg, job.wend, windows_[k]);
+			qs[k] = &seqs_[job.seqoff];
+			qlens[k] = job.len;
+			rfs[k] = &windows_[k][0];
+			rflens[k] = windows_[k].size();
+		}
+		al_.align_batch(n, qs, qlens, rfs, rflens, &colmax_[0]);
+		for(size_t k = 0; k < n; k++) {
+			const Job& job = jobs_[order_[g + k]];
+			RealignResult& res = results_[order_[g + k]];
+			summarize_columns(colmax_[k], max<size_t>(job.len / 2, 1), p_.near_delta, res);
+			res.valid = true;
+		}
+	}
+}
+
+/**
+ * Realign all queued reads one at a time.
+ */
+void RealignBatch::run_serial() {
+	results_.resize(jobs_.size());
+	windows_.resize(1);
+	colmax_.resize(1);
+	for(size_t i = 0; i < jobs_.size(); i++) {
+		const Job& job = jobs_[i];
+		RealignResult& res = results_[i];
+		res.reset();
+		if(job.refi < 0 || job.len == 0 || job.wend <= job.wbeg) {
+			continue;
+		}
+		refs_.fetch(job.refi, job.wbeg, job.wend, windows_[0]);
+		al_.init_query(&seqs_[job.seqoff], job.len);
+		al_.align(&windows_[0][0], windows_[0].size(), colmax_[0]);
+		summarize_columns(colmax_[0], max<size_t>(job.len / 2, 1), p_.near_delta, res);
+		res.valid = true;
+	}
+}
+
+#ifdef REALIGN_MAIN
+
+#include <fstream>
+
+static void random_codes(vector<uint8_t>& v, size_t n) {
+	v.resize(n);
+	for(size_t i = 0; i < n; i++) {
+		v[i] = (uint8_t)(rand() % 4);
+	}
+}
+
+/**
+ * Perfect match scores match bonus times read length.
+ */
+static void test1() {
+	RealignParams p;
+	LocalAligner al(p);
+	vector<uint8_t> rf, q;
+	random_codes(rf, 500);
+	q.assign(rf.begin() + 200, rf.begin() + 300);
+	al.init_query(&q[0], q.size());
+	vector<int> colmax;
+	int best = al.align(&rf[0], rf.size(), colmax);
+	assert(best == 200);
+	assert(colmax[299] == 200);
+}
+
+/**
+ * Striped and scalar aligners agree on every column, including for queries
+ * with mismatches, Ns and indels.  Checks every kernel this CPU can run.
+ */
+static void test2() {
+	RealignParams p;
+	for(int simd = SIMD_NONE; simd <= simd_level(); simd++) {
+		LocalAligner al(p, simd);
+		cerr << "  checking " << al.kernel_name() << " kernel" << endl;
+		vector<uint8_t> rf, q;
+		vector<int> colmax1, colmax2;
+		for(int t = 0; t < 2000; t++) {
+			random_codes(rf, 20 + rand() % 400);
+			size_t st = rand() % (rf.size() / 2);
+			size_t qlen = 1 + rand() % 150;
+			q.clear();
+			for(size_t i = st; i < rf.size() && q.size() < qlen; i++) {
+				int r = rand() % 100;
+				if(r < 5) {
+					q.push_back((uint8_t)(rand() % 5)); // mismatch or N
+				} else if(r < 8) {
+					q.push_back((uint8_t)(rand() % 4)); // insertion
+					q.push_back(rf[i]);
+				} else if(r < 11) {
+					// deletion
+				} else {
+					q.push_back(rf[i]);
+				}
+			}
+			if(q.empty()) {
+				q.push_back(0);
+			}
+			al.init_query(&q[0], q.size());
+			int best1 = al.align(&rf[0], rf.size(), colmax1);
+			int best2 = al.align_scalar(&rf[0], rf.size(), colmax2);
+			assert(best1 == best2);
+			assert(colmax1 == colmax2);
+		}
+	}
+}
+
+/**
+ * A read occurring twice in the window has a near-equal placement and a
+ * second-best score equal to the best.
+ */
+static void test3() {
+	RealignParams p;
+	LocalAligner al(p);
+	vector<uint8_t> rf, q, filler;
+	random_codes(q, 100);
+	random_codes(filler, 150);
+	rf = filler;
+	rf.insert(rf.end(), q.begin(), q.end());
+	rf.insert(rf.end(), filler.begin(), filler.end());
+	rf.insert(rf.end(), q.begin(), q.end());
+	rf.insert(rf.end(), filler.begin(), filler.end());
+	al.init_query(&q[0], q.size());
+	vector<int> colmax;
+	al.align(&rf[0], rf.size(), colmax);
+	RealignResult res;
+	summarize_columns(colmax, 50, p.near_delta, res);
+	assert(res.best == 200);
+	assert(res.second == 200);
+	assert(res.near == 1);
+
+	// A mismatch in the second copy puts it more than near_delta below the
+	// best placement
+	rf[150 + 100 + 150 + 50] = (uint8_t)((rf[150 + 100 + 150 + 50] + 1) % 4);
+	al.align(&rf[0], rf.size(), colmax);
+	summarize_columns(colmax, 50, p.near_delta, res);
+	assert(res.best == 200);
+	assert(res.second == 200 - p.match - p.mismatch);
+	assert(res.near == 0);
+}
+
+/**
+ * Load references from FASTA, then realign a batch against them.
+ */
+static void test4() {
+	string fn = ".realign.test4.fa";
+	ofstream ofs(fn.c_str(), ofstream::out);
+	string seq1 = "ACGTTGCAAGGCTTAACCGGTTACGATCGATCGGATCTAGCTAGCTAGGCTA";
+	ofs << ">ref1 first" << endl;
+	ofs << seq1.substr(0, 20) << endl << seq1.substr(20) << endl;
+	ofs << ">ref2\tsecond" << endl;
+	ofs << "NNNNACGT" << endl;
+	ofs.close();
+
+	ReferenceSet refs;
+	vector<string> fns;
+	fns.push_back(fn);
+	refs.load(fns);
+	assert(refs.num_refs() == 2);
+	assert(refs.lookup("ref1") == 0);
+	assert(refs.lookup("ref2\tblah") == 1);
+	assert(refs.lookup("ref3") == -1);
+	assert(refs.length(0) == seq1.length());
+	assert(refs.length(1) == 8);
+	vector<uint8_t> win;
+	refs.fetch(1, 0, 8, win);
+	assert(win.size() == 8);
+	assert(win[0] == 4);
+	assert(win[3] == 4);
+	assert(win[4] == 0);
+	assert(win[7] == 3);
+	refs.fetch(1, 2, 6, win);
+	assert(win.size() == 4);
+	assert(win[1] == 4);
+	assert(win[2] == 0);
+	refs.fetch(0, 0, seq1.length(), win);
+	for(size_t i = 0; i < seq1.length(); i++) {
+		assert(win[i] == base_code(seq1[i]));
+	}
+
+	RealignParams p;
+	p.window = 5;
+	RealignBatch batch(refs, p);
+	string rd = seq1.substr(10, 20);
+	size_t j1 = batch.add(rd.c_str(), rd.length(), "ref1", 10, 20);
+	size_t j2 = batch.add(rd.c_str(), rd.length(), "ref3", 10, 20);
+	size_t j3 = batch.add(rd.c_str(), rd.length(), "ref1", -3, 20);
+	batch.run();
+	assert(batch.result(j1).valid);
+	assert(batch.result(j1).best == 40);
+	assert(!batch.result(j2).valid);
+	assert(batch.result(j3).valid);
+	batch.clear();
+	assert(batch.size() == 0);
+	remove(fn.c_str());
+}
+
+/**
+ * Packed references decode to the same codes as the FASTA for any window,
+ * including ones that start, end or lie inside runs of non-ACGT characters
+ * and ones that straddle a chunk boundary.
+ */
+static void test5() {
+	string fn = ".realign.test5.fa";
+	const char *alpha = "ACGTacgt";
+	vector<string> seqs;
+	ofstream ofs(fn.c_str(), ofstream::out);
+	for(int r = 0; r < 5; r++) {
+		string seq;
+		size_t len = (r == 2) ? 3 * 1024 * 1024 + 7 : 1 + rand() % 5000;
+		while(seq.length() < len) {
+			int c = rand() % 200;
+			if(c == 0) {
+				seq.append(1 + rand() % 30, 'N');
+			} else if(c == 1) {
+				seq.push_back("nRY"[rand() % 3]);
+			} else {
+				seq.push_back(alpha[rand() % 8]);
+			}
+		}
+		seq.resize(len);
+		seqs.push_back(seq);
+		ofs << ">r" << r << endl;
+		for(size_t i = 0; i < seq.length(); i += 60) {
+			ofs << seq.substr(i, 60) << endl;
+		}
+	}
+	ofs.close();
+
+	ReferenceSet refs;
+	vector<string> fns;
+	fns.push_back(fn);
+	refs.load(fns);
+	assert(refs.num_refs() == seqs.size());
+	size_t tot = 0;
+	for(size_t r = 0; r < seqs.size(); r++) {
+		tot += seqs[r].length();
+	}
+	assert(refs.num_bases() == tot);
+	assert(refs.num_bytes() < tot / 2);
+	vector<uint8_t> win;
+	for(int t = 0; t < 5000; t++) {
+		const int r = rand() % (int)seqs.size();
+		const string& seq = seqs[r];
+		size_t beg = rand() % seq.length();
+		size_t end = min(seq.length(), beg + rand() % 500);
+		refs.fetch(r, beg, end, win);
+		assert(win.size() == end - beg);
+		for(size_t i = beg; i < end; i++) {
+			assert(win[i - beg] == base_code(seq[i]));
+		}
+	}
+	// Straddle the 1 MB chunk boundary in the long reference
+	const size_t mb = 1024 * 1024;
+	refs.fetch(2, mb - 100, mb + 100, win);
+	for(size_t i = mb - 100; i < mb + 100; i++) {
+		assert(win[i - (mb - 100)] == base_code(seqs[2][i]));
+	}
+	remove(fn.c_str());
+}
+
+/**
+ * Aligning reads in lanes gives the same column maxima as aligning them one
+ * at a time, for groups of reads with different lengths and windows, Ns,
+ * partly filled groups and reads too long for 16-bit lanes.  Checks every
+ * kernel this CPU can run.
+ */
+static void test6() {
+	RealignParams p;
+	for(int simd = SIMD_NONE; simd <= simd_level(); simd++) {
+		LocalAligner al(p, simd), al_scalar(p, SIMD_NONE);
+		cerr << "  checking " << al.kernel_name() << " batch kernel" << endl;
+		const size_t L = al.batch_lanes();
+		vector<vector<uint8_t> > q(L), rf(L);
+		vector<vector<int> > colmax(L);
+		vector<int> colmax1;
+		const uint8_t *qs[MAX_BATCH_LANES], *rfs[MAX_BATCH_LANES];
+		size_t qlens[MAX_BATCH_LANES], rflens[MAX_BATCH_LANES];
+		for(int t = 0; t < 300; t++) {
+			const size_t n = 1 + rand() % L;
+			for(size_t k = 0; k < n; k++) {
+				random_codes(rf[k], 1 + rand() % 400);
+				size_t qlen = (t == 0 && k == 0) ? 16000 : 1 + rand() % 150;
+				if(rand() % 2 == 0) {
+					// read drawn from its window, with edits
+					size_t st = rand() % rf[k].size();
+					q[k].clear();
+					for(size_t i = st; i < rf[k].size() && q[k].size() < qlen; i++) {
+						int r = rand() % 100;
+						if(r < 5) {
+							q[k].push_back((uint8_t)(rand() % 5));
+						} else if(r < 8) {
+							q[k].push_back((uint8_t)(rand() % 4));
+							q[k].push_back(rf[k][i]);
+						} else if(r >= 11) {
+							q[k].push_back(rf[k][i]);
+						}
+					}
+					if(q[k].empty()) {
+						q[k].push_back(4);
+					}
+				} else {
+					random_codes(q[k], qlen);
+				}
+				if(rand() % 4 == 0) {
+					rf[k][rand() % rf[k].size()] = 4;
+				}
+				qs[k] = &q[k][0];
+				qlens[k] = q[k].size();
+				rfs[k] = &rf[k][0];
+				rflens[k] = rf[k].size();
+			}
+			al.align_batch(n, qs, qlens, rfs, rflens, &colmax[0]);
+			for(size_t k = 0; k < n; k++) {
+				al_scalar.init_query(qs[k], qlens[k]);
+				al_scalar.align_scalar(rfs[k], rflens[k], colmax1);
+				assert(colmax[k] == colmax1);
+			}
+		}
+	}
+}
+
+/**
+ * A batch bigger than one group of lanes, with reads of mixed lengths and
+ * some without a window, gets the same results from run() as from
+ * run_serial().
+ */
+static void test7() {
+	string fn = ".realign.test7.fa";
+	ofstream ofs(fn.c_str(), ofstream::out);
+	vector<uint8_t> codes;
+	random_codes(codes, 20000);
+	string ref;
+	for(size_t i = 0; i < codes.size(); i++) {
+		ref.push_back((i % 997 < 5) ? 'N' : "ACGT"[codes[i]]);
+	}
+	ofs << ">chr" << endl << ref << endl;
+	ofs.close();
+
+	ReferenceSet refs;
+	vector<string> fns;
+	fns.push_back(fn);
+	refs.load(fns);
+	RealignParams p;
+	p.window = 50;
+	RealignBatch batch(refs, p);
+	for(int i = 0; i < 1000; i++) {
+		const size_t len = 20 + rand() % 130;
+		const long long pos = (long long)(rand() % (ref.length() + 100)) - 50;
+		string rd;
+		for(size_t j = 0; j < len; j++) {
+			long long k = pos + (long long)j;
+			rd.push_back((k >= 0 && k < (long long)ref.length() && rand() % 20 != 0) ?
+				ref[k] : "ACGTN"[rand() % 5]);
+		}
+		batch.add(rd.c_str(), rd.length(), (i % 50 == 0) ? "nope" : "chr", pos, len);
+	}
+	batch.run();
+	vector<RealignResult> res1;
+	for(size_t i = 0; i < batch.size(); i++) {
+		res1.push_back(batch.result(i));
+	}
+	batch.run_serial();
+	for(size_t i = 0; i < batch.size(); i++) {
+		const RealignResult& r1 = res1[i], & r2 = batch.result(i);
+		assert(r1.valid == r2.valid);
+		assert(r1.best == r2.best);
+		assert(r1.second == r2.second);
+		assert(r1.near == r2.near);
+	}
+	assert(!batch.result(0).valid);
+	remove(fn.c_str());
+}
+
+int main(void) {
+	srand(77);
+	test1();
+	test2();
+	test3();
+	test4();
+	test5();
+	test6();
+	test7();
+	cout << "ALL TESTS PASSED" << endl;
+}
+#endif
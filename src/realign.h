@@ -0,0 +1,385 @@
+//
+//  realign.h
+//  qtip
+//
+
+#ifndef __qtip__realign__
+#define __qtip__realign__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * All the sequences from one or more FASTA files, held in memory 2 bits per
+ * base so that a window around any reported alignment can be fetched by
+ * reference name and offset.  Characters other than A, C, G and T are kept
+ * as sorted runs alongside the packed bases, so a window decodes to A=0, C=1,
+ * G=2, T=3 and anything else=4.
+ */
+class ReferenceSet {
+
+public:
+
+	ReferenceSet() : nbases_(0), last_idx_(-1) { }
+
+	/**
+	 * Read all records from all the given FASTA files.
+	 */
+	void load(const std::vector<std::string>& fns);
+
+	/**
+	 * Return index of the reference with the given name, or -1 if there's no
+	 * such reference.  Name is terminated by NUL or whitespace.
+	 */
+	int lookup(const char *name) const;
+
+	/**
+	 * Return length of reference with given index.
+	 */
+	size_t length(int refi) const {
+		return lens_[refi];
+	}
+
+	/**
+	 * Decode bases [beg, end) of reference with given index into out.
+	 */
+	void fetch(int refi, size_t beg, size_t end, std::vector<uint8_t>& out) const;
+
+	/**
+	 * Return number of references loaded.
+	 */
+	size_t num_refs() const {
+		return lens_.size();
+	}
+
+	/**
+	 * Return total number of bases loaded.
+	 */
+	size_t num_bases() const {
+		return nbases_;
+	}
+
+	/**
+	 * Return number of bytes used to hold the bases.
+	 */
+	size_t num_bytes() const {
+		return packed_.size() + (nbeg_.size() + nend_.size()) * sizeof(size_t);
+	}
+
+protected:
+
+	std::map<std::string, int> name2idx_;
+	std::vector<size_t> offs_;    // offset of each reference into packed_, in bases
+	std::vector<size_t> lens_;    // length of each reference
+	std::vector<uint8_t> packed_; // all references, concatenated, 4 bases per byte
+	std::vector<size_t> nbeg_;    // runs of non-ACGT, as offsets in bases
+	std::vector<size_t> nend_;
+	size_t nbases_;
+	mutable std::string last_name_; // name & index from most recent lookup
+	mutable int last_idx_;
+};
+
+/**
+ * Scoring and window parameters for realignment.  Defaults mirror Bowtie 2's
+ * --local scoring.
+ */
+struct RealignParams {
+
+	RealignParams() :
+		match(2),
+		mismatch(6),
+		n_penalty(1),
+		gap_open(5),
+		gap_extend(3),
+		window(0),
+		near_delta(6) { }
+
+	int match;      // bonus for a match
+	int mismatch;   // penalty for a mismatch
+	int n_penalty;  // penalty for a position with an N in read or ref
+	int gap_open;   // penalty for opening a gap (in addition to extension)
+	int gap_extend; // penalty for each gap position
+	int window;     // # ref chars on either side of reported alignment
+	int near_delta; // placements this close to best count as near-equal
+};
+
+/**
+ * Features summarizing how a read realigns within its window.
+ */
+struct RealignResult {
+
+	RealignResult() { reset(); }
+
+	void reset() {
+		valid = false;
+		best = second = near = 0;
+	}
+
+	bool valid;  // false if reference or window was unavailable
+	int best;    // best local alignment score in window
+	int second;  // best score among placements distinct from the best
+	int near;    // # distinct placements other than best within near_delta
+};
+
+/**
+ * Signature shared by all striped local alignment kernels.  profile is the
+ * striped query profile for seglen vectors; hs, hl and ev are scratch arrays
+ * of seglen vectors each.  Fills colmax[0..rflen) and returns the maximum.
+ */
+typedef int (*StripedKernel)(
+	const int16_t *profile,
+	size_t seglen,
+	const uint8_t *rf,
+	size_t rflen,
+	int gap_open,
+	int gap_extend,
+	int16_t *hs,
+	int16_t *hl,
+	int16_t *ev,
+	int *colmax);
+
+/**
+ * Query code for positions past the end of a lane's query in a BatchKernel.
+ */
+static const int16_t BATCH_PAD = 5;
+
+/**
+ * Lanes in the widest BatchKernel.
+ */
+static const size_t MAX_BATCH_LANES = 16;
+
+/**
+ * Signature shared by all inter-read kernels, which align a different
+ * query/reference pair in each 16-bit lane.  qs holds qmax query vectors and
+ * rf rflen reference vectors, coded as in ReferenceSet, with BATCH_PAD past
+ * the end of each lane's query.  hv and ev are scratch arrays of qmax vectors
+ * each.  Fills colmax[j * lanes + k] with the maximum of column j in lane k.
+ */
+typedef void (*BatchKernel)(
+	const int16_t *qs,
+	size_t qmax,
+	const int16_t *rf,
+	size_t rflen,
+	int match,
+	int mismatch,
+	int n_penalty,
+	int gap_open,
+	int gap_extend,
+	int16_t *hv,
+	int16_t *ev,
+	int16_t *colmax);
+
+/**
+ * Kernels compiled for a particular instruction set in their own files.  Each
+ * returns NULL if this build couldn't compile it (e.g. non-x86 targets).
+ */
+StripedKernel striped_kernel_sse42();
+StripedKernel striped_kernel_avx2();
+BatchKernel batch_kernel_sse42();
+BatchKernel batch_kernel_avx2();
+
+/**
+ * Local aligner that fills in, for every reference column, the maximum
+ * Smith-Waterman score of any cell in that column.  Uses Farrar's striped
+ * layout with the widest kernel the CPU supports (16 lanes for AVX2, 8 for
+ * SSE4.2 and SSE2); falls back to a scalar Gotoh recurrence otherwise.  Can
+ * also align several reads at once, one per lane.  All produce identical
+ * column maxima.
+ */
+class LocalAligner {
+
+public:
+
+	/**
+	 * simd caps the instruction set used, as one of the SIMD_* levels from
+	 * simd.h; by default the best one available is used.
+	 */
+	LocalAligner(const RealignParams& p, int simd = -1);
+
+	/**
+	 * Return name of the instruction set the striped kernel uses, or "none"
+	 * if only the scalar aligner is available.
+	 */
+	const char *kernel_name() const;
+
+	/**
+	 * Set the query.  Bases are encoded as in ReferenceSet.
+	 */
+	void init_query(const uint8_t *q, size_t qlen);
+
+	/**
+	 * Align the current query against rf[0..rflen) and store per-column
+	 * maxima in colmax.  Returns the overall maximum.
+	 */
+	int align(const uint8_t *rf, size_t rflen, std::vector<int>& colmax);
+
+	/**
+	 * Same as align() but using the scalar recurrence regardless of which
+	 * SIMD kernel is available.
+	 */
+	int align_scalar(const uint8_t *rf, size_t rflen, std::vector<int>& colmax);
+
+	/**
+	 * Return the most query/reference pairs align_batch() takes at once.
+	 */
+	size_t batch_lanes() const {
+		return lanes_;
+	}
+
+	/**
+	 * Align queries qs[k] against their own reference windows rfs[k] for
+	 * k < n <= batch_lanes(), one pair per vector lane, storing per-column
+	 * maxima for pair k in colmax[k].  Replaces the current query.  Pairs
+	 * work best when they are all about the same size, since every lane
+	 * does as much work as the longest query and window.
+	 */
+	void align_batch(
+		size_t n,
+		const uint8_t * const *qs,
+		const size_t *qlens,
+		const uint8_t * const *rfs,
+		const size_t *rflens,
+		std::vector<int> *colmax);
+
+	/**
+	 * Return score for aligning query base q to reference base r.
+	 */
+	inline int score(int q, int r) const {
+		if(q > 3 || r > 3) {
+			return -p_.n_penalty;
+		}
+		return q == r ? p_.match : -p_.mismatch;
+	}
+
+protected:
+
+	const RealignParams& p_;
+	int simd_;                     // SIMD level of kernel_
+	StripedKernel kernel_;         // striped kernel, or NULL for scalar only
+	BatchKernel batch_;            // inter-read kernel, or NULL for scalar only
+	size_t lanes_;                 // 16-bit lanes per vector in kernel_
+	std::vector<uint8_t> query_;
+	size_t qlen_;
+	size_t seglen_;                // # vectors spanning the query
+	std::vector<int16_t> profile_; // striped query profile, 5 x seglen_ x lanes_
+	std::vector<int16_t> hstore_;  // H, E and scratch vectors, seglen_ x lanes_
+	std::vector<int16_t> hload_;
+	std::vector<int16_t> e_;
+	std::vector<int> h_scalar_;    // scalar fallback rows
+	std::vector<int> e_scalar_;
+	std::vector<int16_t> bq_;      // interleaved queries for batch_
+	std::vector<int16_t> brf_;     // interleaved reference windows for batch_
+	std::vector<int16_t> bcol_;    // interleaved column maxima from batch_
+};
+
+/**
+ * Reduce per-column maxima to best score, second-best distinct placement and
+ * the number of near-equal placements.  Placements are local maxima of the
+ * column scores; ones within 'excl' columns of an already-accepted placement
+ * are not considered distinct.
+ */
+void summarize_columns(
+	const std::vector<int>& colmax,
+	size_t excl,
+	int near_delta,
+	RealignResult& res);
+
+/**
+ * Accumulates reads to realign so they can be processed together.  run()
+ * sorts the reads by length and window size and aligns them in groups of
+ * LocalAligner::batch_lanes(), one read per vector lane.
+ */
+class RealignBatch {
+
+public:
+
+	RealignBatch(const ReferenceSet& refs, const RealignParams& p) :
+		refs_(refs), p_(p), al_(p_) { }
+
+	/**
+	 * Queue a read for realignment.  lpos is the 0-based leftmost reference
+	 * offset involved in the reported alignment, possibly negative when the
+	 * read is soft clipped at the start of the reference; rflen is the number
+	 * of reference characters it spans.  Sequence is copied.  Returns index of
+	 * the job, for use with result().
+	 */
+	size_t add(
+		const char *seq,
+		size_t len,
+		const char *rname,
+		long long lpos,
+		size_t rflen);
+
+	/**
+	 * Realign all queued reads.
+	 */
+	void run();
+
+	/**
+	 * Same as run() but aligning one read at a time with the striped kernel.
+	 */
+	void run_serial();
+
+	/**
+	 * Return result for job i; only valid after run().
+	 */
+	const RealignResult& result(size_t i) const {
+		return results_[i];
+	}
+
+	/**
+	 * Return number of queued jobs.
+	 */
+	size_t size() const {
+		return jobs_.size();
+	}
+
+	/**
+	 * Forget all jobs and results, keeping buffers.
+	 */
+	void clear() {
+		jobs_.clear();
+		seqs_.clear();
+		results_.clear();
+	}
+
+protected:
+
+	struct Job {
+		size_t seqoff;  // offset into seqs_
+		size_t len;     // read length
+		int refi;       // reference index, or -1 if unknown
+		size_t wbeg;    // window start, inclusive
+		size_t wend;    // window end, exclusive
+	};
+
+	/**
+	 * Orders job indexes by read length, then window length.
+	 */
+	struct JobSizeLess {
+		JobSizeLess(const std::vector<Job>& jobs) : jobs_(jobs) { }
+		bool operator()(size_t a, size_t b) const {
+			const Job& ja = jobs_[a], & jb = jobs_[b];
+			if(ja.len != jb.len) {
+				return ja.len < jb.len;
+			}
+			return (ja.wend - ja.wbeg) < (jb.wend - jb.wbeg);
+		}
+		const std::vector<Job>& jobs_;
+	};
+
+	const ReferenceSet& refs_;
+	const RealignParams p_;
+	LocalAligner al_;
+	std::vector<Job> jobs_;
+	std::vector<uint8_t> seqs_;
+	std::vector<RealignResult> results_;
+	std::vector<size_t> order_;            // jobs to align, sorted by size
+	std::vector<std::vector<uint8_t> > windows_; // one reference window per lane
+	std::vector<std::vector<int> > colmax_;      // column maxima per lane
+};
+
+#endif /* defined(__qtip__realign__) */
@@ -0,0 +1,73 @@
+//
+//  realign_avx2.cpp
+//  qtip
+//
+//  Striped and inter-read local alignment kernels for CPUs with AVX2.
+//  Compiled with -mavx2; only ever called after simd_level() says the CPU
+//  supports it.
+//
+
+#include "realign_kernel.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+namespace {
+
+/**
+ * 16 x 16-bit lanes.  AVX2 byte shifts work within each 128-bit half, so
+ * shifting up a lane has to carry the top lane of the low half across.
+ */
+struct VecAVX2 {
+	typedef __m256i V;
+	enum { LANES = 16 };
+	static inline V load(const int16_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+	static inline void store(int16_t *p, V v) { _mm256_storeu_si256((__m256i*)p, v); }
+	static inline V set1(int x) { return _mm256_set1_epi16((short)x); }
+	static inline V zero() { return _mm256_setzero_si256(); }
+	static inline V adds(V a, V b) { return _mm256_adds_epi16(a, b); }
+	static inline V subs(V a, V b) { return _mm256_subs_epi16(a, b); }
+	static inline V max(V a, V b) { return _mm256_max_epi16(a, b); }
+	static inline V shift_up(V a) {
+		// low half of carry is zero, high half is low half of a
+		const V carry = _mm256_permute2x128_si256(a, a, 0x08);
+		return _mm256_alignr_epi8(a, carry, 14);
+	}
+	static inline V cmpeq(V a, V b) { return _mm256_cmpeq_epi16(a, b); }
+	static inline V cmpgt(V a, V b) { return _mm256_cmpgt_epi16(a, b); }
+	static inline V and_(V a, V b) { return _mm256_and_si256(a, b); }
+	static inline V or_(V a, V b) { return _mm256_or_si256(a, b); }
+	static inline V select(V m, V a, V b) { return _mm256_blendv_epi8(b, a, m); }
+	static inline bool any_gt(V a, V b) {
+		return _mm256_movemask_epi8(_mm256_cmpgt_epi16(a, b)) != 0;
+	}
+	static inline int hmax(V v) {
+		__m128i m = _mm_max_epi16(_mm256_castsi256_si128(v),
+		                          _mm256_extracti128_si256(v, 1));
+		const __m128i vtop = _mm_set1_epi16(0x7fff);
+		return 0x7fff - _mm_extract_epi16(_mm_minpos_epu16(_mm_sub_epi16(vtop, m)), 0);
+	}
+};
+
+}
+
+StripedKernel striped_kernel_avx2() {
+	return &striped_local_align<VecAVX2>;
+}
+
+BatchKernel batch_kernel_avx2() {
+	return &batch_local_align<VecAVX2>;
+}
+
+#else
+
+StripedKernel striped_kernel_avx2() {
+	return NULL;
+}
+
+BatchKernel batch_kernel_avx2() {
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,205 @@
+//
+//  realign_kernel.h
+//  qtip
+//
+
+#ifndef __qtip__realign_kernel__
+#define __qtip__realign_kernel__
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#include "realign.h"
+
+/**
+ * Farrar's striped Smith-Waterman with per-column maxima, written once in
+ * terms of a vector traits class VT so it can be compiled for several
+ * instruction sets.  VT supplies the vector type, LANES 16-bit lanes per
+ * vector, and the handful of saturating and mask operations used below.
+ * gap_open includes the first extension.
+ *
+ * Traits and instantiations must have internal linkage: the same inline
+ * function compiled with -mavx2 in one file and without in another would
+ * otherwise be merged by the linker, and the generic build could end up
+ * running AVX2 instructions.
+ */
+template<typename VT>
+static int striped_local_align(
+	const int16_t *profile,
+	size_t seglen,
+	const uint8_t *rf,
+	size_t rflen,
+	int gap_open,
+	int gap_extend,
+	int16_t *hs,
+	int16_t *hl,
+	int16_t *ev,
+	int *colmax)
+{
+	typedef typename VT::V V;
+	const size_t L = VT::LANES;
+	const V vzero = VT::zero();
+	const V vgapo = VT::set1(gap_open);
+	const V vgape = VT::set1(gap_extend);
+	memset(hs, 0, sizeof(int16_t) * seglen * L);
+	memset(ev, 0, sizeof(int16_t) * seglen * L);
+	int best = 0;
+	for(size_t j = 0; j < rflen; j++) {
+		const int16_t *prof = profile + rf[j] * seglen * L;
+		V vF = vzero;
+		V vMax = vzero;
+		// Diagonal for first segment comes from last segment of previous
+		// column, shifted up one lane
+		V vH = VT::shift_up(VT::load(hs + (seglen-1) * L));
+		std::swap(hs, hl);
+		for(size_t s = 0; s < seglen; s++) {
+			vH = VT::adds(vH, VT::load(prof + s * L));
+			V vE = VT::load(ev + s * L);
+			vH = VT::max(vH, vE);
+			vH = VT::max(vH, vF);
+			vH = VT::max(vH, vzero);
+			vMax = VT::max(vMax, vH);
+			VT::store(hs + s * L, vH);
+			vH = VT::subs(vH, vgapo);
+			vE = VT::max(VT::subs(vE, vgape), vH);
+			VT::store(ev + s * L, vE);
+			vF = VT::max(VT::subs(vF, vgape), vH);
+			vH = VT::load(hl + s * L);
+		}
+		// Lazy-F loop: propagate vertical gaps across lane boundaries until
+		// they can no longer improve any cell
+		vF = VT::shift_up(vF);
+		size_t s = 0;
+		while(true) {
+			V vHs = VT::load(hs + s * L);
+			// F can only matter where it's positive and beats opening a
+			// fresh gap from H
+			if(!VT::any_gt(vF, VT::max(VT::subs(vHs, vgapo), vzero))) {
+				break;
+			}
+			vHs = VT::max(vHs, vF);
+			VT::store(hs + s * L, vHs);
+			vMax = VT::max(vMax, vHs);
+			vHs = VT::subs(vHs, vgapo);
+			VT::store(ev + s * L, VT::max(VT::load(ev + s * L), vHs));
+			vF = VT::subs(vF, vgape);
+			if(++s == seglen) {
+				s = 0;
+				vF = VT::shift_up(vF);
+			}
+		}
+		int m = VT::hmax(vMax);
+		colmax[j] = m;
+		best = std::max(best, m);
+	}
+	return best;
+}
+
+/**
+ * Inter-read Gotoh local alignment: lane k of every vector belongs to a
+ * different query/reference pair, so each cell is the same scalar recurrence
+ * as LocalAligner::align_scalar() done for LANES pairs at once, with no
+ * striping and no lazy-F loop.  Query position i of lane k is qs[i * LANES
+ * + k] and reference position j is rf[j * LANES + k].  Rows past the end of
+ * a lane's query hold BATCH_PAD; they come after every real row, so can't
+ * feed back into it, and are masked out of the column maxima.  Columns past
+ * the end of a lane's window likewise can't affect earlier ones and are left
+ * for the caller to ignore.
+ */
+template<typename VT>
+static void batch_local_align(
+	const int16_t *qs,
+	size_t qmax,
+	const int16_t *rf,
+	size_t rflen,
+	int match,
+	int mismatch,
+	int n_penalty,
+	int gap_open,
+	int gap_extend,
+	int16_t *hv,
+	int16_t *ev,
+	int16_t *colmax)
+{
+	typedef typename VT::V V;
+	const size_t L = VT::LANES;
+	const V vzero = VT::zero();
+	const V vgapo = VT::set1(gap_open);
+	const V vgape = VT::set1(gap_extend);
+	const V vmatch = VT::set1(match);
+	const V vmis = VT::set1(-mismatch);
+	const V vn = VT::set1(-n_penalty);
+	const V vthree = VT::set1(3);
+	const V vpad = VT::set1(BATCH_PAD);
+	memset(hv, 0, sizeof(int16_t) * qmax * L);
+	memset(ev, 0, sizeof(int16_t) * qmax * L);
+	for(size_t j = 0; j < rflen; j++) {
+		const V vR = VT::load(rf + j * L);
+		const V vRn = VT::cmpgt(vR, vthree);
+		V vDiag = vzero;
+		V vF = vzero;
+		V vMax = vzero;
+		for(size_t i = 0; i < qmax; i++) {
+			const V vQ = VT::load(qs + i * L);
+			V vS = VT::select(VT::cmpeq(vQ, vR), vmatch, vmis);
+			vS = VT::select(VT::or_(VT::cmpgt(vQ, vthree), vRn), vn, vS);
+			V vE = VT::load(ev + i * L);
+			V vH = VT::adds(vDiag, vS);
+			vH = VT::max(vH, vE);
+			vH = VT::max(vH, vF);
+			vH = VT::max(vH, vzero);
+			vDiag = VT::load(hv + i * L);
+			VT::store(hv + i * L, vH);
+			vMax = VT::max(vMax, VT::and_(vH, VT::cmpgt(vpad, vQ)));
+			vH = VT::subs(vH, vgapo);
+			VT::store(ev + i * L, VT::max(VT::subs(vE, vgape), vH));
+			vF = VT::max(VT::subs(vF, vgape), vH);
+		}
+		VT::store(colmax + j * L, vMax);
+	}
+}
+
+#if defined(__SSE2__)
+
+#include <emmintrin.h>
+
+namespace {
+
+/**
+ * 8 x 16-bit lanes using nothing beyond SSE2, which every x86-64 CPU has.
+ */
+struct VecSSE2 {
+	typedef __m128i V;
+	enum { LANES = 8 };
+	static inline V load(const int16_t *p) { return _mm_loadu_si128((const __m128i*)p); }
+	static inline void store(int16_t *p, V v) { _mm_storeu_si128((__m128i*)p, v); }
+	static inline V set1(int x) { return _mm_set1_epi16((short)x); }
+	static inline V zero() { return _mm_setzero_si128(); }
+	static inline V adds(V a, V b) { return _mm_adds_epi16(a, b); }
+	static inline V subs(V a, V b) { return _mm_subs_epi16(a, b); }
+	static inline V max(V a, V b) { return _mm_max_epi16(a, b); }
+	static inline V shift_up(V a) { return _mm_slli_si128(a, 2); }
+	static inline V cmpeq(V a, V b) { return _mm_cmpeq_epi16(a, b); }
+	static inline V cmpgt(V a, V b) { return _mm_cmpgt_epi16(a, b); }
+	static inline V and_(V a, V b) { return _mm_and_si128(a, b); }
+	static inline V or_(V a, V b) { return _mm_or_si128(a, b); }
+	static inline V select(V m, V a, V b) {
+		return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+	}
+	static inline bool any_gt(V a, V b) {
+		return _mm_movemask_epi8(_mm_cmpgt_epi16(a, b)) != 0;
+	}
+	static inline int hmax(V v) {
+		v = _mm_max_epi16(v, _mm_srli_si128(v, 8));
+		v = _mm_max_epi16(v, _mm_srli_si128(v, 4));
+		v = _mm_max_epi16(v, _mm_srli_si128(v, 2));
+		return (int16_t)_mm_extract_epi16(v, 0);
+	}
+};
+
+}
+
+#endif
+
+#endif /* defined(__qtip__realign_kernel__) */
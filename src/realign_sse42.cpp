@@ -0,0 +1,55 @@
+//
+//  realign_sse42.cpp
+//  qtip
+//
+//  Striped and inter-read local alignment kernels for CPUs with SSE4.2.  Compiled with
+//  -msse4.2; only ever called after simd_level() says the CPU supports it.
+//
+
+#include "realign_kernel.h"
+
+#if defined(__SSE4_2__)
+
+#include <smmintrin.h>
+
+namespace {
+
+/**
+ * Same lanes as SSE2 but with a PTEST for the lazy-F exit check, PHMINPOSUW
+ * for the horizontal max and PBLENDVB for selects.
+ */
+struct VecSSE42 : public VecSSE2 {
+	static inline V select(V m, V a, V b) { return _mm_blendv_epi8(b, a, m); }
+	static inline bool any_gt(V a, V b) {
+		const V gt = _mm_cmpgt_epi16(a, b);
+		return !_mm_testz_si128(gt, gt);
+	}
+	static inline int hmax(V v) {
+		// Column maxima are never negative, so max(v) = 0x7fff - min(0x7fff - v)
+		// with the subtraction done unsigned
+		const V vtop = _mm_set1_epi16(0x7fff);
+		return 0x7fff - _mm_extract_epi16(_mm_minpos_epu16(_mm_sub_epi16(vtop, v)), 0);
+	}
+};
+
+}
+
+StripedKernel striped_kernel_sse42() {
+	return &striped_local_align<VecSSE42>;
+}
+
+BatchKernel batch_kernel_sse42() {
+	return &batch_local_align<VecSSE42>;
+}
+
+#else
+
+StripedKernel striped_kernel_sse42() {
+	return NULL;
+}
+
+BatchKernel batch_kernel_sse42() {
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,95 @@
+//
+//  refdict.h
+//  qtip
+//
+
+#ifndef __qtip__refdict__
+#define __qtip__refdict__
+
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Maps reference sequence names to small integer ids and back.  Ids are
+ * assigned in order of first addition, so a dictionary filled from a SAM
+ * file's @SQ header lines numbers references the same way for every SAM
+ * file made with the same aligner index.  That's what lets simulated read
+ * names carry an id instead of the full reference name: the input SAM's
+ * header numbers the FASTA contigs when the reads are simulated.  The
+ * simulating run records those ids ([model prefix]_refs.tsv), and parsing
+ * the tandem SAM with ref-ids starts from them, so the tandem SAM's
+ * references get the same ids even if its @SQ lines are in another order.
+ */
+class RefDict {
+
+public:
+
+	RefDict() : last_(-1) { }
+
+	/**
+	 * Add the reference named by the SN: field of an @SQ header line.
+	 * Return its id, or -1 if the line has no SN: field.
+	 */
+	int add_sq(const char *line) {
+		const char *sn = strstr(line, "\tSN:");
+		if(sn == NULL) {
+			return -1;
+		}
+		sn += 4;
+		size_t len = strcspn(sn, "\t\r\n");
+		return add(std::string(sn, len));
+	}
+
+	/**
+	 * Add a reference, if it's not already present, and return its id.
+	 */
+	int add(const std::string& name) {
+		std::map<std::string, int>::const_iterator it = ids_.find(name);
+		if(it != ids_.end()) {
+			return it->second;
+		}
+		int id = (int)names_.size();
+		names_.push_back(name);
+		ids_[name] = id;
+		return id;
+	}
+
+	/**
+	 * Return the id of the named reference, or -1 if it's not present.
+	 * Consecutive alignments are usually to the same reference, so the
+	 * last hit is checked first.
+	 */
+	int id(const char *name) const {
+		if(last_ >= 0 && strcmp(names_[last_].c_str(), name) == 0) {
+			return last_;
+		}
+		std::map<std::string, int>::const_iterator it = ids_.find(name);
+		if(it == ids_.end()) {
+			return -1;
+		}
+		last_ = it->second;
+		return last_;
+	}
+
+	const std::string& name(int id) const {
+		return names_[id];
+	}
+
+	size_t size() const {
+		return names_.size();
+	}
+
+	bool empty() const {
+		return names_.empty();
+	}
+
+protected:
+
+	std::vector<std::string> names_;
+	std::map<std::string, int> ids_;
+	mutable int last_;
+};
+
+#endif /* defined(__qtip__refdict__) */
@@ -0,0 +1,421 @@
+//
+//  run_decode.cpp
+//  qtip
+//
+
+#include "run_decode.h"
+#include "simd.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+void decode_cigar_scalar(
+	const char *cigar,
+	size_t len,
+	EList<char>& ops,
+	EList<int>& runs)
+{
+	size_t i = 0;
+	while(i < len) {
+		int run = 0;
+		while(i < len && isdigit(cigar[i])) {
+			run *= 10;
+			run += ((int)cigar[i] - (int)'0');
+			i++;
+		}
+		if(i == len) {
+			break; // trailing digits with no operation
+		}
+		ops.push_back(cigar[i++]);
+		runs.push_back(run);
+	}
+}
+
+void decode_mdz_scalar(
+	const char *mdz,
+	size_t len,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars)
+{
+	size_t i = 0;
+	while(i < len) {
+		if(isdigit(mdz[i])) {
+			// Matching stretch
+			int run = 0;
+			do {
+				run *= 10;
+				run += ((int)mdz[i] - (int)'0');
+				i++;
+			} while(i < len && isdigit(mdz[i]));
+			if(run > 0) {
+				oro.expand();
+				oro.back().init(0, run, -1);
+			}
+		} else if(isalpha(mdz[i])) {
+			// Mismatching stretch
+			int run = 0;
+			do {
+				chars.push_back(mdz[i++]);
+				run++;
+			} while(i < len && isalpha(mdz[i]));
+			oro.expand();
+			oro.back().init(1, run, (int)(chars.size() - run));
+		} else if(mdz[i] == '^') {
+			i++; // skip the ^
+			int run = 0;
+			while(i < len && isalpha(mdz[i])) {
+				chars.push_back(mdz[i++]);
+				run++;
+			}
+			oro.expand();
+			oro.back().init(2, run, (int)(chars.size() - run));
+		} else {
+			fprintf(stderr, "Unexpected character at position %d of MD:Z string '%.*s'\n",
+			        (int)i, (int)len, mdz);
+			i++;
+		}
+	}
+}
+
+#if defined(__SSE2__)
+
+/**
+ * Return true iff the n bytes from p are on one page, so they can be read
+ * even if only some of them belong to the string; the rest are masked off.
+ * Saves copying the ends of short strings.
+ */
+static inline bool same_page(const char *p, size_t n) {
+	return ((uintptr_t)p & 4095) <= 4096 - n;
+}
+
+/**
+ * Return the number spelled by the digits s[beg, end).  Runs of up to 8
+ * digits that can be read 8 bytes at a time are converted all at once:
+ * the digits are shifted to the top of a 64-bit word, padded with '0's
+ * below, and combined pairwise, then in fours, then in eights.
+ */
+static inline int digits_to_int(const char *s, size_t beg, size_t end, size_t len) {
+	const size_t k = end - beg;
+	if(k == 0) {
+		return 0;
+	}
+	if(k <= 8 && (beg + 8 <= len || same_page(s + beg, 8))) {
+		uint64_t v;
+		memcpy(&v, s + beg, 8);
+		if(k < 8) {
+			v = (v << (8 * (8 - k))) | (0x3030303030303030ULL >> (8 * k));
+		}
+		v -= 0x3030303030303030ULL;
+		v = (v * 10) + (v >> 8);
+		v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+		     (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+		return (int)v;
+	}
+	int run = 0;
+	for(size_t i = beg; i < end; i++) {
+		run = run * 10 + ((int)s[i] - (int)'0');
+	}
+	return run;
+}
+
+/**
+ * Return a mask with bit i set iff s[off + i] isn't a decimal digit, for the
+ * up to 16 characters from off that are before len.
+ */
+static inline unsigned nondigit_mask(const char *s, size_t off, size_t len) {
+	__m128i v;
+	if(off + 16 <= len || same_page(s + off, 16)) {
+		v = _mm_loadu_si128((const __m128i *)(s + off));
+	} else {
+		char tail[16];
+		memset(tail, 0, 16);
+		memcpy(tail, s + off, len - off);
+		v = _mm_loadu_si128((const __m128i *)tail);
+	}
+	const __m128i dig = _mm_and_si128(
+		_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	unsigned mask = ~(unsigned)_mm_movemask_epi8(dig) & 0xffffu;
+	if(len - off < 16) {
+		mask &= (1u << (len - off)) - 1;
+	}
+	return mask;
+}
+
+void decode_cigar_sse2(
+	const char *cigar,
+	size_t len,
+	EList<char>& ops,
+	EList<int>& runs)
+{
+	size_t run_beg = 0;
+	for(size_t off = 0; off < len; off += 16) {
+		unsigned mask = nondigit_mask(cigar, off, len);
+		while(mask != 0) {
+			const size_t i = off + __builtin_ctz(mask);
+			mask &= mask - 1;
+			ops.push_back(cigar[i]);
+			runs.push_back(digits_to_int(cigar, run_beg, i, len));
+			run_beg = i + 1;
+		}
+	}
+}
+
+/**
+ * Finish a mismatch or deletion stretch of an MD:Z string, if one's open.
+ */
+static inline void close_mdz_stretch(
+	char& open,
+	int run,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars)
+{
+	if(open != 0) {
+		oro.expand();
+		oro.back().init(open, run, (int)(chars.size() - run));
+		open = 0;
+	}
+}
+
+/**
+ * Finish the digit run mdz[beg, end), if non-empty, and any stretch before
+ * it.
+ */
+static inline void close_mdz_digits(
+	const char *mdz,
+	size_t beg,
+	size_t end,
+	size_t len,
+	char& open,
+	int open_run,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars)
+{
+	if(end > beg) {
+		close_mdz_stretch(open, open_run, oro, chars);
+		int run = digits_to_int(mdz, beg, end, len);
+		if(run > 0) {
+			oro.expand();
+			oro.back().init(0, run, -1);
+		}
+	}
+}
+
+void decode_mdz_sse2(
+	const char *mdz,
+	size_t len,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars)
+{
+	// Non-digits are few and come in short stretches, so they're handled
+	// one at a time; it's the digit runs between them that are skipped
+	char open = 0; // 1 or 2 while a mismatch or deletion stretch is open
+	int open_run = 0;
+	size_t run_beg = 0;
+	for(size_t off = 0; off < len; off += 16) {
+		unsigned mask = nondigit_mask(mdz, off, len);
+		while(mask != 0) {
+			const size_t i = off + __builtin_ctz(mask);
+			mask &= mask - 1;
+			close_mdz_digits(mdz, run_beg, i, len, open, open_run, oro, chars);
+			run_beg = i + 1;
+			const char c = mdz[i];
+			if(c == '^') {
+				close_mdz_stretch(open, open_run, oro, chars);
+				open = 2;
+				open_run = 0;
+			} else if(isalpha(c)) {
+				if(open == 0) {
+					open = 1;
+					open_run = 0;
+				}
+				chars.push_back(c);
+				open_run++;
+			} else {
+				close_mdz_stretch(open, open_run, oro, chars);
+				fprintf(stderr, "Unexpected character at position %d of MD:Z string '%.*s'\n",
+				        (int)i, (int)len, mdz);
+			}
+		}
+	}
+	close_mdz_digits(mdz, run_beg, len, len, open, open_run, oro, chars);
+	close_mdz_stretch(open, open_run, oro, chars);
+}
+
+#endif
+
+void decode_cigar(
+	const char *cigar,
+	size_t len,
+	EList<char>& ops,
+	EList<int>& runs)
+{
+#if defined(__SSE2__)
+	if(simd_level() >= SIMD_SSE2) {
+		decode_cigar_sse2(cigar, len, ops, runs);
+		return;
+	}
+#endif
+	decode_cigar_scalar(cigar, len, ops, runs);
+}
+
+void decode_mdz(
+	const char *mdz,
+	size_t len,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars)
+{
+#if defined(__SSE2__)
+	if(simd_level() >= SIMD_SSE2) {
+		decode_mdz_sse2(mdz, len, oro, chars);
+		return;
+	}
+#endif
+	decode_mdz_scalar(mdz, len, oro, chars);
+}
+
+#ifdef RUN_DECODE_MAIN
+
+#include <stdlib.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+
+static bool same_cigar(const char *s) {
+	EList<char> ops1, ops2;
+	EList<int> runs1, runs2;
+	decode_cigar_scalar(s, strlen(s), ops1, runs1);
+	decode_cigar_sse2(s, strlen(s), ops2, runs2);
+	if(ops1.size() != ops2.size()) {
+		return false;
+	}
+	for(size_t i = 0; i < ops1.size(); i++) {
+		if(ops1[i] != ops2[i] || runs1[i] != runs2[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool same_mdz(const char *s) {
+	EList<OpRunOffset> oro1, oro2;
+	EList<char> chars1, chars2;
+	decode_mdz_scalar(s, strlen(s), oro1, chars1);
+	decode_mdz_sse2(s, strlen(s), oro2, chars2);
+	if(oro1.size() != oro2.size() || chars1.size() != chars2.size()) {
+		return false;
+	}
+	for(size_t i = 0; i < oro1.size(); i++) {
+		if(oro1[i].op != oro2[i].op || oro1[i].run != oro2[i].run ||
+		   oro1[i].offset != oro2[i].offset)
+		{
+			return false;
+		}
+	}
+	for(size_t i = 0; i < chars1.size(); i++) {
+		if(chars1[i] != chars2[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Append a random run length of 1-9 digits, sometimes with leading zeros.
+ */
+static void random_run(std::string& s) {
+	int ndig = 1 + rand() % 9;
+	if(rand() % 2 == 0) {
+		ndig = 1 + rand() % 3;  // short runs are the common case
+	}
+	for(int i = 0; i < ndig; i++) {
+		s.push_back((char)('0' + rand() % 10));
+	}
+}
+
+static void test1() {
+	// Known answers
+	EList<char> ops;
+	EList<int> runs;
+	decode_cigar_scalar("5S100M2I12345678D3S", 19, ops, runs);
+	assert(ops.size() == 5);
+	assert(ops[0] == 'S' && runs[0] == 5);
+	assert(ops[1] == 'M' && runs[1] == 100);
+	assert(ops[3] == 'D' && runs[3] == 12345678);
+	assert(ops[4] == 'S' && runs[4] == 3);
+	EList<OpRunOffset> oro;
+	EList<char> chars;
+	decode_mdz_scalar("10A0C^GT5", 9, oro, chars);
+	assert(oro.size() == 5);
+	assert(oro[0].op == 0 && oro[0].run == 10);
+	assert(oro[1].op == 1 && oro[1].run == 1 && oro[1].offset == 0);
+	assert(oro[2].op == 1 && oro[2].run == 1 && oro[2].offset == 1);
+	assert(oro[3].op == 2 && oro[3].run == 2 && oro[3].offset == 2);
+	assert(oro[4].op == 0 && oro[4].run == 5);
+	assert(chars.size() == 4 && chars[3] == 'T');
+	const char *cases[] = {"", "M", "100M", "0M", "1234567890M", "99999999M",
+	                       "12345678901234567M", "7", "^", "^5", "A", "5A^C",
+	                       "AC^GT0A", "00000000000000001", NULL};
+	for(int i = 0; cases[i] != NULL; i++) {
+		assert(same_cigar(cases[i]));
+		assert(same_mdz(cases[i]));
+	}
+	std::cerr << "PASSED test1" << std::endl;
+}
+
+static void test2() {
+	// Differential fuzz: random CIGARs against the scalar decoder
+	const char *cops = "MIDNSHP=X";
+	srand(11);
+	for(int t = 0; t < 200000; t++) {
+		std::string s;
+		int nops = rand() % 40;
+		for(int i = 0; i < nops; i++) {
+			random_run(s);
+			s.push_back(cops[rand() % 9]);
+		}
+		assert(same_cigar(s.c_str()));
+	}
+	std::cerr << "PASSED test2" << std::endl;
+}
+
+static void test3() {
+	// Differential fuzz: random MD:Z strings against the scalar decoder
+	const char *bases = "ACGTN";
+	srand(13);
+	for(int t = 0; t < 200000; t++) {
+		std::string s;
+		int nels = rand() % 40;
+		for(int i = 0; i < nels; i++) {
+			int r = rand() % 4;
+			if(r < 2) {
+				random_run(s);
+			} else {
+				if(r == 3) {
+					s.push_back('^');
+				}
+				int nb = rand() % 4;
+				for(int j = 0; j < nb; j++) {
+					s.push_back(bases[rand() % 5]);
+				}
+			}
+		}
+		assert(same_mdz(s.c_str()));
+	}
+	std::cerr << "PASSED test3" << std::endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+	test3();
+}
+
+#endif
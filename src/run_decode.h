@@ -0,0 +1,88 @@
+//
+//  run_decode.h
+//  qtip
+//
+
+#ifndef __qtip__run_decode__
+#define __qtip__run_decode__
+
+#include <stddef.h>
+#include "ds.h"
+
+/**
+ * Decoders for the run-length strings in SAM records: CIGAR strings and
+ * MD:Z fields.  Each has a scalar version and an SSE2 version that finds
+ * the non-digit characters 16 bytes at a time and converts each digit run
+ * with SWAR arithmetic rather than a digit at a time.  Both give the same
+ * results; the one without a suffix picks the SSE2 version when simd_level()
+ * allows (see simd.h).
+ */
+
+/**
+ * One element of a decoded MD:Z string.  op is 0 for a stretch of matches,
+ * 1 for a stretch of mismatched reference characters and 2 for a stretch
+ * of deleted reference characters.  For 1 and 2, offset is where the
+ * characters start in the character list; it's -1 for matches.
+ */
+struct OpRunOffset {
+	char op;
+	int run;
+	int offset;
+
+	void init(char _op, int _run, int _offset) {
+		op = _op;
+		run = _run;
+		offset = _offset;
+	}
+};
+
+/**
+ * Append the operations and run lengths of the CIGAR string cigar, of
+ * length len, to ops and runs.
+ */
+void decode_cigar(
+	const char *cigar,
+	size_t len,
+	EList<char>& ops,
+	EList<int>& runs);
+
+void decode_cigar_scalar(
+	const char *cigar,
+	size_t len,
+	EList<char>& ops,
+	EList<int>& runs);
+
+/**
+ * Append the elements of the MD:Z string mdz, of length len, to oro, and the
+ * reference characters it mentions to chars.  Zero-length match stretches
+ * are left out.
+ */
+void decode_mdz(
+	const char *mdz,
+	size_t len,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars);
+
+void decode_mdz_scalar(
+	const char *mdz,
+	size_t len,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars);
+
+#if defined(__SSE2__)
+
+void decode_cigar_sse2(
+	const char *cigar,
+	size_t len,
+	EList<char>& ops,
+	EList<int>& runs);
+
+void decode_mdz_sse2(
+	const char *mdz,
+	size_t len,
+	EList<OpRunOffset>& oro,
+	EList<char>& chars);
+
+#endif
+
+#endif /* defined(__qtip__run_decode__) */
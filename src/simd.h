@@ -0,0 +1,77 @@
+//
+//  simd.h
+//  qtip
+//
+
+#ifndef __qtip__simd__
+#define __qtip__simd__
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Instruction set levels for which qtip has SIMD kernels, in increasing order
+ * of capability.
+ */
+enum {
+	SIMD_NONE = 0,
+	SIMD_SSE2,
+	SIMD_SSE42,
+	SIMD_AVX2
+};
+
+/**
+ * Return name of given SIMD level.
+ */
+static inline const char *simd_level_name(int level) {
+	switch(level) {
+		case SIMD_SSE2:  return "sse2";
+		case SIMD_SSE42: return "sse4.2";
+		case SIMD_AVX2:  return "avx2";
+		default:         return "none";
+	}
+}
+
+/**
+ * Ask the CPU which of the instruction sets we have kernels for it supports.
+ * If the QTIP_SIMD environment variable is set to none, sse2, sse42 or avx2,
+ * the result is capped at that level, which is handy for testing fallbacks.
+ */
+static inline int detect_simd_level() {
+	int level = SIMD_NONE;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) {
+		level = SIMD_SSE2;
+		if(__builtin_cpu_supports("sse4.2")) {
+			level = SIMD_SSE42;
+			if(__builtin_cpu_supports("avx2")) {
+				level = SIMD_AVX2;
+			}
+		}
+	}
+#endif
+	const char *cap = getenv("QTIP_SIMD");
+	if(cap != NULL) {
+		int cap_level = level;
+		if(strcmp(cap, "none") == 0) {
+			cap_level = SIMD_NONE;
+		} else if(strcmp(cap, "sse2") == 0) {
+			cap_level = SIMD_SSE2;
+		} else if(strcmp(cap, "sse42") == 0) {
+			cap_level = SIMD_SSE42;
+		}
+		level = (cap_level < level) ? cap_level : level;
+	}
+	return level;
+}
+
+/**
+ * Return the SIMD level to use, detecting it on first call.
+ */
+inline int simd_level() {
+	static const int level = detect_simd_level();
+	return level;
+}
+
+#endif /* defined(__qtip__simd__) */
@@ -15,6 +15,8 @@
 #include "fasta.h"
 #include "rnglib.hpp"
 #include "edit_xscript.h"
+#include "perfcount.h"
+#include "probes.h"
 
 using namespace std;
 
@@ -25,6 +27,8 @@ static inline size_t draw_binomial(size_t n, float p) {
 	return (size_t)ignbin((int)n, p);
 }
 
+RandomBaseSource random_bases;
+
 /**
  * Mutate given simulated read in-place.
  */
@@ -37,23 +41,31 @@ void SimulatedRead::mutate(const char *seq) {
 	const size_t edlen = strlen(edit_xscript_);
 	for(size_t i = 0; i < edlen; i++) {
 		if(edit_xscript_[i] == '=') {
-			assert(seq[rfoff] != '\0');
-			assert(isalpha(seq[rfoff]));
-			seq_buf_[rdoff++] = seq[rfoff++];
+			// copy the whole run of matches at once
+			size_t run = 1;
+			while(i + run < edlen && edit_xscript_[i + run] == '=') {
+				run++;
+			}
+			memcpy(seq_buf_ + rdoff, seq + rfoff, run);
+#ifndef NDEBUG
+			for(size_t j = 0; j < run; j++) {
+				assert(seq[rfoff + j] != '\0');
+				assert(isalpha(seq[rfoff + j]));
+			}
+#endif
+			rdoff += run;
+			rfoff += run;
+			i += run - 1;
 		} else if(edit_xscript_[i] == 'X') {
 			assert(seq[rfoff] != '\0');
 			assert(isalpha(seq[rfoff]));
-			do {
-				seq_buf_[rdoff] = draw_base();
-			} while(seq_buf_[rdoff] == seq[rfoff]);
-			rdoff++;
-			rfoff++;
+			seq_buf_[rdoff++] = random_bases.substitute(seq[rfoff++]);
 		} else if(edit_xscript_[i] == 'I') {
-			seq_buf_[rdoff++] = draw_base();
+			seq_buf_[rdoff++] = random_bases.base();
 		} else if(edit_xscript_[i] == 'D') {
 			rfoff++;
 		} else if(edit_xscript_[i] == 'S') {
-			seq_buf_[rdoff++] = draw_base();
+			seq_buf_[rdoff++] = random_bases.base();
 			rfoff++;
 		} else {
 			fprintf(stderr, "Unknown operation in edit transcript: '%c'\n", edit_xscript_[i]);
@@ -101,7 +113,7 @@ char asc2dnacomp[] = {
  */
 void SimulatedRead::write(FILE *fh, const char *typ) {
 	size_t len = strlen(qual_);
-	fprintf(fh, "@%s%c%s%c%c%c%llu%c%d%c%s\n",
+	fprintf(fh, "@%s%c%d%c%c%c%llu%c%d%c%s\n",
 			sim_startswith, sim_sep,
 			refid_, sim_sep,
 			fw_ ? '+' : '-', sim_sep,
@@ -138,7 +150,7 @@ void SimulatedRead::write_pair(
 {
 	FILE *fhs[2] = {fh1, fh2};
 	for(size_t i = 0; i < 2; i++) {
-		fprintf(fhs[i], "@%s%c%s%c%c%c%llu%c%d%c%s%c%c%c%llu%c%d%c%s\n",
+		fprintf(fhs[i], "@%s%c%d%c%c%c%llu%c%d%c%d%c%c%c%llu%c%d%c%s\n",
 				sim_startswith, sim_sep,
 				rd1.refid_, sim_sep,
 				rd1.fw_ ? '+' : '-', sim_sep, // got different fws
@@ -189,6 +201,114 @@ size_t apply_function(float fraction, int function, size_t mn, size_t n) {
     return std::max((size_t)nn, mn);
 }
 
+/**
+ * Scan a new chunk, recording its N-free runs.
+ */
+void ValidStarts::init(
+	const char *buf,
+	size_t len,
+	size_t nslots,
+	size_t max_class)
+{
+	runs_.clear();
+	cum_.clear();
+	nslots_ = nslots;
+	max_class_ = max_class;
+	size_t i = 0;
+	while(i < len) {
+		const char *n = (const char *)memchr(buf + i, 'N', len - i);
+		size_t end = (n == NULL) ? len : (size_t)(n - buf);
+		if(end > i) {
+			runs_.push_back(make_pair(i, end));
+		}
+		i = end + 1;
+	}
+}
+
+/**
+ * Return true iff [off, off+len) lies within an N-free run.
+ */
+bool ValidStarts::n_free(size_t off, size_t len) const {
+	// last run starting at or before off
+	vector<pair<size_t, size_t> >::const_iterator it = upper_bound(
+		runs_.begin(), runs_.end(), make_pair(off, (size_t)-1));
+	if(it == runs_.begin()) {
+		return false;
+	}
+	--it;
+	return off + len <= it->second;
+}
+
+/**
+ * Return cumulative valid-start counts for length class cls.  Element r is
+ * the number of valid starts in runs 0 through r.
+ */
+const vector<size_t>& ValidStarts::cumulative(size_t cls) {
+	map<size_t, vector<size_t> >::iterator it = cum_.find(cls);
+	if(it != cum_.end()) {
+		return it->second;
+	}
+	vector<size_t>& cum = cum_[cls];
+	cum.resize(runs_.size());
+	size_t tot = 0;
+	for(size_t r = 0; r < runs_.size(); r++) {
+		const size_t beg = runs_[r].first, end = runs_[r].second;
+		if(beg < nslots_ && end >= beg + cls) {
+			tot += std::min(end - cls + 1, nslots_) - beg;
+		}
+		cum[r] = tot;
+	}
+	return cum;
+}
+
+/**
+ * Return number of valid starts for a template spanning len ref chars.
+ */
+size_t ValidStarts::count(size_t len) {
+	const size_t cls = std::max(len, std::min(length_class(len), max_class_));
+	const vector<size_t>& cum = cumulative(cls);
+	return cum.empty() ? 0 : cum.back();
+}
+
+/**
+ * Return a uniformly random valid start for a template spanning len ref
+ * chars.
+ */
+size_t ValidStarts::draw(size_t len) {
+	const size_t cls = std::max(len, std::min(length_class(len), max_class_));
+	const vector<size_t>& cum = cumulative(cls);
+	assert(!cum.empty() && cum.back() > 0);
+	size_t k = std::min((size_t)(r4_uni_01() * cum.back()), cum.back()-1);
+	// first run whose cumulative count exceeds k
+	size_t r = upper_bound(cum.begin(), cum.end(), k) - cum.begin();
+	assert(r < runs_.size());
+	const size_t before = (r == 0) ? 0 : cum[r-1];
+	const size_t off = runs_[r].first + (k - before);
+	assert(off < nslots_);
+	assert(off + cls <= runs_[r].second);
+	return off;
+}
+
+/**
+ * Return the index of the segment holding offset off.
+ */
+size_t StreamingSimulator::segment_at(
+	const std::vector<Segment>& segs,
+	size_t off)
+{
+	assert(!segs.empty());
+	size_t lo = 0, hi = segs.size();
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if(segs[mid].beg <= off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
 /**
  * Simulate a batch of reads
  */
@@ -198,212 +318,310 @@ void StreamingSimulator::simulate_batch(
 	size_t min_u,
 	size_t min_c,
 	size_t min_d,
-	size_t min_b)
+	size_t min_b,
+	const char *categories,
+	Checkpointer *ck)
 {
-	size_t nc = 0, nd = 0, nu = 0, nb = 0;
-	size_t n_wrote_c = 0, n_wrote_d = 0, n_wrote_u = 0, n_wrote_b = 0;
-	nu = apply_function(fraction, function, min_u, model_u_.num_added());
-	nb = apply_function(fraction, function, min_b, model_b_.num_added());
-	nc = apply_function(fraction, function, min_c, model_c_.num_added());
-	nd = apply_function(fraction, function, min_d, model_d_.num_added());
-	assert(nu + nb + nc + nd > 0);
+	SimCounts cnt;
+	if(strchr(categories, 'u') != NULL) {
+		cnt.nu = apply_function(fraction, function, min_u, model_u_.num_added());
+	}
+	if(strchr(categories, 'b') != NULL) {
+		cnt.nb = apply_function(fraction, function, min_b, model_b_.num_added());
+	}
+	if(strchr(categories, 'c') != NULL) {
+		cnt.nc = apply_function(fraction, function, min_c, model_c_.num_added());
+	}
+	if(strchr(categories, 'd') != NULL) {
+		cnt.nd = apply_function(fraction, function, min_d, model_d_.num_added());
+	}
+	if(cnt.nu + cnt.nb + cnt.nc + cnt.nd == 0) {
+		cerr << "    No templates for categories \"" << categories
+		     << "\"; nothing to simulate" << endl;
+		return;
+	}
 	
 	std::string refid, refid_full;
 	size_t refoff = 0, retsz = 0;
-	SimulatedRead rd1, rd2;
-	int hist[256];
-	const int max_attempts = 10;
+	std::vector<Segment> chunk_seg(1);
+	pack_.clear();
+	pack_segs_.clear();
+	size_t npacked = 0;
+	// Checkpoint on the way in too, so a restarted run doesn't have to parse
+	// the input again; no need if we're resuming from that checkpoint
+	bool first = true;
+	if(ck != NULL && ck->resuming()) {
+		cerr << "    Resuming from checkpoint" << endl;
+		restore(ck->reader(), cnt, refid, refid_full, npacked);
+		ck->resumed();
+		first = false;
+	}
 	while(true) {
+		if(ck != NULL && ck->enabled() && (first || ck->due())) {
+			if(ck->save([&](CheckpointWriter& w) {
+				save(w, cnt, refid, refid_full, npacked);
+			}) != 0)
+			{
+				throw 1;
+			}
+		}
+		first = false;
 		const char * buf = fa_.next(refid, refid_full, refoff, retsz);
-		if(buf == NULL && fa_.done()) {
-			break; // finished scanning FASTA
+		if(buf == NULL) {
+			if(fa_.done()) {
+				break; // finished scanning FASTA
+			}
+			continue; // finished a FASTA file
 		}
-		if(retsz < olap_) {
-			continue; // chunk is too small to simulate fragments from
+		const int refidx = refs_.add(refid);
+		if(fa_.last_chunk() && refoff == 0) {
+			// The whole record fit in one chunk.  Pack it together with
+			// other short records, N-separated so no template straddles
+			// two of them, and simulate from them all at once
+			if(!pack_.empty() && pack_.size() + 1 + retsz > chunksz_) {
+				simulate_chunk(&pack_.front(), pack_.size(), pack_.size(),
+				               pack_segs_, cnt);
+				pack_.clear();
+				pack_segs_.clear();
+			}
+			if(!pack_.empty()) {
+				pack_.push_back('N');
+			}
+			pack_segs_.push_back(Segment(pack_.size(), refidx, 0));
+			pack_.insert(pack_.end(), buf, buf + retsz);
+			npacked++;
+			continue;
 		}
-		const size_t nchances = retsz - olap_ + 1; // # draws within window
+		// Starts in the last olap_ characters are drawn from the next chunk,
+		// which repeats them, unless this is the record's last chunk
+		const size_t nslots = fa_.last_chunk() ? retsz : retsz - olap_;
+		chunk_seg[0] = Segment(0, refidx, refoff);
+		simulate_chunk(buf, retsz, nslots, chunk_seg, cnt);
+	}
+	if(!pack_.empty()) {
+		simulate_chunk(&pack_.front(), pack_.size(), pack_.size(),
+		               pack_segs_, cnt);
+	}
+	if(npacked > 0) {
+		cerr << "    Packed " << npacked << " short FASTA records "
+		     << "into shared chunks" << endl;
+	}
+	cerr << "    Wrote " << cnt.wrote_u << " unpaired tandem reads "
+	     << "(target=" << cnt.nu << ")" << endl;
+	cerr << "    Wrote " << cnt.wrote_b << " bad-end tandem reads "
+	     << "(target=" << cnt.nb << ")" << endl;
+	cerr << "    Wrote " << cnt.wrote_c << " concordant tandem pairs "
+	     << "(target=" << cnt.nc << ")" << endl;
+	cerr << "    Wrote " << cnt.wrote_d << " discordant tandem pairs "
+	     << "(target=" << cnt.nd << ")" << endl;
+}
 
-		const float binom_p = min(((float)nchances) * 1.1f / tot_fasta_len_, 0.999f);
-		// Histogram characters
-		memset(hist, 0, sizeof(int) * 256);
-		for(size_t i = 0; i < retsz; i++) {
-			hist[(int)buf[i]]++;
-		}
-		if(hist['N'] > (int)(0.9 * retsz)) {
-			continue; // skip chunks that are mostly Ns
-		}
-		
-		// Maybe N content should affect choice for n*_chances
-		
-		//
-		// Unpaired
-		//
-		
-		size_t nu_samp = draw_binomial(nu, binom_p);
-		for(size_t i = 0; i < nu_samp; i++) {
-			int attempts = 0;
-			do {
-				if(attempts > max_attempts) {
-					break;
-				}
-				attempts++;
-				const TemplateUnpaired &t = model_u_.draw();
-				size_t nslots = retsz - olap_;
-				assert(nslots > 0);
-				size_t off = std::min((size_t)(r4_uni_01() * nslots), nslots-1);
-				assert(off < nslots);
-				const size_t rflen = t.reflen();
-				for(size_t j = off; j < off + rflen; j++) {
-					const int b = buf[j];
-					if(b != 'A' && b != 'C' && b != 'G' && b != 'T') {
-						continue; // uses 1 attempt
-					}
-				}
-				rd1.init(
-					buf + off,
-					t.qual_,
-					t.edit_xscript_,
-					t.fw_flag_ == 'T',
-					t.best_score_,
-					refid.c_str(),
-					refoff + off);
-				n_wrote_u++;
-				rd1.write(fh_u_, "u");
-			} while(false);
+void StreamingSimulator::save(
+	CheckpointWriter& w,
+	const SimCounts& cnt,
+	const std::string& refid,
+	const std::string& refid_full,
+	size_t npacked) const
+{
+	checkpoint_save_rng(w);
+	random_bases.save(w);
+	w.put_u64(cnt.nu); w.put_u64(cnt.nb); w.put_u64(cnt.nc); w.put_u64(cnt.nd);
+	w.put_u64(cnt.wrote_u); w.put_u64(cnt.wrote_b);
+	w.put_u64(cnt.wrote_c); w.put_u64(cnt.wrote_d);
+	w.put_str(refid);
+	w.put_str(refid_full);
+	fa_.save(w);
+	w.put_u64(pack_.size());
+	w.put_bytes(pack_.empty() ? NULL : &pack_.front(), pack_.size());
+	w.put_u64(pack_segs_.size());
+	for(size_t i = 0; i < pack_segs_.size(); i++) {
+		w.put_u64(pack_segs_[i].beg);
+		w.put_i64(pack_segs_[i].refid);
+		w.put_u64(pack_segs_[i].refoff);
+	}
+	w.put_u64(npacked);
+}
+
+void StreamingSimulator::restore(
+	CheckpointReader& r,
+	SimCounts& cnt,
+	std::string& refid,
+	std::string& refid_full,
+	size_t& npacked)
+{
+	checkpoint_restore_rng(r);
+	random_bases.restore(r);
+	cnt.nu = r.get_u64(); cnt.nb = r.get_u64(); cnt.nc = r.get_u64(); cnt.nd = r.get_u64();
+	cnt.wrote_u = r.get_u64(); cnt.wrote_b = r.get_u64();
+	cnt.wrote_c = r.get_u64(); cnt.wrote_d = r.get_u64();
+	refid = r.get_str();
+	refid_full = r.get_str();
+	fa_.restore(r);
+	pack_.resize((size_t)r.get_u64());
+	r.get_bytes(pack_.empty() ? NULL : &pack_.front(), pack_.size());
+	pack_segs_.resize((size_t)r.get_u64());
+	for(size_t i = 0; i < pack_segs_.size(); i++) {
+		pack_segs_[i].beg = (size_t)r.get_u64();
+		pack_segs_[i].refid = (int)r.get_i64();
+		pack_segs_[i].refoff = (size_t)r.get_u64();
+	}
+	npacked = (size_t)r.get_u64();
+}
+
+/**
+ * Simulate reads from one buffer of reference characters.  Templates may
+ * start in [0, nslots) and must end within the buffer.
+ */
+void StreamingSimulator::simulate_chunk(
+	const char *buf,
+	size_t len,
+	size_t nslots,
+	const std::vector<Segment>& segs,
+	SimCounts& cnt)
+{
+	PerfScope perf("sim_chunk");
+	QTIP_PROBE2(sim_chunk, len, segs.size());
+	const int max_attempts = 10;
+	starts_.init(buf, len, nslots, olap_);
+	
+	// Each category's share of this chunk is proportional to the number
+	// of places a read of its average length fits without covering an
+	// N, so chunks with N runs get proportionally fewer reads rather
+	// than reads that can't align
+	
+	//
+	// Unpaired
+	//
+	
+	size_t nu_samp = draw_binomial(cnt.nu, chunk_binom_p(model_u_.avg_len()));
+	for(size_t i = 0; i < nu_samp; i++) {
+		for(int attempts = 0; attempts < max_attempts; attempts++) {
+			const TemplateUnpaired &t = model_u_.draw();
+			const size_t rflen = t.reflen();
+			if(starts_.count(rflen) == 0) {
+				continue; // no N-free place for this template
+			}
+			size_t off = starts_.draw(rflen);
+			assert(off < nslots);
+			const Segment& seg = segs[segment_at(segs, off)];
+			rd1_.init(
+				buf + off,
+				t.qual_,
+				t.edit_xscript_,
+				t.fw_flag_ == 'T',
+				t.best_score_,
+				seg.refid,
+				seg.refoff + off - seg.beg);
+			rd1_.write(shard_fh(fh_u_, cnt.wrote_u++), "u");
+			break;
 		}
-		
-		//
-		// Bad-end
-		//
-
-		size_t nb_samp = draw_binomial(nb, binom_p);
-		for(size_t i = 0; i < nb_samp; i++) {
-			int attempts = 0;
-			do {
-				if(attempts > max_attempts) {
-					break;
-				}
-				attempts++;
-				const TemplateUnpaired &t = model_b_.draw();
-				bool mate1 = t.mate_flag_ == '1';
-				size_t nslots = retsz - olap_;
-				size_t off = std::min((size_t)(r4_uni_01() * nslots), nslots-1);
-				assert(off < nslots);
-				const size_t rflen = t.reflen();
-				for(size_t j = off; j < off + rflen; j++) {
-					const int b = buf[j];
-					if(b != 'A' && b != 'C' && b != 'G' && b != 'T') {
-						continue; // uses 1 attempt
-					}
-				}
-				if(mate1) {
-					rd1.init(
-						buf + off,
-						t.qual_,
-						t.edit_xscript_,
-						t.fw_flag_ == 'T',
-						t.best_score_,
-						refid.c_str(),
-						refoff + off);
-					rd2.init_random(
-						t.opp_len_,
-						t.fw_flag_ == 'T', // doesn't matter much, but need them for name
-						t.best_score_, // doesn't matter much, but need them for name
-						refid.c_str(), // doesn't matter much, but need them for name
-						refoff + off); // doesn't matter much, but need them for name
-				} else {
-					rd2.init(
-						buf + off,
-						t.qual_,
-						t.edit_xscript_,
-						t.fw_flag_ == 'T',
-						t.best_score_,
-						refid.c_str(),
-						refoff + off);
-					rd1.init_random(
-						t.opp_len_,
-						t.fw_flag_ == 'T', // doesn't matter much, but need them for name
-						t.best_score_, // doesn't matter much, but need them for name
-						refid.c_str(), // doesn't matter much, but need them for name
-						refoff + off); // doesn't matter much, but need them for name
-				}
-				n_wrote_b++;
-				const char *lab = mate1 ? "b1" : "b2";
-				SimulatedRead::write_pair(rd1, rd2, fh_b_1_, fh_b_2_, lab);
-			} while(false);
+	}
+	
+	//
+	// Bad-end
+	//
+
+	size_t nb_samp = draw_binomial(cnt.nb, chunk_binom_p(model_b_.avg_len()));
+	for(size_t i = 0; i < nb_samp; i++) {
+		for(int attempts = 0; attempts < max_attempts; attempts++) {
+			const TemplateUnpaired &t = model_b_.draw();
+			bool mate1 = t.mate_flag_ == '1';
+			const size_t rflen = t.reflen();
+			if(starts_.count(rflen) == 0) {
+				continue; // no N-free place for this template
+			}
+			size_t off = starts_.draw(rflen);
+			assert(off < nslots);
+			const Segment& seg = segs[segment_at(segs, off)];
+			const size_t seg_off = seg.refoff + off - seg.beg;
+			SimulatedRead& rd_al = mate1 ? rd1_ : rd2_;
+			SimulatedRead& rd_rand = mate1 ? rd2_ : rd1_;
+			rd_al.init(
+				buf + off,
+				t.qual_,
+				t.edit_xscript_,
+				t.fw_flag_ == 'T',
+				t.best_score_,
+				seg.refid,
+				seg_off);
+			rd_rand.init_random(
+				t.opp_len_,
+				t.fw_flag_ == 'T', // doesn't matter much, but need them for name
+				t.best_score_, // doesn't matter much, but need them for name
+				seg.refid, // doesn't matter much, but need them for name
+				seg_off); // doesn't matter much, but need them for name
+			const char *lab = mate1 ? "b1" : "b2";
+			SimulatedRead::write_pair(rd1_, rd2_,
+			                          shard_fh(fh_b_1_, cnt.wrote_b),
+			                          shard_fh(fh_b_2_, cnt.wrote_b), lab);
+			cnt.wrote_b++;
+			break;
 		}
+	}
 
-		//
-		// Concordant & discordant
-		//
-		
-		size_t nc_samp = draw_binomial(nc, binom_p);
-		size_t nd_samp = draw_binomial(nd, binom_p);
-		for(size_t i = 0; i < nc_samp + nd_samp; i++) {
-			bool conc = i < nc_samp;
-			int attempts = 0;
-			do {
-				if(attempts > max_attempts) {
-					break;
-				}
-				attempts++;
-				const TemplatePaired &t = conc ? model_c_.draw() : model_d_.draw();
-				size_t nslots = retsz - olap_;
-				size_t off = std::min((size_t)(r4_uni_01() * nslots), nslots-1);
-				assert(off < nslots);
-				size_t off_1, off_2;
-				const size_t rflen_1 = edit_xscript_to_rflen(t.edit_xscript_1_);
-				const size_t rflen_2 = edit_xscript_to_rflen(t.edit_xscript_2_);
-				if(t.upstream1_) {
-					off_1 = off;
-					off_2 = off + std::max(t.fraglen_, rflen_2) - rflen_2;
-				} else {
-					off_2 = off;
-					off_1 = off + std::max(t.fraglen_, rflen_1) - rflen_1;
-				}
-				for(size_t j = off_1; j < off_1 + rflen_1; j++) {
-					const int b = buf[j];
-					if(b != 'A' && b != 'C' && b != 'G' && b != 'T') {
-						continue; // uses 1 attempt
-					}
+	//
+	// Concordant & discordant
+	//
+	
+	size_t nc_samp = draw_binomial(cnt.nc, chunk_binom_p(model_c_.avg_mate_len()));
+	size_t nd_samp = draw_binomial(cnt.nd, chunk_binom_p(model_d_.avg_mate_len()));
+	for(size_t i = 0; i < nc_samp + nd_samp; i++) {
+		bool conc = i < nc_samp;
+		for(int attempts = 0; attempts < max_attempts; attempts++) {
+			const TemplatePaired &t = conc ? model_c_.draw() : model_d_.draw();
+			const size_t rflen_1 = edit_xscript_to_rflen(t.edit_xscript_1_);
+			const size_t rflen_2 = edit_xscript_to_rflen(t.edit_xscript_2_);
+			// Place the upstream mate at an N-free start, then check the
+			// downstream mate; Ns between the mates don't matter
+			const size_t rflen_up = t.upstream1_ ? rflen_1 : rflen_2;
+			if(starts_.count(rflen_up) == 0) {
+				continue; // no N-free place for this template
+			}
+			size_t off = starts_.draw(rflen_up);
+			assert(off < nslots);
+			size_t off_1, off_2;
+			if(t.upstream1_) {
+				off_1 = off;
+				off_2 = off + std::max(t.fraglen_, rflen_2) - rflen_2;
+				if(!starts_.n_free(off_2, rflen_2)) {
+					continue; // uses 1 attempt
 				}
-				for(size_t j = off_2; j < off_2 + rflen_2; j++) {
-					const int b = buf[j];
-					if(b != 'A' && b != 'C' && b != 'G' && b != 'T') {
-						continue; // uses 1 attempt
-					}
+			} else {
+				off_2 = off;
+				off_1 = off + std::max(t.fraglen_, rflen_1) - rflen_1;
+				if(!starts_.n_free(off_1, rflen_1)) {
+					continue; // uses 1 attempt
 				}
-				rd1.init(buf + off_1,
-						 t.qual_1_,
-						 t.edit_xscript_1_,
-						 t.fw_flag_1_ == 'T',
-						 t.score_1_,
-						 refid.c_str(),
-						 refoff + off_1);
-				rd2.init(buf + off_2,
-						 t.qual_2_,
-						 t.edit_xscript_2_,
-						 t.fw_flag_2_ == 'T',
-						 t.score_2_,
-						 refid.c_str(),
-						 refoff + off_2);
-				if(conc) { n_wrote_c++; } else { n_wrote_d++; }
-				const char *lab = conc ? "c" : "d";
-				SimulatedRead::write_pair(rd1, rd2,
-										  conc ? fh_c_1_ : fh_d_1_,
-										  conc ? fh_c_2_ : fh_d_2_,
-										  lab);
-			} while(false);
+			}
+			const size_t segi = segment_at(segs, off);
+			if(segment_at(segs, std::max(off_1, off_2)) != segi) {
+				continue; // mates in different packed records; uses 1 attempt
+			}
+			const Segment& seg = segs[segi];
+			rd1_.init(buf + off_1,
+					  t.qual_1_,
+					  t.edit_xscript_1_,
+					  t.fw_flag_1_ == 'T',
+					  t.score_1_,
+					  seg.refid,
+					  seg.refoff + off_1 - seg.beg);
+			rd2_.init(buf + off_2,
+					  t.qual_2_,
+					  t.edit_xscript_2_,
+					  t.fw_flag_2_ == 'T',
+					  t.score_2_,
+					  seg.refid,
+					  seg.refoff + off_2 - seg.beg);
+			size_t& wrote = conc ? cnt.wrote_c : cnt.wrote_d;
+			const char *lab = conc ? "c" : "d";
+			SimulatedRead::write_pair(rd1_, rd2_,
+									  shard_fh(conc ? fh_c_1_ : fh_d_1_, wrote),
+									  shard_fh(conc ? fh_c_2_ : fh_d_2_, wrote),
+									  lab);
+			wrote++;
+			break;
 		}
 	}
-	cerr << "    Wrote " << n_wrote_u << " unpaired tandem reads "
-	     << "(target=" << nu << ")" << endl;
-	cerr << "    Wrote " << n_wrote_b << " bad-end tandem reads "
-	     << "(target=" << nb << ")" << endl;
-	cerr << "    Wrote " << n_wrote_c << " concordant tandem pairs "
-	     << "(target=" << nc << ")" << endl;
-	cerr << "    Wrote " << n_wrote_d << " discordant tandem pairs "
-	     << "(target=" << nd << ")" << endl;
 }
 
 #ifdef SIMPLESIM_MAIN
@@ -414,9 +632,9 @@ void StreamingSimulator::simulate_batch(
 static void test1() {
 	SimulatedRead rd;
 	const char *ref = "ACGT";
-	const char *qual = "ABCD";
-	const char *edit_xscript = "====";
-	rd.init(ref, qual, edit_xscript,true, 0, "r1", 0);
+	char qual[] = "ABCD";
+	char edit_xscript[] = "====";
+	rd.init(ref, qual, edit_xscript,true, 0, 0, 0);
 	assert(strcmp(rd.mutated_seq(), "ACGT") == 0);
 	assert(strcmp(rd.qual(), "ABCD") == 0);
 	assert(strcmp(rd.edit_xscript(), "====") == 0);
@@ -425,9 +643,9 @@ static void test1() {
 static void test2() {
 	SimulatedRead rd;
 	const char *ref = "AACC";
-	const char *qual = "ABCD";
-	const char *edit_xscript = "====";
-	rd.init(ref, qual, edit_xscript,false, 0, "r1", 0);
+	char qual[] = "ABCD";
+	char edit_xscript[] = "====";
+	rd.init(ref, qual, edit_xscript,false, 0, 0, 0);
 	assert(strcmp(rd.mutated_seq(), "AACC") == 0);
 	assert(strcmp(rd.qual(), "ABCD") == 0);
 	assert(strcmp(rd.edit_xscript(), "====") == 0);
@@ -436,9 +654,9 @@ static void test2() {
 static void test3() {
 	SimulatedRead rd;
 	const char *ref = "ACGT";
-	const char *qual = "ABCD";
-	const char *edit_xscript = "=X==";
-	rd.init(ref, qual, edit_xscript,true, 0, "r1", 0);
+	char qual[] = "ABCD";
+	char edit_xscript[] = "=X==";
+	rd.init(ref, qual, edit_xscript,true, 0, 0, 0);
 	assert(strcmp(rd.mutated_seq(), "ACGT") != 0);
 	assert(rd.mutated_seq()[0] == 'A');
 	assert(rd.mutated_seq()[1] != 'C');
@@ -451,9 +669,9 @@ static void test3() {
 static void test4() {
 	SimulatedRead rd;
 	const char *ref = "ACGT";
-	const char *qual = "ABC";
-	const char *edit_xscript = "=D==";
-	rd.init(ref, qual, edit_xscript,true, 0, "r1", 0);
+	char qual[] = "ABC";
+	char edit_xscript[] = "=D==";
+	rd.init(ref, qual, edit_xscript,true, 0, 0, 0);
 	assert(strcmp(rd.mutated_seq(), "AGT") == 0);
 	assert(strcmp(rd.qual(), "ABC") == 0);
 	assert(strcmp(rd.edit_xscript(), "=D==") == 0);
@@ -462,9 +680,9 @@ static void test4() {
 static void test5() {
 	SimulatedRead rd;
 	const char *ref = "AGT";
-	const char *qual = "ABCD";
-	const char *edit_xscript = "=I==";
-	rd.init(ref, qual, edit_xscript,true, 0, "r1", 0);
+	char qual[] = "ABCD";
+	char edit_xscript[] = "=I==";
+	rd.init(ref, qual, edit_xscript,true, 0, 0, 0);
 	assert(rd.mutated_seq()[0] == 'A');
 	assert(rd.mutated_seq()[2] == 'G');
 	assert(rd.mutated_seq()[3] == 'T');
@@ -478,17 +696,18 @@ static void test5() {
 static void test6() {
 	SimulatedRead rd;
 	const char *ref = "ACGT";
-	const char *qual = "ABCD";
-	const char *edit_xscript = "====";
+	char qual[] = "ABCD";
+	char edit_xscript[] = "====";
 	const char *fn = ".test6.tmp";
 	{
 		FILE *fh = fopen(fn, "wb");
-		rd.init(ref, qual, edit_xscript, true, 0, "r1", 0);
+		rd.init(ref, qual, edit_xscript, true, 0, 3, 0);
 		rd.write(fh, "hello");
 		fclose(fh);
 	}
 	ifstream t(fn);
 	string str((istreambuf_iterator<char>(t)), istreambuf_iterator<char>());
+	assert(str.find("@qtip!:3:+:0:0:hello\n") == 0);
 	assert(str.rfind("\nACGT\n+\nABCD\n") != string::npos);
 	remove(fn);
 }
@@ -496,12 +715,12 @@ static void test6() {
 static void test7() {
 	SimulatedRead rd;
 	const char *ref = "AAACC";
-	const char *qual = "EDCBA";
-	const char *edit_xscript = "=====";
+	char qual[] = "EDCBA";
+	char edit_xscript[] = "=====";
 	const char *fn = ".test7.tmp";
 	{
 		FILE *fh = fopen(fn, "wb");
-		rd.init(ref, qual, edit_xscript, false, 0, "r1", 0);
+		rd.init(ref, qual, edit_xscript, false, 0, 0, 0);
 		rd.write(fh, "hello");
 		fclose(fh);
 	}
@@ -511,7 +730,143 @@ static void test7() {
 	remove(fn);
 }
 
+/**
+ * Substitutions never reproduce the reference base and pick each of the
+ * other three about equally often; non-ACGT reference gets any base.
+ */
+static void test8() {
+	const char *rf = "ACGTN";
+	for(int i = 0; i < 5; i++) {
+		int counts[256] = {0};
+		for(int j = 0; j < 30000; j++) {
+			counts[(int)random_bases.substitute(rf[i])]++;
+		}
+		int nbases = 0;
+		for(int c = 0; c < 4; c++) {
+			int n = counts[(int)"ACGT"[c]];
+			if(n > 0) {
+				nbases++;
+				assert(n > (i < 4 ? 9000 : 6500));
+			}
+		}
+		assert(nbases == (i < 4 ? 3 : 4));
+		if(i < 4) {
+			assert(counts[(int)rf[i]] == 0);
+		}
+	}
+}
+
+/**
+ * Bulk random bases agree with one-at-a-time draws from the same stream
+ * and cover all four bases.
+ */
+static void test9() {
+	set_seed(1234, 5678);
+	random_bases.reset();
+	char buf1[101], buf2[101];
+	random_bases.bases(buf1, 3);
+	random_bases.bases(buf1 + 3, 98);
+	set_seed(1234, 5678);
+	random_bases.reset();
+	for(int i = 0; i < 101; i++) {
+		buf2[i] = random_bases.base();
+	}
+	assert(memcmp(buf1, buf2, 101) == 0);
+	SimulatedRead rd;
+	rd.init_random(100, true, 0, 0, 0);
+	const char *seq = rd.mutated_seq();
+	assert(strlen(seq) == 100);
+	assert(strlen(rd.qual()) == 100);
+	for(int c = 0; c < 4; c++) {
+		assert(strchr(seq, "ACGT"[c]) != NULL);
+	}
+}
+
+/**
+ * Offsets are drawn only from starts whose window is N-free, and every such
+ * start gets drawn.
+ */
+static void test10() {
+	//                 0         1         2
+	//                 0123456789012345678901234
+	const char *buf = "ACGTNACGTACGTNNACGTACGTAC";
+	const size_t len = strlen(buf), nslots = 20;
+	ValidStarts st;
+	st.init(buf, len, nslots, 5);
+	// length 4: starts 0, 5-9, 15-19
+	assert(st.count(4) == 11);
+	// length 5: starts 5-8, 15-19
+	assert(st.count(5) == 9);
+	// longer than the overlap: starts 15-16
+	assert(st.count(9) == 2);
+	bool seen[32] = {false};
+	for(int i = 0; i < 2000; i++) {
+		size_t off = st.draw(4);
+		assert(off < nslots);
+		assert(memchr(buf + off, 'N', 4) == NULL);
+		seen[off] = true;
+	}
+	for(size_t i = 0; i < nslots; i++) {
+		assert(seen[i] == (memchr(buf + i, 'N', 4) == NULL));
+	}
+	assert(st.n_free(5, 8));
+	assert(!st.n_free(5, 9));
+	assert(!st.n_free(4, 1));
+	assert(st.n_free(15, 10));
+	assert(!st.n_free(15, 11));
+	st.init("NNNNNNNNNN", 10, 5, 3);
+	assert(st.count(1) == 0);
+}
+
+/**
+ * Reference ids follow @SQ order; names not in the header get the next
+ * ids, and lookups of missing names fail.
+ */
+static void test11() {
+	RefDict refs;
+	assert(refs.add_sq("@SQ\tSN:chr2\tLN:100\n") == 0);
+	assert(refs.add_sq("@SQ\tLN:50\tSN:HLA-A*01:01:01\n") == 1);
+	assert(refs.add_sq("@SQ\tLN:50\n") == -1);
+	assert(refs.add_sq("@SQ\tSN:chr2\tLN:100\n") == 0);
+	assert(refs.add("chrM") == 2);
+	assert(refs.size() == 3);
+	assert(refs.id("HLA-A*01:01:01") == 1);
+	assert(refs.id("HLA-A*01:01:01") == 1);
+	assert(refs.id("chr2") == 0);
+	assert(refs.id("chr1") == -1);
+	assert(refs.name(2) == "chrM");
+}
+
+/**
+ * A restored random base source carries on with the same bases.
+ */
+static void test12() {
+	set_seed(4321, 8765);
+	random_bases.reset();
+	char buf1[40], buf2[40];
+	random_bases.bases(buf1, 7);
+	random_bases.substitute('A');
+	CheckpointWriter w;
+	checkpoint_save_rng(w);
+	random_bases.save(w);
+	const char *fn = ".test12.ckpt";
+	assert(w.commit(fn) == 0);
+	random_bases.bases(buf1, 40);
+	set_seed(1, 1);
+	random_bases.reset();
+	random_bases.bases(buf2, 11);
+	CheckpointReader r;
+	assert(r.load(fn) == 0);
+	checkpoint_restore_rng(r);
+	random_bases.restore(r);
+	assert(r.done());
+	random_bases.bases(buf2, 40);
+	assert(memcmp(buf1, buf2, 40) == 0);
+	remove(fn);
+}
+
 int main(void) {
+	initialize();
 	test1();
 	test2();
 	test3();
@@ -519,6 +874,11 @@ int main(void) {
 	test5();
 	test6();
 	test7();
+	test8();
+	test9();
+	test10();
+	test11();
+	test12();
 	cerr << "ALL TESTS PASSED" << endl;
 }
 #endif
@@ -10,12 +10,18 @@
 #define __qtip__simplesim__
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <vector>
+#include <map>
 #include <algorithm>
 #include <fstream>
 #include "fasta.h"
+#include "refdict.h"
 #include "input_model.h"
 #include "ranlib.hpp"
+#include "rnglib.hpp"
+#include "checkpoint.h"
 
 #define SIM_STARTSWITH_LITERAL "qtip!"
 #define SIM_SEPARATOR_LITERAL ':'
@@ -23,15 +29,154 @@
 static const char * sim_startswith = SIM_STARTSWITH_LITERAL;
 static const char sim_sep = SIM_SEPARATOR_LITERAL;
 
-static inline char draw_base() {
-    return "ACGT"[std::min((int)(r4_uni_01() * 4), 3)];
-}
+/**
+ * Fast source of random bases for mutating simulated reads.  Draws 64 bits at
+ * a time from a xorshift64* generator and hands them out 2 bits per base, so
+ * one step yields 32 bases.  The generator is seeded lazily from rnglib's
+ * current stream, so output is still determined by the "seed" argument.
+ */
+class RandomBaseSource {
+
+public:
+
+	RandomBaseSource() :
+		state_(0),
+		bases_(0),
+		nbases_(0),
+		offs_(0),
+		noffs_(0) { }
+
+	/**
+	 * Return a uniformly random base.
+	 */
+	inline char base() {
+		if(nbases_ == 0) {
+			bases_ = next();
+			nbases_ = 32;
+		}
+		char c = "ACGT"[bases_ & 3];
+		bases_ >>= 2;
+		nbases_--;
+		return c;
+	}
+
+	/**
+	 * Fill buf[0..n) with uniformly random bases.
+	 */
+	void bases(char *buf, size_t n) {
+		while(n > 0) {
+			if(nbases_ == 0) {
+				bases_ = next();
+				nbases_ = 32;
+			}
+			size_t take = std::min(n, (size_t)nbases_);
+			uint64_t bits = bases_;
+			for(size_t i = 0; i < take; i++) {
+				buf[i] = "ACGT"[bits & 3];
+				bits >>= 2;
+			}
+			bases_ = bits;
+			nbases_ -= (int)take;
+			buf += take;
+			n -= take;
+		}
+	}
+
+	/**
+	 * Return a random base different from reference character rf, without
+	 * rejection sampling: the result is 1-3 positions past rf in ACGT order,
+	 * each equally likely.  If rf isn't A/C/G/T, any base will do.
+	 */
+	inline char substitute(int rf) {
+		int code;
+		switch(rf) {
+			case 'A': case 'a': code = 0; break;
+			case 'C': case 'c': code = 1; break;
+			case 'G': case 'g': code = 2; break;
+			case 'T': case 't': code = 3; break;
+			default: return base();
+		}
+		if(noffs_ == 0) {
+			offs_ = next();
+			noffs_ = 4;
+		}
+		// map 16 random bits onto {1, 2, 3} by multiply-and-shift
+		const int off = 1 + (int)(((offs_ & 0xffff) * 3) >> 16);
+		offs_ >>= 16;
+		noffs_--;
+		return "ACGT"[(code + off) & 3];
+	}
+
+	/**
+	 * Save or restore the generator and unused bits, for checkpointing.
+	 */
+	void save(CheckpointWriter& w) const {
+		w.put_u64(state_);
+		w.put_u64(bases_);
+		w.put_i64(nbases_);
+		w.put_u64(offs_);
+		w.put_i64(noffs_);
+	}
+
+	void restore(CheckpointReader& r) {
+		state_ = r.get_u64();
+		bases_ = r.get_u64();
+		nbases_ = (int)r.get_i64();
+		offs_ = r.get_u64();
+		noffs_ = (int)r.get_i64();
+	}
+
+	/**
+	 * Discard the generator state so it's reseeded from rnglib on next use.
+	 */
+	void reset() {
+		state_ = 0;
+		nbases_ = noffs_ = 0;
+	}
+
+protected:
+
+	/**
+	 * Return next 64 random bits.
+	 */
+	inline uint64_t next() {
+		if(state_ == 0) {
+			seed();
+		}
+		state_ ^= state_ >> 12;
+		state_ ^= state_ << 25;
+		state_ ^= state_ >> 27;
+		return state_ * 2685821657736338717ULL;
+	}
+
+	/**
+	 * Seed from two rnglib draws, scrambled with splitmix64's finalizer.
+	 */
+	void seed() {
+		uint64_t z = ((uint64_t)i4_uni() << 32) ^ (uint64_t)i4_uni();
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		z ^= z >> 31;
+		state_ = (z == 0) ? 1 : z;
+	}
+
+	uint64_t state_;  // xorshift64* state; 0 means not yet seeded
+	uint64_t bases_;  // unused random bits for bases
+	int nbases_;      // # bases left in bases_
+	uint64_t offs_;   // unused random bits for substitution offsets
+	int noffs_;       // # 16-bit draws left in offs_
+};
+
+/**
+ * Shared by all simulated reads.
+ */
+extern RandomBaseSource random_bases;
 
 /**
  * The thing is really built in two stages.  First we get seq (but it's pointer
  * into the reference buffer), fw, qual (but it's a pointer into the template
- * object), edit_xscript (also pointer to template), score, refid (from string
- * variable in simulator), and refoff (from size_t in simulator).
+ * object), edit_xscript (also pointer to template), score, refid (reference
+ * id from the simulator's RefDict), and refoff (from size_t in simulator).
  *
  * Then we mutate the reference sequence into the appropriate read sequence
  * using the edit transcript.  When we do this, we have to allocate a new
@@ -45,7 +190,7 @@ public:
 		qual_(NULL),
 		edit_xscript_(NULL),
 		score_(),
-		refid_(NULL),
+		refid_(-1),
 		refoff_()
 	{
 		seq_buf_len_ = 64;
@@ -71,7 +216,7 @@ public:
 		char *edit_xscript,
 		bool fw,
 		int score,
-		const char *refid,
+		int refid,
 		size_t refoff)
 	{
 		qual_ = qual;
@@ -90,7 +235,7 @@ public:
 		size_t len,
 		bool fw,
 		int score,
-		const char *refid,
+		int refid,
 		size_t refoff)
 	{
 		assert(len > 0);
@@ -104,15 +249,9 @@ public:
 		score_ = score;
 		refid_ = refid;
 		refoff_ = refoff;
-		char *seq_cur = seq_buf_;
-		char *qual_cur = qual_buf_;
-		for(size_t i = 0; i < len; i++) {
-			int c = draw_base();
-			int q = 'I';
-			*seq_cur++ = c;
-			*qual_cur++ = q;
-		}
-		*seq_cur = *qual_cur = '\0';
+		random_bases.bases(seq_buf_, len);
+		memset(qual_buf_, 'I', len);
+		seq_buf_[len] = qual_buf_[len] = '\0';
 		qual_ = qual_buf_;
 	}
 	
@@ -184,7 +323,7 @@ protected:
 	char *qual_;
 	const char *edit_xscript_;
 	int score_;
-	const char *refid_;
+	int refid_;
 	size_t refoff_;
 	
 	size_t seq_buf_len_;
@@ -200,6 +339,69 @@ enum {
     FUNC_CONST
 };
 
+/**
+ * Tracks where in a FASTA chunk a template can start without covering an N.
+ * The chunk is reduced to its list of N-free runs; for each template length
+ * class, cumulative counts of valid starts per run are built on first use,
+ * after which counting is O(1) and drawing a uniformly random valid start is
+ * a binary search.
+ */
+class ValidStarts {
+
+public:
+
+	ValidStarts() : nslots_(0), max_class_(0) { }
+
+	/**
+	 * Scan a new chunk.  Starts are restricted to [0, nslots); length
+	 * classes are capped at max_class, normally the chunk overlap.
+	 */
+	void init(const char *buf, size_t len, size_t nslots, size_t max_class);
+
+	/**
+	 * Return number of valid starts for a template spanning len reference
+	 * characters.  Counts starts valid for len's whole length class, so may
+	 * slightly undercount next to N runs.
+	 */
+	size_t count(size_t len);
+
+	/**
+	 * Return a uniformly random valid start for a template spanning len
+	 * reference characters.  count(len) must be > 0.
+	 */
+	size_t draw(size_t len);
+
+	/**
+	 * Return true iff [off, off+len) lies within the chunk and has no Ns.
+	 */
+	bool n_free(size_t off, size_t len) const;
+
+	/**
+	 * Return the length class for len: len rounded up to within 1/8 of its
+	 * magnitude, so at most a few dozen classes cover all templates.
+	 */
+	static size_t length_class(size_t len) {
+		size_t gran = 1;
+		while(gran * 16 <= len) {
+			gran *= 2;
+		}
+		return ((len + gran - 1) / gran) * gran;
+	}
+
+protected:
+
+	/**
+	 * Return cumulative valid-start counts for length class cls, building
+	 * them if this is the first use in the current chunk.
+	 */
+	const std::vector<size_t>& cumulative(size_t cls);
+
+	std::vector<std::pair<size_t, size_t> > runs_; // N-free runs [beg, end)
+	std::map<size_t, std::vector<size_t> > cum_;   // class -> cumulative counts
+	size_t nslots_;
+	size_t max_class_;
+};
+
 /**
  * What do we need from the dists?
  * 1. Average read/fragment lengths for all 4 classes
@@ -214,6 +416,7 @@ public:
 	StreamingSimulator(
 		const std::vector<std::string>& fns, // FASTAs to simulate reads from
 		size_t chunksz,                      // rolling FASTA buffer length
+		RefDict& refs,                       // reference ids; see RefDict
 		const InputModelUnpaired& model_u,
 		const InputModelUnpaired& model_b,
 		const InputModelPaired& model_c,
@@ -229,24 +432,48 @@ public:
 			  std::max(model_b.max_len(),
 			  std::max(model_c.max_len(), model_d.max_len())))),
 		fa_(fns, chunksz, olap_),
+		chunksz_(chunksz),
+		refs_(refs),
 		model_u_(model_u),
 		model_b_(model_b),
 		model_c_(model_c),
-		model_d_(model_d),
-		fh_u_(fh_u),
-		fh_b_1_(fh_b_1),
-		fh_b_2_(fh_b_2),
-		fh_c_1_(fh_c_1),
-		fh_c_2_(fh_c_2),
-		fh_d_1_(fh_d_1),
-		fh_d_2_(fh_d_2)
+		model_d_(model_d)
 	{
 		tot_fasta_len_ = estimate_fasta_length(fns);
+		add_shard(fh_u, fh_b_1, fh_b_2, fh_c_1, fh_c_2, fh_d_1, fh_d_2);
+	}
+
+	/**
+	 * Add another set of output files.  With more than one set (shard),
+	 * each category's reads are dealt round-robin across them: the ith
+	 * read or pair written goes to shard i mod (number of shards).  Which
+	 * reads are simulated doesn't depend on the number of shards.
+	 */
+	void add_shard(
+		FILE *fh_u,
+		FILE *fh_b_1,
+		FILE *fh_b_2,
+		FILE *fh_c_1,
+		FILE *fh_c_2,
+		FILE *fh_d_1,
+		FILE *fh_d_2)
+	{
+		fh_u_.push_back(fh_u);
+		fh_b_1_.push_back(fh_b_1);
+		fh_b_2_.push_back(fh_b_2);
+		fh_c_1_.push_back(fh_c_1);
+		fh_c_2_.push_back(fh_c_2);
+		fh_d_1_.push_back(fh_d_1);
+		fh_d_2_.push_back(fh_d_2);
 	}
 	
 	/**
 	 * Simulate a batch of reads over the course of a single pass over the
-	 * FASTA files.
+	 * FASTA files.  Only categories whose letters (u, b, c, d) appear in
+	 * categories are simulated.
+	 *
+	 * If ck is non-NULL and enabled, checkpoints are taken between chunks,
+	 * and if it's resuming, the pass picks up from its checkpoint.
 	 */
 	void simulate_batch(
 		float fraction,
@@ -254,7 +481,9 @@ public:
 		size_t min_u,
 		size_t min_c,
 		size_t min_d,
-		size_t min_b);
+		size_t min_b,
+		const char *categories = "ubcd",
+		Checkpointer *ck = NULL);
 	
 	/**
 	 * Return the estimated number of bases in all the FASTA files, based on
@@ -265,7 +494,84 @@ public:
 	}
 
 protected:
+
+	/**
+	 * A stretch of a chunk that comes from one FASTA record: beginning in
+	 * the chunk, reference id and reference offset of its first character.
+	 */
+	struct Segment {
+		Segment() : beg(0), refid(-1), refoff(0) { }
+		Segment(size_t beg_, int refid_, size_t refoff_) :
+			beg(beg_), refid(refid_), refoff(refoff_) { }
+		size_t beg;
+		int refid;
+		size_t refoff;
+	};
+
+	/**
+	 * Per-category targets and counts of reads written, for a batch.
+	 */
+	struct SimCounts {
+		SimCounts() :
+			nu(0), nb(0), nc(0), nd(0),
+			wrote_u(0), wrote_b(0), wrote_c(0), wrote_d(0) { }
+		size_t nu, nb, nc, nd;
+		size_t wrote_u, wrote_b, wrote_c, wrote_d;
+	};
+
+	/**
+	 * Simulate reads from len reference characters in buf, which are made
+	 * up of the given segments.  Templates start in [0, nslots) and lie
+	 * entirely within the buffer and within one segment.
+	 */
+	void simulate_chunk(
+		const char *buf,
+		size_t len,
+		size_t nslots,
+		const std::vector<Segment>& segs,
+		SimCounts& cnt);
+
+	/**
+	 * Save or restore the state of a pass over the FASTA files between
+	 * chunks, along with the random number generators.
+	 */
+	void save(
+		CheckpointWriter& w,
+		const SimCounts& cnt,
+		const std::string& refid,
+		const std::string& refid_full,
+		size_t npacked) const;
+
+	void restore(
+		CheckpointReader& r,
+		SimCounts& cnt,
+		std::string& refid,
+		std::string& refid_full,
+		size_t& npacked);
+
+	/**
+	 * Return the shard's file that the ith read of a category goes to.
+	 */
+	static FILE *shard_fh(const std::vector<FILE*>& fhs, size_t i) {
+		return fhs[i % fhs.size()];
+	}
+
+	/**
+	 * Return index of the segment containing chunk offset off.
+	 */
+	static size_t segment_at(const std::vector<Segment>& segs, size_t off);
 	
+	/**
+	 * Return success probability for the binomial draw deciding how many of a
+	 * category's reads come from the current chunk: the chunk's share of all
+	 * places a read of the category's average length can start.
+	 */
+	float chunk_binom_p(float avg_len) {
+		size_t len = std::max((size_t)(avg_len + 0.5f), (size_t)1);
+		const size_t nvalid = starts_.count(std::min(len, olap_));
+		return std::min(((float)nvalid) * 1.1f / tot_fasta_len_, 0.999f);
+	}
+
 	/**
 	 * Return size of file in bytes.
 	 */
@@ -288,18 +594,26 @@ protected:
 	size_t olap_;  // bases of overlap between overlapping windows from ref
 	FastaChunkwiseParser fa_;  // FASTA parser that gives chunks at a time
 	                           // chunk size is set in constructor
+	size_t chunksz_;           // FASTA chunk size, also bounds packed chunks
 	size_t tot_fasta_len_;     // estimate of FASTA length, based on file size
+	RefDict& refs_;            // ids for FASTA contigs; ones missing from
+	                           // the @SQ header are added on the fly
 	const InputModelUnpaired& model_u_;  // input model for unpaired alns
 	const InputModelUnpaired& model_b_;  // input model for bad-end alns
 	const InputModelPaired&   model_c_;  // input model for concordant alns
 	const InputModelPaired&   model_d_;  // input model for discordant alns
-	FILE *fh_u_;    // destimation for simulated unpaired reads
-	FILE *fh_b_1_;  // destimation for simulated bad-end reads, mate 1
-	FILE *fh_b_2_;  // destimation for simulated bad-end reads, mate 2
-	FILE *fh_c_1_;  // destimation for simulated concordant reads, mate 1
-	FILE *fh_c_2_;  // destimation for simulated discordant reads, mate 2
-	FILE *fh_d_1_;  // destimation for simulated concordant reads, mate 1
-	FILE *fh_d_2_;  // destimation for simulated discordant reads, mate 2
+	// Destinations for simulated reads, one per shard
+	std::vector<FILE*> fh_u_;    // unpaired reads
+	std::vector<FILE*> fh_b_1_;  // bad-end reads, mate 1
+	std::vector<FILE*> fh_b_2_;  // bad-end reads, mate 2
+	std::vector<FILE*> fh_c_1_;  // concordant reads, mate 1
+	std::vector<FILE*> fh_c_2_;  // concordant reads, mate 2
+	std::vector<FILE*> fh_d_1_;  // discordant reads, mate 1
+	std::vector<FILE*> fh_d_2_;  // discordant reads, mate 2
+	ValidStarts starts_; // N-free template starts in current chunk
+	std::vector<char> pack_;         // short FASTA records, N-separated
+	std::vector<Segment> pack_segs_; // records in pack_
+	SimulatedRead rd1_, rd2_;
 };
 
 #endif /* defined(__qtip__simplesim__) */
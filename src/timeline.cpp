@@ -0,0 +1,150 @@
+//
+//  timeline.cpp
+//  qtip
+//
+
+#include "timeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <iostream>
+
+using namespace std;
+
+int Timeline::fd_ = -1;
+int Timeline::pid_ = 0;
+
+static const size_t TIMELINE_EVENTSZ = 1024;
+
+bool Timeline::init(const char *process_name) {
+	const char *fn = getenv("QTIP_TRACE_FILE");
+	if(fn == NULL || fn[0] == '\0' || fd_ >= 0) {
+		return enabled();
+	}
+	fd_ = ::open(fn, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if(fd_ < 0) {
+		cerr << "Warning: could not open trace file \"" << fn
+		     << "\"; not recording a timeline" << endl;
+		return false;
+	}
+	pid_ = (int)getpid();
+	struct stat st;
+	if(fstat(fd_, &st) == 0 && st.st_size == 0) {
+		emit("[\n", 2);
+	}
+	char buf[TIMELINE_EVENTSZ];
+	int len = snprintf(buf, sizeof(buf),
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s\"}},\n",
+		pid_, pid_, process_name);
+	emit(buf, len);
+	return true;
+}
+
+uint64_t Timeline::now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000ULL + (uint64_t)tv.tv_usec;
+}
+
+void Timeline::span(
+	const char *name,
+	const char *cat,
+	uint64_t ts,
+	uint64_t dur,
+	const char *args)
+{
+	if(fd_ < 0) {
+		return;
+	}
+	char buf[TIMELINE_EVENTSZ];
+	int len = snprintf(buf, sizeof(buf),
+		"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+		"\"ts\":%llu,\"dur\":%llu,\"args\":{%s}},\n",
+		name, cat, pid_, pid_,
+		(unsigned long long)ts, (unsigned long long)dur,
+		args == NULL ? "" : args);
+	emit(buf, len);
+}
+
+void Timeline::emit(const char *buf, int len) {
+	if(len <= 0 || (size_t)len >= TIMELINE_EVENTSZ) {
+		return; // truncated; drop rather than write broken JSON
+	}
+	if(write(fd_, buf, (size_t)len) != (ssize_t)len) {
+		cerr << "Warning: error writing trace file; not recording the "
+		     << "rest of the timeline" << endl;
+		close();
+	}
+}
+
+void Timeline::close() {
+	if(fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+}
+
+#ifdef TIMELINE_MAIN
+
+#include <cassert>
+#include <string>
+#include <fstream>
+#include <sstream>
+
+static string slurp(const char *fn) {
+	ifstream ifs(fn);
+	stringstream ss;
+	ss << ifs.rdbuf();
+	return ss.str();
+}
+
+static void test1() {
+	// Nothing recorded without QTIP_TRACE_FILE
+	unsetenv("QTIP_TRACE_FILE");
+	assert(!Timeline::init("test"));
+	{
+		TimelineScope s("off", "phase");
+	}
+	assert(!Timeline::enabled());
+	cerr << "PASSED test1" << endl;
+}
+
+static void test2() {
+	const char *fn = ".timeline.test2.json";
+	unlink(fn);
+	setenv("QTIP_TRACE_FILE", fn, 1);
+	assert(Timeline::init("qtip-test"));
+	Timeline::span("a", "phase", 10, 5, "\"n\":3");
+	{
+		TimelineScope s("b", "phase");
+	}
+	Timeline::close();
+	string s = slurp(fn);
+	assert(s.compare(0, 2, "[\n") == 0);
+	assert(s.find("\"name\":\"process_name\",\"ph\":\"M\"") != string::npos);
+	assert(s.find("\"args\":{\"name\":\"qtip-test\"}") != string::npos);
+	assert(s.find("\"name\":\"a\",\"cat\":\"phase\",\"ph\":\"X\"") != string::npos);
+	assert(s.find("\"ts\":10,\"dur\":5,\"args\":{\"n\":3}") != string::npos);
+	assert(s.find("\"name\":\"b\"") != string::npos);
+	// A second process appends without repeating the opening bracket
+	assert(Timeline::init("qtip-test2"));
+	Timeline::close();
+	s = slurp(fn);
+	assert(s.find("[", 1) == string::npos);
+	assert(s.find("qtip-test2") != string::npos);
+	unlink(fn);
+	unsetenv("QTIP_TRACE_FILE");
+	cerr << "PASSED test2" << endl;
+}
+
+int main(void) {
+	test1();
+	test2();
+}
+
+#endif
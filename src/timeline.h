@@ -0,0 +1,92 @@
+//
+//  timeline.h
+//  qtip
+//
+
+#ifndef __qtip__timeline__
+#define __qtip__timeline__
+
+#include <stdint.h>
+
+/**
+ * Appends Chrome trace events (the JSON array format read by
+ * chrome://tracing and Perfetto) to the file named by the QTIP_TRACE_FILE
+ * environment variable.  The qtip driver sets the variable and writes the
+ * driver's own events to the same file, so one timeline shows the driver's
+ * stages, each binary's lifetime and the phases inside it (see PerfScope).
+ *
+ * The file is opened in append mode and each event goes out in a single
+ * write(), so processes running at the same time don't interleave partial
+ * lines.  Events end with a comma and the closing ] is left off, which the
+ * format allows.  Timestamps are wall-clock microseconds so they line up
+ * across processes.
+ */
+class Timeline {
+
+public:
+
+	/**
+	 * If QTIP_TRACE_FILE is set, open it and name this process in the
+	 * timeline.  Return true iff events will be recorded.
+	 */
+	static bool init(const char *process_name);
+
+	static bool enabled() {
+		return fd_ >= 0;
+	}
+
+	/**
+	 * Microseconds since the epoch.
+	 */
+	static uint64_t now_us();
+
+	/**
+	 * Record a span ("complete" event) that began at ts and lasted dur
+	 * microseconds.  args, if non-NULL, is a JSON object's members
+	 * without the enclosing braces, e.g. "\"n\":3".
+	 */
+	static void span(
+		const char *name,
+		const char *cat,
+		uint64_t ts,
+		uint64_t dur,
+		const char *args = 0);
+
+	/**
+	 * Close the trace file.
+	 */
+	static void close();
+
+protected:
+
+	static void emit(const char *buf, int len);
+
+	static int fd_;
+	static int pid_;
+};
+
+/**
+ * Records its lifetime as a span.  Does nothing when there's no timeline.
+ */
+class TimelineScope {
+
+public:
+
+	TimelineScope(const char *name, const char *cat) : name_(name), cat_(cat) {
+		t0_ = Timeline::enabled() ? Timeline::now_us() : 0;
+	}
+
+	~TimelineScope() {
+		if(Timeline::enabled()) {
+			Timeline::span(name_, cat_, t0_, Timeline::now_us() - t0_);
+		}
+	}
+
+protected:
+
+	const char *name_;
+	const char *cat_;
+	uint64_t t0_;
+};
+
+#endif /* defined(__qtip__timeline__) */
@@ -2,10 +2,13 @@
 Copyright 2016, Ben Langmead <langmea@cs.jhu.edu>
 
 TemporaryFileManager for maintaining and measuring a set of related
-temporary files.
+temporary files, and plan_temp_usage for choosing ways of keeping them
+within a budget.
 """
 
 import os
+import math
+import gzip
 import tempfile
 import errno
 import shutil
@@ -27,12 +30,14 @@ class TemporaryFileManager(object):
     temporary-file footprint at any given point.
     """
 
-    def __init__(self, dr=None):
+    def __init__(self, dr=None, budget=None):
         self.dir = tempfile.mkdtemp(dir=dr)
         self.files = set()
         self.dirs = set()
         self.groups = defaultdict(list)
         self.peak_size = 0
+        self.budget = budget
+        self.over_budget = False
 
     def get_file(self, fn_basename, group=''):
         """ Return filename for new temporary file in temp dir """
@@ -74,25 +79,198 @@ class TemporaryFileManager(object):
                 os.remove(join(self.dir, base))
         del self.groups[group]
 
-    def purge(self, log=logging):
-        """ Remove all temporary files created for caller """
+    def purge(self, log=logging, keep=()):
+        """ Remove all temporary files created for caller, except those
+            belonging to the groups named in keep """
         self.update_peak()
-        for root, subdirs, files in os.walk(self.dir):
-            for fn in files:
-                log.warning("  still have file: %s/%s" % (root, fn))
-                os.remove(join(root, fn))
-            for dr in subdirs:
-                log.warning("  still have subdir: %s/%s" % (root, dr))
-                shutil.rmtree(join(root, dr))
-        assert len(list(os.walk(self.dir))) == 1, str(list(os.walk(self.dir)))
-        self.files = set()
-        self.dirs = set()
-        self.groups = defaultdict(list)
+        kept = set(base for group in keep for base, _ in self.groups.get(group, []))
+        for base in sorted(os.listdir(self.dir)):
+            if base in kept:
+                continue
+            if os.path.isdir(join(self.dir, base)):
+                log.warning("  still have subdir: %s/%s" % (self.dir, base))
+                shutil.rmtree(join(self.dir, base))
+            else:
+                log.warning("  still have file: %s/%s" % (self.dir, base))
+                os.remove(join(self.dir, base))
+        assert set(os.listdir(self.dir)) <= kept, str(os.listdir(self.dir))
+        self.files &= kept
+        self.dirs &= kept
+        self.groups = defaultdict(list, [(group, self.groups[group]) for group in keep
+                                         if group in self.groups])
 
     def size(self):
         """ Return total size of all the files in the temp dir """
         return _recursive_size(self.dir)
 
-    def update_peak(self):
+    def update_peak(self, log=logging):
         """ Update peak size of temporary files """
         self.peak_size = max(self.peak_size, self.size())
+        if self.budget is not None and self.peak_size > self.budget and not self.over_budget:
+            log.warning('Temporary files (%0.2fMB) exceeded --temp-budget (%0.2fMB)' %
+                        (self.peak_size / (1024.0 * 1024), self.budget / (1024.0 * 1024)))
+            self.over_budget = True
+
+
+_size_suffixes = {'k': 1 << 10, 'm': 1 << 20, 'g': 1 << 30, 't': 1 << 40}
+
+
+def parse_size(st):
+    """ Parse a size like 500M or 20G into bytes """
+    st = st.strip()
+    mult = _size_suffixes.get(st[-1:].lower(), 1)
+    if mult > 1:
+        st = st[:-1]
+    return int(float(st) * mult)
+
+
+# Rough sizes used to estimate temporary-file footprint
+_SAM_EXTRA_BYTES = 200  # SAM record bytes beyond those of its FASTQ record
+_REC_BYTES = 400  # feature-table row, plus its share of the .meta file
+_PRED_BYTES = 16  # prediction-file entry
+_BSAM_RATIO = 0.3  # size of block-compressed SAM relative to plain SAM
+_GZ_RATIO = 4.0  # size of gzipped FASTQ once decompressed
+
+
+def sample_reads(fns, nsample=1000):
+    """ Estimate the number of reads and the average FASTQ record size in
+        the given (possibly gzipped) FASTQ files from the first nsample
+        records of the first one """
+    if len(fns) == 0:
+        return 0, 0
+    opener = gzip.open if fns[0].endswith('.gz') else open
+    nrec, nbytes = 0, 0
+    with opener(fns[0], 'rb') as fh:
+        for i, ln in enumerate(fh):
+            if i >= 4 * nsample:
+                break
+            nbytes += len(ln)
+            nrec += 1 if i % 4 == 0 else 0
+    if nrec == 0:
+        return 0, 0
+    rec_bytes = nbytes / float(nrec)
+    tot_bytes = sum(getsize(fn) * (_GZ_RATIO if fn.endswith('.gz') else 1.0) for fn in fns)
+    return int(tot_bytes / rec_bytes), rec_bytes
+
+
+def sim_target(n, function, factor, minimum):
+    """ Number of tandem reads qtip-parse simulates for a category with n
+        input reads; see --sim-function """
+    if function == 'linear':
+        return max(minimum, int(factor * n))
+    elif function == 'const':
+        return max(minimum, int(factor))
+    return max(minimum, int(factor * math.sqrt(n)))
+
+
+class TempPlan(object):
+    """
+    Which ways of saving temporary space to use.  In order of how much they
+    cost, they are:
+
+    purge_tandem_reads: remove tandem FASTQs once they've been aligned
+    rather than once predictions are made
+    compress_tandem_sam: stream the tandem-read aligner's output through a
+    named pipe into qtip-bsam so only block-compressed SAM hits the disk
+    compress_input_sam: same for the input-read aligner's output
+    """
+
+    measures = ['purge_tandem_reads', 'compress_tandem_sam', 'compress_input_sam']
+
+    def __init__(self):
+        for m in self.measures:
+            setattr(self, m, False)
+        self.peak = 0  # estimated peak bytes
+        self.fits = False
+
+    def __str__(self):
+        on = [m for m in self.measures if getattr(self, m)]
+        return ', '.join(on) if len(on) > 0 else 'nothing'
+
+
+def estimate_peak(plan, nreads, rec_bytes, ntandem, paired):
+    """ Estimate peak temporary-file bytes given a TempPlan, the number of
+        input reads (ends, if paired), their average FASTQ record size and
+        the number of tandem reads (ends) """
+    sam_rec = rec_bytes + _SAM_EXTRA_BYTES
+    in_sam = nreads * sam_rec * (_BSAM_RATIO if plan.compress_input_sam else 1.0)
+    in_rec = nreads * _REC_BYTES
+    # Paired tandem reads are also concatenated into a single pair of files
+    tan_fq = ntandem * rec_bytes * (2 if paired else 1)
+    tan_sam = ntandem * sam_rec * (_BSAM_RATIO if plan.compress_tandem_sam else 1.0)
+    tan_rec = ntandem * _REC_BYTES
+    preds = nreads * _PRED_BYTES
+    tan_fq_after = 0 if plan.purge_tandem_reads else tan_fq
+    return max(in_sam + in_rec + tan_fq + tan_sam,  # aligning tandem reads
+               in_sam + in_rec + tan_fq_after + tan_sam + tan_rec,  # parsing them
+               in_sam + in_rec + tan_fq_after + tan_rec + preds)  # predicting
+
+
+def plan_temp_usage(budget, nreads, rec_bytes, ntandem, paired):
+    """ Return a TempPlan using as few measures as needed for the estimated
+        peak to fit in budget bytes, or all of them if it won't fit """
+    plan = TempPlan()
+    for m in [None] + plan.measures:
+        if m is not None:
+            setattr(plan, m, True)
+        plan.peak = estimate_peak(plan, nreads, rec_bytes, ntandem, paired)
+        if plan.peak <= budget:
+            plan.fits = True
+            break
+    return plan
+
+
+if __name__ == "__main__":
+
+    import sys
+    import unittest
+
+    class TestCases(unittest.TestCase):
+
+        def test_parse_size(self):
+            self.assertEqual(1000, parse_size('1000'))
+            self.assertEqual(512 * 1024 * 1024, parse_size('512M'))
+            self.assertEqual(int(1.5 * (1 << 30)), parse_size('1.5g'))
+
+        def test_sim_target(self):
+            self.assertEqual(30000, sim_target(10000, 'sqrt', 45.0, 30000))
+            self.assertEqual(45000, sim_target(1000000, 'sqrt', 45.0, 30000))
+            self.assertEqual(200, sim_target(100, 'linear', 2.0, 0))
+            self.assertEqual(5, sim_target(100, 'const', 5.0, 0))
+
+        def test_purge_keep(self):
+            dr = tempfile.mkdtemp()
+            try:
+                tm = TemporaryFileManager(dr)
+                keep_dir = tm.get_dir('prediction_files')
+                with open(join(keep_dir, 'p.npy'), 'w') as fh:
+                    fh.write('x' * 100)
+                open(tm.get_file('kept.txt', group='prediction_files'), 'w').close()
+                open(join(tm.get_dir('tandem_alignments'), 'a.sam'), 'w').close()
+                open(tm.get_file('stray.txt'), 'w').close()
+                tm.purge(keep=['prediction_files'])
+                self.assertEqual(['kept.txt', 'prediction_files'], sorted(os.listdir(tm.dir)))
+                self.assertTrue(os.path.exists(join(keep_dir, 'p.npy')))
+                self.assertGreater(tm.peak_size, 0)
+                tm.remove_group('prediction_files')
+                tm.purge()
+                self.assertEqual([], os.listdir(tm.dir))
+            finally:
+                shutil.rmtree(dr)
+
+        def test_plan(self):
+            args = (10000000, 250, 150000, False)
+            nothing = plan_temp_usage(1 << 50, *args)
+            self.assertTrue(nothing.fits)
+            self.assertEqual('nothing', str(nothing))
+            # Measures are added cheapest first, and each lowers the peak
+            peaks = [nothing.peak]
+            for budget in [nothing.peak - 1, 0]:
+                plan = plan_temp_usage(budget, *args)
+                peaks.append(plan.peak)
+                self.assertTrue(plan.purge_tandem_reads)
+            self.assertFalse(plan.fits)
+            self.assertTrue(plan.compress_input_sam)
+            self.assertTrue(peaks[0] >= peaks[1] > peaks[2])
+
+    unittest.main(argv=[sys.argv[0]])
@@ -0,0 +1,291 @@
+"""
+End-to-end tests of qtip-parse on small generated inputs: a random
+reference, a SAM file of reads aligned to it, and stand-in tandem
+alignments made by placing each simulated read exactly where its name says
+it was drawn from.  Needs only the standard library.
+
+Build first (make -C ../src), then run from this directory:
+
+    python parse_test.py
+"""
+
+from __future__ import print_function
+import os
+import random
+import shutil
+import struct
+import subprocess
+import tempfile
+import unittest
+
+QTIP_PARSE = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir, 'qtip-parse')
+
+# reference names and lengths
+REFS = [('chrA', 6000), ('chrB', 4000), ('chrC', 5000)]
+READ_LEN = 100
+
+# small simulation, so each test runs in a fraction of a second
+SIM_ARGS = ['sim-unp-min', '300', 'sim-conc-min', '300',
+            'sim-disc-min', '100', 'sim-bad-end-min', '100']
+
+
+def write_fasta(fn, seqs):
+    with open(fn, 'w') as fh:
+        for name, seq in seqs:
+            fh.write('>%s\n' % name)
+            for i in range(0, len(seq), 60):
+                fh.write(seq[i:i+60] + '\n')
+
+
+def sam_header(sq_order):
+    return ['@HD\tVN:1.0'] + ['@SQ\tSN:%s\tLN:%d' % (name, ln) for name, ln in sq_order]
+
+
+def sam_record(name, flag, rname, off, seq, qual, rnext='*', pnext=0, tlen=0, mapq=30, tags=None):
+    """ One full-length ungapped alignment at 0-based offset off """
+    toks = [name, str(flag), rname, str(off + 1), str(mapq), '%dM' % len(seq),
+            rnext, str(pnext), str(tlen), seq, qual]
+    if tags is None:
+        tags = ['AS:i:0', 'XS:i:-12', 'NM:i:0', 'MD:Z:%d' % len(seq), 'ZT:Z:0,-12,0.5']
+    return '\t'.join(toks + tags)
+
+
+def write_input_sam(fn, seqs, rng, nunp=400, npair=400):
+    """ Unpaired reads and concordant pairs aligned without edits """
+    lines = sam_header([(name, len(seq)) for name, seq in seqs])
+    for i in range(nunp):
+        name, seq = rng.choice(seqs)
+        off = rng.randrange(len(seq) - READ_LEN)
+        lines.append(sam_record('u%d' % i, rng.choice([0, 16]), name, off,
+                                seq[off:off+READ_LEN], 'I' * READ_LEN))
+    for i in range(npair):
+        name, seq = rng.choice(seqs)
+        fraglen = rng.randrange(250, 400)
+        off1 = rng.randrange(len(seq) - fraglen)
+        off2 = off1 + fraglen - READ_LEN
+        lines.append(sam_record('p%d' % i, 1 | 2 | 32 | 64, name, off1, seq[off1:off1+READ_LEN],
+                                'I' * READ_LEN, '=', off2 + 1, fraglen))
+        lines.append(sam_record('p%d' % i, 1 | 2 | 16 | 128, name, off2, seq[off2:off2+READ_LEN],
+                                'I' * READ_LEN, '=', off1 + 1, -fraglen))
+    with open(fn, 'w') as fh:
+        fh.write('\n'.join(lines) + '\n')
+
+
+def read_fastq(fn):
+    if not os.path.exists(fn):
+        return []
+    with open(fn) as fh:
+        ls = fh.read().split('\n')
+    return [(ls[i][1:], ls[i+1], ls[i+3]) for i in range(0, len(ls) - 3, 4)]
+
+
+def fake_align(tandem_prefix, sam_fn, input_order, sq_order):
+    """ Align tandem reads to where their names say they came from.
+        Reference ids in the names index input_order; the SAM header lists
+        the references in sq_order. """
+    lines = sam_header(sq_order)
+    for name, seq, qual in read_fastq(tandem_prefix + '_reads_u.fastq'):
+        t = name.split(':')
+        flag = 0 if t[2] == '+' else 16
+        lines.append(sam_record(name, flag, input_order[int(t[1])][0], int(t[3]), seq, qual))
+    for typ in 'cd':
+        mates1 = read_fastq(tandem_prefix + '_reads_%s_1.fastq' % typ)
+        mates2 = read_fastq(tandem_prefix + '_reads_%s_2.fastq' % typ)
+        for (n1, s1, q1), (n2, s2, q2) in zip(mates1, mates2):
+            t = n1.split(':')
+            conc = 2 if typ == 'c' else 0
+            for mate, (n, s, q), (ref, strand, off) in [(64, (n1, s1, q1), t[1:4]),
+                                                       (128, (n2, s2, q2), t[5:8])]:
+                flag = 1 | conc | mate | (0 if strand == '+' else 16)
+                lines.append(sam_record(n, flag, input_order[int(ref)][0], int(off), s, q))
+    with open(sam_fn, 'w') as fh:
+        fh.write('\n'.join(lines) + '\n')
+
+
+def run_parse(modes, args, sams, fastas, *prefixes):
+    cmd = [QTIP_PARSE, modes, '--'] + args + ['--'] + sams + ['--'] + fastas
+    for prefix in prefixes:
+        cmd += ['--', prefix]
+    with open(os.devnull, 'w') as devnull:
+        subprocess.check_call(cmd, stderr=devnull)
+
+
+def read_meta(prefix):
+    """ Return the lines of a .meta file, split on commas """
+    with open(prefix + '.meta') as fh:
+        return [ln.rstrip('\n').split(',') for ln in fh]
+
+
+def read_records(prefix):
+    """ Return the records of a feature file as lists of floats, along
+        with the column names and the number of rows the metadata declares.
+        Compact pair records (one per pair) are returned as stored. """
+    meta = read_meta(prefix)
+    cols, nrow = meta[0][:-1], int(meta[0][-1])
+    paired = len(meta) > 1 and meta[1][:2] == ['layout', 'pair']
+    nstored = nrow // 2 if paired else nrow
+    with open(prefix + '.npy', 'rb') as fh:
+        data = fh.read()
+    assert nstored == 0 or len(data) % (8 * nstored) == 0, (len(data), nstored)
+    ncol = len(data) // (8 * nstored) if nstored > 0 else len(cols)
+    vals = struct.unpack('<%dd' % (len(data) // 8), data)
+    return [list(vals[i*ncol:(i+1)*ncol]) for i in range(len(vals) // ncol)], cols, nrow
+
+
+class TestParse(unittest.TestCase):
+
+    def setUp(self):
+        self.assertTrue(os.path.exists(QTIP_PARSE), 'build qtip-parse first')
+        self.dir = tempfile.mkdtemp(prefix='qtip_parse_test')
+        rng = random.Random(1)
+        self.seqs = [(name, ''.join(rng.choice('ACGT') for _ in range(ln))) for name, ln in REFS]
+        self.fasta = self._fn('ref.fa')
+        write_fasta(self.fasta, self.seqs)
+        self.input_sam = self._fn('input.sam')
+        write_input_sam(self.input_sam, self.seqs, rng)
+        self.input_order = [(name, len(seq)) for name, seq in self.seqs]
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def _fn(self, name):
+        return os.path.join(self.dir, name)
+
+    def test_shards_one_training_set(self):
+        """ Tandem SAMs of several shards parse into one set of record
+            files with a single header and distinct ids """
+        run_parse('ifs', ['seed', '3', 'sim-shards', '2'] + SIM_ARGS,
+                  [self.input_sam], [self.fasta], self._fn('inp'), self._fn('tan'))
+        sams = []
+        for k in range(2):
+            sams.append(self._fn('tandem_shard%d.sam' % k))
+            fake_align(self._fn('tan_shard%d' % k), sams[-1], self.input_order, self.input_order)
+        # each shard on its own, then both at once
+        for k in range(2):
+            run_parse('f', ['seed', '3'], [sams[k]], [self.fasta], self._fn('rec%d' % k))
+        run_parse('f', ['seed', '3'], sams, [self.fasta], self._fn('both'))
+        for cat in 'uc':
+            recs, cols, nrow = read_records(self._fn('both_rec_%s' % cat))
+            self.assertEqual(1, sum(1 for ln in read_meta(self._fn('both_rec_%s' % cat))
+                                    if ln[0] == 'id'))
+            self.assertEqual(sum(read_records(self._fn('rec%d_rec_%s' % (k, cat)))[2] for k in range(2)),
+                             nrow)
+            self.assertGreater(nrow, 0)
+            if cat == 'u':
+                ids = [rec[0] for rec in recs]
+            else:
+                # id is the first column of each mate's block
+                m = (len(recs[0]) - 1) // 2
+                ids = [rec[0] for rec in recs] + [rec[m] for rec in recs]
+            self.assertEqual(nrow, len(ids))
+            self.assertEqual(len(ids), len(set(ids)))
+
+    def _correct(self, prefix):
+        """ Return the 'correct' column of the u and c records """
+        correct = []
+        recs, _, _ = read_records(prefix + '_rec_u')
+        correct.extend(rec[-1] for rec in recs)
+        recs, _, _ = read_records(prefix + '_rec_c')
+        m = (len(recs[0]) - 1) // 2
+        correct.extend(rec[i] for rec in recs for i in [m - 1, 2 * m - 1])
+        return correct
+
+    def test_sq_order(self):
+        """ Tandem alignments are judged correct when the tandem SAM lists
+            @SQ lines in a different order from the input SAM """
+        run_parse('ifs', ['seed', '3'] + SIM_ARGS,
+                  [self.input_sam], [self.fasta], self._fn('inp'), self._fn('tan'))
+        with open(self._fn('tan_refs.tsv')) as fh:
+            self.assertEqual(['0\tchrA', '1\tchrB', '2\tchrC'],
+                             [ln.rstrip('\n') for ln in fh if not ln.startswith('#')])
+        tandem_sam = self._fn('tandem.sam')
+        fake_align(self._fn('tan'), tandem_sam, self.input_order, self.input_order[::-1])
+        run_parse('f', ['seed', '3', 'ref-ids', self._fn('tan_refs.tsv')],
+                  [tandem_sam], [self.fasta], self._fn('rec'))
+        correct = self._correct(self._fn('rec'))
+        self.assertGreater(len(correct), 0)
+        self.assertEqual([1.0] * len(correct), correct)
+        # Numbering by the tandem SAM's own @SQ order gets chrA and chrC wrong
+        run_parse('f', ['seed', '3'], [tandem_sam], [self.fasta], self._fn('rec_sq'))
+        self.assertIn(0.0, self._correct(self._fn('rec_sq')))
+
+    def test_top_up_one_category(self):
+        """ A top-up run appends new reads to one category's tandem read
+            file and leaves the other categories' files alone.  It needs
+            only the input model the first run saved, not the input SAM. """
+        # a reservoir smaller than the input, so it's full when saved
+        run_parse('ifs', ['seed', '3', 'input-model-size', '100'] + SIM_ARGS,
+                  [self.input_sam], [self.fasta], self._fn('inp'), self._fn('tan'))
+        suffixes = ['_reads_u.fastq', '_reads_c_1.fastq', '_reads_c_2.fastq',
+                    '_reads_d_1.fastq', '_reads_d_2.fastq', '_reads_b_1.fastq', '_reads_b_2.fastq']
+        before = {}
+        for suf in suffixes:
+            with open(self._fn('tan' + suf), 'rb') as fh:
+                before[suf] = fh.read()
+        self.assertGreater(len(before['_reads_c_1.fastq']), 0)
+        orig = read_fastq(self._fn('tan_reads_u.fastq'))
+        shutil.copyfile(self._fn('tan_reads_u.fastq'), self._fn('tan2_reads_u.fastq'))
+        top_up = ['seed', '3', 'input-model-size', '100', 'sim-function', 'const', 'sim-factor', '0',
+                  'sim-unp-min', '50', 'sim-categories', 'u',
+                  'sim-append', 'True', 'sim-continuation', '1']
+        run_parse('s', top_up + ['input-model', self._fn('tan_input_model.bin')],
+                  [], [self.fasta], self._fn('inp2'), self._fn('tan'))
+        for suf in suffixes[1:]:
+            with open(self._fn('tan' + suf), 'rb') as fh:
+                self.assertEqual(before[suf], fh.read(), suf)
+        with open(self._fn('tan_reads_u.fastq'), 'rb') as fh:
+            self.assertTrue(fh.read().startswith(before['_reads_u.fastq']))
+        reads = read_fastq(self._fn('tan_reads_u.fastq'))
+        self.assertEqual(len(orig) + 50, len(reads))
+        # reseeded, so not the first run's reads over again
+        self.assertNotEqual(orig[:50], reads[len(orig):])
+        # the same reads as a top-up that parses the input SAM again
+        run_parse('s', top_up, [self.input_sam], [self.fasta], self._fn('inp3'), self._fn('tan2'))
+        self.assertEqual(reads, read_fastq(self._fn('tan2_reads_u.fastq')))
+
+    def test_aux_features(self):
+        """ With aux-features, the ZT:Z stand-ins come from AS:i, XS:i,
+            NM:i, XA:Z, SA:Z and the qualities of mismatched bases """
+        def rec(name, cigar, seq, qual, tags):
+            return '\t'.join([name, '0', 'chrA', '101', '30', cigar, '*', '0', '0', seq, qual] + tags)
+        # soft clip, then M/I/M/D/M; MD:Z mismatches line up with read
+        # offsets 5 and 13 (qualities 20 and 10), skipping the insertion
+        # and the deleted GT
+        qual1 = 'II' + 'III5I' + 'I' + 'III' + 'II+I'
+        # extended CIGAR, no MD:Z; the X is at read offset 3 (quality 20)
+        qual2 = 'III5IIII'
+        lines = sam_header(self.input_order) + [
+            rec('r1', '2S5M1I3M2D4M', 'ACGTACGTACGTACG', qual1,
+                ['AS:i:-11', 'XS:i:-20', 'NM:i:5', 'MD:Z:3A4^GT2C1',
+                 'XA:Z:chrB,+100,15M,1;chrC,-200,15M,2;', 'SA:Z:chrA,1,+,15M,60,0;']),
+            rec('r2', '3=1X4=', 'ACGTACGT', qual2, ['AS:i:-6', 'XS:i:-6', 'NM:i:1']),
+            rec('r3', '8M', 'ACGTACGT', 'IIIIIIII', ['NM:i:0', 'MD:Z:8'])]
+        sam = self._fn('aux.sam')
+        with open(sam, 'w') as fh:
+            fh.write('\n'.join(lines) + '\n')
+        run_parse('f', ['aux-features', 'True'], [sam], [self.fasta], self._fn('aux'))
+        recs, cols, nrow = read_records(self._fn('aux_rec_u'))
+        self.assertEqual(3, nrow)
+        ztz = [[rec[cols.index('ztz%d' % i)] for i in range(6)] for rec in recs]
+        nan = float('nan')
+
+        def same(a, b):
+            return len(a) == len(b) and all(x == y or (x != x and y != y) for x, y in zip(a, b))
+        for got, want in zip(ztz, [[-11, -20, 5, 2, 1, 30],
+                                   [-6, -6, 1, 0, 0, 20],
+                                   [nan, nan, 0, 0, 0, 0]]):
+            self.assertTrue(same(want, got), (want, got))
+        # Simulating from the input model needs the alignment score, so r3
+        # is an error rather than a score of 0
+        sim_args = ['aux-features', 'True'] + SIM_ARGS
+        with self.assertRaises(subprocess.CalledProcessError):
+            run_parse('is', sim_args, [sam], [self.fasta], self._fn('aux_i'), self._fn('aux_tan'))
+        lines.pop()
+        with open(sam, 'w') as fh:
+            fh.write('\n'.join(lines) + '\n')
+        run_parse('is', sim_args, [sam], [self.fasta], self._fn('aux_i'), self._fn('aux_tan'))
+        self.assertGreater(len(read_fastq(self._fn('aux_tan_reads_u.fastq'))), 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
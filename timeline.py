@@ -0,0 +1,228 @@
+"""
+Copyright 2016, Ben Langmead <langmea@cs.jhu.edu>
+
+Timeline for writing a Chrome trace-event file (JSON array format; open it
+in chrome://tracing or https://ui.perfetto.dev) covering a whole qtip run:
+driver stages, subprocess lifetimes, the phases qtip-parse, qtip-rewrite
+and qtip-bsam record themselves, and periodic memory and I/O counters for
+the driver and everything it spawns.
+
+The binaries find the file through the QTIP_TRACE_FILE environment
+variable, which Timeline sets.  Every event is one line ending in a comma
+and appended with a single write, so the driver and the binaries can append
+to the same file at the same time.  The format allows the closing ] to be
+left off.
+"""
+
+import os
+import sys
+import json
+import time
+import threading
+
+
+TRACE_ENV = 'QTIP_TRACE_FILE'
+
+
+def _now_us():
+    return int(time.time() * 1000000)
+
+
+def _proc_children():
+    """ Return dict mapping each pid to the pids of its children """
+    children = {}
+    for ent in os.listdir('/proc'):
+        if not ent.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % ent) as fh:
+                stat = fh.read()
+        except (IOError, OSError):
+            continue  # exited
+        # comm may contain spaces and parens; ppid follows the last ')'
+        ppid = int(stat[stat.rindex(')') + 2:].split()[1])
+        children.setdefault(ppid, []).append(int(ent))
+    return children
+
+
+def _proc_descendants(pid):
+    children = _proc_children()
+    ret, stack = [], [pid]
+    while stack:
+        p = stack.pop()
+        ret.append(p)
+        stack.extend(children.get(p, []))
+    return ret
+
+
+def _proc_rss_mb(pid):
+    with open('/proc/%d/status' % pid) as fh:
+        for ln in fh:
+            if ln.startswith('VmRSS:'):
+                return int(ln.split()[1]) / 1024.0
+    return 0.0
+
+
+def _proc_io_mb(pid):
+    """ Return (bytes read, bytes written) from storage, in MB """
+    rd, wr = 0, 0
+    with open('/proc/%d/io' % pid) as fh:
+        for ln in fh:
+            if ln.startswith('read_bytes:'):
+                rd = int(ln.split()[1])
+            elif ln.startswith('write_bytes:'):
+                wr = int(ln.split()[1])
+    return rd / (1024.0 * 1024.0), wr / (1024.0 * 1024.0)
+
+
+def _proc_name(pid):
+    try:
+        with open('/proc/%d/comm' % pid) as fh:
+            return fh.read().strip()
+    except (IOError, OSError):
+        return str(pid)
+
+
+class Timeline(object):
+    """
+    Writes the driver's events to a trace file shared with the binaries.
+    """
+
+    def __init__(self, fn, sample_interval=0.5):
+        self.fn = fn
+        self.pid = os.getpid()
+        self.fd = os.open(fn, os.O_WRONLY | os.O_APPEND | os.O_CREAT | os.O_TRUNC, 0o644)
+        self.lock = threading.Lock()
+        self.named = set()
+        self.sample_interval = sample_interval
+        self.sampler = None
+        self.done = threading.Event()
+        self._write('[\n')
+        self.name_process(self.pid, 'qtip')
+        os.environ[TRACE_ENV] = os.path.abspath(fn)
+
+    def _write(self, s):
+        data = s.encode('utf-8')
+        with self.lock:
+            if self.fd is not None:
+                os.write(self.fd, data)
+
+    def _event(self, ev):
+        self._write(json.dumps(ev, separators=(',', ':')) + ',\n')
+
+    def name_process(self, pid, name):
+        """ Label a process's track; only the first label sticks """
+        if pid in self.named:
+            return
+        self.named.add(pid)
+        self._event({'name': 'process_name', 'ph': 'M', 'pid': pid, 'tid': pid,
+                     'args': {'name': name}})
+
+    def span(self, name, cat, ts, dur, pid=None, args=None):
+        """ Record a span that began at ts and lasted dur microseconds """
+        pid = self.pid if pid is None else pid
+        self._event({'name': name, 'cat': cat, 'ph': 'X', 'pid': pid, 'tid': pid,
+                     'ts': ts, 'dur': dur, 'args': args or {}})
+
+    def counter(self, name, pid, ts, values):
+        self._event({'name': name, 'ph': 'C', 'pid': pid, 'ts': ts, 'args': values})
+
+    def start_sampler(self):
+        """ Start sampling RSS and I/O of the driver and its descendants """
+        if not os.path.exists('/proc/self/status'):
+            return  # needs Linux /proc
+        self.sampler = threading.Thread(target=self._sample_loop)
+        self.sampler.daemon = True
+        self.sampler.start()
+
+    def _sample_loop(self):
+        while not self.done.wait(self.sample_interval):
+            ts = _now_us()
+            for pid in _proc_descendants(self.pid):
+                try:
+                    rss = _proc_rss_mb(pid)
+                    rd, wr = _proc_io_mb(pid)
+                except (IOError, OSError, ValueError):
+                    continue  # exited, or /proc/<pid>/io not readable
+                self.name_process(pid, _proc_name(pid))
+                self.counter('rss_mb', pid, ts, {'rss': round(rss, 1)})
+                self.counter('io_mb', pid, ts, {'read': round(rd, 1), 'written': round(wr, 1)})
+
+    def close(self):
+        if self.sampler is not None:
+            self.done.set()
+            self.sampler.join()
+            self.sampler = None
+        with self.lock:
+            if self.fd is not None:
+                os.close(self.fd)
+                self.fd = None
+        if os.environ.get(TRACE_ENV) == os.path.abspath(self.fn):
+            del os.environ[TRACE_ENV]
+
+
+class ProcessSpan(object):
+    """
+    Records a subprocess's lifetime, from when it's constructed to when
+    end() is called after the subprocess has been reaped.
+    """
+
+    def __init__(self, timeline, name, pid):
+        self.timeline, self.name, self.pid = timeline, name, pid
+        self.t0 = _now_us()
+        if timeline is not None:
+            timeline.name_process(pid, name)
+
+    def end(self, ret=None):
+        if self.timeline is not None:
+            self.timeline.span(self.name, 'process', self.t0, _now_us() - self.t0,
+                               pid=self.pid, args={'exitlevel': ret})
+
+
+if __name__ == "__main__":
+
+    import unittest
+    import tempfile
+    import subprocess
+
+    class TestCases(unittest.TestCase):
+
+        def _events(self, fn):
+            with open(fn) as fh:
+                txt = fh.read()
+            self.assertTrue(txt.startswith('[\n'))
+            return json.loads(txt.rstrip().rstrip(',') + ']')
+
+        def test_spans(self):
+            fn = tempfile.mktemp(suffix='.json')
+            tl = Timeline(fn)
+            self.assertEqual(os.environ[TRACE_ENV], os.path.abspath(fn))
+            tl.span('stage', 'stage', 10, 5)
+            proc = subprocess.Popen(['true'])
+            ps = ProcessSpan(tl, 'true', proc.pid)
+            ps.end(proc.wait())
+            tl.close()
+            self.assertFalse(TRACE_ENV in os.environ)
+            evs = self._events(fn)
+            self.assertEqual('process_name', evs[0]['name'])
+            self.assertEqual(10, evs[1]['ts'])
+            self.assertEqual(proc.pid, evs[-1]['pid'])
+            self.assertEqual(0, evs[-1]['args']['exitlevel'])
+            os.remove(fn)
+
+        def test_sampler(self):
+            if not os.path.exists('/proc/self/status'):
+                return
+            fn = tempfile.mktemp(suffix='.json')
+            tl = Timeline(fn, sample_interval=0.05)
+            tl.start_sampler()
+            proc = subprocess.Popen(['sleep', '0.3'])
+            proc.wait()
+            tl.close()
+            evs = self._events(fn)
+            rss = [ev for ev in evs if ev['name'] == 'rss_mb']
+            self.assertTrue(len(rss) > 0)
+            self.assertTrue(any(ev['pid'] == os.getpid() for ev in rss))
+            os.remove(fn)
+
+    unittest.main(argv=[sys.argv[0]])